@@ -0,0 +1,177 @@
+/*
+Flat-field (background) normalization, see background.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "background.h"
+#include "histogram.h"
+
+int background_alloc(Background* bg, int width, int height, int scale, int radius, FlatMode mode) {
+    bg->width = width;
+    bg->height = height;
+    bg->scale = scale;
+    bg->bw = (width + scale - 1) / scale;
+    bg->bh = (height + scale - 1) / scale;
+    bg->radius = radius;
+    bg->mode = mode;
+    bg->level = 0;
+    bg->low = (float*)calloc((size_t)bg->bw * bg->bh, sizeof(float));
+    bg->x0 = (int*)malloc(width * sizeof(int));
+    bg->tx = (float*)malloc(width * sizeof(float));
+    // one more sample at the end, so x0 + 1 is always readable
+    bg->row = (float*)malloc((bg->bw + 1) * sizeof(float));
+    if (!bg->low || !bg->x0 || !bg->tx || !bg->row) {
+        background_free(bg);
+        return 0;
+    }
+    // low resolution samples sit in the middle of their blocks, outside the first and the last
+    // one the background is held constant
+    for (int i = 0; i < width; i++) {
+        float f = (i - (scale - 1) / 2.0f) / scale;
+        if (f < 0) f = 0;
+        if (f > bg->bw - 1) f = bg->bw - 1;
+        bg->x0[i] = (int)f;
+        bg->tx[i] = f - bg->x0[i];
+    }
+    return 1;
+}
+
+void background_free(Background* bg) {
+    free(bg->low);
+    free(bg->x0);
+    free(bg->tx);
+    free(bg->row);
+    bg->low = bg->tx = bg->row = NULL;
+    bg->x0 = NULL;
+}
+
+void background_accumulate(Background* bg, int j, unsigned char* gray_row) {
+    // adds row j to its block sums, called by the pass that produces the grayscale rows
+    float* low = &bg->low[(j / bg->scale) * bg->bw];
+    for (int bx = 0; bx < bg->bw; bx++) {
+        int start = bx * bg->scale;
+        int end = start + bg->scale < bg->width ? start + bg->scale : bg->width;
+        int sum = 0;
+        for (int i = start; i < end; i++) sum += gray_row[i];
+        low[bx] += sum;
+    }
+}
+
+static void filter_lines(float* data, int n, int count, int step, int line_step, int radius, char op, float* tmp) {
+    // max ('M'), min ('m') or mean ('b') over [k - radius, k + radius] clipped to the line,
+    // for count lines of n samples step apart, lines line_step apart
+    for (int l = 0; l < count; l++) {
+        float* line = &data[l * line_step];
+        for (int k = 0; k < n; k++) tmp[k] = line[k * step];
+        for (int k = 0; k < n; k++) {
+            int lo = k - radius < 0 ? 0 : k - radius, hi = k + radius >= n ? n - 1 : k + radius;
+            float acc = tmp[lo];
+            for (int q = lo + 1; q <= hi; q++) {
+                if (op == 'M') acc = tmp[q] > acc ? tmp[q] : acc;
+                else if (op == 'm') acc = tmp[q] < acc ? tmp[q] : acc;
+                else acc += tmp[q];
+            }
+            line[k * step] = op == 'b' ? acc / (hi - lo + 1) : acc;
+        }
+    }
+}
+
+static void filter_low(Background* bg, char op, float* tmp) {
+    filter_lines(bg->low, bg->bw, bg->bh, 1, bg->bw, bg->radius, op, tmp);
+    filter_lines(bg->low, bg->bh, bg->bw, bg->bw, 1, bg->radius, op, tmp);
+}
+
+void background_estimate(Background* bg, BackgroundEstimate method) {
+    // block sums to means, then the estimate at low resolution: a radius r there spans
+    // r * scale pixels of the image for 1 / scale^2 of the work
+    int w = bg->width, h = bg->height, s = bg->scale;
+    for (int by = 0; by < bg->bh; by++) {
+        int rows = (by + 1) * s < h ? s : h - by * s;
+        for (int bx = 0; bx < bg->bw; bx++) {
+            int cols = (bx + 1) * s < w ? s : w - bx * s;
+            bg->low[by * bg->bw + bx] /= (float)rows * cols;
+        }
+    }
+    float* tmp = (float*)malloc((bg->bw > bg->bh ? bg->bw : bg->bh) * sizeof(float));
+    if (tmp) {
+        if (method == BG_CLOSE) {
+            // dilation then erosion of the gray levels removes everything darker and thinner than the radius
+            filter_low(bg, 'M', tmp);
+            filter_low(bg, 'm', tmp);
+        }
+        // three box passes are close to a gaussian
+        for (int k = 0; k < 3; k++) filter_low(bg, 'b', tmp);
+        free(tmp);
+    }
+    double sum = 0;
+    for (int i = 0; i < bg->bw * bg->bh; i++) sum += bg->low[i];
+    bg->level = sum / ((double)bg->bw * bg->bh);
+}
+
+void background_row(Background* bg, int j, unsigned char* gray_row, unsigned char* lut, unsigned char* out) {
+    // row j normalized against the bilinearly interpolated background and mapped through lut
+    int s = bg->scale;
+    float f = (j - (s - 1) / 2.0f) / s;
+    if (f < 0) f = 0;
+    if (f > bg->bh - 1) f = bg->bh - 1;
+    int y0 = (int)f, y1 = y0 + 1 < bg->bh ? y0 + 1 : y0;
+    float ty = f - y0;
+    float* a = &bg->low[y0 * bg->bw];
+    float* b = &bg->low[y1 * bg->bw];
+    for (int bx = 0; bx < bg->bw; bx++) bg->row[bx] = a[bx] + (b[bx] - a[bx]) * ty;
+    bg->row[bg->bw] = bg->row[bg->bw - 1];
+
+    float level = bg->level;
+    for (int i = 0; i < bg->width; i++) {
+        float* r = &bg->row[bg->x0[i]];
+        float back = r[0] + (r[1] - r[0]) * bg->tx[i];
+        float v = bg->mode == FLAT_DIVIDE
+            ? gray_row[i] * level / (back < 1 ? 1 : back)
+            : gray_row[i] - back + level;
+        out[i] = lut[v < 0 ? 0 : v > MAXGRAY ? MAXGRAY : (int)v];
+    }
+}
+
+typedef struct {
+    Background* bg;
+    unsigned char* gray;
+    unsigned char identity[MAXSIZE];
+    unsigned char* row;
+} NormalizedRows;
+
+static unsigned char* normalized_row(void* ctx, int j) {
+    NormalizedRows* nr = (NormalizedRows*)ctx;
+    background_row(nr->bg, j, &nr->gray[j * nr->bg->width], nr->identity, nr->row);
+    return nr->row;
+}
+
+int background_histogram(Background* bg, unsigned char* gray, double fraction, int* hist) {
+    // histogram of the normalized image without storing it, on the same strata as strided_histogram;
+    // the number of pixels counted, -1 when out of memory
+    NormalizedRows nr = {bg, gray, {0}, (unsigned char*)malloc(bg->width)};
+    if (!nr.row) return -1;
+    for (int i = 0; i < MAXSIZE; i++) nr.identity[i] = i;
+    int n = row_histogram(bg->width, bg->height, normalized_row, &nr, fraction, hist);
+    free(nr.row);
+    return n;
+}
+
+void padded_load_flat(PaddedImage* img, unsigned char* gray, unsigned char* lut, Background* bg) {
+    // padded_load_lut with the normalization in the same pass
+    for (int j = 0; j < img->height; j++) {
+        background_row(bg, j, &gray[j * img->width], lut, &img->px[j * img->stride]);
+    }
+}
+
+FlatMode parse_flat_mode(char const * name) {
+    if (strcmp(name, "divide") == 0) return FLAT_DIVIDE;
+    if (strcmp(name, "subtract") == 0) return FLAT_SUBTRACT;
+    return FLAT_COUNT;
+}
+
+BackgroundEstimate parse_background_estimate(char const * name) {
+    if (strcmp(name, "close") == 0) return BG_CLOSE;
+    if (strcmp(name, "blur") == 0) return BG_BLUR;
+    return BG_COUNT;
+}
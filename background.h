@@ -0,0 +1,52 @@
+/*
+Flat-field (background) normalization for unevenly lit scans.
+The background is estimated on a copy downsampled by an 8-16x box average, collected row by row
+while the grayscale image is produced, so it costs no extra pass over the image. The pass that
+applies the tone LUT reads it back with bilinear interpolation on the fly and divides the image by
+it (or subtracts it) before the lookup.
+*/
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include "image.h"
+
+#define FLATSCALE 16
+#define FLATRADIUS 2
+
+typedef enum {
+    FLAT_DIVIDE,        // gray * level / background, for illumination (multiplicative)
+    FLAT_SUBTRACT,      // gray - background + level, for haze or glare (additive)
+    FLAT_COUNT
+} FlatMode;
+
+typedef enum {
+    BG_CLOSE,           // grayscale closing then a blur, drops dark text and lines from the estimate
+    BG_BLUR,            // large blur only
+    BG_COUNT
+} BackgroundEstimate;
+
+typedef struct {
+    int width, height;      // full resolution
+    int scale;              // downsampling factor
+    int bw, bh;             // low resolution
+    int radius;             // estimate radius in low resolution pixels
+    FlatMode mode;
+    float* low;             // bw x bh block sums, then the background
+    float level;            // mean background, flat areas are normalized to it
+    int* x0;                // per full resolution column: left low resolution sample
+    float* tx;              // and the weight of the right one
+    float* row;             // one background row, interpolated
+} Background;
+
+int background_alloc(Background* bg, int width, int height, int scale, int radius, FlatMode mode);
+void background_free(Background* bg);
+void background_accumulate(Background* bg, int j, unsigned char* gray_row);
+void background_estimate(Background* bg, BackgroundEstimate method);
+void background_row(Background* bg, int j, unsigned char* gray_row, unsigned char* lut, unsigned char* out);
+int background_histogram(Background* bg, unsigned char* gray, double fraction, int* hist);
+void padded_load_flat(PaddedImage* img, unsigned char* gray, unsigned char* lut, Background* bg);
+FlatMode parse_flat_mode(char const * name);
+BackgroundEstimate parse_background_estimate(char const * name);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+Batch engine for small images, see batch.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "batch.h"
+#include "stream.h"
+#include "trace.h"
+
+typedef struct {
+    Batch* b;
+    int first, last;            // images first..last-1
+    PointParams* pp;
+    unsigned char* gamma;       // shared gamma LUT, NULL when every image needs its own
+    TresholdMethod method;
+    int ok;
+} BatchJob;
+
+int batch_alloc(Batch* b, int capacity, size_t max_pixels) {
+    memset(b, 0, sizeof(Batch));
+    b->images = (BatchImage*)malloc(capacity * sizeof(BatchImage));
+    b->rgb = (unsigned char*)malloc(max_pixels * 3);
+    b->out = (unsigned char*)malloc(max_pixels);
+    b->capacity = capacity;
+    b->max_pixels = max_pixels;
+    if (!b->images || !b->rgb || !b->out) {
+        batch_free(b);
+        return 0;
+    }
+    return 1;
+}
+
+void batch_free(Batch* b) {
+    free(b->images);
+    free(b->rgb);
+    free(b->out);
+    b->images = NULL;
+    b->rgb = b->out = NULL;
+}
+
+void batch_clear(Batch* b) {
+    b->count = 0;
+    b->pixels = 0;
+}
+
+unsigned char* batch_add(Batch* b, int width, int height) {
+    // room for the RGB pixels of one more image, NULL when the batch is full
+    size_t n = (size_t)width * height;
+    if (b->count == b->capacity || b->pixels + n > b->max_pixels) return NULL;
+    BatchImage* im = &b->images[b->count++];
+    im->width = width;
+    im->height = height;
+    im->offset = b->pixels;
+    im->treshold = 0;
+    b->pixels += n;
+    return &b->rgb[im->offset * 3];
+}
+
+static inline unsigned char gauss_px(unsigned char* up, unsigned char* row, unsigned char* down, int l, int i, int r) {
+    return (up[l] + 2 * up[i] + up[r] + 2 * (row[l] + 2 * row[i] + row[r]) + down[l] + 2 * down[i] + down[r]) >> 4;
+}
+
+void batch_gauss_row(unsigned char* up, unsigned char* row, unsigned char* down, int w, unsigned char* out,
+    int* hist) {
+    // the 3x3 gaussian of zad1 with replicated edges: its double sums of sixteenths are exact, so the
+    // truncated result is the integer sum shifted by 4; the interior has no clamps and vectorizes;
+    // hist may be NULL
+    out[0] = gauss_px(up, row, down, 0, 0, w > 1 ? 1 : 0);
+    for (int i = 1; i < w - 1; i++) out[i] = gauss_px(up, row, down, i - 1, i, i + 1);
+    if (w > 1) out[w - 1] = gauss_px(up, row, down, w - 2, w - 1, w - 1);
+    for (int i = 0; i < w && hist; i++) hist[out[i]]++;
+}
+
+static int process_image(BatchJob* job, BatchImage* im, unsigned char* gray) {
+    Batch* b = job->b;
+    int w = im->width, h = im->height, size = w * h;
+    unsigned char* rgb = &b->rgb[im->offset * 3];
+    unsigned char* out = &b->out[im->offset];
+    int hist[MAXSIZE] = {0};
+    for (int j = 0; j < h; j++) {
+        unsigned char* g = &gray[(size_t)j * w];
+        stream_gray_row(STREAM_RGB, &rgb[(size_t)j * w * 3], w, g);
+        for (int i = 0; i < w; i++) hist[g[i]]++;
+    }
+
+    // tone LUT: the shared gamma after this image's equalization, or the whole point_lut
+    unsigned char lut[MAXSIZE];
+    if (job->gamma) {
+        unsigned char tvals[MAXSIZE];
+        histogram_lut(size, hist, tvals);
+        for (int i = 0; i < MAXSIZE; i++) lut[i] = job->gamma[tvals[i]];
+    } else {
+        PointParams pp = *job->pp;
+        point_lut(size, hist, &pp, lut);
+    }
+    for (int i = 0; i < size; i++) gray[i] = lut[gray[i]];
+
+    int fhist[MAXSIZE] = {0};
+    for (int j = 0; j < h; j++) {
+        unsigned char* row = &gray[(size_t)j * w];
+        batch_gauss_row(j > 0 ? row - w : row, row, j < h - 1 ? row + w : row, w, &out[(size_t)j * w], fhist);
+    }
+    int t;
+    if (job->method == TH_OTSU) {
+        t = otsu_counts_treshold(size, fhist);
+    } else {
+        HistStats st;
+        hist_stats(size, fhist, &st);
+        t = hist_treshold(&st, job->method);
+    }
+    for (int i = 0; i < size; i++) out[i] = out[i] > t ? MAXGRAY : 0;
+    im->treshold = t;
+    return 1;
+}
+
+static void* batch_range(void* arg) {
+    // whole images, one scratch image for all of them
+    BatchJob* job = (BatchJob*)arg;
+    Batch* b = job->b;
+    size_t max = 0;
+    for (int k = job->first; k < job->last; k++) {
+        size_t n = (size_t)b->images[k].width * b->images[k].height;
+        max = n > max ? n : max;
+    }
+    unsigned char* gray = (unsigned char*)malloc(max ? max : 1);
+    job->ok = gray != NULL;
+    for (int k = job->first; k < job->last && job->ok; k++) {
+        trace_begin("image", k);
+        job->ok = process_image(job, &b->images[k], gray);
+        trace_end("image", k);
+    }
+    free(gray);
+    return NULL;
+}
+
+int batch_run(Batch* b, PointParams* pp, TresholdMethod method, int threads) {
+    // every image of the batch into b->out, thresholds into the images; 0 on failure
+    if (threads > b->count) threads = b->count;
+    if (threads < 1) return 1;
+    unsigned char gamma[MAXSIZE];
+    int shared = !pp->ref_hist && !pp->auto_levels && pp->gamma > 0;
+    if (shared) gamma_lut(pp->gamma, gamma);
+
+    // ranges of about the same number of pixels
+    BatchJob jobs[threads];
+    int k = 0;
+    size_t seen = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t end = b->pixels * (t + 1) / threads;
+        jobs[t] = (BatchJob){b, k, k, pp, shared ? gamma : NULL, method, 1};
+        while (k < b->count && (seen < end || t == threads - 1)) {
+            seen += (size_t)b->images[k].width * b->images[k].height;
+            k++;
+        }
+        jobs[t].last = k;
+    }
+    pthread_t ids[threads];
+    int started[threads];
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, batch_range, &jobs[t]) == 0;
+        // no thread, run its share here instead
+        if (!started[t]) batch_range(&jobs[t]);
+    }
+    batch_range(&jobs[0]);
+    int ok = jobs[0].ok;
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+        ok = ok && jobs[t].ok;
+    }
+    return ok;
+}
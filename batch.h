@@ -0,0 +1,42 @@
+/*
+Batch engine for many small images (thumbnails), zad1's default pipeline on each of them.
+At 64x64..256x256 pixels the fixed costs of an image - allocations, the gamma LUT (256 pow calls),
+hist_stats for the threshold (256 logs and the mode search) - weigh as much as its pixels, so:
+the images are packed back to back in one arena (and their outputs in a second one), the gamma LUT
+is built once for the batch when the gamma is fixed, Otsu reads only the tables it needs, and every
+thread takes a range of whole images with one scratch buffer, sweeping its part of the arena once
+for the gray conversion and the histograms. The fixed 3x3 gaussian runs in integers (exact, its
+weights are sixteenths).
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "histogram.h"
+
+#define BATCHIMAGES 4096        // images per arena fill
+#define BATCHPIXELS (BATCHIMAGES * 128 * 128)
+
+typedef struct {
+    int width, height;
+    size_t offset;              // of the first pixel, in pixels (RGB bytes are at 3 * offset)
+    int treshold;               // filled by batch_run
+} BatchImage;
+
+typedef struct {
+    BatchImage* images;
+    int count, capacity;
+    unsigned char* rgb;         // input pixels of every image back to back
+    unsigned char* out;         // output pixels at the same offsets
+    size_t pixels, max_pixels;  // arena use and size
+} Batch;
+
+int batch_alloc(Batch* b, int capacity, size_t max_pixels);
+void batch_free(Batch* b);
+void batch_clear(Batch* b);
+unsigned char* batch_add(Batch* b, int width, int height);
+int batch_run(Batch* b, PointParams* pp, TresholdMethod method, int threads);
+void batch_gauss_row(unsigned char* up, unsigned char* row, unsigned char* down, int w, unsigned char* out,
+    int* hist);
+
+#endif
@@ -0,0 +1,328 @@
+/*
+Corner detection, see corners.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "corners.h"
+
+#define FASTARC 9
+#define HARRISK 0.04
+
+// Bresenham circle of radius 3, clockwise from the top
+static const int circle[16][2] = {
+    {0, -3}, {1, -3}, {2, -2}, {3, -1}, {3, 0}, {3, 1}, {2, 2}, {1, 3},
+    {0, 3}, {-1, 3}, {-2, 2}, {-3, 1}, {-3, 0}, {-3, -1}, {-2, -2}, {-1, -3}
+};
+
+typedef struct {
+    PaddedImage* img;
+    CornerMethod method;
+    double treshold;        // fast: gray levels; harris: absolute response, set between the phases
+    float* map;             // width x height scores, 0 for no corner
+    int y0, y1;             // rows of this band
+    float max;              // highest score in the band
+    int grid;
+    Keypoint* cells;        // one slot per grid cell, score 0 when empty
+    int ok;
+} CornerJob;
+
+static int fast_arc(unsigned char* p, int* offsets, int t) {
+    // scalar FAST-9 test: FASTARC contiguous circle pixels all brighter than c + t or all darker than c - t
+    int c = p[0], run_b = 0, run_d = 0;
+    for (int k = 0; k < 16 + FASTARC - 1; k++) {
+        int v = p[offsets[k % 16]];
+        run_b = v > c + t ? run_b + 1 : 0;
+        run_d = v < c - t ? run_d + 1 : 0;
+        if (run_b >= FASTARC || run_d >= FASTARC) return 1;
+    }
+    return 0;
+}
+
+static float fast_score(unsigned char* p, int* offsets, int t) {
+    // sum of the differences beyond t on the brighter or on the darker side, whichever is larger
+    int c = p[0], sb = 0, sd = 0;
+    for (int k = 0; k < 16; k++) {
+        int v = p[offsets[k]];
+        if (v > c + t) sb += v - c - t;
+        else if (v < c - t) sd += c - t - v;
+    }
+    return sb > sd ? sb : sd;
+}
+
+static void fast_row(PaddedImage* img, int y, int t, int* offsets, float* out) {
+    int w = img->width;
+    unsigned char* row = &img->px[y * img->stride];
+    memset(out, 0, w * sizeof(float));
+    if (y < CORNERBORDER || y >= img->height - CORNERBORDER) return;
+    int x = CORNERBORDER, end = w - CORNERBORDER;
+#if defined(__SSE2__)
+    // 16 centers at a time: per circle position a byte mask of brighter and of darker pixels,
+    // the longest run of set masks around the circle is counted in every lane
+    const __m128i vt = _mm_set1_epi8((char)t), one = _mm_set1_epi8(1), arc = _mm_set1_epi8(FASTARC);
+    for (; x + 16 <= end; x += 16) {
+        __m128i c = _mm_loadu_si128((__m128i*)&row[x]);
+        __m128i hi = _mm_adds_epu8(c, vt), lo = _mm_subs_epu8(c, vt);
+        __m128i mb[16], md[16];
+        for (int k = 0; k < 16; k++) {
+            __m128i v = _mm_loadu_si128((__m128i*)&row[x + offsets[k]]);
+            // unsigned a > b is a saturating a - b that is not zero
+            mb[k] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, hi), _mm_setzero_si128()), _mm_set1_epi8(-1));
+            md[k] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(lo, v), _mm_setzero_si128()), _mm_set1_epi8(-1));
+        }
+        __m128i rb = _mm_setzero_si128(), rd = rb, best = rb;
+        for (int k = 0; k < 16 + FASTARC - 1; k++) {
+            rb = _mm_and_si128(_mm_add_epi8(rb, one), mb[k % 16]);
+            rd = _mm_and_si128(_mm_add_epi8(rd, one), md[k % 16]);
+            best = _mm_max_epu8(best, _mm_max_epu8(rb, rd));
+        }
+        int hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(best, arc), best));
+        while (hits) {
+            int lane = __builtin_ctz(hits);
+            out[x + lane] = fast_score(&row[x + lane], offsets, t);
+            hits &= hits - 1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t vt = vdupq_n_u8(t), one = vdupq_n_u8(1), arc = vdupq_n_u8(FASTARC);
+    for (; x + 16 <= end; x += 16) {
+        uint8x16_t c = vld1q_u8(&row[x]);
+        uint8x16_t hi = vqaddq_u8(c, vt), lo = vqsubq_u8(c, vt);
+        uint8x16_t mb[16], md[16];
+        for (int k = 0; k < 16; k++) {
+            uint8x16_t v = vld1q_u8(&row[x + offsets[k]]);
+            mb[k] = vcgtq_u8(v, hi);
+            md[k] = vcltq_u8(v, lo);
+        }
+        uint8x16_t rb = vdupq_n_u8(0), rd = rb, best = rb;
+        for (int k = 0; k < 16 + FASTARC - 1; k++) {
+            rb = vandq_u8(vaddq_u8(rb, one), mb[k % 16]);
+            rd = vandq_u8(vaddq_u8(rd, one), md[k % 16]);
+            best = vmaxq_u8(best, vmaxq_u8(rb, rd));
+        }
+        unsigned char hits[16];
+        vst1q_u8(hits, vcgeq_u8(best, arc));
+        for (int lane = 0; lane < 16; lane++) {
+            if (hits[lane]) out[x + lane] = fast_score(&row[x + lane], offsets, t);
+        }
+    }
+#endif
+    for (; x < end; x++) {
+        if (fast_arc(&row[x], offsets, t)) out[x] = fast_score(&row[x], offsets, t);
+    }
+}
+
+static void* fast_band(void* arg) {
+    CornerJob* job = (CornerJob*)arg;
+    int offsets[16];
+    for (int k = 0; k < 16; k++) offsets[k] = circle[k][1] * job->img->stride + circle[k][0];
+    job->max = 0;
+    for (int y = job->y0; y < job->y1; y++) {
+        float* out = &job->map[(size_t)y * job->img->width];
+        fast_row(job->img, y, (int)job->treshold, offsets, out);
+        for (int x = 0; x < job->img->width; x++) job->max = out[x] > job->max ? out[x] : job->max;
+    }
+    return NULL;
+}
+
+static void sobel_products(PaddedImage* img, int y, int r, int* xx, int* yy, int* xy) {
+    // gradient products of row y for columns [-r, width + r), stored from index 0
+    int s = img->stride;
+    unsigned char* p = &img->px[y * s];
+    for (int x = -r; x < img->width + r; x++) {
+        unsigned char* q = &p[x];
+        int gx = (q[-s + 1] + 2 * q[1] + q[s + 1]) - (q[-s - 1] + 2 * q[-1] + q[s - 1]);
+        int gy = (q[s - 1] + 2 * q[s] + q[s + 1]) - (q[-s - 1] + 2 * q[-s] + q[-s + 1]);
+        xx[x + r] = gx * gx;
+        yy[x + r] = gy * gy;
+        xy[x + r] = gx * gy;
+    }
+}
+
+static void* harris_band(void* arg) {
+    // structure tensor box sums: running column sums over 2r + 1 product rows kept in a ring,
+    // then a running sum along the row; response det - k * trace^2
+    CornerJob* job = (CornerJob*)arg;
+    PaddedImage* img = job->img;
+    int w = img->width, r = HARRISRADIUS, pw = w + 2 * r, rows = 2 * r + 1;
+    int* ring = (int*)malloc(sizeof(int) * 3 * pw * rows);
+    long long* col = (long long*)calloc(3 * (size_t)pw, sizeof(long long));
+    job->max = 0;
+    job->ok = ring && col;
+    if (!job->ok) {
+        free(ring);
+        free(col);
+        return NULL;
+    }
+    for (int y = job->y0 - r; y < job->y1 + r; y++) {
+        int* slot = &ring[3 * pw * ((y - job->y0 + rows) % rows)];
+        // the slot still holds row y - rows, which leaves the window
+        if (y - rows >= job->y0 - r) {
+            for (int i = 0; i < 3 * pw; i++) col[i] -= slot[i];
+        }
+        sobel_products(img, y, r, slot, slot + pw, slot + 2 * pw);
+        for (int i = 0; i < 3 * pw; i++) col[i] += slot[i];
+        int yc = y - r;
+        if (yc < job->y0) continue;
+        float* out = &job->map[(size_t)yc * w];
+        long long sxx = 0, syy = 0, sxy = 0;
+        for (int i = 0; i < 2 * r; i++) {
+            sxx += col[i];
+            syy += col[pw + i];
+            sxy += col[2 * pw + i];
+        }
+        for (int x = 0; x < w; x++) {
+            sxx += col[x + 2 * r];
+            syy += col[pw + x + 2 * r];
+            sxy += col[2 * pw + x + 2 * r];
+            double det = (double)sxx * syy - (double)sxy * sxy, tr = (double)sxx + syy;
+            double resp = det - HARRISK * tr * tr;
+            int edge = yc < CORNERBORDER || yc >= img->height - CORNERBORDER
+                || x < CORNERBORDER || x >= w - CORNERBORDER;
+            out[x] = resp > 0 && !edge ? resp : 0;
+            job->max = out[x] > job->max ? out[x] : job->max;
+            sxx -= col[x];
+            syy -= col[pw + x];
+            sxy -= col[2 * pw + x];
+        }
+    }
+    free(ring);
+    free(col);
+    return NULL;
+}
+
+static void* grid_band(void* arg) {
+    // best score above the treshold per cell that is also a 3x3 local maximum;
+    // job->y0, y1 are cell rows here
+    CornerJob* job = (CornerJob*)arg;
+    int w = job->img->width, h = job->img->height, g = job->grid;
+    int cells_x = (w + g - 1) / g;
+    float t = job->method == CORNER_HARRIS ? job->treshold : 0;
+    for (int cy = job->y0; cy < job->y1; cy++) {
+        for (int cx = 0; cx < cells_x; cx++) {
+            Keypoint best = {0, 0, 0};
+            for (int y = cy * g; y < (cy + 1) * g && y < h; y++) {
+                float* row = &job->map[(size_t)y * w];
+                for (int x = cx * g; x < (cx + 1) * g && x < w; x++) {
+                    float s = row[x];
+                    if (s <= t || s <= best.score) continue;
+                    int peak = 1;
+                    for (int dy = -1; dy <= 1 && peak; dy++) {
+                        if (y + dy < 0 || y + dy >= h) continue;
+                        for (int dx = -1; dx <= 1; dx++) {
+                            if ((dx || dy) && x + dx >= 0 && x + dx < w && row[dy * w + x + dx] > s) peak = 0;
+                        }
+                    }
+                    if (peak) best = (Keypoint){x, y, s};
+                }
+            }
+            job->cells[cy * cells_x + cx] = best;
+        }
+    }
+    return NULL;
+}
+
+static void run_jobs(void* (*fn)(void*), CornerJob* jobs, int threads) {
+    pthread_t ids[threads];
+    int started[threads];
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, fn, &jobs[t]) == 0;
+        // no thread, run its share here instead
+        if (!started[t]) fn(&jobs[t]);
+    }
+    fn(&jobs[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+    }
+}
+
+int detect_corners(PaddedImage* img, CornerMethod method, double treshold, int grid, int threads, Keypoint** keypoints) {
+    // img needs a border of CORNERBORDER; returns the number of keypoints in *keypoints, -1 on failure
+    int w = img->width, h = img->height;
+    int cells_x = (w + grid - 1) / grid, cells_y = (h + grid - 1) / grid;
+    if (threads > h) threads = h;
+    if (threads < 1) threads = 1;
+    float* map = (float*)malloc((size_t)w * h * sizeof(float));
+    Keypoint* cells = (Keypoint*)malloc((size_t)cells_x * cells_y * sizeof(Keypoint));
+    CornerJob jobs[threads];
+    if (!map || !cells) {
+        free(map);
+        free(cells);
+        return -1;
+    }
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (CornerJob){img, method, treshold, map, (int)((long)h * t / threads),
+                              (int)((long)h * (t + 1) / threads), 0, grid, cells, 1};
+    }
+    run_jobs(method == CORNER_FAST ? fast_band : harris_band, jobs, threads);
+
+    // harris treshold relative to the strongest response, known only after all bands
+    float max = 0;
+    int ok = 1;
+    for (int t = 0; t < threads; t++) {
+        max = jobs[t].max > max ? jobs[t].max : max;
+        ok = ok && jobs[t].ok;
+    }
+    int cell_threads = threads < cells_y ? threads : cells_y;
+    for (int t = 0; t < cell_threads; t++) {
+        jobs[t].treshold = method == CORNER_HARRIS ? treshold * max : treshold;
+        jobs[t].y0 = (int)((long)cells_y * t / cell_threads);
+        jobs[t].y1 = (int)((long)cells_y * (t + 1) / cell_threads);
+    }
+    if (ok) run_jobs(grid_band, jobs, cell_threads);
+    free(map);
+    if (!ok) {
+        free(cells);
+        return -1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < cells_x * cells_y; i++) {
+        if (cells[i].score > 0) cells[n++] = cells[i];
+    }
+    *keypoints = cells;
+    return n;
+}
+
+int save_keypoints(char const * file_name, Keypoint* keypoints, int n, CornerMethod method) {
+    // text: a comment line, then "x y score" per keypoint in row-major cell order
+    FILE* f = fopen(file_name, "w");
+    if (!f) return 0;
+    fprintf(f, "# %d %s keypoints: x y score\n", n, method == CORNER_FAST ? "fast" : "harris");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "%d %d %g\n", keypoints[i].x, keypoints[i].y, keypoints[i].score);
+    }
+    return fclose(f) == 0;
+}
+
+CornerMethod parse_corner_method(char const * name, double* treshold) {
+    // fast[:T] with T in gray levels, harris[:Q] with Q relative to the strongest response
+    CornerMethod method = CORNER_COUNT;
+    char const * arg = NULL;
+    if (strncmp(name, "fast", 4) == 0) {
+        method = CORNER_FAST;
+        *treshold = FASTTRESHOLD;
+        arg = name + 4;
+    } else if (strncmp(name, "harris", 6) == 0) {
+        method = CORNER_HARRIS;
+        *treshold = HARRISQUALITY;
+        arg = name + 6;
+    }
+    if (method == CORNER_COUNT) return CORNER_COUNT;
+    if (*arg == ':') {
+        *treshold = strtod(arg + 1, NULL);
+        if (*treshold <= 0 || (method == CORNER_FAST && *treshold > 254) || (method == CORNER_HARRIS && *treshold >= 1)) {
+            return CORNER_COUNT;
+        }
+    } else if (*arg != '\0') {
+        return CORNER_COUNT;
+    }
+    return method;
+}
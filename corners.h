@@ -0,0 +1,34 @@
+/*
+Corner detection on a border-padded grayscale image, for page registration keypoints.
+FAST-9 tests 16 pixels at a time with SIMD byte compares; Harris uses integer Sobel gradients
+and box sums of their products. Both fill a score map in row bands, one per thread, then keep the
+strongest local maximum of every grid cell.
+*/
+
+#ifndef CORNERS_H
+#define CORNERS_H
+
+#include "image.h"
+
+#define CORNERBORDER 3      // guard pixels the detectors read around the image
+#define CORNERGRID 16
+#define FASTTRESHOLD 20
+#define HARRISQUALITY 0.01
+#define HARRISRADIUS 1      // box radius of the structure tensor, 3x3
+
+typedef enum {
+    CORNER_FAST,
+    CORNER_HARRIS,
+    CORNER_COUNT
+} CornerMethod;
+
+typedef struct {
+    int x, y;
+    float score;
+} Keypoint;
+
+int detect_corners(PaddedImage* img, CornerMethod method, double treshold, int grid, int threads, Keypoint** keypoints);
+int save_keypoints(char const * file_name, Keypoint* keypoints, int n, CornerMethod method);
+CornerMethod parse_corner_method(char const * name, double* treshold);
+
+#endif
@@ -0,0 +1,429 @@
+/*
+Frequency-domain filtering for large kernels, see fft.h.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "fft.h"
+#include "trace.h"
+
+#define TRANSPOSEBLOCK 16
+static FftTuning tuning = {DIRECTCOST, FFTCOST, FFTTILEFACTOR};
+
+// butterflies on whole rows: len floats (len / 2 complex values) at a time
+static void row_add_sub(int len, float* a, float* b, float* s, float* d) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= len; i += 4) {
+        __m128 va = _mm_loadu_ps(&a[i]), vb = _mm_loadu_ps(&b[i]);
+        _mm_storeu_ps(&s[i], _mm_add_ps(va, vb));
+        _mm_storeu_ps(&d[i], _mm_sub_ps(va, vb));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t va = vld1q_f32(&a[i]), vb = vld1q_f32(&b[i]);
+        vst1q_f32(&s[i], vaddq_f32(va, vb));
+        vst1q_f32(&d[i], vsubq_f32(va, vb));
+    }
+#endif
+    for (; i < len; i++) {
+        float va = a[i], vb = b[i];
+        s[i] = va + vb;
+        d[i] = va - vb;
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128 cmul_ps(__m128 v, __m128 wr, __m128 wi) {
+    // (re, im) * (wr, wi) for two complex values, wi is (-wi, wi, -wi, wi)
+    __m128 sw = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_add_ps(_mm_mul_ps(v, wr), _mm_mul_ps(sw, wi));
+}
+#elif defined(__ARM_NEON)
+static inline float32x4_t cmul_ps(float32x4_t v, float32x4_t wr, float32x4_t wi) {
+    return vaddq_f32(vmulq_f32(v, wr), vmulq_f32(vrev64q_f32(v), wi));
+}
+#endif
+
+static void radix4_rows(int len, float* a, float* b, float* c, float* d,
+                        float* y0, float* y1, float* y2, float* y3,
+                        float const * w, int sign) {
+    // w holds w1, w2, w3 as re/im pairs, sign is -1 forward and 1 inverse
+    int i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    float wv[3][2][4];
+    for (int k = 0; k < 3; k++) {
+        for (int l = 0; l < 4; l++) {
+            wv[k][0][l] = w[2 * k];
+            wv[k][1][l] = l & 1 ? w[2 * k + 1] : -w[2 * k + 1];
+        }
+    }
+    float jv[4] = {(float)sign, (float)-sign, (float)sign, (float)-sign};
+#endif
+#if defined(__SSE2__)
+    __m128 w1r = _mm_loadu_ps(wv[0][0]), w1i = _mm_loadu_ps(wv[0][1]);
+    __m128 w2r = _mm_loadu_ps(wv[1][0]), w2i = _mm_loadu_ps(wv[1][1]);
+    __m128 w3r = _mm_loadu_ps(wv[2][0]), w3i = _mm_loadu_ps(wv[2][1]);
+    __m128 js = _mm_loadu_ps(jv);
+    for (; i + 4 <= len; i += 4) {
+        __m128 va = _mm_loadu_ps(&a[i]), vb = _mm_loadu_ps(&b[i]);
+        __m128 vc = _mm_loadu_ps(&c[i]), vd = _mm_loadu_ps(&d[i]);
+        __m128 apc = _mm_add_ps(va, vc), amc = _mm_sub_ps(va, vc);
+        __m128 bpd = _mm_add_ps(vb, vd), bmd = _mm_sub_ps(vb, vd);
+        // -sign * i * (b - d)
+        __m128 jbmd = _mm_mul_ps(_mm_shuffle_ps(bmd, bmd, _MM_SHUFFLE(2, 3, 0, 1)), js);
+        _mm_storeu_ps(&y0[i], _mm_add_ps(apc, bpd));
+        _mm_storeu_ps(&y1[i], cmul_ps(_mm_sub_ps(amc, jbmd), w1r, w1i));
+        _mm_storeu_ps(&y2[i], cmul_ps(_mm_sub_ps(apc, bpd), w2r, w2i));
+        _mm_storeu_ps(&y3[i], cmul_ps(_mm_add_ps(amc, jbmd), w3r, w3i));
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t w1r = vld1q_f32(wv[0][0]), w1i = vld1q_f32(wv[0][1]);
+    float32x4_t w2r = vld1q_f32(wv[1][0]), w2i = vld1q_f32(wv[1][1]);
+    float32x4_t w3r = vld1q_f32(wv[2][0]), w3i = vld1q_f32(wv[2][1]);
+    float32x4_t js = vld1q_f32(jv);
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t va = vld1q_f32(&a[i]), vb = vld1q_f32(&b[i]);
+        float32x4_t vc = vld1q_f32(&c[i]), vd = vld1q_f32(&d[i]);
+        float32x4_t apc = vaddq_f32(va, vc), amc = vsubq_f32(va, vc);
+        float32x4_t bpd = vaddq_f32(vb, vd), bmd = vsubq_f32(vb, vd);
+        float32x4_t jbmd = vmulq_f32(vrev64q_f32(bmd), js);
+        vst1q_f32(&y0[i], vaddq_f32(apc, bpd));
+        vst1q_f32(&y1[i], cmul_ps(vsubq_f32(amc, jbmd), w1r, w1i));
+        vst1q_f32(&y2[i], cmul_ps(vsubq_f32(apc, bpd), w2r, w2i));
+        vst1q_f32(&y3[i], cmul_ps(vaddq_f32(amc, jbmd), w3r, w3i));
+    }
+#endif
+    for (; i < len; i += 2) {
+        float apc_r = a[i] + c[i], apc_i = a[i + 1] + c[i + 1];
+        float amc_r = a[i] - c[i], amc_i = a[i + 1] - c[i + 1];
+        float bpd_r = b[i] + d[i], bpd_i = b[i + 1] + d[i + 1];
+        float bmd_r = b[i] - d[i], bmd_i = b[i + 1] - d[i + 1];
+        float j_r = sign * bmd_i, j_i = -sign * bmd_r;
+        float t_r, t_i;
+        y0[i] = apc_r + bpd_r;
+        y0[i + 1] = apc_i + bpd_i;
+        t_r = amc_r - j_r; t_i = amc_i - j_i;
+        y1[i] = t_r * w[0] - t_i * w[1];
+        y1[i + 1] = t_i * w[0] + t_r * w[1];
+        t_r = apc_r - bpd_r; t_i = apc_i - bpd_i;
+        y2[i] = t_r * w[2] - t_i * w[3];
+        y2[i + 1] = t_i * w[2] + t_r * w[3];
+        t_r = amc_r + j_r; t_i = amc_i + j_i;
+        y3[i] = t_r * w[4] - t_i * w[5];
+        y3[i + 1] = t_i * w[4] + t_r * w[5];
+    }
+}
+
+static void fft_columns(int n, int s, int eo, int sign, int len, float* x, float* y) {
+    // Stockham autosort fft over the row index, every element is a whole row of len floats;
+    // n points at stride s rows, the result ends up in x when eo is 0 and in y when it is 1
+    if (n == 1) {
+        if (eo) memcpy(y, x, (size_t)s * len * sizeof(float));
+        return;
+    }
+    if (n == 2) {
+        float* z = eo ? y : x;
+        for (int q = 0; q < s; q++) {
+            row_add_sub(len, &x[(size_t)q * len], &x[(size_t)(q + s) * len],
+                        &z[(size_t)q * len], &z[(size_t)(q + s) * len]);
+        }
+        return;
+    }
+    int n1 = n / 4;
+    double theta = 2 * M_PI / n;
+    for (int p = 0; p < n1; p++) {
+        float w[6];
+        for (int k = 1; k <= 3; k++) {
+            w[2 * (k - 1)] = cos(k * p * theta);
+            w[2 * (k - 1) + 1] = sign * sin(k * p * theta);
+        }
+        for (int q = 0; q < s; q++) {
+            radix4_rows(len,
+                        &x[(size_t)(q + s * p) * len], &x[(size_t)(q + s * (p + n1)) * len],
+                        &x[(size_t)(q + s * (p + 2 * n1)) * len], &x[(size_t)(q + s * (p + 3 * n1)) * len],
+                        &y[(size_t)(q + s * 4 * p) * len], &y[(size_t)(q + s * (4 * p + 1)) * len],
+                        &y[(size_t)(q + s * (4 * p + 2)) * len], &y[(size_t)(q + s * (4 * p + 3)) * len],
+                        w, sign);
+        }
+    }
+    fft_columns(n / 4, 4 * s, !eo, sign, len, y, x);
+}
+
+static void transpose(int n, float* data) {
+    // in place, complex values moved as one 64-bit unit, in TRANSPOSEBLOCK square blocks
+    unsigned long long* m = (unsigned long long*)data;
+    for (int bj = 0; bj < n; bj += TRANSPOSEBLOCK) {
+        for (int bi = bj; bi < n; bi += TRANSPOSEBLOCK) {
+            for (int j = bj; j < bj + TRANSPOSEBLOCK && j < n; j++) {
+                for (int i = bi == bj ? j + 1 : bi; i < bi + TRANSPOSEBLOCK && i < n; i++) {
+                    unsigned long long t = m[(size_t)j * n + i];
+                    m[(size_t)j * n + i] = m[(size_t)i * n + j];
+                    m[(size_t)i * n + j] = t;
+                }
+            }
+        }
+    }
+}
+
+void fft2d(int n, float* data, float* work, int inverse) {
+    // data is n x n complex, work the same size; forward leaves the spectrum transposed,
+    // inverse takes it that way and returns the image in its own layout, scaled by 1 / n^2
+    int sign = inverse ? 1 : -1;
+    fft_columns(n, 1, 0, sign, 2 * n, data, work);
+    transpose(n, data);
+    fft_columns(n, 1, 0, sign, 2 * n, data, work);
+    if (inverse) {
+        float scale = 1.0f / ((float)n * n);
+        for (size_t i = 0; i < (size_t)2 * n * n; i++) data[i] *= scale;
+    }
+}
+
+void fft_tuning(FftTuning const * t) {
+    // the cost model and tile factor for the next filters, NULL restores the built-in ones;
+    // set once before any filtering, it is not synchronized
+    FftTuning d = {DIRECTCOST, FFTCOST, FFTTILEFACTOR};
+    tuning = t ? *t : d;
+}
+
+int fft_tile_size(int margin, int extent) {
+    // smallest power of two where the valid block is at least 1 - 2/factor of the tile side (3/4 for
+    // the default 8), or that covers the whole image (extent is its larger side) if that is smaller
+    int n = FFTMINSIZE;
+    while (n < FFTMAXSIZE && n < tuning.tile_factor * margin && n < extent + 2 * margin) n *= 2;
+    return n > 2 * margin ? n : 0;
+}
+
+int fft_preferred(int kw, int kh, int width, int height) {
+    // estimated operations per output pixel, direct taps against a forward and an inverse
+    // transform per two tiles plus the spectrum product
+    int margin = (kw > kh ? kw : kh) / 2;
+    int n = fft_tile_size(margin, width > height ? width : height);
+    if (!n) return 0;
+    int block = n - 2 * margin;
+    // tiny images do not fill a tile, the transform then costs for the whole tile anyway
+    double outputs = (double)(block < width ? block : width) * (block < height ? block : height);
+    double fft = (tuning.fft_cost * 2 * log2((double)n * n) + 6) * n * n / 2 / outputs;
+    double direct = tuning.direct_cost * kw * kh;
+    return fft < direct;
+}
+
+static int freq_filter_alloc(FreqFilter* f, int margin, int extent) {
+    f->margin = margin;
+    f->n = fft_tile_size(margin, extent);
+    f->offset = 0;
+    f->response = NULL;
+    if (!f->n) return 0;
+    f->response = (float*)aligned_alloc(PADALIGN, sizeof(float) * 2 * f->n * f->n);
+    return f->response != NULL;
+}
+
+static int kernel_spectrum(FreqFilter* f, double* kernel, int kw, int kh) {
+    // same taps as the direct path: out(i, j) = sum k[jj][ii] * in(i + ii - kw/2, j + jj - kh/2),
+    // i.e. circular convolution with the kernel mirrored around its center
+    int n = f->n, cx = kw / 2, cy = kh / 2;
+    float* work = (float*)aligned_alloc(PADALIGN, sizeof(float) * 2 * n * n);
+    if (!work) {
+        // the response is not usable, release it here so failed builds leave nothing behind
+        freq_filter_free(f);
+        return 0;
+    }
+    memset(f->response, 0, sizeof(float) * 2 * n * n);
+    for (int jj = 0; jj < kh; jj++) {
+        for (int ii = 0; ii < kw; ii++) {
+            int y = ((cy - jj) % n + n) % n, x = ((cx - ii) % n + n) % n;
+            f->response[2 * ((size_t)y * n + x)] += kernel[jj * kw + ii];
+        }
+    }
+    fft2d(n, f->response, work, 0);
+    free(work);
+    return 1;
+}
+
+int freq_filter_kernel(FreqFilter* f, double* kernel, int kw, int kh, int extent) {
+    int kx = kw - 1 - kw / 2 > kw / 2 ? kw - 1 - kw / 2 : kw / 2;
+    int ky = kh - 1 - kh / 2 > kh / 2 ? kh - 1 - kh / 2 : kh / 2;
+    if (!freq_filter_alloc(f, kx > ky ? kx : ky, extent)) return 0;
+    return kernel_spectrum(f, kernel, kw, kh);
+}
+
+int freq_filter_wiener(FreqFilter* f, double* kernel, int kw, int kh, double nsr, int extent) {
+    // restores an image blurred by kernel: conj(H) / (|H|^2 + nsr); the inverse response is
+    // longer than the blur, so tiles keep twice the kernel size of context on every side
+    int k = kw > kh ? kw : kh;
+    if (!freq_filter_alloc(f, 2 * k, extent)) return 0;
+    if (!kernel_spectrum(f, kernel, kw, kh)) return 0;
+    for (size_t i = 0; i < (size_t)f->n * f->n; i++) {
+        float re = f->response[2 * i], im = f->response[2 * i + 1];
+        float den = re * re + im * im + nsr;
+        f->response[2 * i] = re / den;
+        f->response[2 * i + 1] = -im / den;
+    }
+    return 1;
+}
+
+int freq_filter_gauss(FreqFilter* f, double sigma, int highpass, int extent) {
+    // Gaussian with spatial sigma built directly as its transfer function exp(-2 pi^2 sigma^2 f^2),
+    // high-pass is one minus it around mid-gray; the response is symmetric so its layout does not matter
+    if (!freq_filter_alloc(f, (int)ceil(3 * sigma), extent)) return 0;
+    int n = f->n;
+    for (int v = 0; v < n; v++) {
+        double fv = (double)(v < n / 2 ? v : v - n) / n;
+        for (int u = 0; u < n; u++) {
+            double fu = (double)(u < n / 2 ? u : u - n) / n;
+            double g = exp(-2 * M_PI * M_PI * sigma * sigma * (fu * fu + fv * fv));
+            f->response[2 * ((size_t)v * n + u)] = highpass ? 1 - g : g;
+            f->response[2 * ((size_t)v * n + u) + 1] = 0;
+        }
+    }
+    f->offset = highpass ? MAXSIZE / 2 : 0;
+    return 1;
+}
+
+void freq_filter_free(FreqFilter* f) {
+    free(f->response);
+    f->response = NULL;
+}
+
+static void spectrum_product(size_t count, float* z, float const * r) {
+    // z *= r, count complex values
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 2 <= count; i += 2) {
+        __m128 vz = _mm_load_ps(&z[2 * i]), vr = _mm_load_ps(&r[2 * i]);
+        __m128 rr = _mm_shuffle_ps(vr, vr, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 ri = _mm_shuffle_ps(vr, vr, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 sw = _mm_shuffle_ps(vz, vz, _MM_SHUFFLE(2, 3, 0, 1));
+        ri = _mm_mul_ps(ri, _mm_set_ps(1, -1, 1, -1));
+        _mm_store_ps(&z[2 * i], _mm_add_ps(_mm_mul_ps(vz, rr), _mm_mul_ps(sw, ri)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 2 <= count; i += 2) {
+        float32x4_t vz = vld1q_f32(&z[2 * i]), vr = vld1q_f32(&r[2 * i]);
+        float32x4_t rr = vtrn1q_f32(vr, vr), ri = vtrn2q_f32(vr, vr);
+        float const sgn[4] = {-1, 1, -1, 1};
+        ri = vmulq_f32(ri, vld1q_f32(sgn));
+        vst1q_f32(&z[2 * i], vaddq_f32(vmulq_f32(vz, rr), vmulq_f32(vrev64q_f32(vz), ri)));
+    }
+#endif
+    for (; i < count; i++) {
+        float zr = z[2 * i], zi = z[2 * i + 1];
+        z[2 * i] = zr * r[2 * i] - zi * r[2 * i + 1];
+        z[2 * i + 1] = zi * r[2 * i] + zr * r[2 * i + 1];
+    }
+}
+
+typedef struct {
+    FreqFilter* f;
+    PaddedImage* src;
+    unsigned char* dst;
+    float* fdst;            // unclamped output instead of dst when not NULL
+    int tiles_x, tiles;
+    int first, step;        // tile pairs first, first + step, ...
+    int ok;
+} FilterJob;
+
+static void load_tile(FreqFilter* f, PaddedImage* src, int tile, int tiles_x, float* z, int part) {
+    // input around the output block of tile into the real (part 0) or imaginary (part 1) lanes
+    int n = f->n, m = f->margin, block = n - 2 * m;
+    int x0 = (tile % tiles_x) * block - m, y0 = (tile / tiles_x) * block - m;
+    // the padded image ends margin pixels past the last pixel, the rest of a border tile stays 0
+    int w = src->width + m - x0 < n ? src->width + m - x0 : n;
+    int h = src->height + m - y0 < n ? src->height + m - y0 : n;
+    for (int j = 0; j < h; j++) {
+        unsigned char* row = &src->px[(y0 + j) * src->stride + x0];
+        float* out = &z[2 * (size_t)j * n + part];
+        for (int i = 0; i < w; i++) out[2 * i] = row[i];
+    }
+}
+
+static void store_tile(FreqFilter* f, PaddedImage* src, int tile, int tiles_x, float* z, int part,
+                       unsigned char* dst, float* fdst) {
+    int n = f->n, m = f->margin, block = n - 2 * m;
+    int x0 = (tile % tiles_x) * block, y0 = (tile / tiles_x) * block;
+    int w = src->width - x0 < block ? src->width - x0 : block;
+    int h = src->height - y0 < block ? src->height - y0 : block;
+    for (int j = 0; j < h; j++) {
+        float* in = &z[2 * ((size_t)(m + j) * n + m) + part];
+        if (fdst) {
+            float* out = &fdst[(size_t)(y0 + j) * src->width + x0];
+            for (int i = 0; i < w; i++) out[i] = in[2 * i] + f->offset;
+            continue;
+        }
+        unsigned char* out = &dst[(y0 + j) * src->width + x0];
+        for (int i = 0; i < w; i++) {
+            float v = in[2 * i] + f->offset;
+            out[i] = v < 0 ? 0 : v > MAXGRAY ? MAXGRAY : (unsigned char)v;
+        }
+    }
+}
+
+static void* filter_worker(void* arg) {
+    FilterJob* job = (FilterJob*)arg;
+    FreqFilter* f = job->f;
+    int n = f->n;
+    float* z = (float*)aligned_alloc(PADALIGN, sizeof(float) * 2 * n * n);
+    float* work = (float*)aligned_alloc(PADALIGN, sizeof(float) * 2 * n * n);
+    job->ok = z && work;
+    for (int pair = job->first; job->ok && 2 * pair < job->tiles; pair += job->step) {
+        int a = 2 * pair, b = 2 * pair + 1;
+        trace_begin("fft tile pair", pair);
+        memset(z, 0, sizeof(float) * 2 * n * n);
+        load_tile(f, job->src, a, job->tiles_x, z, 0);
+        if (b < job->tiles) load_tile(f, job->src, b, job->tiles_x, z, 1);
+        fft2d(n, z, work, 0);
+        spectrum_product((size_t)n * n, z, f->response);
+        fft2d(n, z, work, 1);
+        // the response belongs to a real filter, so the two tiles come back apart
+        store_tile(f, job->src, a, job->tiles_x, z, 0, job->dst, job->fdst);
+        if (b < job->tiles) store_tile(f, job->src, b, job->tiles_x, z, 1, job->dst, job->fdst);
+        trace_end("fft tile pair", pair);
+    }
+    free(z);
+    free(work);
+    return NULL;
+}
+
+static int apply_tiles(FreqFilter* f, PaddedImage* src, unsigned char* dst, float* fdst, int threads) {
+    // overlap-save: every tile transforms block + 2 * margin input pixels and keeps the inner
+    // block, which the circular wrap-around cannot reach; src needs a border of at least margin
+    if (src->border < f->margin) return 0;
+    int block = f->n - 2 * f->margin;
+    int tiles_x = (src->width + block - 1) / block;
+    int tiles = tiles_x * ((src->height + block - 1) / block);
+    int pairs = (tiles + 1) / 2;
+    if (threads < 1) threads = 1;
+    if (threads > pairs) threads = pairs;
+    FilterJob jobs[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (FilterJob){f, src, dst, fdst, tiles_x, tiles, t, threads, 1};
+        started[t] = t > 0 && pthread_create(&ids[t], NULL, filter_worker, &jobs[t]) == 0;
+        // no thread, run its share here instead
+        if (t > 0 && !started[t]) filter_worker(&jobs[t]);
+    }
+    filter_worker(&jobs[0]);
+    int ok = jobs[0].ok;
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+        ok = ok && jobs[t].ok;
+    }
+    return ok;
+}
+
+int freq_filter_apply(FreqFilter* f, PaddedImage* src, unsigned char* dst, int threads) {
+    return apply_tiles(f, src, dst, NULL, threads);
+}
+
+int freq_filter_apply_float(FreqFilter* f, PaddedImage* src, float* dst, int threads) {
+    // same, but the filtered values are kept as they are, e.g. for correlations
+    return apply_tiles(f, src, NULL, dst, threads);
+}
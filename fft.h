@@ -0,0 +1,53 @@
+/*
+Frequency-domain filtering for large kernels.
+2D FFTs are done as a vector Stockham FFT along the columns (radix-4, one radix-2 step for odd
+powers), a blocked transpose and the same column FFT again, so the butterflies always work on
+whole rows with SIMD. Spectra stay in that transposed layout, filters are built in it too.
+Images are filtered tile by tile with overlap-save, two real tiles share one complex transform
+(one as the real, one as the imaginary part), tiles are spread over threads.
+*/
+
+#ifndef FFT_H
+#define FFT_H
+
+#include "image.h"
+
+#ifndef MAXGRAY
+#define MAXGRAY 255
+#define MAXSIZE (MAXGRAY+1)
+#endif
+#define FFTMINSIZE 64
+#define FFTMAXSIZE 1024
+#define FFTTILEFACTOR 8     // tiles grow to at least this many margins
+// relative cost of one direct tap per pixel and of one fft point per log2 of the size,
+// calibrated with box kernels from 3x3 to 21x21 on sample.ppm (3x3 is about even);
+// zad1 --autotune measures them (and the tile factor) for the host, see fft_tuning
+#define DIRECTCOST 2.0
+#define FFTCOST 1.0
+
+typedef struct {
+    double direct_cost;     // of one direct tap per pixel
+    double fft_cost;        // of one transform point per log2 of the size, in the same units
+    int tile_factor;
+} FftTuning;
+
+typedef struct {
+    int n;              // transform size, power of two
+    int margin;         // input pixels an output pixel needs on each side
+    float* response;    // n x n complex response, interleaved re/im, transposed spectrum layout
+    float offset;       // added to every output pixel (mid-gray for high-pass)
+} FreqFilter;
+
+void fft_tuning(FftTuning const * t);
+int fft_tile_size(int margin, int extent);
+void fft2d(int n, float* data, float* work, int inverse);
+int fft_preferred(int kw, int kh, int width, int height);
+
+int freq_filter_kernel(FreqFilter* f, double* kernel, int kw, int kh, int extent);
+int freq_filter_wiener(FreqFilter* f, double* kernel, int kw, int kh, double nsr, int extent);
+int freq_filter_gauss(FreqFilter* f, double sigma, int highpass, int extent);
+void freq_filter_free(FreqFilter* f);
+int freq_filter_apply(FreqFilter* f, PaddedImage* src, unsigned char* dst, int threads);
+int freq_filter_apply_float(FreqFilter* f, PaddedImage* src, float* dst, int threads);
+
+#endif
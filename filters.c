@@ -0,0 +1,437 @@
+/*
+Unsharp mask and guided filter, see filters.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "filters.h"
+#include "trace.h"
+
+#define MAXGRAY 255
+
+static unsigned char clamp_gray(double x) {
+    // clamped and truncated, as zad1's round_clamp
+    if (x > MAXGRAY) return MAXGRAY;
+    if (x < 0) return 0;
+    return (unsigned char)x;
+}
+
+static void unsharp_vertical(int n, unsigned char* top, int stride, int taps, unsigned short* w, unsigned short* out) {
+    // n columns of sum w[k] * (px << 8) >> 16 down taps rows, blur in 8.8 fixed point
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i <= n - 8; i += 8) {
+        __m128i acc = zero;
+        for (int k = 0; k < taps; k++) {
+            __m128i p = _mm_unpacklo_epi8(zero, _mm_loadl_epi64((__m128i*)&top[k * stride + i]));
+            acc = _mm_add_epi16(acc, _mm_mulhi_epu16(p, _mm_set1_epi16(w[k])));
+        }
+        _mm_storeu_si128((__m128i*)&out[i], acc);
+    }
+#elif defined(__ARM_NEON)
+    for (; i <= n - 8; i += 8) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (int k = 0; k < taps; k++) {
+            uint16x8_t p = vshll_n_u8(vld1_u8(&top[k * stride + i]), 8);
+            uint16x4_t wk = vdup_n_u16(w[k]);
+            uint16x8_t hi = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(p), wk), 16),
+                                         vshrn_n_u32(vmull_u16(vget_high_u16(p), wk), 16));
+            acc = vaddq_u16(acc, hi);
+        }
+        vst1q_u16(&out[i], acc);
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned short acc = 0;
+        for (int k = 0; k < taps; k++) {
+            acc += (unsigned short)(((unsigned)top[k * stride + i] << 8) * w[k] >> 16);
+        }
+        out[i] = acc;
+    }
+}
+
+static void unsharp_horizontal(int n, unsigned char* row, unsigned short* v, int taps, unsigned short* w,
+                               short amount, short treshold, unsigned char* out) {
+    // blur along the row from the vertical sums, then out = row + amount * (row - blur) where
+    // |row - blur| > treshold; the difference is in 12.4, amount in 4.12, the add saturates
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a = _mm_set1_epi16(amount), t = _mm_set1_epi16(treshold);
+    for (; i <= n - 8; i += 8) {
+        __m128i blur = zero;
+        for (int k = 0; k < taps; k++) {
+            __m128i vk = _mm_loadu_si128((__m128i*)&v[i + k]);
+            blur = _mm_add_epi16(blur, _mm_mulhi_epu16(vk, _mm_set1_epi16(w[k])));
+        }
+        __m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&row[i]), zero);
+        __m128i d = _mm_sub_epi16(_mm_slli_epi16(px, 4), _mm_srli_epi16(blur, 4));
+        __m128i ad = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+        d = _mm_and_si128(d, _mm_cmpgt_epi16(ad, t));
+        __m128i r = _mm_adds_epi16(px, _mm_mulhi_epi16(d, a));
+        _mm_storel_epi64((__m128i*)&out[i], _mm_packus_epi16(r, r));
+    }
+#elif defined(__ARM_NEON)
+    const int16x4_t a = vdup_n_s16(amount);
+    const int16x8_t t = vdupq_n_s16(treshold);
+    for (; i <= n - 8; i += 8) {
+        uint16x8_t blur = vdupq_n_u16(0);
+        for (int k = 0; k < taps; k++) {
+            uint16x8_t vk = vld1q_u16(&v[i + k]);
+            uint16x4_t wk = vdup_n_u16(w[k]);
+            blur = vaddq_u16(blur, vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(vk), wk), 16),
+                                                vshrn_n_u32(vmull_u16(vget_high_u16(vk), wk), 16)));
+        }
+        int16x8_t px = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&row[i])));
+        int16x8_t d = vsubq_s16(vshlq_n_s16(px, 4), vreinterpretq_s16_u16(vshrq_n_u16(blur, 4)));
+        d = vandq_s16(d, vreinterpretq_s16_u16(vcgtq_s16(vabsq_s16(d), t)));
+        int16x8_t delta = vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(d), a), 16),
+                                       vshrn_n_s32(vmull_s16(vget_high_s16(d), a), 16));
+        vst1_u8(&out[i], vqmovun_s16(vqaddq_s16(px, delta)));
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned short blur = 0;
+        for (int k = 0; k < taps; k++) {
+            blur += (unsigned short)((unsigned)v[i + k] * w[k] >> 16);
+        }
+        int d = (row[i] << 4) - (blur >> 4);
+        if (abs(d) <= treshold) d = 0;
+        int r = row[i] + ((d * amount) >> 16);
+        out[i] = r < 0 ? 0 : r > MAXGRAY ? MAXGRAY : r;
+    }
+}
+
+int unsharp_padded(PaddedImage* src, unsigned char* new_grayscale, UnsharpParams* up) {
+    // unsharp mask in the same sweep as its blur: for every output row the 2r + 1 padded rows
+    // around it are summed vertically into one 16-bit row, blurred along it and sharpened;
+    // the blur is binomial, radius 1 is the 3x3 gaussian of the default filter
+    int width = src->width, stride = src->stride, r = up->radius, taps = 2 * r + 1;
+    unsigned short w[2 * MAXUNSHARP + 1];
+    // C(2r, k) / 4^r in 0.16 fixed point for the high half multiplies
+    double c = 1;
+    for (int k = 0; k < taps; k++) {
+        w[k] = (unsigned short)lround(c / pow(4, r) * 65536);
+        c = c * (2 * r - k) / (k + 1);
+    }
+    // amounts just under 8 round to 8.0 = 32768, one past what 4.12 in a short holds
+    long q = lround(up->amount * 4096);
+    short amount = (short)(q > SHRT_MAX ? SHRT_MAX : q);
+    short treshold = (short)(up->treshold << 4);
+    unsigned short* v = (unsigned short*)malloc((width + 2 * r) * sizeof(unsigned short));
+    if (!v) return 0;
+    for (int j = 0; j < src->height; j++) {
+        unsigned char* row = &src->px[j * stride];
+        unsharp_vertical(width + 2 * r, row - r * stride - r, stride, taps, w, v);
+        unsharp_horizontal(width, row, v, taps, w, amount, treshold, &new_grayscale[j * width]);
+    }
+    free(v);
+    return 1;
+}
+
+static void guided_columns(int n, unsigned char* guide, unsigned char* src, int sign,
+                           unsigned int* si, unsigned int* sp, unsigned int* sii, unsigned int* sip) {
+    // add (sign 1) or remove (sign -1) one row from the running column sums of I, p, I*I and I*p;
+    // self-guided (src == guide) only keeps I and I*I, the other two alias them
+    int self = src == guide;
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i <= n - 8; i += 8) {
+        __m128i g = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&guide[i]), zero);
+        __m128i p = self ? g : _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&src[i]), zero);
+        // products fit 16 bits unsigned (255 * 255), widened before the 32-bit sums
+        __m128i gg = _mm_mullo_epi16(g, g), gp = _mm_mullo_epi16(g, p);
+        __m128i v[4][2] = {
+            {_mm_unpacklo_epi16(g, zero), _mm_unpackhi_epi16(g, zero)},
+            {_mm_unpacklo_epi16(gg, zero), _mm_unpackhi_epi16(gg, zero)},
+            {_mm_unpacklo_epi16(p, zero), _mm_unpackhi_epi16(p, zero)},
+            {_mm_unpacklo_epi16(gp, zero), _mm_unpackhi_epi16(gp, zero)}
+        };
+        unsigned int* sums[4] = {si, sii, sp, sip};
+        for (int c = 0; c < (self ? 2 : 4); c++) {
+            for (int h = 0; h < 2; h++) {
+                __m128i* s = (__m128i*)&sums[c][i + 4 * h];
+                __m128i cur = _mm_loadu_si128(s);
+                _mm_storeu_si128(s, sign > 0 ? _mm_add_epi32(cur, v[c][h]) : _mm_sub_epi32(cur, v[c][h]));
+            }
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i <= n - 8; i += 8) {
+        uint8x8_t g8 = vld1_u8(&guide[i]), p8 = self ? g8 : vld1_u8(&src[i]);
+        uint16x8_t g = vmovl_u8(g8), p = vmovl_u8(p8);
+        uint16x8_t gg = vmull_u8(g8, g8), gp = vmull_u8(g8, p8);
+        uint16x8_t v[4] = {g, gg, p, gp};
+        unsigned int* sums[4] = {si, sii, sp, sip};
+        for (int c = 0; c < (self ? 2 : 4); c++) {
+            uint32x4_t lo = vld1q_u32(&sums[c][i]), hi = vld1q_u32(&sums[c][i + 4]);
+            uint32x4_t vl = vmovl_u16(vget_low_u16(v[c])), vh = vmovl_u16(vget_high_u16(v[c]));
+            vst1q_u32(&sums[c][i], sign > 0 ? vaddq_u32(lo, vl) : vsubq_u32(lo, vl));
+            vst1q_u32(&sums[c][i + 4], sign > 0 ? vaddq_u32(hi, vh) : vsubq_u32(hi, vh));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned int g = guide[i], p = src[i];
+        si[i] += sign * g;
+        sii[i] += sign * g * g;
+        if (!self) {
+            sp[i] += sign * p;
+            sip[i] += sign * g * p;
+        }
+    }
+}
+
+static void box_sums(int n, int r, unsigned int* col, unsigned int* prefix, unsigned int* out) {
+    // horizontal box sums of the column sums over [x - r, x + r] clipped to the row; the prefix sums
+    // may wrap around, the box sums fit 32 bits up to GUIDEDMAXRADIUS and come out exact
+    prefix[0] = 0;
+    for (int x = 0; x < n; x++) prefix[x + 1] = prefix[x] + col[x];
+    int x = 0;
+    for (; x < n && x < r; x++) out[x] = prefix[x + r + 1 > n ? n : x + r + 1];
+#if defined(__SSE2__)
+    for (; x <= n - r - 4; x += 4) {
+        __m128i hi = _mm_loadu_si128((__m128i*)&prefix[x + r + 1]);
+        __m128i lo = _mm_loadu_si128((__m128i*)&prefix[x - r]);
+        _mm_storeu_si128((__m128i*)&out[x], _mm_sub_epi32(hi, lo));
+    }
+#elif defined(__ARM_NEON)
+    for (; x <= n - r - 4; x += 4) {
+        vst1q_u32(&out[x], vsubq_u32(vld1q_u32(&prefix[x + r + 1]), vld1q_u32(&prefix[x - r])));
+    }
+#endif
+    for (; x < n; x++) {
+        int lo = x - r < 0 ? 0 : x - r, hi = x + r + 1 > n ? n : x + r + 1;
+        out[x] = prefix[hi] - prefix[lo];
+    }
+}
+
+static void box_row(int n, int r, double* col, double* prefix, double* out) {
+    // the same for the running sums of a and b, in double so they do not drift with the band start
+    prefix[0] = 0;
+    for (int x = 0; x < n; x++) prefix[x + 1] = prefix[x] + col[x];
+    int x = 0;
+    for (; x < n && x < r; x++) out[x] = prefix[x + r + 1 > n ? n : x + r + 1];
+#if defined(__SSE2__)
+    for (; x <= n - r - 2; x += 2) {
+        _mm_storeu_pd(&out[x], _mm_sub_pd(_mm_loadu_pd(&prefix[x + r + 1]), _mm_loadu_pd(&prefix[x - r])));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; x <= n - r - 2; x += 2) {
+        vst1q_f64(&out[x], vsubq_f64(vld1q_f64(&prefix[x + r + 1]), vld1q_f64(&prefix[x - r])));
+    }
+#endif
+    for (; x < n; x++) {
+        int lo = x - r < 0 ? 0 : x - r, hi = x + r + 1 > n ? n : x + r + 1;
+        out[x] = prefix[hi] - prefix[lo];
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128 u32_to_ps(unsigned int* p) {
+    // rounded once like (float)p[i], SSE2 only converts signed lanes
+    __m128i v = _mm_loadu_si128((__m128i*)p);
+    __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(v, 16)), lo = _mm_cvtepi32_ps(_mm_and_si128(v, _mm_set1_epi32(0xffff)));
+    return _mm_add_ps(_mm_mul_ps(hi, _mm_set1_ps(65536.0f)), lo);
+}
+#endif
+
+static void guided_ab(int n, unsigned int** box, int self, float* invx, float invy, float eps, float* a, float* b) {
+    // a = cov / (var + eps) and b = mean_p - a * mean_I of a row from its box sums (I, p, I*I, I*p),
+    // 4 pixels at a time; the box sums are exact, so float only rounds the moments
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128 e = _mm_set1_ps(eps), iy = _mm_set1_ps(invy);
+    for (; x <= n - 4; x += 4) {
+        __m128 inv = _mm_mul_ps(_mm_loadu_ps(&invx[x]), iy);
+        __m128 mi = _mm_mul_ps(u32_to_ps(&box[0][x]), inv);
+        __m128 var = _mm_sub_ps(_mm_mul_ps(u32_to_ps(&box[2][x]), inv), _mm_mul_ps(mi, mi));
+        __m128 mp = mi, cov = var;
+        if (!self) {
+            mp = _mm_mul_ps(u32_to_ps(&box[1][x]), inv);
+            cov = _mm_sub_ps(_mm_mul_ps(u32_to_ps(&box[3][x]), inv), _mm_mul_ps(mi, mp));
+        }
+        __m128 va = _mm_div_ps(cov, _mm_add_ps(var, e));
+        _mm_storeu_ps(&a[x], va);
+        _mm_storeu_ps(&b[x], _mm_sub_ps(mp, _mm_mul_ps(va, mi)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t e = vdupq_n_f32(eps);
+    for (; x <= n - 4; x += 4) {
+        float32x4_t inv = vmulq_n_f32(vld1q_f32(&invx[x]), invy);
+        float32x4_t mi = vmulq_f32(vcvtq_f32_u32(vld1q_u32(&box[0][x])), inv);
+        float32x4_t var = vsubq_f32(vmulq_f32(vcvtq_f32_u32(vld1q_u32(&box[2][x])), inv), vmulq_f32(mi, mi));
+        float32x4_t mp = mi, cov = var;
+        if (!self) {
+            mp = vmulq_f32(vcvtq_f32_u32(vld1q_u32(&box[1][x])), inv);
+            cov = vsubq_f32(vmulq_f32(vcvtq_f32_u32(vld1q_u32(&box[3][x])), inv), vmulq_f32(mi, mp));
+        }
+        float32x4_t va = vdivq_f32(cov, vaddq_f32(var, e));
+        vst1q_f32(&a[x], va);
+        vst1q_f32(&b[x], vsubq_f32(mp, vmulq_f32(va, mi)));
+    }
+#endif
+    for (; x < n; x++) {
+        float inv = invx[x] * invy;
+        float mi = (float)box[0][x] * inv, var = (float)box[2][x] * inv - mi * mi;
+        float mp = mi, cov = var;
+        if (!self) {
+            mp = (float)box[1][x] * inv;
+            cov = (float)box[3][x] * inv - mi * mp;
+        }
+        a[x] = cov / (var + eps);
+        b[x] = mp - a[x] * mi;
+    }
+}
+
+typedef struct {
+    PaddedImage* src;
+    unsigned char* guide;       // width x height, or NULL to guide by src
+    GuidedParams* gp;
+    unsigned char* out;
+    int y0, y1;                 // output rows of this band
+    int band;
+    int ok;
+} GuidedJob;
+
+static unsigned char* guide_row(GuidedJob* job, int y) {
+    return job->guide ? &job->guide[(size_t)y * job->src->width] : &job->src->px[y * job->src->stride];
+}
+
+static void* guided_rows(void* arg) {
+    // running-sum box filters, so the cost per pixel does not depend on the radius:
+    // a, b are computed for the band plus r rows of halo, then box filtered again into q = mean_a * I + mean_b
+    GuidedJob* job = (GuidedJob*)arg;
+    PaddedImage* src = job->src;
+    int w = src->width, h = src->height, r = job->gp->radius;
+    int ya = job->y0 - r < 0 ? 0 : job->y0 - r, yb = job->y1 + r > h ? h : job->y1 + r;
+    float eps = (float)(job->gp->eps * MAXGRAY * MAXGRAY);
+    int self = job->guide == NULL;
+    // column sums, then the prefix and the box sums of the first pass
+    unsigned int* isums = (unsigned int*)calloc(9 * (size_t)w + 1, sizeof(unsigned int));
+    double* d = (double*)malloc((5 * (size_t)w + 1) * sizeof(double));
+    float* invx = (float*)malloc(w * sizeof(float));
+    float* ab = (float*)malloc(2 * (size_t)w * (yb - ya) * sizeof(float));
+    job->ok = isums && d && invx && ab;
+    if (!job->ok) {
+        free(isums);
+        free(d);
+        free(invx);
+        free(ab);
+        return NULL;
+    }
+    unsigned int *si = isums, *sii = isums + w, *sp = isums + 2 * w, *sip = isums + 3 * w;
+    if (self) {
+        sp = si;
+        sip = sii;
+    }
+    unsigned int* iprefix = isums + 4 * w;
+    unsigned int* box[4] = {isums + 5 * w + 1, isums + 6 * w + 1, isums + 7 * w + 1, isums + 8 * w + 1};
+    unsigned int* csums[4] = {si, sp, sii, sip};     // box[] follows the same order
+    for (int x = 0; x < w; x++) invx[x] = 1.0f / ((x + r + 1 > w ? w : x + r + 1) - (x - r < 0 ? 0 : x - r));
+
+    // first pass: window rows [y - r, y + r] clipped to the image
+    for (int y = ya - r < 0 ? 0 : ya - r; y <= ya + r && y < h; y++) {
+        guided_columns(w, guide_row(job, y), &src->px[y * src->stride], 1, si, sp, sii, sip);
+    }
+    for (int y = ya; y < yb; y++) {
+        int ny = (y + r + 1 > h ? h : y + r + 1) - (y - r < 0 ? 0 : y - r);
+        for (int c = 0; c < 4; c++) {
+            if (self && c % 2) continue;
+            box_sums(w, r, csums[c], iprefix, box[c]);
+        }
+        float* a = &ab[2 * (size_t)(y - ya) * w];
+        guided_ab(w, box, self, invx, 1.0f / ny, eps, a, a + w);
+        if (y + r + 1 < h) {
+            int yn = y + r + 1;
+            guided_columns(w, guide_row(job, yn), &src->px[yn * src->stride], 1, si, sp, sii, sip);
+        }
+        if (y - r >= 0) {
+            guided_columns(w, guide_row(job, y - r), &src->px[(y - r) * src->stride], -1, si, sp, sii, sip);
+        }
+    }
+
+    // second pass over the band only, the halo rows of a, b are all there
+    double *prefix = d, *ca = d + w + 1, *cb = d + 2 * w + 1, *ma = d + 3 * w + 1, *mb = d + 4 * w + 1;
+    memset(ca, 0, w * sizeof(double));
+    memset(cb, 0, w * sizeof(double));
+    for (int y = job->y0 - r < 0 ? 0 : job->y0 - r; y <= job->y0 + r && y < h; y++) {
+        float* a = &ab[2 * (size_t)(y - ya) * w];
+        for (int x = 0; x < w; x++) {
+            ca[x] += a[x];
+            cb[x] += a[w + x];
+        }
+    }
+    for (int y = job->y0; y < job->y1; y++) {
+        int ny = (y + r + 1 > h ? h : y + r + 1) - (y - r < 0 ? 0 : y - r);
+        box_row(w, r, ca, prefix, ma);
+        box_row(w, r, cb, prefix, mb);
+        unsigned char* g = guide_row(job, y);
+        unsigned char* out = &job->out[(size_t)y * w];
+        for (int x = 0; x < w; x++) {
+            int nx = (x + r + 1 > w ? w : x + r + 1) - (x - r < 0 ? 0 : x - r);
+            out[x] = clamp_gray((ma[x] * g[x] + mb[x]) / ((double)nx * ny));
+        }
+        // the halo ends at yb, the band's last row needs no next window
+        if (y + r + 1 < yb) {
+            float* a = &ab[2 * (size_t)(y + r + 1 - ya) * w];
+            for (int x = 0; x < w; x++) {
+                ca[x] += a[x];
+                cb[x] += a[w + x];
+            }
+        }
+        if (y - r >= 0) {
+            float* a = &ab[2 * (size_t)(y - r - ya) * w];
+            for (int x = 0; x < w; x++) {
+                ca[x] -= a[x];
+                cb[x] -= a[w + x];
+            }
+        }
+    }
+    free(isums);
+    free(d);
+    free(invx);
+    free(ab);
+    return NULL;
+}
+
+static void* guided_band(void* arg) {
+    GuidedJob* job = (GuidedJob*)arg;
+    trace_begin("guided band", job->band);
+    guided_rows(job);
+    trace_end("guided band", job->band);
+    return NULL;
+}
+
+int guided_filter(PaddedImage* src, unsigned char* guide, GuidedParams* gp, unsigned char* new_grayscale, int threads) {
+    // He et al. guided filter, bands of rows filtered by threads independently
+    int h = src->height;
+    if (gp->radius < 1 || gp->radius > GUIDEDMAXRADIUS) return 0;
+    if (threads > h) threads = h;
+    GuidedJob jobs[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (GuidedJob){src, guide, gp, new_grayscale, (int)((long)h * t / threads),
+                              (int)((long)h * (t + 1) / threads), t, 1};
+        started[t] = t > 0 && pthread_create(&ids[t], NULL, guided_band, &jobs[t]) == 0;
+        if (t > 0 && !started[t]) guided_band(&jobs[t]);
+    }
+    guided_band(&jobs[0]);
+    int ok = jobs[0].ok;
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+        ok = ok && jobs[t].ok;
+    }
+    return ok;
+}
@@ -0,0 +1,31 @@
+/*
+Edge-aware and sharpening filters of a border-padded grayscale image, shared by zad1 and imgproc.
+The unsharp mask adds the detail back in the same sweep as its binomial blur, in 16-bit fixed
+point with SIMD. The guided filter (He et al.) is O(1) per pixel whatever the radius: running
+column sums and box sums of rows, in bands of rows with a halo, one band per thread. The box sums
+are exact 32-bit integers, so a and b are computed in float 4 pixels at a time.
+*/
+
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include "image.h"
+
+#define MAXUNSHARP 8
+#define GUIDEDMAXRADIUS 127    // box sums of 255^2 over 255x255 windows still fit 32 bits
+
+typedef struct {
+    double amount;      // how much of the detail (image - blur) is added back, < 8
+    int radius;         // blur radius, 1..MAXUNSHARP
+    int treshold;       // details up to this many gray levels are left alone
+} UnsharpParams;
+
+typedef struct {
+    int radius;         // box radius, 1..GUIDEDMAXRADIUS, the cost does not depend on it
+    double eps;         // regularization as a fraction of the full range squared, larger smooths more edges
+} GuidedParams;
+
+int unsharp_padded(PaddedImage* src, unsigned char* new_grayscale, UnsharpParams* up);
+int guided_filter(PaddedImage* src, unsigned char* guide, GuidedParams* gp, unsigned char* new_grayscale, int threads);
+
+#endif
@@ -0,0 +1,621 @@
+/*
+Histogram statistics and threshold methods, see histogram.h.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "histogram.h"
+
+static char const * method_names[TH_COUNT] = {
+    "otsu", "kapur", "yen", "triangle", "isodata", "li", "auto"
+};
+
+static unsigned char lut_clamp(double x) {
+    // same as round_clamp in the programs, LUTs built here must not change their results
+    if (x > 255) return 255;
+    if (x < 0) return 0;
+    return (unsigned char)x;
+}
+
+void histogram_lut(int size, int* hist, unsigned char* tvals) {
+    // compute gmin
+    int gmin = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        if (hist[i] > 0) {
+            gmin = i;
+            break;
+        }
+    }
+
+    // compute c.img histogram
+    int histc[MAXSIZE] = {0};
+    histc[0] = 0;
+    for (int i = 1; i < MAXSIZE; i++) {
+        histc[i] = histc[i-1] + hist[i];
+    }
+    int hmin = histc[gmin];
+
+    // compute T values
+    tvals[0] = 0;
+    for (int i = 1; i < MAXSIZE; i++) {
+        // happy casting
+        double val = MAXGRAY * ((double)(histc[i] - hmin) / (size - hmin));
+        tvals[i] = lut_clamp(val);
+    }
+}
+
+void gamma_lut(double gamma, unsigned char* lookup) {
+    for (int i = 0; i < MAXSIZE; i++) {
+        double val = (double) i / MAXGRAY;
+        lookup[i] = lut_clamp(MAXGRAY * pow(val, gamma));
+    }
+}
+
+void match_lut(int size, int* hist, int* ref_hist, unsigned char* mvals) {
+    // map each level to the first reference level whose CDF reaches the source CDF
+    double ref_total = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        ref_total += ref_hist[i];
+    }
+
+    double cdf = 0, ref_cdf = ref_hist[0] / ref_total;
+    int r = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        cdf += (double)hist[i] / size;
+        // both CDFs only grow, so r never goes back
+        while (r < MAXGRAY && ref_cdf < cdf - 1e-12) {
+            r++;
+            ref_cdf += ref_hist[r] / ref_total;
+        }
+        mvals[i] = r;
+    }
+}
+
+void levels_lut(int size, int* hist, double clip, int* black, int* white, unsigned char* lvals) {
+    // black and white points at the clip and 1 - clip percentiles, linear stretch in between
+    int lo = (int)(clip * size), hi = (int)((1 - clip) * size);
+    int cum = 0;
+    *black = -1;
+    *white = MAXGRAY;
+    for (int i = 0; i < MAXSIZE; i++) {
+        cum += hist[i];
+        if (*black < 0 && cum > lo) *black = i;
+        if (cum >= hi) {
+            *white = i;
+            break;
+        }
+    }
+    if (*black < 0) *black = 0;
+    if (*white <= *black) *white = *black + 1 > MAXGRAY ? MAXGRAY : *black + 1;
+    if (*white == *black) *black = *white - 1;
+
+    for (int i = 0; i < MAXSIZE; i++) {
+        lvals[i] = lut_clamp(MAXGRAY * (double)(i - *black) / (*white - *black));
+    }
+}
+
+double auto_gamma(int size, int* hist, unsigned char* tone, double target) {
+    // gamma that brings the mean luminance after the tone LUT to target,
+    // the mean of (v/255)^gamma falls with gamma, so bisect over the 256 bins
+    double lo = 0.2, hi = 5;
+    for (int it = 0; it < 40; it++) {
+        double g = (lo + hi) / 2;
+        double mean = 0;
+        for (int i = 0; i < MAXSIZE; i++) {
+            if (hist[i] > 0) mean += hist[i] * pow((double)tone[i] / MAXGRAY, g);
+        }
+        mean /= size;
+        if (mean > target) {
+            lo = g;
+        } else {
+            hi = g;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+void point_lut(int size, int* hist, PointParams* pp, unsigned char* lut) {
+    // tone step (equalization, matching or levels) followed by gamma, applied as one LUT
+    unsigned char tvals[MAXSIZE] = {0};
+    unsigned char gvals[MAXSIZE] = {0};
+    if (pp->ref_hist) {
+        match_lut(size, hist, pp->ref_hist, tvals);
+    } else if (pp->auto_levels) {
+        levels_lut(size, hist, LEVELSCLIP, &pp->black, &pp->white, tvals);
+    } else {
+        histogram_lut(size, hist, tvals);
+    }
+    pp->used_gamma = pp->gamma > 0 ? pp->gamma : auto_gamma(size, hist, tvals, AUTOGAMMAMEAN);
+    gamma_lut(pp->used_gamma, gvals);
+    for (int i = 0; i < MAXSIZE; i++) {
+        lut[i] = gvals[tvals[i]];
+    }
+}
+
+void report_point_params(PointParams* pp) {
+    if (pp->auto_levels && !pp->ref_hist) {
+        printf("Auto levels: black point %d, white point %d.\n", pp->black, pp->white);
+    }
+    if (pp->gamma <= 0) {
+        printf("Auto gamma: %.3f.\n", pp->used_gamma);
+    }
+}
+
+int save_histogram(char const * file_name, int* hist) {
+    FILE* f = fopen(file_name, "wb");
+    if (f == NULL) return 0;
+    unsigned char buf[HISTMAGICSIZE + 4 * MAXSIZE];
+    memcpy(buf, HISTMAGIC, HISTMAGICSIZE);
+    for (int i = 0; i < MAXSIZE; i++) {
+        unsigned int v = (unsigned int)hist[i];
+        unsigned char* p = buf + HISTMAGICSIZE + 4 * i;
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+        p[2] = (v >> 16) & 0xff;
+        p[3] = (v >> 24) & 0xff;
+    }
+    int ok = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+    return fclose(f) == 0 && ok;
+}
+
+int load_histogram(char const * file_name, int* hist) {
+    FILE* f = fopen(file_name, "rb");
+    if (f == NULL) return 0;
+    unsigned char buf[HISTMAGICSIZE + 4 * MAXSIZE];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (n != sizeof(buf) || memcmp(buf, HISTMAGIC, HISTMAGICSIZE) != 0) return 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        unsigned char* p = buf + HISTMAGICSIZE + 4 * i;
+        hist[i] = (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+    }
+    return 1;
+}
+
+int pgm_histogram(char const * file_name, int* hist) {
+    // histogram of a P5 file, read in chunks so the reference image is never held in memory
+    FILE* f = fopen(file_name, "rb");
+    if (f == NULL) return 0;
+
+    char format[3], buffer[BUFSIZ];
+    int fields[5];
+    int nfields = 0;
+    int magic = 0;
+    while (nfields < 3 && fgets(buffer, sizeof(buffer), f) != NULL) {
+        if (buffer[0] == '#') continue;
+        if (!magic) {
+            if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '5') break;
+            magic = 1;
+            continue;
+        }
+        int n = sscanf(buffer, "%d %d %d", &fields[nfields], &fields[nfields + 1], &fields[nfields + 2]);
+        if (n < 1) break;
+        nfields += n;
+    }
+    if (nfields < 3 || fields[0] < 1 || fields[1] < 1 || fields[2] > MAXGRAY) {
+        fclose(f);
+        return 0;
+    }
+
+    long remaining = (long)fields[0] * fields[1];
+    unsigned char chunk[BUFSIZ];
+    memset(hist, 0, MAXSIZE * sizeof(int));
+    while (remaining > 0) {
+        size_t want = remaining < (long)sizeof(chunk) ? (size_t)remaining : sizeof(chunk);
+        size_t got = fread(chunk, 1, want, f);
+        if (got == 0) break;
+        for (size_t i = 0; i < got; i++) {
+            hist[chunk[i]]++;
+        }
+        remaining -= got;
+    }
+    fclose(f);
+    return remaining == 0;
+}
+
+static int read_reference(char const * file_name, int* hist) {
+    // a saved histogram is used as is, for a P5 image a FILE.hist cache next to it
+    // is used while it is newer than the image, and (re)written otherwise
+    if (load_histogram(file_name, hist)) return 1;
+
+    char cache_name[BUFSIZ];
+    struct stat img_st, cache_st;
+    snprintf(cache_name, sizeof(cache_name), "%s.hist", file_name);
+    if (stat(file_name, &img_st) == 0 && stat(cache_name, &cache_st) == 0
+        && cache_st.st_mtime >= img_st.st_mtime && load_histogram(cache_name, hist)) {
+        return 1;
+    }
+
+    if (!pgm_histogram(file_name, hist)) return 0;
+    save_histogram(cache_name, hist); // a read-only directory only costs the cache
+    return 1;
+}
+
+int reference_histogram(char const * file_name, int* hist) {
+    // 0 also for an empty histogram, which has no CDF to match
+    if (!read_reference(file_name, hist)) return 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        if (hist[i] > 0) return 1;
+    }
+    return 0;
+}
+
+int sample_step(double fraction) {
+    // keep every step-th row and column
+    if (fraction <= 0 || fraction >= 1) return 1;
+    return (int)round(1 / fraction);
+}
+
+int sample_jitter(int a, int b, int step) {
+    // position inside a step x step stratum, hashed so a regular stride cannot alias with halftones
+    unsigned int h = (unsigned int)a * 73856093u ^ (unsigned int)b * 19349663u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (int)(h % (unsigned int)step);
+}
+
+int sample_too_sparse(int n, int* hist) {
+    int used = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        if (hist[i] > 0) used++;
+    }
+    return n < MINSAMPLES || n < 16 * used;
+}
+
+double sample_cdf_error(int n) {
+    // DKW bound on the CDF with 95% confidence, stratified samples do at least this well
+    return sqrt(log(2 / 0.05) / (2.0 * n));
+}
+
+void report_sample(int n, int size) {
+    if (n >= size) return;
+    double eps = sample_cdf_error(n);
+    printf("Sampled histogram: %d of %d px, CDF error <= %.4f (95%%), equalization LUT error <= %.1f gray levels.\n",
+        n, size, eps, eps * MAXGRAY);
+}
+
+static int sampled_rows(int width, int height, unsigned char* (*row)(void*, int), void* ctx, double fraction,
+    int* hist, int report) {
+    // one pixel per step x step stratum, or every pixel when sampling is off or the sample is too sparse;
+    // row(ctx, j) gives the gray values of row j, only the sampled rows are asked for, NULL when it fails.
+    // returns the number of pixels counted, -1 when a row failed
+    int size = width * height;
+    int step = sample_step(fraction);
+    memset(hist, 0, MAXSIZE * sizeof(int));
+    if (step > 1) {
+        int n = 0;
+        for (int by = 0; by * step < height; by++) {
+            int j = by * step + sample_jitter(by, 0, step);
+            if (j >= height) continue;
+            unsigned char* gray = row(ctx, j);
+            if (!gray) return -1;
+            for (int bx = 0; bx * step < width; bx++) {
+                int i = bx * step + sample_jitter(by, bx + 1, step);
+                if (i >= width) continue;
+                hist[gray[i]]++;
+                n++;
+            }
+        }
+        if (!sample_too_sparse(n, hist)) {
+            if (report) report_sample(n, size);
+            return n;
+        }
+        printf("Sampled histogram too sparse, using the exact one.\n");
+        memset(hist, 0, MAXSIZE * sizeof(int));
+    }
+    for (int j = 0; j < height; j++) {
+        unsigned char* gray = row(ctx, j);
+        if (!gray) return -1;
+        for (int i = 0; i < width; i++) {
+            hist[gray[i]]++;
+        }
+    }
+    return size;
+}
+
+int row_histogram(int width, int height, unsigned char* (*row)(void*, int), void* ctx, double fraction, int* hist) {
+    return sampled_rows(width, height, row, ctx, fraction, hist, 1);
+}
+
+typedef struct {
+    unsigned char* gray;
+    int stride;
+} StridedRows;
+
+static unsigned char* strided_row(void* ctx, int j) {
+    StridedRows* s = (StridedRows*)ctx;
+    return &s->gray[(size_t)j * s->stride];
+}
+
+int strided_histogram(int width, int height, int stride, unsigned char* gray, double fraction, int* hist) {
+    // rows start stride bytes apart
+    StridedRows s = {gray, stride};
+    return sampled_rows(width, height, strided_row, &s, fraction, hist, 1);
+}
+
+int gray_histogram(int width, int height, unsigned char* gray, double fraction, int* hist) {
+    return strided_histogram(width, height, width, gray, fraction, hist);
+}
+
+int gray_histogram_quiet(int width, int height, unsigned char* gray, double fraction, int* hist) {
+    // the same sample again later in a run, its error was reported with the first one
+    StridedRows s = {gray, width};
+    return sampled_rows(width, height, strided_row, &s, fraction, hist, 0);
+}
+
+void hist_stats(int size, int* hist, HistStats* st) {
+    memset(st, 0, sizeof(HistStats));
+    st->size = size;
+
+    double cp = 0, cm = 0, cplogp = 0, cpp = 0, ch = 0, cph = 0, cphh = 0;
+    st->gmin = -1;
+    for (int i = 0; i < MAXSIZE; i++) {
+        double p = (double)hist[i] / size;
+        st->p[i] = p;
+        cp += p;
+        cm += i * p;
+        if (p > 0) cplogp += p * log(p);
+        cpp += p * p;
+        ch += hist[i];
+        cph += p * hist[i];
+        cphh += p * hist[i] * hist[i];
+        st->cp[i] = cp;
+        st->cm[i] = cm;
+        st->cplogp[i] = cplogp;
+        st->cpp[i] = cpp;
+        st->ch[i] = ch;
+        st->cph[i] = cph;
+        st->cphh[i] = cphh;
+
+        if (hist[i] > 0) {
+            if (st->gmin < 0) st->gmin = i;
+            st->gmax = i;
+        }
+        if (hist[i] > hist[st->peak]) st->peak = i;
+    }
+    if (st->gmin < 0) st->gmin = 0;
+
+    // moments
+    st->mean = cm;
+    double m2 = 0, m3 = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        double d = i - st->mean;
+        m2 += st->p[i] * d * d;
+        m3 += st->p[i] * d * d * d;
+    }
+    st->var = m2;
+    st->skew = m2 > 0 ? m3 / pow(m2, 1.5) : 0;
+
+    // count significant peaks of the 5-tap smoothed histogram,
+    // two peaks are separate modes only if the valley between them drops below half of the lower one
+    double smooth[MAXSIZE];
+    double smax = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        double s = 0;
+        for (int k = i - 2; k <= i + 2; k++) {
+            if (k >= 0 && k < MAXSIZE) s += st->p[k];
+        }
+        smooth[i] = s / 5;
+        if (smooth[i] > smax) smax = smooth[i];
+    }
+    int modes = 0;
+    double last_peak = 0, valley = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        double left = i > 0 ? smooth[i-1] : 0;
+        double right = i < MAXSIZE-1 ? smooth[i+1] : 0;
+        if (modes > 0 && smooth[i] < valley) valley = smooth[i];
+        if (smooth[i] < 0.05 * smax || smooth[i] < left || smooth[i] <= right) continue;
+        if (modes == 0) {
+            modes = 1;
+        } else if (valley < 0.5 * fmin(last_peak, smooth[i])) {
+            modes++;
+        } else if (smooth[i] < last_peak) {
+            continue;
+        }
+        last_peak = smooth[i];
+        valley = smooth[i];
+    }
+    st->modes = modes;
+}
+
+int otsu_counts_treshold(int size, int* hist) {
+    // otsu_hist_treshold from just the four tables it reads, built the way hist_stats builds them;
+    // for small images, where the rest of hist_stats costs more than the pixels
+    HistStats st;
+    double cp = 0, ch = 0, cph = 0, cphh = 0;
+    for (int i = 0; i < MAXSIZE; i++) {
+        double p = (double)hist[i] / size;
+        cp += p;
+        ch += hist[i];
+        cph += p * hist[i];
+        cphh += p * hist[i] * hist[i];
+        st.cp[i] = cp;
+        st.ch[i] = ch;
+        st.cph[i] = cph;
+        st.cphh[i] = cphh;
+    }
+    return otsu_hist_treshold(&st);
+}
+
+int otsu_hist_treshold(HistStats* st) {
+    // same criterion as the direct version (weighted spread of bin counts on both sides),
+    // with sums of p, p*h and p*h^2 taken from the cumulative tables
+    double total_h = st->ch[MAXSIZE-1];
+    double total_p = st->cp[MAXSIZE-1];
+    double total_ph = st->cph[MAXSIZE-1];
+    double total_phh = st->cphh[MAXSIZE-1];
+
+    double tvar = 0;
+    int th = 0;
+    for (int i = 0; i < MAXSIZE-2; i++) {
+        int size_b = i+1;
+        int size_f = MAXSIZE-i-1;
+        double mean_b = st->ch[i] / size_b;
+        double mean_f = (total_h - st->ch[i]) / size_f;
+        double om_b = st->cp[i];
+        double om_f = total_p - st->cp[i];
+
+        double var_b = st->cphh[i] - 2 * mean_b * st->cph[i] + mean_b * mean_b * om_b;
+        double var_f = (total_phh - st->cphh[i]) - 2 * mean_f * (total_ph - st->cph[i])
+            + mean_f * mean_f * om_f;
+
+        double var = om_b * var_b + om_f * var_f;
+        if (i == 0 || tvar > var) {
+            tvar = var;
+            th = i;
+        }
+    }
+    return th;
+}
+
+int kapur_treshold(HistStats* st) {
+    // maximize the sum of the entropies of both classes
+    double total = st->cplogp[MAXSIZE-1];
+    double best = -INFINITY;
+    int th = st->gmin;
+    for (int i = st->gmin; i < st->gmax; i++) {
+        double pb = st->cp[i];
+        double pf = 1 - pb;
+        if (pb <= 0 || pf <= 0) continue;
+        double hb = log(pb) - st->cplogp[i] / pb;
+        double hf = log(pf) - (total - st->cplogp[i]) / pf;
+        if (hb + hf > best) {
+            best = hb + hf;
+            th = i;
+        }
+    }
+    return th;
+}
+
+int yen_treshold(HistStats* st) {
+    // maximize the correlation criterion -log(sum (p/P)^2) of both classes
+    double total = st->cpp[MAXSIZE-1];
+    double best = -INFINITY;
+    int th = st->gmin;
+    for (int i = st->gmin; i < st->gmax; i++) {
+        double pb = st->cp[i];
+        double pf = 1 - pb;
+        double qb = st->cpp[i];
+        double qf = total - qb;
+        if (pb <= 0 || pf <= 0 || qb <= 0 || qf <= 0) continue;
+        double crit = -log(qb / (pb * pb)) - log(qf / (pf * pf));
+        if (crit > best) {
+            best = crit;
+            th = i;
+        }
+    }
+    return th;
+}
+
+int triangle_treshold(HistStats* st) {
+    // line from the peak to the end of the longer tail, threshold at the bin furthest below it
+    int peak = st->peak;
+    int left = st->gmin > 0 ? st->gmin - 1 : 0;
+    int right = st->gmax < MAXGRAY ? st->gmax + 1 : MAXGRAY;
+    int from, to;
+    if (peak - left >= right - peak) {
+        from = left;
+        to = peak;
+    } else {
+        from = peak;
+        to = right;
+    }
+    if (from == to) return peak;
+
+    double p_from = st->p[from], p_to = st->p[to];
+    double best = -INFINITY;
+    int th = from;
+    for (int i = from; i <= to; i++) {
+        // vertical distance to the line, proportional to the perpendicular one
+        double line = p_from + (p_to - p_from) * (i - from) / (to - from);
+        double d = line - st->p[i];
+        if (d > best) {
+            best = d;
+            th = i;
+        }
+    }
+    return th;
+}
+
+static double mean_below(HistStats* st, int t) {
+    return st->cm[t] / st->cp[t];
+}
+
+static double mean_above(HistStats* st, int t) {
+    return (st->cm[MAXSIZE-1] - st->cm[t]) / (st->cp[MAXSIZE-1] - st->cp[t]);
+}
+
+static int split_ok(HistStats* st, int t) {
+    return t >= st->gmin && t < st->gmax && st->cp[t] > 0;
+}
+
+int isodata_treshold(HistStats* st) {
+    // iterate t = (mean below + mean above) / 2, each step is O(1) with the cumulative tables
+    if (st->gmin >= st->gmax) return st->gmin;
+    int t = (int)st->mean;
+    if (!split_ok(st, t)) t = st->gmin;
+    for (int it = 0; it < MAXSIZE; it++) {
+        int tn = (int)((mean_below(st, t) + mean_above(st, t)) / 2);
+        if (tn >= st->gmax) tn = st->gmax - 1;
+        if (tn < st->gmin) tn = st->gmin;
+        if (tn == t) break;
+        t = tn;
+    }
+    return t;
+}
+
+int li_treshold(HistStats* st) {
+    // minimum cross entropy, iterate t = (mb - mf) / (ln mb - ln mf)
+    // gray levels are shifted by one so that the logarithms stay finite
+    if (st->gmin >= st->gmax) return st->gmin;
+    double t = st->mean;
+    int ti = (int)t;
+    if (!split_ok(st, ti)) ti = st->gmin;
+    for (int it = 0; it < 1000; it++) {
+        double mb = mean_below(st, ti) + 1;
+        double mf = mean_above(st, ti) + 1;
+        if (mf - mb < 1e-9) break;
+        double tn = (mf - mb) / (log(mf) - log(mb)) - 1;
+        if (fabs(tn - t) < 0.5) break;
+        t = tn;
+        ti = (int)t;
+        if (ti >= st->gmax) ti = st->gmax - 1;
+        if (ti < st->gmin) ti = st->gmin;
+    }
+    return ti;
+}
+
+TresholdMethod auto_treshold_method(HistStats* st) {
+    // bimodal histograms suit otsu, a single peak with a long tail (faint strokes on paper)
+    // suits triangle, a single symmetric peak is left to li
+    if (st->modes >= 2) return TH_OTSU;
+    if (fabs(st->skew) >= 1) return TH_TRIANGLE;
+    return TH_LI;
+}
+
+int hist_treshold(HistStats* st, TresholdMethod method) {
+    if (method == TH_AUTO) method = auto_treshold_method(st);
+    switch (method) {
+        case TH_KAPUR: return kapur_treshold(st);
+        case TH_YEN: return yen_treshold(st);
+        case TH_TRIANGLE: return triangle_treshold(st);
+        case TH_ISODATA: return isodata_treshold(st);
+        case TH_LI: return li_treshold(st);
+        default: return otsu_hist_treshold(st);
+    }
+}
+
+TresholdMethod parse_treshold_method(char const * name) {
+    for (int i = 0; i < TH_COUNT; i++) {
+        if (strcmp(name, method_names[i]) == 0) return (TresholdMethod)i;
+    }
+    return TH_COUNT;
+}
+
+char const * treshold_method_name(TresholdMethod method) {
+    if (method < 0 || method >= TH_COUNT) return "unknown";
+    return method_names[method];
+}
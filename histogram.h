@@ -0,0 +1,98 @@
+/*
+Histogram statistics and histogram-based threshold methods shared by zad1 and zad6.
+All methods work on one 256-bin histogram and its cumulative tables, so after
+the single pass over the pixels every method is O(256).
+A threshold th splits the gray levels into [0, th] (black) and [th+1, 255] (white).
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#ifndef MAXGRAY
+#define MAXGRAY 255
+#define MAXSIZE (MAXGRAY+1)
+#endif
+// compact binary histogram file: magic, then MAXSIZE little-endian uint32 counts
+#define HISTMAGIC "CVH1"
+#define HISTMAGICSIZE 4
+// auto levels clip this fraction of pixels at each end, auto gamma aims at this mean luminance
+#define LEVELSCLIP 0.005
+#define AUTOGAMMAMEAN 0.5
+// sampled histograms with fewer pixels than this (or than 16 per used bin) fall back to exact ones
+#define MINSAMPLES 4096
+
+typedef enum {
+    TH_OTSU,
+    TH_KAPUR,
+    TH_YEN,
+    TH_TRIANGLE,
+    TH_ISODATA,
+    TH_LI,
+    TH_AUTO,
+    TH_COUNT
+} TresholdMethod;
+
+typedef struct {
+    int size;                   // number of pixels
+    double p[MAXSIZE];          // probabilities
+    double cp[MAXSIZE];         // cumulative probability
+    double cm[MAXSIZE];         // cumulative first moment (sum k * p)
+    double cplogp[MAXSIZE];     // cumulative p * log(p), for kapur
+    double cpp[MAXSIZE];        // cumulative p^2, for yen
+    double ch[MAXSIZE];         // cumulative counts, for otsu
+    double cph[MAXSIZE];        // cumulative p * count, for otsu
+    double cphh[MAXSIZE];       // cumulative p * count^2, for otsu
+    // shape statistics
+    int gmin, gmax, peak;
+    int modes;                  // number of significant peaks
+    double mean, var, skew;
+} HistStats;
+
+typedef struct {
+    int* ref_hist;              // match to this histogram instead of equalizing, NULL to equalize
+    int auto_levels;            // stretch between percentile black/white points instead of equalizing
+    double gamma;               // gamma after the tone LUT, 0 picks it from the histogram
+    // filled by point_lut
+    int black, white;
+    double used_gamma;
+} PointParams;
+
+void histogram_lut(int size, int* hist, unsigned char* tvals);
+void gamma_lut(double gamma, unsigned char* lookup);
+void match_lut(int size, int* hist, int* ref_hist, unsigned char* mvals);
+void levels_lut(int size, int* hist, double clip, int* black, int* white, unsigned char* lvals);
+double auto_gamma(int size, int* hist, unsigned char* tone, double target);
+void point_lut(int size, int* hist, PointParams* pp, unsigned char* lut);
+void report_point_params(PointParams* pp);
+
+int save_histogram(char const * file_name, int* hist);
+int load_histogram(char const * file_name, int* hist);
+int pgm_histogram(char const * file_name, int* hist);
+int reference_histogram(char const * file_name, int* hist);
+
+int sample_step(double fraction);
+int sample_jitter(int a, int b, int step);
+int row_histogram(int width, int height, unsigned char* (*row)(void*, int), void* ctx, double fraction, int* hist);
+int strided_histogram(int width, int height, int stride, unsigned char* gray, double fraction, int* hist);
+int gray_histogram(int width, int height, unsigned char* gray, double fraction, int* hist);
+int gray_histogram_quiet(int width, int height, unsigned char* gray, double fraction, int* hist);
+int sample_too_sparse(int n, int* hist);
+double sample_cdf_error(int n);
+void report_sample(int n, int size);
+
+void hist_stats(int size, int* hist, HistStats* st);
+
+int otsu_hist_treshold(HistStats* st);
+int otsu_counts_treshold(int size, int* hist);
+int kapur_treshold(HistStats* st);
+int yen_treshold(HistStats* st);
+int triangle_treshold(HistStats* st);
+int isodata_treshold(HistStats* st);
+int li_treshold(HistStats* st);
+TresholdMethod auto_treshold_method(HistStats* st);
+
+int hist_treshold(HistStats* st, TresholdMethod method);
+TresholdMethod parse_treshold_method(char const * name);
+char const * treshold_method_name(TresholdMethod method);
+
+#endif
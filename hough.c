@@ -0,0 +1,381 @@
+/*
+Hough line transform on packed bitmaps, see hough.h.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "hough.h"
+
+#define HOUGHMAXSIDE 32767  // coordinates are multiplied as signed 16-bit values
+
+typedef struct {
+    short tab[2 * HOUGHANGLES];     // cos, sin pairs in Q14
+    int base[HOUGHANGLES];          // accumulator index of rho 0 for every angle
+    int nrho, diag;
+} HoughTables;
+
+typedef struct {
+    unsigned char* bits;
+    int width, row_bytes;
+    HoughTables* ht;
+    int* acc;
+    int y0, y1;
+} HoughJob;
+
+static void hough_tables(HoughTables* ht, int width, int height) {
+    ht->diag = (int)ceil(sqrt((double)width * width + (double)height * height));
+    ht->nrho = 2 * ht->diag + 1;
+    for (int t = 0; t < HOUGHANGLES; t++) {
+        double a = t * M_PI / HOUGHANGLES;
+        ht->tab[2 * t] = (short)lround(cos(a) * (1 << HOUGHSHIFT));
+        ht->tab[2 * t + 1] = (short)lround(sin(a) * (1 << HOUGHSHIFT));
+        ht->base[t] = t * ht->nrho + ht->diag;
+    }
+}
+
+static void rho_bins(HoughTables* ht, int x, int y, int* idx) {
+    // accumulator index of (x, y) for every angle, rho = x cos + y sin rounded to whole pixels
+    int t = 0;
+#if defined(__SSE2__)
+    // madd multiplies the (cos, sin) pairs by (x, y) and adds them, four angles at once
+    __m128i xy = _mm_set1_epi32((y << 16) | x);
+    __m128i half = _mm_set1_epi32(1 << (HOUGHSHIFT - 1));
+    for (; t < HOUGHANGLES; t += 4) {
+        __m128i r = _mm_madd_epi16(_mm_loadu_si128((__m128i*)&ht->tab[2 * t]), xy);
+        r = _mm_srai_epi32(_mm_add_epi32(r, half), HOUGHSHIFT);
+        _mm_storeu_si128((__m128i*)&idx[t], _mm_add_epi32(r, _mm_loadu_si128((__m128i*)&ht->base[t])));
+    }
+#elif defined(__ARM_NEON)
+    int32x4_t half = vdupq_n_s32(1 << (HOUGHSHIFT - 1));
+    for (; t < HOUGHANGLES; t += 4) {
+        int16x4x2_t cs = vld2_s16(&ht->tab[2 * t]);
+        int32x4_t r = vmlal_n_s16(vmull_n_s16(cs.val[0], (short)x), cs.val[1], (short)y);
+        r = vshrq_n_s32(vaddq_s32(r, half), HOUGHSHIFT);
+        vst1q_s32(&idx[t], vaddq_s32(r, vld1q_s32(&ht->base[t])));
+    }
+#endif
+    for (; t < HOUGHANGLES; t++) {
+        int r = (ht->tab[2 * t] * x + ht->tab[2 * t + 1] * y + (1 << (HOUGHSHIFT - 1))) >> HOUGHSHIFT;
+        idx[t] = r + ht->base[t];
+    }
+}
+
+static uint64_t load_bits(unsigned char* row, int k, int row_bytes) {
+    // 64 pixels from byte k, the first one in the top bit as in P4; zeros past the row
+    uint64_t w = 0;
+    if (k + 8 <= row_bytes) {
+        memcpy(&w, &row[k], 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+    }
+    for (int b = 0; b < 8; b++) {
+        w = (w << 8) | (k + b < row_bytes ? row[k + b] : 0);
+    }
+    return w;
+}
+
+static inline int get_bit(unsigned char* bits, int row_bytes, int x, int y) {
+    return (bits[y * row_bytes + x / 8] >> (7 - x % 8)) & 1;
+}
+
+static inline void set_bit(unsigned char* bits, int row_bytes, int x, int y, int v) {
+    unsigned char m = 1 << (7 - x % 8);
+    if (v) bits[y * row_bytes + x / 8] |= m;
+    else bits[y * row_bytes + x / 8] &= ~m;
+}
+
+static void* vote_band(void* arg) {
+    // every set bit of rows [y0, y1) votes once per angle, set bits are found by leading zeros
+    HoughJob* job = (HoughJob*)arg;
+    int idx[HOUGHANGLES];
+    for (int y = job->y0; y < job->y1; y++) {
+        unsigned char* row = &job->bits[y * job->row_bytes];
+        for (int k = 0; k < job->row_bytes; k += 8) {
+            uint64_t w = load_bits(row, k, job->row_bytes);
+            while (w) {
+                int b = __builtin_clzll(w);
+                w &= ~(0x8000000000000000ull >> b);
+                rho_bins(job->ht, 8 * k + b, y, idx);
+                for (int t = 0; t < HOUGHANGLES; t++) job->acc[idx[t]]++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int by_votes(const void* a, const void* b) {
+    // most votes first, then by angle and distance so the order does not depend on qsort
+    const HoughLine* la = (const HoughLine*)a;
+    const HoughLine* lb = (const HoughLine*)b;
+    if (la->votes != lb->votes) return lb->votes - la->votes;
+    if (la->theta != lb->theta) return la->theta - lb->theta;
+    return la->rho - lb->rho;
+}
+
+static int standard_hough(unsigned char* bits, int width, int height, HoughTables* ht, int min_votes,
+                          int max_lines, int threads, HoughLine* lines) {
+    int row_bytes = (width + 7) / 8, nrho = ht->nrho;
+    size_t cells = (size_t)HOUGHANGLES * nrho;
+    if (threads > HOUGHMAXTHREADS) threads = HOUGHMAXTHREADS;
+    if (threads > height) threads = height;
+    if (threads < 1) threads = 1;
+    HoughJob jobs[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    int ok = 1;
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (HoughJob){bits, width, row_bytes, ht, (int*)calloc(cells, sizeof(int)),
+                             (int)((long)height * t / threads), (int)((long)height * (t + 1) / threads)};
+        ok = ok && jobs[t].acc;
+    }
+    if (ok) {
+        for (int t = 1; t < threads; t++) {
+            started[t] = pthread_create(&ids[t], NULL, vote_band, &jobs[t]) == 0;
+            // no thread, run its share here instead
+            if (!started[t]) vote_band(&jobs[t]);
+        }
+        vote_band(&jobs[0]);
+        for (int t = 1; t < threads; t++) {
+            if (started[t]) pthread_join(ids[t], NULL);
+        }
+    }
+    int* acc = jobs[0].acc;
+    for (int t = 1; t < threads; t++) {
+        if (ok) {
+            for (size_t i = 0; i < cells; i++) acc[i] += jobs[t].acc[i];
+        }
+        free(jobs[t].acc);
+    }
+    if (!ok) {
+        free(acc);
+        return -1;
+    }
+
+    // local maxima of the accumulator, plateaus are broken towards the first cell
+    int n = 0, cap = 64;
+    HoughLine* found = (HoughLine*)malloc(cap * sizeof(HoughLine));
+    for (int t = 0; found && t < HOUGHANGLES; t++) {
+        for (int r = 0; r < nrho; r++) {
+            int v = acc[t * nrho + r];
+            if (v < min_votes) continue;
+            int peak = 1;
+            for (int dt = -1; dt <= 1 && peak; dt++) {
+                for (int dr = -1; dr <= 1; dr++) {
+                    int tt = t + dt, rr = r + dr;
+                    if ((dt == 0 && dr == 0) || tt < 0 || rr < 0 || tt >= HOUGHANGLES || rr >= nrho) continue;
+                    int u = acc[tt * nrho + rr];
+                    if (u > v || (u == v && (dt < 0 || (dt == 0 && dr < 0)))) peak = 0;
+                }
+            }
+            if (!peak) continue;
+            if (n == cap) {
+                cap *= 2;
+                HoughLine* grown = (HoughLine*)realloc(found, cap * sizeof(HoughLine));
+                if (!grown) {
+                    free(found);
+                    found = NULL;
+                    break;
+                }
+                found = grown;
+            }
+            found[n++] = (HoughLine){r - ht->diag, t * 180 / HOUGHANGLES, 0, 0, 0, 0, v};
+        }
+    }
+    free(acc);
+    if (!found) return -1;
+    qsort(found, n, sizeof(HoughLine), by_votes);
+    if (n > max_lines) n = max_lines;
+    memcpy(lines, found, n * sizeof(HoughLine));
+    free(found);
+    return n;
+}
+
+static void line_step(HoughTables* ht, int t, int* xs, int* ys) {
+    // Q16 step along the line of angle t, one whole pixel on the major axis
+    int dx = -ht->tab[2 * t + 1], dy = ht->tab[2 * t];
+    if (abs(dx) > abs(dy)) {
+        *xs = dx > 0 ? 1 << 16 : -(1 << 16);
+        *ys = (int)(((long long)dy * 65536) / abs(dx));
+    } else {
+        *ys = dy > 0 ? 1 << 16 : -(1 << 16);
+        *xs = (int)(((long long)dx * 65536) / abs(dy));
+    }
+}
+
+static int progressive_hough(unsigned char* bits, int width, int height, HoughTables* ht, int min_votes,
+                             int max_lines, HoughLine* lines) {
+    // votes pixels in random order; once a bin reaches min_votes the line through the pixel is
+    // followed in both directions over gaps of up to HOUGHGAP, its pixels leave the image and, when
+    // the segment is long enough, take their votes back
+    int row_bytes = (width + 7) / 8;
+    size_t bytes = (size_t)row_bytes * height;
+    long npoints = 0;
+    for (size_t i = 0; i < bytes; i++) npoints += __builtin_popcount(bits[i]);
+    int* acc = (int*)calloc((size_t)HOUGHANGLES * ht->nrho, sizeof(int));
+    int* points = (int*)malloc((npoints > 0 ? npoints : 1) * 2 * sizeof(int));
+    unsigned char* mask = (unsigned char*)malloc(bytes);
+    unsigned char* voted = (unsigned char*)calloc(bytes, 1);
+    if (!acc || !points || !mask || !voted) {
+        free(acc);
+        free(points);
+        free(mask);
+        free(voted);
+        return -1;
+    }
+    memcpy(mask, bits, bytes);
+    long p = 0;
+    for (int y = 0; y < height; y++) {
+        for (int k = 0; k < row_bytes; k += 8) {
+            uint64_t w = load_bits(&bits[y * row_bytes], k, row_bytes);
+            while (w) {
+                int b = __builtin_clzll(w);
+                w &= ~(0x8000000000000000ull >> b);
+                points[2 * p] = 8 * k + b;
+                points[2 * p + 1] = y;
+                p++;
+            }
+        }
+    }
+    // fixed seed, the same image always gives the same segments
+    unsigned int seed = 2463534242u;
+    for (long i = npoints - 1; i > 0; i--) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        long j = seed % (i + 1);
+        int tx = points[2 * i], ty = points[2 * i + 1];
+        points[2 * i] = points[2 * j];
+        points[2 * i + 1] = points[2 * j + 1];
+        points[2 * j] = tx;
+        points[2 * j + 1] = ty;
+    }
+
+    int n = 0;
+    int idx[HOUGHANGLES];
+    for (long i = 0; i < npoints && n < max_lines; i++) {
+        int x = points[2 * i], y = points[2 * i + 1];
+        if (!get_bit(mask, row_bytes, x, y)) continue;
+        rho_bins(ht, x, y, idx);
+        int best = 0;
+        for (int t = 0; t < HOUGHANGLES; t++) {
+            if (++acc[idx[t]] > acc[idx[best]]) best = t;
+        }
+        set_bit(voted, row_bytes, x, y, 1);
+        // before the unvoting walk below reuses idx for other pixels
+        int votes = acc[idx[best]], rho = idx[best] - ht->base[best];
+        if (votes < min_votes) continue;
+
+        int xs, ys, ends[2][2];
+        line_step(ht, best, &xs, &ys);
+        for (int k = 0; k < 2; k++) {
+            int sx = k ? -xs : xs, sy = k ? -ys : ys;
+            int fx = (x << 16) + (1 << 15), fy = (y << 16) + (1 << 15), gap = 0;
+            ends[k][0] = x;
+            ends[k][1] = y;
+            for (;;) {
+                fx += sx;
+                fy += sy;
+                int px = fx >> 16, py = fy >> 16;
+                if (px < 0 || py < 0 || px >= width || py >= height) break;
+                if (get_bit(mask, row_bytes, px, py)) {
+                    gap = 0;
+                    ends[k][0] = px;
+                    ends[k][1] = py;
+                } else if (++gap > HOUGHGAP) {
+                    break;
+                }
+            }
+        }
+        int good = abs(ends[1][0] - ends[0][0]) >= HOUGHMINLENGTH || abs(ends[1][1] - ends[0][1]) >= HOUGHMINLENGTH;
+
+        // the same walk again up to the ends: pixels leave the image, voted ones of a kept segment unvote
+        for (int k = 0; k < 2; k++) {
+            int sx = k ? -xs : xs, sy = k ? -ys : ys;
+            int fx = (x << 16) + (1 << 15), fy = (y << 16) + (1 << 15);
+            int px = x, py = y;
+            for (;;) {
+                if (get_bit(mask, row_bytes, px, py)) {
+                    if (good && get_bit(voted, row_bytes, px, py)) {
+                        rho_bins(ht, px, py, idx);
+                        for (int t = 0; t < HOUGHANGLES; t++) acc[idx[t]]--;
+                    }
+                    set_bit(mask, row_bytes, px, py, 0);
+                }
+                if (px == ends[k][0] && py == ends[k][1]) break;
+                fx += sx;
+                fy += sy;
+                px = fx >> 16;
+                py = fy >> 16;
+            }
+        }
+        if (good) {
+            lines[n++] = (HoughLine){rho, best * 180 / HOUGHANGLES,
+                                     ends[1][0], ends[1][1], ends[0][0], ends[0][1], votes};
+        }
+    }
+    free(acc);
+    free(points);
+    free(mask);
+    free(voted);
+    return n;
+}
+
+int hough_lines(unsigned char* bits, int width, int height, HoughMode mode, int min_votes, int max_lines,
+                int threads, HoughLine* lines) {
+    // bits are P4 rows of (width + 7) / 8 bytes; returns the number of lines written (at most
+    // max_lines, strongest first for HOUGH_LINES, in detection order for HOUGH_SEGMENTS), -1 on failure
+    if (width > HOUGHMAXSIDE || height > HOUGHMAXSIDE) return -1;
+    HoughTables ht;
+    hough_tables(&ht, width, height);
+    if (mode == HOUGH_SEGMENTS) return progressive_hough(bits, width, height, &ht, min_votes, max_lines, lines);
+    return standard_hough(bits, width, height, &ht, min_votes, max_lines, threads, lines);
+}
+
+int save_hough_lines(char const * file_name, HoughLine* lines, int n, HoughMode mode) {
+    // text: a comment line, then "rho theta votes" or "x0 y0 x1 y1 votes" per line
+    FILE* f = fopen(file_name, "w");
+    if (!f) return 0;
+    if (mode == HOUGH_LINES) {
+        fprintf(f, "# %d lines: rho theta votes\n", n);
+        for (int i = 0; i < n; i++) fprintf(f, "%d %d %d\n", lines[i].rho, lines[i].theta, lines[i].votes);
+    } else {
+        fprintf(f, "# %d segments: x0 y0 x1 y1 votes\n", n);
+        for (int i = 0; i < n; i++) {
+            fprintf(f, "%d %d %d %d %d\n", lines[i].x0, lines[i].y0, lines[i].x1, lines[i].y1, lines[i].votes);
+        }
+    }
+    return fclose(f) == 0;
+}
+
+HoughMode parse_hough_mode(char const * name, int* min_votes) {
+    // lines[:V] or segments[:V] with V the votes a line needs
+    HoughMode mode = HOUGH_COUNT;
+    char const * arg = NULL;
+    if (strncmp(name, "lines", 5) == 0) {
+        mode = HOUGH_LINES;
+        arg = name + 5;
+    } else if (strncmp(name, "segments", 8) == 0) {
+        mode = HOUGH_SEGMENTS;
+        arg = name + 8;
+    }
+    if (mode == HOUGH_COUNT) return HOUGH_COUNT;
+    *min_votes = HOUGHVOTES;
+    if (*arg == ':') {
+        *min_votes = atoi(arg + 1);
+        if (*min_votes < 1) return HOUGH_COUNT;
+    } else if (*arg != '\0') {
+        return HOUGH_COUNT;
+    }
+    return mode;
+}
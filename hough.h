@@ -0,0 +1,39 @@
+/*
+Hough line transform on the packed P4 bitmap zad6 writes, black (set) bits vote.
+Set bits are found a 64-bit word at a time with count-leading-zeros, so white paper costs almost
+nothing. Votes use Q14 fixed-point cos/sin tables, four angles per SIMD multiply-add; row bands are
+voted into per-thread accumulators that are summed at the end. The probabilistic mode (progressive
+probabilistic Hough) votes pixels in random order and extracts a segment as soon as a bin is full,
+removing its pixels, which gives endpoints and needs only a fraction of the votes.
+*/
+
+#ifndef HOUGH_H
+#define HOUGH_H
+
+#define HOUGHANGLES 180     // theta resolution of 1 degree, a multiple of 4
+#define HOUGHSHIFT 14       // fixed-point bits of the trig tables
+#define HOUGHVOTES 64
+#define HOUGHCOUNT 32
+#define HOUGHMINLENGTH 32   // shortest segment kept, pixels along the major axis
+#define HOUGHGAP 4          // white pixels a segment may bridge
+#define HOUGHMAXTHREADS 8   // more accumulators cost more to merge than they save
+
+typedef enum {
+    HOUGH_LINES,
+    HOUGH_SEGMENTS,
+    HOUGH_COUNT
+} HoughMode;
+
+typedef struct {
+    int rho;                // signed distance from the top-left corner, pixels
+    int theta;              // normal angle in degrees, 0..179
+    int x0, y0, x1, y1;     // segment endpoints, HOUGH_SEGMENTS only
+    int votes;
+} HoughLine;
+
+int hough_lines(unsigned char* bits, int width, int height, HoughMode mode, int min_votes, int max_lines,
+                int threads, HoughLine* lines);
+int save_hough_lines(char const * file_name, HoughLine* lines, int n, HoughMode mode);
+HoughMode parse_hough_mode(char const * name, int* min_votes);
+
+#endif
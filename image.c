@@ -0,0 +1,125 @@
+/*
+Border-padded grayscale images, see image.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+int padded_alloc(PaddedImage* img, int width, int height, int border) {
+    // the left border is rounded up to PADALIGN so that pixel rows stay aligned
+    int left = (border + PADALIGN - 1) / PADALIGN * PADALIGN;
+    img->width = width;
+    img->height = height;
+    img->border = border;
+    img->stride = (left + width + border + PADALIGN - 1) / PADALIGN * PADALIGN;
+    img->data = (unsigned char*)aligned_alloc(PADALIGN, (size_t)img->stride * (height + 2 * border));
+    if (!img->data) return 0;
+    img->px = img->data + (size_t)border * img->stride + left;
+    return 1;
+}
+
+void padded_free(PaddedImage* img) {
+    free(img->data);
+    img->data = img->px = NULL;
+}
+
+void padded_load_lut(PaddedImage* img, unsigned char* gray, unsigned char* lut) {
+    // producing pass: contiguous gray mapped through lut into the padded rows
+    for (int j = 0; j < img->height; j++) {
+        unsigned char* src = &gray[j * img->width];
+        unsigned char* dst = &img->px[j * img->stride];
+        for (int i = 0; i < img->width; i++) {
+            dst[i] = lut[src[i]];
+        }
+    }
+}
+
+static int border_index(int i, int n, BorderMode mode) {
+    // position inside [0, n) that an outside index i reads from
+    if (mode == BORDER_REPLICATE) return i < 0 ? 0 : n - 1;
+    if (n == 1) return 0;
+    int period = 2 * (n - 1);
+    i = i % period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+}
+
+void padded_fill_border(PaddedImage* img, BorderMode mode, unsigned char value) {
+    int w = img->width, h = img->height, b = img->border, s = img->stride;
+    // left and right of every pixel row
+    for (int j = 0; j < h; j++) {
+        unsigned char* row = &img->px[j * s];
+        for (int i = 1; i <= b; i++) {
+            row[-i] = mode == BORDER_CONSTANT ? value : row[border_index(-i, w, mode)];
+            row[w - 1 + i] = mode == BORDER_CONSTANT ? value : row[border_index(w - 1 + i, w, mode)];
+        }
+    }
+    // whole rows above and below, borders included
+    for (int j = 1; j <= b; j++) {
+        unsigned char* top = &img->px[-j * s - b];
+        unsigned char* bottom = &img->px[(h - 1 + j) * s - b];
+        if (mode == BORDER_CONSTANT) {
+            memset(top, value, w + 2 * b);
+            memset(bottom, value, w + 2 * b);
+        } else {
+            memcpy(top, &img->px[border_index(-j, h, mode) * s - b], w + 2 * b);
+            memcpy(bottom, &img->px[border_index(h - 1 + j, h, mode) * s - b], w + 2 * b);
+        }
+    }
+}
+
+BorderMode parse_border_mode(char const * name, unsigned char* value) {
+    // replicate, reflect or constant[:V]
+    *value = 0;
+    if (strcmp(name, "replicate") == 0) return BORDER_REPLICATE;
+    if (strcmp(name, "reflect") == 0) return BORDER_REFLECT;
+    if (strncmp(name, "constant", 8) == 0) {
+        if (name[8] == ':') {
+            int v = atoi(name + 9);
+            if (v < 0 || v > 255) return BORDER_COUNT;
+            *value = v;
+        } else if (name[8] != '\0') {
+            return BORDER_COUNT;
+        }
+        return BORDER_CONSTANT;
+    }
+    return BORDER_COUNT;
+}
+
+unsigned char* read_pgm(char const * file_name, int* width, int* height) {
+    // whole P5 file with max value up to 255, NULL when it cannot be read
+    FILE* f = fopen(file_name, "rb");
+    if (f == NULL) return NULL;
+
+    char format[3], buffer[BUFSIZ];
+    int fields[5];
+    int nfields = 0;
+    int magic = 0;
+    while (nfields < 3 && fgets(buffer, sizeof(buffer), f) != NULL) {
+        if (buffer[0] == '#') continue;
+        if (!magic) {
+            if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '5') break;
+            magic = 1;
+            continue;
+        }
+        int n = sscanf(buffer, "%d %d %d", &fields[nfields], &fields[nfields + 1], &fields[nfields + 2]);
+        if (n < 1) break;
+        nfields += n;
+    }
+    if (nfields < 3 || fields[0] < 1 || fields[1] < 1 || fields[2] > 255) {
+        fclose(f);
+        return NULL;
+    }
+    size_t size = (size_t)fields[0] * fields[1];
+    unsigned char* gray = (unsigned char*)malloc(size);
+    if (gray && fread(gray, 1, size, f) != size) {
+        free(gray);
+        gray = NULL;
+    }
+    fclose(f);
+    *width = fields[0];
+    *height = fields[1];
+    return gray;
+}
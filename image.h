@@ -0,0 +1,35 @@
+/*
+Border-padded grayscale images shared by zad1 and zad6.
+Every row is surrounded by a guard border filled once after the pass that produced the image,
+so neighborhood kernels can read up to border pixels outside without any bounds checks.
+Rows of pixel data start on PADALIGN byte boundaries.
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#define PADALIGN 64
+
+typedef enum {
+    BORDER_REPLICATE,   // nearest image pixel, what get_safe_gval returns
+    BORDER_REFLECT,     // mirrored without repeating the edge pixel
+    BORDER_CONSTANT,    // fixed value
+    BORDER_COUNT
+} BorderMode;
+
+typedef struct {
+    int width, height;
+    int border;             // guard pixels on every side
+    int stride;             // bytes between rows, a multiple of PADALIGN
+    unsigned char* data;    // whole allocation
+    unsigned char* px;      // pixel (0, 0), px[j * stride + i] is valid for i, j in [-border, size + border)
+} PaddedImage;
+
+int padded_alloc(PaddedImage* img, int width, int height, int border);
+void padded_free(PaddedImage* img);
+void padded_load_lut(PaddedImage* img, unsigned char* gray, unsigned char* lut);
+void padded_fill_border(PaddedImage* img, BorderMode mode, unsigned char value);
+BorderMode parse_border_mode(char const * name, unsigned char* value);
+unsigned char* read_pgm(char const * file_name, int* width, int* height);
+
+#endif
@@ -0,0 +1,810 @@
+/*
+CPython extension exposing the library stages and the streaming pipeline to Python without temp files.
+Images are any objects supporting the buffer protocol with 1-byte items (bytes, bytearray, memoryview,
+NumPy uint8 arrays): shape (H, W) or (H, W, 3), rows may be strided (e.g. a NumPy slice) as long as the
+pixels of a row are contiguous; flat buffers take width= and height=. Inputs are read in place and
+outputs are written into out= when it is given (any writable buffer of the right size, also the input
+itself for apply_lut), otherwise into a new bytearray (np.frombuffer(b, np.uint8).reshape(h, w) views
+it without a copy). The GIL is released while the pixels are processed, so Python threads run
+conversions in parallel; buffers must not be resized meanwhile, which the buffer protocol enforces.
+Can be compiled with the makefile provided (make imgproc); imgproc_bench.py compares it to calling zad1.
+Functions:
+    gray(rgb, width=0, height=0, out=None) -> out
+    histogram(gray, width=0, height=0, sample=1.0) -> list of 256 counts
+    tone_lut(hist, gamma=2.0, levels=False, match=None) -> bytes of 256 ("auto" gamma is allowed)
+    apply_lut(gray, lut, width=0, height=0, out=None) -> out
+    threshold(hist, method="otsu") -> (threshold, method name)
+    pipeline(image, width=0, height=0, channels=3, threshold="otsu", gamma=2.0, levels=False, hist=None,
+             filter=True, kernel=None, morph=None, ksize=1, out=None, threads=1) -> (out, threshold)
+        zad1's pipeline: the default one on RGB runs fused or tiled over threads as in strategy.h, the
+        rest through stream.h; threshold=None keeps the gray, morph is "erode" or "dilate".
+    unsharp(gray, width=0, height=0, amount=1.0, radius=1, threshold=0, border="replicate", out=None) -> out
+    guided(gray, width=0, height=0, radius=4, eps=0.01, guide=None, threads=1, out=None) -> out
+        guide is a C-contiguous gray image of the same size, the image itself when None.
+    fft_filter(gray, width=0, height=0, kernel=None, kernel_width=0, kernel_height=0, nsr=0.0, lowpass=0.0,
+               highpass=0.0, threads=1, border="replicate", out=None) -> out
+        one of: kernel (kernel_width * kernel_height weights, Wiener deconvolution of it when nsr > 0),
+        lowpass or highpass (gaussian sigma); zad1's --kernel --fft=on, --deconvolve, --lowpass, --highpass.
+    flatfield(gray, width=0, height=0, mode="divide", scale=16, radius=2, background="close", out=None)
+        -> (out, level); zad1's --flatfield and --background without the tone curve after it.
+    corners(gray, width=0, height=0, method="fast", threshold=0, grid=16, threads=1) -> [(x, y, score)]
+    match(gray, template, width=0, height=0, template_width=0, template_height=0, k=1, levels=-1,
+          fft="auto", threads=1, min_score=0.0) -> [(x, y, score)]
+    hough(image, width=0, height=0, mode="lines", votes=64, count=32, threads=1, packed=False)
+        -> [(rho, theta, votes)] or [(x0, y0, x1, y1, votes)]; zero pixels vote, packed takes P4 rows.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdlib.h>
+#include <string.h>
+#include "histogram.h"
+#include "image.h"
+#include "stream.h"
+#include "strategy.h"
+#include "corners.h"
+#include "match.h"
+#include "hough.h"
+#include "fft.h"
+#include "background.h"
+#include "filters.h"
+
+typedef struct {
+    Py_buffer view;
+    int width, height, channels;
+    Py_ssize_t stride;          // bytes between rows
+    unsigned char* px;
+} Image;
+
+typedef struct {
+    unsigned char* px;
+    Py_ssize_t stride;
+} RowSink;
+
+static int get_image(PyObject* obj, int width, int height, int channels, int writable, Image* img) {
+    // the buffer of obj as height rows of width * channels bytes; 0 with an exception set
+    int flags = PyBUF_STRIDES | (writable ? PyBUF_WRITABLE : 0);
+    if (PyObject_GetBuffer(obj, &img->view, flags) != 0) return 0;
+    Py_buffer* v = &img->view;
+    Py_ssize_t w = width, h = height, stride = 0;
+    int ok = v->itemsize == 1;
+    if (ok && v->ndim == 3) {
+        ok = v->shape[2] == channels && v->strides[2] == 1 && v->strides[1] == channels;
+        w = v->shape[1];
+        h = v->shape[0];
+        stride = v->strides[0];
+    } else if (ok && v->ndim == 2) {
+        ok = v->strides[1] == 1 && v->shape[1] % channels == 0;
+        w = v->shape[1] / channels;
+        h = v->shape[0];
+        stride = v->strides[0];
+    } else if (ok && v->ndim <= 1) {
+        ok = (v->ndim == 0 || v->strides[0] == 1) && w > 0 && (h > 0 || v->len % (w * channels) == 0);
+        if (ok && h <= 0) h = v->len / (w * channels);
+        ok = ok && v->len == w * h * channels;
+        stride = w * channels;
+    } else {
+        ok = 0;
+    }
+    ok = ok && w > 0 && h > 0 && w <= INT_MAX / channels && (!width || w == width) && (!height || h == height);
+    if (!ok) {
+        PyErr_Format(PyExc_ValueError, "expected %s of 1-byte items with contiguous rows%s", channels == 3
+            ? "an (H, W, 3) buffer" : "an (H, W) buffer", width ? " matching width and height" : " (or width=)");
+        PyBuffer_Release(v);
+        return 0;
+    }
+    img->width = w;
+    img->height = h;
+    img->channels = channels;
+    img->stride = stride;
+    img->px = (unsigned char*)v->buf;
+    return 1;
+}
+
+static int output_image(PyObject* out, int width, int height, PyObject** result, Image* img) {
+    // out= or a new bytearray of width x height gray pixels
+    if (out && out != Py_None) {
+        if (!get_image(out, width, height, 1, 1, img)) return 0;
+        Py_INCREF(out);
+        *result = out;
+        return 1;
+    }
+    *result = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)width * height);
+    if (!*result) return 0;
+    if (!get_image(*result, width, height, 1, 1, img)) {
+        Py_DECREF(*result);
+        return 0;
+    }
+    return 1;
+}
+
+static int contiguous(Image* img) {
+    if (img->stride == (Py_ssize_t)img->width * img->channels) return 1;
+    PyErr_SetString(PyExc_BufferError, "this stage needs a C-contiguous buffer");
+    return 0;
+}
+
+static int get_histogram(PyObject* obj, int* hist) {
+    // a sequence of MAXSIZE counts
+    PyObject* seq = PySequence_Fast(obj, "histogram must be a sequence of 256 counts");
+    if (!seq) return 0;
+    int ok = PySequence_Fast_GET_SIZE(seq) == MAXSIZE;
+    for (int i = 0; ok && i < MAXSIZE; i++) {
+        long v = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        ok = v >= 0 && v <= INT_MAX && !PyErr_Occurred();
+        hist[i] = v;
+    }
+    Py_DECREF(seq);
+    if (!ok && !PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "histogram must be a sequence of 256 counts");
+    return ok;
+}
+
+static int get_gamma(PyObject* obj, double* gamma) {
+    // a positive number or "auto" (0)
+    if (PyUnicode_Check(obj) && PyUnicode_CompareWithASCIIString(obj, "auto") == 0) {
+        *gamma = 0;
+        return 1;
+    }
+    *gamma = PyFloat_AsDouble(obj);
+    if (PyErr_Occurred() || *gamma <= 0) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "gamma must be a positive number or \"auto\"");
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject* py_gray(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"rgb", "width", "height", "out", NULL};
+    PyObject *src, *out = NULL, *result;
+    int width = 0, height = 0;
+    Image in, dst;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iiO", names, &src, &width, &height, &out)) return NULL;
+    if (!get_image(src, width, height, 3, 0, &in)) return NULL;
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (int j = 0; j < in.height; j++) {
+        stream_gray_row(STREAM_RGB, &in.px[j * in.stride], in.width, &dst.px[j * dst.stride]);
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in.view);
+    PyBuffer_Release(&dst.view);
+    return result;
+}
+
+static PyObject* py_histogram(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "sample", NULL};
+    PyObject* src;
+    int width = 0, height = 0, hist[MAXSIZE];
+    double fraction = 1;
+    Image in;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iid", names, &src, &width, &height, &fraction)) return NULL;
+    if (fraction <= 0 || fraction > 1) {
+        PyErr_SetString(PyExc_ValueError, "sample fraction must be in (0, 1]");
+        return NULL;
+    }
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    if (in.stride < in.width) {
+        PyBuffer_Release(&in.view);
+        PyErr_SetString(PyExc_BufferError, "histogram needs rows in increasing memory order");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    strided_histogram(in.width, in.height, in.stride, in.px, fraction, hist);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in.view);
+    PyObject* list = PyList_New(MAXSIZE);
+    for (int i = 0; list && i < MAXSIZE; i++) PyList_SET_ITEM(list, i, PyLong_FromLong(hist[i]));
+    return list;
+}
+
+static PyObject* py_tone_lut(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"hist", "gamma", "levels", "match", NULL};
+    PyObject *hist_obj, *gamma_obj = NULL, *match_obj = Py_None;
+    int levels = 0, hist[MAXSIZE], ref[MAXSIZE];
+    unsigned char lut[MAXSIZE];
+    PointParams pp = {.ref_hist = NULL, .auto_levels = 0, .gamma = 2.0};
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|OpO", names, &hist_obj, &gamma_obj, &levels, &match_obj)) {
+        return NULL;
+    }
+    if (!get_histogram(hist_obj, hist) || (gamma_obj && !get_gamma(gamma_obj, &pp.gamma))) return NULL;
+    if (match_obj != Py_None) {
+        if (!get_histogram(match_obj, ref)) return NULL;
+        int total = 0;
+        for (int i = 0; i < MAXSIZE; i++) total += ref[i];
+        if (total == 0) return PyErr_Format(PyExc_ValueError, "empty reference histogram");
+        pp.ref_hist = ref;
+    }
+    pp.auto_levels = levels;
+    int n = 0;
+    for (int i = 0; i < MAXSIZE; i++) n += hist[i];
+    point_lut(n, hist, &pp, lut);
+    return PyBytes_FromStringAndSize((char*)lut, MAXSIZE);
+}
+
+static PyObject* py_apply_lut(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "lut", "width", "height", "out", NULL};
+    PyObject *src, *lut_obj, *out = NULL, *result;
+    int width = 0, height = 0;
+    Py_buffer lut;
+    Image in, dst;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|iiO", names, &src, &lut_obj, &width, &height, &out)) return NULL;
+    if (PyObject_GetBuffer(lut_obj, &lut, PyBUF_SIMPLE) != 0) return NULL;
+    if (lut.len != MAXSIZE) {
+        PyBuffer_Release(&lut);
+        PyErr_SetString(PyExc_ValueError, "lut must have 256 bytes");
+        return NULL;
+    }
+    if (!get_image(src, width, height, 1, 0, &in)) {
+        PyBuffer_Release(&lut);
+        return NULL;
+    }
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&lut);
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    unsigned char* l = (unsigned char*)lut.buf;
+    Py_BEGIN_ALLOW_THREADS
+    for (int j = 0; j < in.height; j++) {
+        unsigned char* s = &in.px[j * in.stride];
+        unsigned char* d = &dst.px[j * dst.stride];
+        for (int i = 0; i < in.width; i++) d[i] = l[s[i]];
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&lut);
+    PyBuffer_Release(&in.view);
+    PyBuffer_Release(&dst.view);
+    return result;
+}
+
+static PyObject* py_threshold(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"hist", "method", NULL};
+    PyObject* hist_obj;
+    char const * name = "otsu";
+    int hist[MAXSIZE];
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|s", names, &hist_obj, &name)) return NULL;
+    TresholdMethod method = parse_treshold_method(name);
+    if (method == TH_COUNT) return PyErr_Format(PyExc_ValueError, "unknown threshold method %s", name);
+    if (!get_histogram(hist_obj, hist)) return NULL;
+    int n = 0;
+    for (int i = 0; i < MAXSIZE; i++) n += hist[i];
+    if (n == 0) return PyErr_Format(PyExc_ValueError, "empty histogram");
+    HistStats st;
+    hist_stats(n, hist, &st);
+    if (method == TH_AUTO) method = auto_treshold_method(&st);
+    return Py_BuildValue("is", hist_treshold(&st, method), treshold_method_name(method));
+}
+
+static void sink_row(void* user, int y, unsigned char const * row, int width) {
+    RowSink* sink = (RowSink*)user;
+    memcpy(&sink->px[y * sink->stride], row, width);
+}
+
+static PyObject* py_pipeline(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"image", "width", "height", "channels", "threshold", "gamma", "levels", "hist", "filter",
+                            "kernel", "morph", "ksize", "out", "threads", NULL};
+    PyObject *src, *th_obj = NULL, *gamma_obj = NULL, *hist_obj = Py_None, *kernel_obj = Py_None, *out = NULL;
+    PyObject* result;
+    int width = 0, height = 0, channels = 3, levels = 0, filter = 1, ksize = 1, threads = 1;
+    char const * morph = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iiiOOpOpOziOi", names, &src, &width, &height, &channels, &th_obj,
+        &gamma_obj, &levels, &hist_obj, &filter, &kernel_obj, &morph, &ksize, &out, &threads)) {
+        return NULL;
+    }
+    double kernel[9] = {
+        1.0 / 16, 2.0 / 16, 1.0 / 16,
+        2.0 / 16, 4.0 / 16, 2.0 / 16,
+        1.0 / 16, 2.0 / 16, 1.0 / 16
+    };
+    int hist[MAXSIZE];
+    StreamParams sp = {channels == 3 ? STREAM_RGB : STREAM_GRAY,
+                       {.ref_hist = NULL, .auto_levels = levels, .gamma = 2.0}, NULL,
+                       filter ? kernel : NULL, TH_OTSU, STREAMAUTO, 0, ksize};
+    if (channels != 1 && channels != 3) return PyErr_Format(PyExc_ValueError, "channels must be 1 or 3");
+    if (threads < 1) return PyErr_Format(PyExc_ValueError, "threads must be positive");
+    if (gamma_obj && !get_gamma(gamma_obj, &sp.pp.gamma)) return NULL;
+    if (th_obj == Py_None) {
+        sp.treshold = STREAMNONE;
+    } else if (th_obj && PyLong_Check(th_obj)) {
+        sp.treshold = PyLong_AsLong(th_obj);
+        if (sp.treshold < 0 || sp.treshold > MAXGRAY) return PyErr_Format(PyExc_ValueError, "threshold out of 0..255");
+    } else if (th_obj) {
+        char const * name = PyUnicode_Check(th_obj) ? PyUnicode_AsUTF8(th_obj) : NULL;
+        sp.method = name ? parse_treshold_method(name) : TH_COUNT;
+        if (sp.method == TH_COUNT) {
+            return PyErr_Format(PyExc_ValueError, "threshold is a method name, a gray level or None");
+        }
+    }
+    if (hist_obj != Py_None) {
+        if (!get_histogram(hist_obj, hist)) return NULL;
+        sp.hist = hist;
+    }
+    if (kernel_obj != Py_None) {
+        PyObject* seq = PySequence_Fast(kernel_obj, "kernel must be 9 weights");
+        if (!seq) return NULL;
+        int ok = PySequence_Fast_GET_SIZE(seq) == 9;
+        for (int i = 0; ok && i < 9; i++) {
+            kernel[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+            ok = !PyErr_Occurred();
+        }
+        Py_DECREF(seq);
+        if (!ok) {
+            if (!PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "kernel must be 9 weights");
+            return NULL;
+        }
+        sp.kernel = kernel;
+    }
+    if (morph) {
+        sp.morph = strcmp(morph, "erode") == 0 ? 'e' : strcmp(morph, "dilate") == 0 ? 'd' : 0;
+        if (!sp.morph || ksize < 1) return PyErr_Format(PyExc_ValueError, "morph is erode or dilate with ksize >= 1");
+    }
+
+    Image in, dst;
+    if (!get_image(src, width, height, channels, 0, &in)) return NULL;
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    // zad1's default on an RGB frame runs fused or tiled like zad1 does (strategy.h); the stream takes
+    // what strategy_run does not do: other kernels, morphology, gray input, a given histogram, a fixed
+    // or no threshold and strided rows
+    int whole = channels == 3 && sp.kernel && kernel_obj == Py_None && !sp.morph && !sp.hist
+        && sp.treshold == STREAMAUTO && in.stride == (Py_ssize_t)in.width * 3;
+    int ok, used = -1;
+    if (whole) {
+        StrategyRun r = {
+            .width = in.width,
+            .height = in.height,
+            .rgb = in.px,
+            .out = dst.stride == in.width ? dst.px : (unsigned char*)malloc((size_t)in.width * in.height),
+            .pp = &sp.pp,
+            .method = sp.method,
+            .fraction = 1,
+            .scale = 1
+        };
+        Py_BEGIN_ALLOW_THREADS
+        int n = strategy_pick(in.width, in.height, threads, NULL) == STRATEGY_FUSED ? 1 : threads;
+        ok = r.out && strategy_run(&r, n);
+        for (int j = 0; ok && r.out != dst.px && j < in.height; j++) {
+            memcpy(&dst.px[j * dst.stride], &r.out[(size_t)j * in.width], in.width);
+        }
+        Py_END_ALLOW_THREADS
+        if (r.out != dst.px) free(r.out);
+        used = r.used_treshold;
+    } else {
+        RowSink sink = {dst.px, dst.stride};
+        Stream s;
+        Py_BEGIN_ALLOW_THREADS
+        ok = stream_alloc(&s, in.width, in.height, &sp, sink_row, &sink);
+        for (int j = 0; ok && j < in.height; j++) ok = stream_push(&s, &in.px[j * in.stride], 1, 0);
+        ok = ok && stream_finish(&s);
+        stream_free(&s);
+        Py_END_ALLOW_THREADS
+        used = s.used_treshold;
+    }
+    PyBuffer_Release(&in.view);
+    PyBuffer_Release(&dst.view);
+    if (!ok) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    PyObject* th = used >= 0 ? PyLong_FromLong(used) : (Py_INCREF(Py_None), Py_None);
+    return Py_BuildValue("NN", result, th);
+}
+
+static int load_padded(Image* in, int border, char const * border_name, PaddedImage* img) {
+    // in copied into a new padded image with its border filled; 0 with an exception set
+    unsigned char value;
+    BorderMode mode = parse_border_mode(border_name, &value);
+    if (mode == BORDER_COUNT) {
+        PyErr_SetString(PyExc_ValueError, "border is replicate, reflect or constant[:V]");
+        return 0;
+    }
+    if (!padded_alloc(img, in->width, in->height, border)) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    for (int j = 0; j < in->height; j++) memcpy(&img->px[j * img->stride], &in->px[j * in->stride], in->width);
+    padded_fill_border(img, mode, value);
+    return 1;
+}
+
+static unsigned char* out_pixels(Image* dst) {
+    // the filters write width x height contiguous pixels, strided outputs get them through a copy
+    if (dst->stride == dst->width) return dst->px;
+    return (unsigned char*)malloc((size_t)dst->width * dst->height);
+}
+
+static void out_store(Image* dst, unsigned char* px) {
+    if (px == dst->px) return;
+    for (int j = 0; j < dst->height; j++) memcpy(&dst->px[j * dst->stride], &px[(size_t)j * dst->width], dst->width);
+    free(px);
+}
+
+static PyObject* filter_done(Image* in, Image* dst, PyObject* result, int ok) {
+    // releases the buffers, the result or a MemoryError
+    PyBuffer_Release(&in->view);
+    PyBuffer_Release(&dst->view);
+    if (!ok) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    return result;
+}
+
+static PyObject* py_unsharp(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "amount", "radius", "threshold", "border", "out", NULL};
+    PyObject *src, *out = NULL, *result;
+    int width = 0, height = 0;
+    UnsharpParams up = {.amount = 1, .radius = 1, .treshold = 0};
+    char const * border = "replicate";
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iidiisO", names, &src, &width, &height, &up.amount, &up.radius,
+        &up.treshold, &border, &out)) {
+        return NULL;
+    }
+    if (up.amount <= 0 || up.amount >= 8 || up.radius < 1 || up.radius > MAXUNSHARP || up.treshold < 0) {
+        return PyErr_Format(PyExc_ValueError, "amount in (0, 8), radius 1..%d, threshold >= 0", MAXUNSHARP);
+    }
+    Image in, dst;
+    PaddedImage img;
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    if (!load_padded(&in, up.radius, border, &img)) {
+        PyBuffer_Release(&in.view);
+        PyBuffer_Release(&dst.view);
+        Py_DECREF(result);
+        return NULL;
+    }
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    unsigned char* px = out_pixels(&dst);
+    ok = px && unsharp_padded(&img, px, &up);
+    if (px) out_store(&dst, px);
+    padded_free(&img);
+    Py_END_ALLOW_THREADS
+    return filter_done(&in, &dst, result, ok);
+}
+
+static PyObject* py_guided(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "radius", "eps", "guide", "threads", "out", NULL};
+    PyObject *src, *guide_obj = Py_None, *out = NULL, *result;
+    int width = 0, height = 0, threads = 1;
+    GuidedParams gp = {.radius = 4, .eps = 0.01};
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iiidOiO", names, &src, &width, &height, &gp.radius, &gp.eps,
+        &guide_obj, &threads, &out)) {
+        return NULL;
+    }
+    if (gp.radius < 1 || gp.radius > GUIDEDMAXRADIUS || gp.eps <= 0 || threads < 1) {
+        return PyErr_Format(PyExc_ValueError, "radius 1..%d, eps and threads must be positive", GUIDEDMAXRADIUS);
+    }
+    Image in, guide, dst;
+    PaddedImage img;
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    guide.view.obj = NULL;
+    if (guide_obj != Py_None && (!get_image(guide_obj, in.width, in.height, 1, 0, &guide) || !contiguous(&guide))) {
+        if (guide.view.obj) PyBuffer_Release(&guide.view);
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        if (guide.view.obj) PyBuffer_Release(&guide.view);
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    if (!load_padded(&in, 0, "replicate", &img)) {
+        if (guide.view.obj) PyBuffer_Release(&guide.view);
+        PyBuffer_Release(&in.view);
+        PyBuffer_Release(&dst.view);
+        Py_DECREF(result);
+        return NULL;
+    }
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    unsigned char* px = out_pixels(&dst);
+    ok = px && guided_filter(&img, guide.view.obj ? guide.px : NULL, &gp, px, threads);
+    if (px) out_store(&dst, px);
+    padded_free(&img);
+    Py_END_ALLOW_THREADS
+    if (guide.view.obj) PyBuffer_Release(&guide.view);
+    return filter_done(&in, &dst, result, ok);
+}
+
+static PyObject* py_fft_filter(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "kernel", "kernel_width", "kernel_height", "nsr", "lowpass",
+                            "highpass", "threads", "border", "out", NULL};
+    PyObject *src, *kernel_obj = Py_None, *out = NULL, *result;
+    int width = 0, height = 0, kwidth = 0, kheight = 0, threads = 1;
+    double nsr = 0, lowpass = 0, highpass = 0;
+    char const * border = "replicate";
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iiOiidddisO", names, &src, &width, &height, &kernel_obj, &kwidth,
+        &kheight, &nsr, &lowpass, &highpass, &threads, &border, &out)) {
+        return NULL;
+    }
+    if ((kernel_obj != Py_None) + (lowpass > 0) + (highpass > 0) != 1 || nsr < 0 || threads < 1
+        || (nsr > 0 && kernel_obj == Py_None)) {
+        return PyErr_Format(PyExc_ValueError, "one of kernel (nsr >= 0 for Wiener), lowpass or highpass, threads > 0");
+    }
+    double* kernel = NULL;
+    if (kernel_obj != Py_None) {
+        PyObject* seq = PySequence_Fast(kernel_obj, "kernel must be kernel_width * kernel_height weights");
+        if (!seq) return NULL;
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        int ok = kwidth > 0 && kheight > 0 && n == (Py_ssize_t)kwidth * kheight;
+        if (ok) ok = (kernel = (double*)malloc(n * sizeof(double))) != NULL;
+        for (Py_ssize_t i = 0; ok && i < n; i++) {
+            kernel[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+            ok = !PyErr_Occurred();
+        }
+        Py_DECREF(seq);
+        if (!ok) {
+            free(kernel);
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "kernel must be kernel_width * kernel_height weights");
+            }
+            return NULL;
+        }
+    }
+    Image in, dst;
+    if (!get_image(src, width, height, 1, 0, &in)) {
+        free(kernel);
+        return NULL;
+    }
+    int extent = in.width > in.height ? in.width : in.height;
+    FreqFilter ff = {0};
+    int built = kernel ? (nsr > 0 ? freq_filter_wiener(&ff, kernel, kwidth, kheight, nsr, extent)
+                                  : freq_filter_kernel(&ff, kernel, kwidth, kheight, extent))
+                       : freq_filter_gauss(&ff, lowpass > 0 ? lowpass : highpass, highpass > 0, extent);
+    free(kernel);
+    if (!built) {
+        PyBuffer_Release(&in.view);
+        freq_filter_free(&ff);
+        return PyErr_Format(PyExc_ValueError, "filter too large for the frequency domain");
+    }
+    PaddedImage img;
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&in.view);
+        freq_filter_free(&ff);
+        return NULL;
+    }
+    if (!load_padded(&in, ff.margin, border, &img)) {
+        PyBuffer_Release(&in.view);
+        PyBuffer_Release(&dst.view);
+        Py_DECREF(result);
+        freq_filter_free(&ff);
+        return NULL;
+    }
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    unsigned char* px = out_pixels(&dst);
+    ok = px && freq_filter_apply(&ff, &img, px, threads);
+    if (px) out_store(&dst, px);
+    padded_free(&img);
+    freq_filter_free(&ff);
+    Py_END_ALLOW_THREADS
+    return filter_done(&in, &dst, result, ok);
+}
+
+static PyObject* py_flatfield(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "mode", "scale", "radius", "background", "out", NULL};
+    PyObject *src, *out = NULL, *result;
+    int width = 0, height = 0, scale = FLATSCALE, radius = FLATRADIUS;
+    char const * mode_name = "divide";
+    char const * estimate_name = "close";
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iisiisO", names, &src, &width, &height, &mode_name, &scale, &radius,
+        &estimate_name, &out)) {
+        return NULL;
+    }
+    FlatMode mode = parse_flat_mode(mode_name);
+    BackgroundEstimate estimate = parse_background_estimate(estimate_name);
+    if (mode == FLAT_COUNT || estimate == BG_COUNT || scale < 8 || scale > 16 || radius < 1) {
+        return PyErr_Format(PyExc_ValueError, "mode is divide or subtract, background close or blur, scale 8..16, "
+            "radius positive");
+    }
+    Image in, dst;
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    if (!output_image(out, in.width, in.height, &result, &dst)) {
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    Background bg;
+    unsigned char lut[MAXSIZE];
+    for (int i = 0; i < MAXSIZE; i++) lut[i] = i;
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = background_alloc(&bg, in.width, in.height, scale, radius, mode);
+    if (ok) {
+        for (int j = 0; j < in.height; j++) background_accumulate(&bg, j, &in.px[j * in.stride]);
+        background_estimate(&bg, estimate);
+        // row by row, so out= may be the input itself
+        for (int j = 0; j < in.height; j++) {
+            background_row(&bg, j, &in.px[j * in.stride], lut, &dst.px[j * dst.stride]);
+        }
+        background_free(&bg);
+    }
+    Py_END_ALLOW_THREADS
+    double level = ok ? bg.level : 0;
+    result = filter_done(&in, &dst, result, ok);
+    return result ? Py_BuildValue("Nd", result, level) : NULL;
+}
+
+static PyObject* py_corners(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "width", "height", "method", "threshold", "grid", "threads", NULL};
+    PyObject* src;
+    int width = 0, height = 0, grid = CORNERGRID, threads = 1;
+    char const * name = "fast";
+    double treshold = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iisdii", names, &src, &width, &height, &name, &treshold, &grid,
+        &threads)) {
+        return NULL;
+    }
+    double default_treshold;
+    CornerMethod method = parse_corner_method(name, &default_treshold);
+    if (method == CORNER_COUNT || grid < 1 || threads < 1) {
+        return PyErr_Format(PyExc_ValueError, "method is fast or harris, grid and threads positive");
+    }
+    if (treshold <= 0) treshold = default_treshold;
+    Image in;
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    PaddedImage img;
+    Keypoint* kp = NULL;
+    int n = -1;
+    Py_BEGIN_ALLOW_THREADS
+    if (padded_alloc(&img, in.width, in.height, CORNERBORDER)) {
+        for (int j = 0; j < in.height; j++) memcpy(&img.px[j * img.stride], &in.px[j * in.stride], in.width);
+        padded_fill_border(&img, BORDER_REPLICATE, 0);
+        n = detect_corners(&img, method, treshold, grid, threads, &kp);
+        padded_free(&img);
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in.view);
+    if (n < 0) return PyErr_NoMemory();
+    PyObject* list = PyList_New(n);
+    for (int i = 0; list && i < n; i++) {
+        PyList_SET_ITEM(list, i, Py_BuildValue("iid", kp[i].x, kp[i].y, (double)kp[i].score));
+    }
+    free(kp);
+    return list;
+}
+
+static PyObject* py_match(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"gray", "template", "width", "height", "template_width", "template_height", "k", "levels",
+                            "fft", "threads", "min_score", NULL};
+    PyObject *src, *tmpl_obj;
+    int width = 0, height = 0, tw = 0, th = 0;
+    char const * fft = "auto";
+    MatchParams mp = {1, -1, 'a', 1, 0.0, 0, 0};
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|iiiiiisid", names, &src, &tmpl_obj, &width, &height, &tw, &th,
+        &mp.k, &mp.levels, &fft, &mp.threads, &mp.min_score)) {
+        return NULL;
+    }
+    mp.fft_mode = strcmp(fft, "on") == 0 ? 'y' : strcmp(fft, "off") == 0 ? 'n' : strcmp(fft, "auto") == 0 ? 'a' : 0;
+    if (!mp.fft_mode || mp.k < 1 || mp.threads < 1 || mp.levels > MATCHMAXLEVELS) {
+        return PyErr_Format(PyExc_ValueError, "fft is auto, on or off, k and threads positive, levels <= %d",
+            MATCHMAXLEVELS);
+    }
+    Image in, t;
+    if (!get_image(src, width, height, 1, 0, &in)) return NULL;
+    if (!get_image(tmpl_obj, tw, th, 1, 0, &t)) {
+        PyBuffer_Release(&in.view);
+        return NULL;
+    }
+    Match* matches = NULL;
+    int n = -1;
+    if (!contiguous(&in) || !contiguous(&t)) goto done;
+    if (t.width > in.width || t.height > in.height) {
+        PyErr_SetString(PyExc_ValueError, "template larger than the image");
+        goto done;
+    }
+    matches = (Match*)malloc(mp.k * sizeof(Match));
+    if (!matches) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    n = match_template(in.px, in.width, in.height, t.px, t.width, t.height, &mp, matches);
+    Py_END_ALLOW_THREADS
+    if (n < 0) PyErr_NoMemory();
+done:
+    PyBuffer_Release(&in.view);
+    PyBuffer_Release(&t.view);
+    PyObject* list = n < 0 ? NULL : PyList_New(n);
+    for (int i = 0; list && i < n; i++) {
+        PyList_SET_ITEM(list, i, Py_BuildValue("iid", matches[i].x, matches[i].y, (double)matches[i].score));
+    }
+    free(matches);
+    return list;
+}
+
+static PyObject* py_hough(PyObject* self, PyObject* args, PyObject* kw) {
+    static char* names[] = {"image", "width", "height", "mode", "votes", "count", "threads", "packed", NULL};
+    PyObject* src;
+    int width = 0, height = 0, votes = HOUGHVOTES, count = HOUGHCOUNT, threads = 1, packed = 0;
+    char const * name = "lines";
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iisiiip", names, &src, &width, &height, &name, &votes, &count,
+        &threads, &packed)) {
+        return NULL;
+    }
+    int default_votes;
+    HoughMode mode = parse_hough_mode(name, &default_votes);
+    if (mode == HOUGH_COUNT || votes < 1 || count < 1 || threads < 1) {
+        return PyErr_Format(PyExc_ValueError, "mode is lines or segments, votes, count and threads positive");
+    }
+    if (packed && width < 1) return PyErr_Format(PyExc_ValueError, "packed rows need width=");
+    Image in;
+    // packed rows are (width + 7) / 8 bytes, the bits are what zad6 writes (1 is black)
+    if (!get_image(src, packed ? (width + 7) / 8 : width, height, 1, 0, &in)) return NULL;
+    if (packed) in.width = width;
+    int row_bytes = (in.width + 7) / 8, n = -1;
+    HoughLine* lines = (HoughLine*)malloc(count * sizeof(HoughLine));
+    unsigned char* bits = (unsigned char*)malloc((size_t)row_bytes * in.height);
+    Py_BEGIN_ALLOW_THREADS
+    if (lines && bits) {
+        for (int j = 0; j < in.height; j++) {
+            unsigned char* s = &in.px[j * in.stride];
+            unsigned char* d = &bits[(size_t)j * row_bytes];
+            if (packed) {
+                memcpy(d, s, row_bytes);
+                continue;
+            }
+            memset(d, 0, row_bytes);
+            for (int i = 0; i < in.width; i++) d[i / 8] |= (s[i] == 0) << (7 - i % 8);
+        }
+        n = hough_lines(bits, in.width, in.height, mode, votes, count, threads, lines);
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in.view);
+    free(bits);
+    PyObject* list = n < 0 ? PyErr_NoMemory() : PyList_New(n);
+    for (int i = 0; list && i < n; i++) {
+        HoughLine* l = &lines[i];
+        PyList_SET_ITEM(list, i, mode == HOUGH_LINES ? Py_BuildValue("iii", l->rho, l->theta, l->votes)
+            : Py_BuildValue("iiiii", l->x0, l->y0, l->x1, l->y1, l->votes));
+    }
+    free(lines);
+    return list;
+}
+
+static PyMethodDef methods[] = {
+    {"gray", (PyCFunction)(void(*)(void))py_gray, METH_VARARGS | METH_KEYWORDS,
+     "gray(rgb, width=0, height=0, out=None): RGB to gray with zad1's weights."},
+    {"histogram", (PyCFunction)(void(*)(void))py_histogram, METH_VARARGS | METH_KEYWORDS,
+     "histogram(gray, width=0, height=0, sample=1.0): 256 counts, stratified sample when sample < 1."},
+    {"tone_lut", (PyCFunction)(void(*)(void))py_tone_lut, METH_VARARGS | METH_KEYWORDS,
+     "tone_lut(hist, gamma=2.0, levels=False, match=None): equalization (or levels, or matching) and gamma LUT."},
+    {"apply_lut", (PyCFunction)(void(*)(void))py_apply_lut, METH_VARARGS | METH_KEYWORDS,
+     "apply_lut(gray, lut, width=0, height=0, out=None): map every pixel through a 256-byte LUT."},
+    {"threshold", (PyCFunction)(void(*)(void))py_threshold, METH_VARARGS | METH_KEYWORDS,
+     "threshold(hist, method=\"otsu\"): (threshold, method), pixels above it are white."},
+    {"pipeline", (PyCFunction)(void(*)(void))py_pipeline, METH_VARARGS | METH_KEYWORDS,
+     "pipeline(image, ...): zad1's default pipeline, returns (out, threshold)."},
+    {"unsharp", (PyCFunction)(void(*)(void))py_unsharp, METH_VARARGS | METH_KEYWORDS,
+     "unsharp(gray, ...): unsharp mask fused with its binomial blur."},
+    {"guided", (PyCFunction)(void(*)(void))py_guided, METH_VARARGS | METH_KEYWORDS,
+     "guided(gray, ...): edge-preserving guided filter, self-guided or with guide=."},
+    {"fft_filter", (PyCFunction)(void(*)(void))py_fft_filter, METH_VARARGS | METH_KEYWORDS,
+     "fft_filter(gray, ...): frequency-domain kernel, Wiener deconvolution, low-pass or high-pass."},
+    {"flatfield", (PyCFunction)(void(*)(void))py_flatfield, METH_VARARGS | METH_KEYWORDS,
+     "flatfield(gray, ...): flat-field normalization against a low-resolution background, (out, level)."},
+    {"corners", (PyCFunction)(void(*)(void))py_corners, METH_VARARGS | METH_KEYWORDS,
+     "corners(gray, width=0, height=0, method=\"fast\", threshold=0, grid=16, threads=1): [(x, y, score)]."},
+    {"match", (PyCFunction)(void(*)(void))py_match, METH_VARARGS | METH_KEYWORDS,
+     "match(gray, template, ...): best NCC matches [(x, y, score)]."},
+    {"hough", (PyCFunction)(void(*)(void))py_hough, METH_VARARGS | METH_KEYWORDS,
+     "hough(image, ...): Hough lines or segments of the zero pixels (or of packed P4 rows)."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "imgproc", "zad1/zad6 stages over the buffer protocol, see imgproc.c.", -1, methods
+};
+
+PyMODINIT_FUNC PyInit_imgproc(void) {
+    return PyModule_Create(&module);
+}
@@ -0,0 +1,92 @@
+"""
+Benchmark of the imgproc extension against running zad1 through subprocess with the image
+round-tripped through /tmp, on the same P6 PPM (first argument, default sample.ppm). Both give
+zad1's default output, which is checked first. Then the same work runs from several Python threads
+to show the GIL being released.
+Used from cmd: python3 imgproc_bench.py [FILE.ppm] [runs] [threads]  (make zad1 imgproc first).
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import imgproc
+
+
+def read_ppm(name):
+    # header tokens (comments skipped), then the raw pixels
+    with open(name, "rb") as f:
+        data = f.read()
+    fields, pos = [], 0
+    while len(fields) < 4:
+        while data[pos:pos + 1].isspace():
+            pos += 1
+        if data[pos:pos + 1] == b"#":
+            pos = data.index(b"\n", pos)
+            continue
+        end = pos
+        while not data[end:end + 1].isspace():
+            end += 1
+        fields.append(data[pos:end])
+        pos = end
+    assert fields[0] == b"P6" and int(fields[3]) <= 255
+    return int(fields[1]), int(fields[2]), memoryview(data)[pos + 1:]
+
+
+def via_subprocess(width, height, pixels, tmp):
+    # what the scripts do today: write a PPM, run zad1, read the PGM back
+    src, tgt = os.path.join(tmp, "in.ppm"), os.path.join(tmp, "out.pgm")
+    with open(src, "wb") as f:
+        f.write(b"P6\n%d %d\n255\n" % (width, height))
+        f.write(pixels)
+    subprocess.run(["./zad1", src, tgt], check=True, stdout=subprocess.DEVNULL)
+    with open(tgt, "rb") as f:
+        return f.read()[-width * height:]
+
+
+def via_module(width, height, pixels, out=None):
+    return imgproc.pipeline(pixels, width=width, height=height, out=out)[0]
+
+
+def timed(runs, fn):
+    t0 = time.perf_counter()
+    for _ in range(runs):
+        fn()
+    return (time.perf_counter() - t0) / runs * 1e3
+
+
+def parallel(threads, runs, fn):
+    # runs calls on each of threads Python threads, ms per call overall
+    workers = [threading.Thread(target=lambda: [fn() for _ in range(runs)]) for _ in range(threads)]
+    t0 = time.perf_counter()
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    return (time.perf_counter() - t0) / (runs * threads) * 1e3
+
+
+def main():
+    name = sys.argv[1] if len(sys.argv) > 1 else "sample.ppm"
+    runs = int(sys.argv[2]) if len(sys.argv) > 2 else 20
+    threads = int(sys.argv[3]) if len(sys.argv) > 3 else os.cpu_count()
+    width, height, pixels = read_ppm(name)
+    with tempfile.TemporaryDirectory() as tmp:
+        expected = via_subprocess(width, height, pixels, tmp)
+        if bytes(via_module(width, height, pixels)) != expected:
+            sys.exit("imgproc.pipeline differs from zad1.")
+        print("%s: %dx%d, outputs identical." % (name, width, height))
+        sub = timed(runs, lambda: via_subprocess(width, height, pixels, tmp))
+        out = bytearray(width * height)
+        mod = timed(runs, lambda: via_module(width, height, pixels, out))
+        print("subprocess + /tmp: %.2f ms, imgproc: %.2f ms per image (%.1fx)." % (sub, mod, sub / mod))
+    par = parallel(threads, runs, lambda: via_module(width, height, pixels))
+    print("imgproc from %d threads: %.2f ms per image (%.2fx the single thread throughput)." % (threads, par,
+          mod / par))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,344 @@
+/*
+Normalized cross-correlation template matching, see match.h.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "match.h"
+#include "image.h"
+#include "fft.h"
+
+typedef struct {
+    int width, height;
+    unsigned char* px;
+    double* sum;            // (width + 1) x (height + 1) integral of px
+    double* sq;             // and of px^2
+} MatchLevel;
+
+typedef struct {
+    int width, height;
+    float* zero_mean;       // template minus its mean
+    double norm;            // sqrt of the sum of squares of zero_mean
+} TemplateLevel;
+
+typedef struct {
+    MatchLevel* img;
+    TemplateLevel* t;
+    float* image;           // px as floats
+    float* corr;            // (width - tw + 1) per row, correlation with zero_mean
+    int v0, v1;
+} CorrJob;
+
+static int level_init(MatchLevel* l, unsigned char* px, int width, int height) {
+    l->width = width;
+    l->height = height;
+    l->px = px;
+    l->sum = (double*)malloc(sizeof(double) * (width + 1) * (height + 1));
+    l->sq = (double*)malloc(sizeof(double) * (width + 1) * (height + 1));
+    if (!l->sum || !l->sq) return 0;
+    int s = width + 1;
+    for (int i = 0; i < s; i++) l->sum[i] = l->sq[i] = 0;
+    for (int j = 0; j < height; j++) {
+        double row = 0, row_sq = 0;
+        l->sum[(j + 1) * s] = l->sq[(j + 1) * s] = 0;
+        for (int i = 0; i < width; i++) {
+            double v = px[j * width + i];
+            row += v;
+            row_sq += v * v;
+            l->sum[(j + 1) * s + i + 1] = l->sum[j * s + i + 1] + row;
+            l->sq[(j + 1) * s + i + 1] = l->sq[j * s + i + 1] + row_sq;
+        }
+    }
+    return 1;
+}
+
+static unsigned char* downsample(unsigned char* px, int width, int height) {
+    // 2x2 means, odd last rows and columns are dropped
+    int w = width / 2, h = height / 2;
+    unsigned char* out = (unsigned char*)malloc((size_t)w * h);
+    if (!out) return NULL;
+    for (int j = 0; j < h; j++) {
+        unsigned char* a = &px[2 * j * width];
+        unsigned char* b = a + width;
+        for (int i = 0; i < w; i++) {
+            out[j * w + i] = (a[2 * i] + a[2 * i + 1] + b[2 * i] + b[2 * i + 1] + 2) / 4;
+        }
+    }
+    return out;
+}
+
+static int template_init(TemplateLevel* t, unsigned char* px, int width, int height) {
+    int n = width * height;
+    t->width = width;
+    t->height = height;
+    t->zero_mean = (float*)malloc(sizeof(float) * n);
+    if (!t->zero_mean) return 0;
+    double mean = 0;
+    for (int i = 0; i < n; i++) mean += px[i];
+    mean /= n;
+    t->norm = 0;
+    for (int i = 0; i < n; i++) {
+        t->zero_mean[i] = px[i] - mean;
+        t->norm += (double)t->zero_mean[i] * t->zero_mean[i];
+    }
+    t->norm = sqrt(t->norm);
+    return 1;
+}
+
+static float ncc_score(MatchLevel* l, TemplateLevel* t, int u, int v, double corr) {
+    // corr / (|window - mean| * |template - mean|), 0 for flat windows or templates
+    int s = l->width + 1, n = t->width * t->height;
+    int a = v * s + u, b = v * s + u + t->width, c = (v + t->height) * s + u, d = c + t->width;
+    double s1 = l->sum[d] - l->sum[b] - l->sum[c] + l->sum[a];
+    double s2 = l->sq[d] - l->sq[b] - l->sq[c] + l->sq[a];
+    double var = s2 - s1 * s1 / n;
+    if (var < 1e-6 || t->norm < 1e-6) return 0;
+    return corr / (sqrt(var) * t->norm);
+}
+
+static double corr_at(MatchLevel* l, TemplateLevel* t, int u, int v) {
+    double acc = 0;
+    for (int jj = 0; jj < t->height; jj++) {
+        unsigned char* row = &l->px[(v + jj) * l->width + u];
+        float* tr = &t->zero_mean[jj * t->width];
+        for (int ii = 0; ii < t->width; ii++) acc += tr[ii] * row[ii];
+    }
+    return acc;
+}
+
+static void* corr_band(void* arg) {
+    // direct correlation vectorized over output positions: every template weight is multiplied
+    // into a whole output row at once, so loads and stores stay contiguous
+    CorrJob* job = (CorrJob*)arg;
+    int w = job->img->width, tw = job->t->width, th = job->t->height, ow = w - tw + 1;
+    for (int v = job->v0; v < job->v1; v++) {
+        float* acc = &job->corr[(size_t)v * ow];
+        memset(acc, 0, ow * sizeof(float));
+        for (int jj = 0; jj < th; jj++) {
+            float* in = &job->image[(size_t)(v + jj) * w];
+            for (int ii = 0; ii < tw; ii++) {
+                float k = job->t->zero_mean[jj * tw + ii];
+                float* x = &in[ii];
+                int u = 0;
+#if defined(__SSE2__)
+                __m128 vk = _mm_set1_ps(k);
+                for (; u + 4 <= ow; u += 4) {
+                    _mm_storeu_ps(&acc[u], _mm_add_ps(_mm_loadu_ps(&acc[u]), _mm_mul_ps(vk, _mm_loadu_ps(&x[u]))));
+                }
+#elif defined(__ARM_NEON)
+                float32x4_t vk = vdupq_n_f32(k);
+                for (; u + 4 <= ow; u += 4) {
+                    vst1q_f32(&acc[u], vaddq_f32(vld1q_f32(&acc[u]), vmulq_f32(vk, vld1q_f32(&x[u]))));
+                }
+#endif
+                for (; u < ow; u++) acc[u] += k * x[u];
+            }
+        }
+    }
+    return NULL;
+}
+
+static int corr_direct(MatchLevel* l, TemplateLevel* t, int threads, float* corr) {
+    int w = l->width, h = l->height, oh = h - t->height + 1;
+    float* image = (float*)malloc(sizeof(float) * w * h);
+    if (!image) return 0;
+    for (int i = 0; i < w * h; i++) image[i] = l->px[i];
+    if (threads > oh) threads = oh;
+    CorrJob jobs[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    for (int k = 0; k < threads; k++) {
+        jobs[k] = (CorrJob){l, t, image, corr, (int)((long)oh * k / threads), (int)((long)oh * (k + 1) / threads)};
+        started[k] = k > 0 && pthread_create(&ids[k], NULL, corr_band, &jobs[k]) == 0;
+        if (k > 0 && !started[k]) corr_band(&jobs[k]);
+    }
+    corr_band(&jobs[0]);
+    for (int k = 1; k < threads; k++) {
+        if (started[k]) pthread_join(ids[k], NULL);
+    }
+    free(image);
+    return 1;
+}
+
+static int corr_fft(MatchLevel* l, TemplateLevel* t, int threads, float* corr) {
+    // the fft filter correlates around the kernel center, the top-left position (u, v)
+    // is read at (u + tw/2, v + th/2); every input there is inside the image
+    int w = l->width, h = l->height, tw = t->width, th = t->height, ow = w - tw + 1, oh = h - th + 1;
+    double* kernel = (double*)malloc(sizeof(double) * tw * th);
+    float* full = (float*)malloc(sizeof(float) * w * h);
+    FreqFilter f = {0};
+    PaddedImage p = {0};
+    int ok = kernel && full;
+    if (ok) {
+        for (int i = 0; i < tw * th; i++) kernel[i] = t->zero_mean[i];
+        ok = freq_filter_kernel(&f, kernel, tw, th, w > h ? w : h);
+    }
+    ok = ok && padded_alloc(&p, w, h, f.margin);
+    if (ok) {
+        unsigned char identity[256];
+        for (int i = 0; i < 256; i++) identity[i] = i;
+        padded_load_lut(&p, l->px, identity);
+        padded_fill_border(&p, BORDER_REPLICATE, 0);
+        ok = freq_filter_apply_float(&f, &p, full, threads);
+    }
+    if (ok) {
+        for (int v = 0; v < oh; v++) {
+            memcpy(&corr[(size_t)v * ow], &full[(size_t)(v + th / 2) * w + tw / 2], ow * sizeof(float));
+        }
+    }
+    if (p.data) padded_free(&p);
+    freq_filter_free(&f);
+    free(kernel);
+    free(full);
+    return ok;
+}
+
+static int by_score(const void* a, const void* b) {
+    float sa = ((const Match*)a)->score, sb = ((const Match*)b)->score;
+    return (sa < sb) - (sa > sb);
+}
+
+static int keep_best(Match* m, int n, int k, int tw, int th) {
+    // highest scores first, dropping matches that overlap a better one by more than half the template
+    qsort(m, n, sizeof(Match), by_score);
+    int kept = 0;
+    for (int i = 0; i < n && kept < k; i++) {
+        int clash = 0;
+        for (int j = 0; j < kept && !clash; j++) {
+            clash = abs(m[i].x - m[j].x) < (tw + 1) / 2 && abs(m[i].y - m[j].y) < (th + 1) / 2;
+        }
+        if (!clash) m[kept++] = m[i];
+    }
+    return kept;
+}
+
+static int full_search(MatchLevel* l, TemplateLevel* t, MatchParams* mp, int k, Match** out) {
+    // every position of the level, local maxima as candidates
+    int ow = l->width - t->width + 1, oh = l->height - t->height + 1;
+    float* map = (float*)malloc(sizeof(float) * ow * oh);
+    if (!map) return -1;
+    int ok = mp->used_fft ? corr_fft(l, t, mp->threads, map) : corr_direct(l, t, mp->threads, map);
+    if (!ok) {
+        free(map);
+        return -1;
+    }
+    for (int v = 0; v < oh; v++) {
+        for (int u = 0; u < ow; u++) map[v * ow + u] = ncc_score(l, t, u, v, map[v * ow + u]);
+    }
+    int n = 0, cap = 64;
+    Match* m = (Match*)malloc(sizeof(Match) * cap);
+    for (int v = 0; m && v < oh; v++) {
+        for (int u = 0; u < ow; u++) {
+            float s = map[v * ow + u];
+            if (s < mp->min_score) continue;
+            int peak = 1;
+            for (int dv = -1; dv <= 1 && peak; dv++) {
+                for (int du = -1; du <= 1; du++) {
+                    int x = u + du, y = v + dv;
+                    if ((du || dv) && x >= 0 && y >= 0 && x < ow && y < oh && map[y * ow + x] > s) peak = 0;
+                }
+            }
+            if (!peak) continue;
+            if (n == cap) {
+                cap *= 2;
+                Match* grown = (Match*)realloc(m, sizeof(Match) * cap);
+                if (!grown) {
+                    free(m);
+                    m = NULL;
+                    break;
+                }
+                m = grown;
+            }
+            m[n++] = (Match){u, v, s};
+        }
+    }
+    free(map);
+    if (!m) return -1;
+    *out = m;
+    return keep_best(m, n, k, t->width, t->height);
+}
+
+static void refine(MatchLevel* l, TemplateLevel* t, Match* m) {
+    // best position within MATCHREFINE of the candidate scaled to this level
+    int ow = l->width - t->width + 1, oh = l->height - t->height + 1;
+    int cx = 2 * m->x, cy = 2 * m->y;
+    Match best = {cx < ow ? cx : ow - 1, cy < oh ? cy : oh - 1, -2};
+    for (int v = cy - MATCHREFINE; v <= cy + MATCHREFINE; v++) {
+        for (int u = cx - MATCHREFINE; u <= cx + MATCHREFINE; u++) {
+            if (u < 0 || v < 0 || u >= ow || v >= oh) continue;
+            float s = ncc_score(l, t, u, v, corr_at(l, t, u, v));
+            if (s > best.score) best = (Match){u, v, s};
+        }
+    }
+    *m = best;
+}
+
+int match_template(unsigned char* gray, int width, int height,
+                   unsigned char* tmpl, int tw, int th, MatchParams* mp, Match* matches) {
+    // returns the number of matches written (at most mp->k), -1 on failure
+    if (tw > width || th > height) return 0;
+    int levels = mp->levels;
+    if (levels < 0) {
+        levels = 0;
+        while (levels < MATCHMAXLEVELS && (tw >> (levels + 1)) >= MATCHMINSIZE && (th >> (levels + 1)) >= MATCHMINSIZE) {
+            levels++;
+        }
+    }
+    MatchLevel img[MATCHMAXLEVELS + 1] = {{0}};
+    TemplateLevel tl[MATCHMAXLEVELS + 1] = {{0}};
+    int ok = level_init(&img[0], gray, width, height) && template_init(&tl[0], tmpl, tw, th);
+    unsigned char* tpx = tmpl;
+    int built = 1;
+    for (int l = 1; ok && l <= levels && l <= MATCHMAXLEVELS; l++) {
+        int w = img[l - 1].width / 2, h = img[l - 1].height / 2;
+        int cw = tl[l - 1].width / 2, ch = tl[l - 1].height / 2;
+        if (cw < 1 || ch < 1 || cw > w || ch > h) break;
+        unsigned char* px = downsample(img[l - 1].px, img[l - 1].width, img[l - 1].height);
+        unsigned char* next = downsample(tpx, tl[l - 1].width, tl[l - 1].height);
+        ok = px && next && level_init(&img[l], px, w, h) && template_init(&tl[l], next, cw, ch);
+        if (tpx != tmpl) free(tpx);
+        tpx = next;
+        if (!ok) {
+            // the level's own image has to be freed with the rest
+            if (px && !img[l].px) free(px);
+            break;
+        }
+        // a template smoothed flat scores 0 everywhere, the search starts on the level above
+        if (tl[l].norm < 1e-6) break;
+        built++;
+    }
+    if (tpx != tmpl) free(tpx);
+    int top = built - 1, n = -1;
+    mp->used_levels = top;
+    // NCC is undefined for a flat template: every position would be a peak scoring 0
+    if (ok && tl[0].norm < 1e-6) n = 0;
+    if (ok && n < 0) {
+        TemplateLevel* t = &tl[top];
+        mp->used_fft = mp->fft_mode == 'y'
+            || (mp->fft_mode == 'a' && fft_preferred(t->width, t->height, img[top].width, img[top].height));
+        // more candidates than asked for on coarse levels, some lose out while refined
+        int k = top > 0 ? (4 * mp->k > 16 ? 4 * mp->k : 16) : mp->k;
+        Match* cands = NULL;
+        n = full_search(&img[top], t, mp, k, &cands);
+        for (int l = top - 1; n > 0 && l >= 0; l--) {
+            for (int i = 0; i < n; i++) refine(&img[l], &tl[l], &cands[i]);
+            n = keep_best(cands, n, l > 0 ? k : mp->k, tl[l].width, tl[l].height);
+        }
+        for (int i = 0; i < n; i++) matches[i] = cands[i];
+        free(cands);
+    }
+    for (int l = 0; l <= MATCHMAXLEVELS; l++) {
+        if (l > 0) free(img[l].px);
+        free(img[l].sum);
+        free(img[l].sq);
+        free(tl[l].zero_mean);
+    }
+    return n;
+}
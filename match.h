@@ -0,0 +1,36 @@
+/*
+Normalized cross-correlation template matching on grayscale images.
+The window means and variances come from integral images, so only the correlation with the
+zero-mean template is computed per position: directly with SIMD for small templates, through
+fft.c for large ones. Searches start on a coarse level of a 2x pyramid and are refined level by
+level around the best candidates; the best k non-overlapping matches are returned. A flat template
+(zero variance) correlates with nothing and has no matches.
+*/
+
+#ifndef MATCH_H
+#define MATCH_H
+
+#define MATCHMINSIZE 8      // smallest template side on the coarsest level
+#define MATCHMAXLEVELS 4
+#define MATCHREFINE 2       // search radius around a candidate on the next finer level
+
+typedef struct {
+    int x, y;               // top-left corner of the template in the image
+    float score;            // -1..1
+} Match;
+
+typedef struct {
+    int k;                  // matches to return
+    int levels;             // pyramid levels above full resolution, -1 picks them from the template size
+    char fft_mode;          // 'a' auto, 'y' on, 'n' off
+    int threads;
+    double min_score;
+    // filled by match_template
+    int used_levels;
+    int used_fft;
+} MatchParams;
+
+int match_template(unsigned char* gray, int width, int height,
+                   unsigned char* tmpl, int tw, int th, MatchParams* mp, Match* matches);
+
+#endif
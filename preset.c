@@ -0,0 +1,131 @@
+/*
+Deadline planner, see preset.h.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "preset.h"
+
+static char const * preset_names[PRESET_COUNT] = {"exact", "balanced", "fast"};
+static int const preset_rungs[PRESET_COUNT] = {0, 1, 3};
+static double const rung_fraction[PLANRUNGS] = {1, 0.5, 0.25, 0.25, 0.25};
+static double const rung_mass[PLANRUNGS] = {1, 0.99, 0.95, 0.95, 0.95};
+static int const rung_scale[PLANRUNGS] = {1, 1, 1, 2, 4};
+
+void kernel_crop_size(double* kernel, int kw, int kh, double mass, int* cw, int* ch) {
+    // smallest centered window (odd sides, growing together) with mass of the absolute weight
+    double total = 0;
+    for (int i = 0; i < kw * kh; i++) total += fabs(kernel[i]);
+    *cw = kw;
+    *ch = kh;
+    if (mass >= 1 || total == 0 || kw % 2 == 0 || kh % 2 == 0) return;
+    for (int r = 0; 2 * r + 1 < (kw > kh ? kw : kh); r++) {
+        int rx = r < kw / 2 ? r : kw / 2, ry = r < kh / 2 ? r : kh / 2;
+        double kept = 0;
+        for (int j = kh / 2 - ry; j <= kh / 2 + ry; j++) {
+            for (int i = kw / 2 - rx; i <= kw / 2 + rx; i++) kept += fabs(kernel[j * kw + i]);
+        }
+        if (kept >= mass * total) {
+            *cw = 2 * rx + 1;
+            *ch = 2 * ry + 1;
+            return;
+        }
+    }
+}
+
+void kernel_crop(double* kernel, int kw, int kh, int cw, int ch) {
+    // in place to the centered cw x ch window with the sum of the whole kernel: low-pass kernels are
+    // rescaled to keep their gain, zero-sum ones (derivatives, high-pass) get the dropped sum spread
+    // evenly, rescaling them would zero every weight
+    double sum = 0, total = 0, kept = 0;
+    int x0 = (kw - cw) / 2, y0 = (kh - ch) / 2;
+    for (int i = 0; i < kw * kh; i++) {
+        sum += kernel[i];
+        total += fabs(kernel[i]);
+    }
+    for (int j = 0; j < ch; j++) {
+        for (int i = 0; i < cw; i++) {
+            kernel[j * cw + i] = kernel[(y0 + j) * kw + x0 + i];
+            kept += kernel[j * cw + i];
+        }
+    }
+    if (fabs(sum) > 1e-6 * total && fabs(kept) > 1e-6 * total) {
+        for (int i = 0; i < cw * ch; i++) kernel[i] *= sum / kept;
+    } else {
+        for (int i = 0; i < cw * ch; i++) kernel[i] += (sum - kept) / (cw * ch);
+    }
+}
+
+void plan_init(Plan* p, double* kernel, int kw, int kh, int can_scale) {
+    memset(p, 0, sizeof(Plan));
+    p->kernel = kernel;
+    p->kw = kw;
+    p->kh = kh;
+    p->can_scale = can_scale;
+    plan_rung(p, 0);
+}
+
+void plan_rung(Plan* p, int rung) {
+    p->rung = rung;
+    p->fraction = rung_fraction[rung];
+    p->mass = p->kernel ? rung_mass[rung] : 1;
+    p->cw = p->kw;
+    p->ch = p->kh;
+    if (p->kernel) kernel_crop_size(p->kernel, p->kw, p->kh, p->mass, &p->cw, &p->ch);
+    p->scale = p->can_scale ? rung_scale[rung] : 1;
+}
+
+double plan_estimate(Plan* p, int width, int height, PipelineCosts const * c) {
+    double pixel = c && c->pixel_ns > 0 ? c->pixel_ns : PIXELNS, tap = c && c->tap_ns > 0 ? c->tap_ns : TAPNS;
+    double n = (double)width * height;
+    // the sampled histograms count fraction^2 of the pixels
+    double ns = pixel * (1 - HISTSHARE * (1 - p->fraction * p->fraction));
+    if (p->kernel) ns += tap * p->cw * p->ch;
+    ns /= (double)p->scale * p->scale;
+    if (p->scale > 1) ns += c && c->rescale_ns > 0 ? c->rescale_ns : pixel * RESCALESHARE;
+    return p->estimate_ms = n * ns * 1e-6;
+}
+
+int plan_deadline(Plan* p, Preset preset, double deadline_ms, int width, int height, PipelineCosts const * c) {
+    // the first rung from the preset's up that fits, the last one when none does; 1 when it fits
+    for (int rung = preset_rungs[preset]; rung < PLANRUNGS; rung++) {
+        plan_rung(p, rung);
+        if (plan_estimate(p, width, height, c) <= deadline_ms || deadline_ms <= 0) return 1;
+    }
+    return 0;
+}
+
+void plan_report(Plan* p, Preset preset, double deadline_ms) {
+    char deadline[64] = "";
+    if (deadline_ms > 0) snprintf(deadline, sizeof(deadline), ", deadline %.1f ms", deadline_ms);
+    printf("Plan (%s%s): ", preset_names[preset], deadline);
+    int any = 0;
+    if (p->fraction < 1) {
+        printf("histograms sampled from 1/%d of the rows and columns", (int)round(1 / p->fraction));
+        any = 1;
+    }
+    if (p->cw != p->kw || p->ch != p->kh) {
+        printf("%skernel %dx%d cropped to %dx%d (%.0f%% of its weight)", any ? ", " : "", p->kw, p->kh, p->cw,
+            p->ch, p->mass * 100);
+        any = 1;
+    }
+    if (p->scale > 1) {
+        printf("%sfiltered at 1/%d of the size", any ? ", " : "", p->scale);
+        any = 1;
+    }
+    printf("%s, estimate %.2f ms%s.\n", any ? "" : "no approximations", p->estimate_ms,
+        deadline_ms > 0 && p->estimate_ms > deadline_ms ? ", over the deadline" : "");
+}
+
+Preset parse_preset(char const * name) {
+    for (int i = 0; i < PRESET_COUNT; i++) {
+        if (strcmp(name, preset_names[i]) == 0) return (Preset)i;
+    }
+    return PRESET_COUNT;
+}
+
+char const * preset_name(Preset p) {
+    if (p < 0 || p >= PRESET_COUNT) return "unknown";
+    return preset_names[p];
+}
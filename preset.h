@@ -0,0 +1,60 @@
+/*
+Quality/speed presets and processing deadlines. The planner estimates the processing time of an
+image from per-pixel costs (measured by zad1 --autotune, see tune.h, built-in otherwise) and climbs
+a ladder of approximations, from the preset's rung up, until the estimate fits the deadline:
+  0 exact
+  1 histograms from 1/2 of the rows and columns, kernels cropped to 99% of their weight
+  2 histograms from 1/4 of them, kernels cropped to 95%
+  3 the default pipeline filtered at 1/2 of the size and upscaled before the threshold
+  4 the same at 1/4
+exact starts at 0, balanced at 1 and fast at 3. Rungs the pipeline cannot take (a cropped kernel
+without --kernel, the reduced scale outside the default pipeline) cost nothing and change nothing.
+*/
+
+#ifndef PRESET_H
+#define PRESET_H
+
+#define PLANRUNGS 5
+#define PIXELNS 20.0        // default pipeline per pixel, unoptimized build
+#define TAPNS 3.0           // one direct filter tap per pixel
+#define HISTSHARE 0.2       // of PIXELNS spent on the two histograms
+#define RESCALESHARE 0.5    // of PIXELNS for the downscale, upscale and threshold at full size
+
+typedef enum {
+    PRESET_EXACT,
+    PRESET_BALANCED,
+    PRESET_FAST,
+    PRESET_COUNT
+} Preset;
+
+typedef struct {
+    double pixel_ns;        // default pipeline per pixel, 0: PIXELNS
+    double tap_ns;          // direct filter tap per pixel, 0: TAPNS
+    double rescale_ns;      // downscale, upscale and threshold per full-size pixel, 0: from RESCALESHARE
+} PipelineCosts;
+
+typedef struct {
+    // what the pipeline allows
+    double* kernel;         // direct filter kernel that may be cropped, NULL without
+    int kw, kh;
+    int can_scale;
+    // the plan
+    int rung;
+    double fraction;        // histogram sample, 1 is exact
+    double mass;            // of the kernel's absolute weight kept
+    int cw, ch;             // cropped kernel size
+    int scale;
+    double estimate_ms;
+} Plan;
+
+void plan_init(Plan* p, double* kernel, int kw, int kh, int can_scale);
+void plan_rung(Plan* p, int rung);
+double plan_estimate(Plan* p, int width, int height, PipelineCosts const * c);
+int plan_deadline(Plan* p, Preset preset, double deadline_ms, int width, int height, PipelineCosts const * c);
+void plan_report(Plan* p, Preset preset, double deadline_ms);
+void kernel_crop_size(double* kernel, int kw, int kh, double mass, int* cw, int* ch);
+void kernel_crop(double* kernel, int kw, int kh, int cw, int ch);
+Preset parse_preset(char const * name);
+char const * preset_name(Preset p);
+
+#endif
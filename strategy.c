@@ -0,0 +1,278 @@
+/*
+Size-dependent execution of the default pipeline, see strategy.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "strategy.h"
+#include "stream.h"
+#include "batch.h"
+#include "trace.h"
+
+static char const * strategy_names[STRATEGY_COUNT] = {"auto", "fused", "tiled", "stream", "whole"};
+static char const * phase_spans[3] = {"gray band", "tone and filter band", "threshold band"};
+
+typedef struct {
+    StrategyRun* r;
+    unsigned char* gray;
+    int first, last;            // rows first..last-1
+    int band;
+    int phase;                  // 0 gray, 1 LUT and filter, 2 threshold (after the upscale)
+    unsigned char* lut;
+    StrategyRun* src;           // phase 0 averages its scale x scale blocks, NULL reads r->rgb
+    StrategyRun* small;         // phase 2 upscales its output first, NULL thresholds r->out
+    int hist[MAXSIZE];          // of the band: input in phase 0, filtered in phase 1, unless sampled
+    int ok;
+} StrategyJob;
+
+long long strategy_small_pixels(StrategyLimits const * l) {
+    if (l && l->small_pixels > 0) return l->small_pixels;
+    long l2 = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return (l2 > 0 ? l2 : STRATEGYL2) / STRATEGYBYTES;
+}
+
+long long strategy_huge_pixels(StrategyLimits const * l) {
+    if (l && l->huge_pixels > 0) return l->huge_pixels;
+    long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page <= 0) return 1LL << 28;
+    return (long long)pages * page / STRATEGYMEMORY / STRATEGYBYTES;
+}
+
+Strategy strategy_pick(int width, int height, int threads, StrategyLimits const * l) {
+    long long n = (long long)width * height;
+    if (n >= strategy_huge_pixels(l)) return STRATEGY_STREAM;
+    if (n <= strategy_small_pixels(l) || threads < 2) return STRATEGY_FUSED;
+    return STRATEGY_TILED;
+}
+
+static void lut_row(StrategyJob* job, int y, unsigned char* dst) {
+    int w = job->r->width;
+    unsigned char* src = &job->gray[(size_t)y * w];
+    for (int i = 0; i < w; i++) dst[i] = job->lut[src[i]];
+}
+
+static inline void fold_blocks(unsigned short* sums, int width, int rows, int scale, int w, unsigned char* rgb) {
+    // block averages of the summed rows with 16-bit reciprocals, the last block cut by the edge
+    unsigned int inv = (65536 + rows * scale / 2) / (rows * scale);
+    int full = width / scale;
+    for (int bx = 0; bx < full; bx++) {
+        unsigned int r = 0, g = 0, b = 0;
+        for (int i = bx * scale; i < (bx + 1) * scale; i++) {
+            r += sums[i * 3];
+            g += sums[i * 3 + 1];
+            b += sums[i * 3 + 2];
+        }
+        rgb[bx * 3] = (r * inv + 32768) >> 16;
+        rgb[bx * 3 + 1] = (g * inv + 32768) >> 16;
+        rgb[bx * 3 + 2] = (b * inv + 32768) >> 16;
+    }
+    if (full < w) {
+        int n = rows * (width - full * scale);
+        unsigned int c[3] = {0, 0, 0};
+        for (int i = full * scale; i < width; i++) {
+            for (int k = 0; k < 3; k++) c[k] += sums[i * 3 + k];
+        }
+        for (int k = 0; k < 3; k++) rgb[full * 3 + k] = (c[k] + n / 2) / n;
+    }
+}
+
+static void average_row(StrategyRun* src, int scale, int y, int w, unsigned short* sums, unsigned char* rgb,
+    unsigned char* dst) {
+    // gray row y of src shrunk by scale: the RGB rows are summed (one vectorizable add per row), then the
+    // blocks averaged and weighted; the common scales get their own copy of the block loop
+    int rows = (y + 1) * scale < src->height ? scale : src->height - y * scale, n = src->width * 3;
+    unsigned char* row = &src->rgb[(size_t)y * scale * n];
+    for (int i = 0; i < n; i++) sums[i] = row[i];
+    for (int jj = 1; jj < rows; jj++) {
+        row += n;
+        for (int i = 0; i < n; i++) sums[i] += row[i];
+    }
+    if (scale == 2) fold_blocks(sums, src->width, rows, 2, w, rgb);
+    else if (scale == 4) fold_blocks(sums, src->width, rows, 4, w, rgb);
+    else fold_blocks(sums, src->width, rows, scale, w, rgb);
+    stream_gray_row(STREAM_RGB, rgb, w, dst);
+}
+
+static void upscale_row(StrategyRun* small, int scale, int y, unsigned short* col, unsigned char* phase,
+    unsigned char* dst, int w, int t) {
+    // bilinear and thresholded at t, pixel centers aligned, 8 fractional bits; the vertical pass goes to
+    // col (one slot of padding on each side replicates the edges), then the columns of each phase p of
+    // the scale share x0 - k and fx, so every phase is a loop with fixed weights
+    int sy = (2 * y + 1) * 128 / scale - 128;
+    if (sy < 0) sy = 0;
+    int y0 = sy >> 8, fy = sy & 255, y1 = y0 + 1 < small->height ? y0 + 1 : y0, sw = small->width;
+    unsigned char* a = &small->out[(size_t)y0 * sw];
+    unsigned char* b = &small->out[(size_t)y1 * sw];
+    for (int i = 0; i < sw; i++) col[i + 1] = a[i] * (256 - fy) + b[i] * fy;
+    col[0] = col[1];
+    col[sw + 1] = col[sw];
+    for (int p = 0; p < scale; p++) {
+        int sx = (2 * p + 1) * 128 / scale - 128, off = (sx >> 8) + 1, fx = sx & 255;
+        unsigned short* c = &col[off];
+        int n = (w - p + scale - 1) / scale;
+        for (int k = 0; k < n; k++) {
+            unsigned int v = (c[k] * (256 - fx) + c[k + 1] * fx + 32768) >> 16;
+            phase[k] = v > (unsigned int)t ? MAXGRAY : 0;
+        }
+        for (int k = 0; k < n; k++) dst[k * scale + p] = phase[k];
+    }
+}
+
+static void band_sweep(StrategyJob* job) {
+    StrategyRun* r = job->r;
+    int w = r->width, h = r->height;
+    int count = sample_step(r->fraction) == 1;
+    memset(job->hist, 0, sizeof(job->hist));
+    job->ok = 1;
+    if (job->phase == 0) {
+        unsigned char* rgb = NULL;
+        unsigned short* sums = NULL;
+        if (job->src) {
+            rgb = (unsigned char*)malloc((size_t)w * 3);
+            sums = (unsigned short*)malloc((size_t)job->src->width * 3 * sizeof(unsigned short));
+            job->ok = rgb && sums;
+        }
+        for (int j = job->first; j < job->last && job->ok; j++) {
+            unsigned char* g = &job->gray[(size_t)j * w];
+            if (job->src) average_row(job->src, r->scale, j, w, sums, rgb, g);
+            else stream_gray_row(STREAM_RGB, &r->rgb[(size_t)j * w * 3], w, g);
+            for (int i = 0; i < w && count; i++) job->hist[g[i]]++;
+        }
+        free(rgb);
+        free(sums);
+    } else if (job->phase == 1) {
+        // ring of mapped rows, row y in slot y % 3, one row ahead of the filter
+        unsigned char* ring = (unsigned char*)malloc((size_t)3 * w);
+        job->ok = ring != NULL;
+        if (!job->ok) return;
+        for (int y = job->first > 0 ? job->first - 1 : 0; y <= job->first; y++) lut_row(job, y, &ring[(y % 3) * w]);
+        for (int j = job->first; j < job->last; j++) {
+            if (j + 1 < h) lut_row(job, j + 1, &ring[((j + 1) % 3) * w]);
+            int up = j > 0 ? j - 1 : 0, down = j + 1 < h ? j + 1 : j;
+            batch_gauss_row(&ring[(up % 3) * w], &ring[(j % 3) * w], &ring[(down % 3) * w], w,
+                &r->out[(size_t)j * w], count ? job->hist : NULL);
+        }
+        free(ring);
+    } else if (job->small) {
+        unsigned short* col = (unsigned short*)malloc((job->small->width + 2) * sizeof(unsigned short));
+        unsigned char* phase = (unsigned char*)malloc(job->small->width + 1);
+        job->ok = col && phase;
+        for (int j = job->first; j < job->last && job->ok; j++) {
+            upscale_row(job->small, r->scale, j, col, phase, &r->out[(size_t)j * w], w, r->used_treshold);
+        }
+        free(col);
+        free(phase);
+    } else {
+        unsigned char* out = &r->out[(size_t)job->first * w];
+        size_t n = (size_t)(job->last - job->first) * w;
+        for (size_t i = 0; i < n; i++) out[i] = out[i] > r->used_treshold ? MAXGRAY : 0;
+    }
+}
+
+static void* strategy_band(void* arg) {
+    StrategyJob* job = (StrategyJob*)arg;
+    trace_begin(phase_spans[job->phase], job->band);
+    band_sweep(job);
+    trace_end(phase_spans[job->phase], job->band);
+    return NULL;
+}
+
+static int run_phase(StrategyRun* r, int threads, int phase, unsigned char* gray, unsigned char* lut,
+    StrategyRun* other, int* hist) {
+    // one sweep on bands of rows, hist gets the sum of the band histograms
+    if (threads > r->height) threads = r->height;
+    StrategyJob jobs[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (StrategyJob){
+            .r = r,
+            .gray = gray,
+            .first = (int)((long)r->height * t / threads),
+            .last = (int)((long)r->height * (t + 1) / threads),
+            .band = t,
+            .phase = phase,
+            .lut = lut,
+            .src = phase == 0 ? other : NULL,
+            .small = phase == 2 ? other : NULL,
+            .ok = 1
+        };
+        started[t] = t > 0 && pthread_create(&ids[t], NULL, strategy_band, &jobs[t]) == 0;
+        if (t > 0 && !started[t]) strategy_band(&jobs[t]);
+    }
+    strategy_band(&jobs[0]);
+    int ok = jobs[0].ok;
+    trace_begin("join", phase);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+        ok = ok && jobs[t].ok;
+    }
+    trace_end("join", phase);
+    memset(hist, 0, MAXSIZE * sizeof(int));
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < MAXSIZE; i++) hist[i] += jobs[t].hist[i];
+    }
+    return ok;
+}
+
+static int filter_pass(StrategyRun* r, StrategyRun* src, int threads, int* hist) {
+    // gray (averaged from src when given), tone LUT and filter into r->out; hist gets the filtered
+    // histogram, returns the pixels it counts (sampled with r->fraction) or 0 on failure
+    int size = r->width * r->height, n = size;
+    unsigned char* gray = (unsigned char*)malloc(size);
+    unsigned char lut[MAXSIZE];
+    int ok = gray && run_phase(r, threads, 0, gray, lut, src, hist);
+    if (ok && sample_step(r->fraction) > 1) n = gray_histogram(r->width, r->height, gray, r->fraction, hist);
+    if (ok) point_lut(n, hist, r->pp, lut);
+    ok = ok && run_phase(r, threads, 1, gray, lut, NULL, hist);
+    if (ok && sample_step(r->fraction) > 1) n = gray_histogram_quiet(r->width, r->height, r->out, r->fraction, hist);
+    free(gray);
+    return ok ? n : 0;
+}
+
+int strategy_run(StrategyRun* r, int threads) {
+    // the default pipeline on r->rgb in threads bands of rows, 1 runs it fused on this thread;
+    // at 1/scale the small image is filtered and upscaled before the threshold; 0 on failure
+    if (threads < 1) threads = 1;
+    StrategyRun small = *r;
+    small.out = NULL;
+    if (r->scale > 1) {
+        small.width = (r->width + r->scale - 1) / r->scale;
+        small.height = (r->height + r->scale - 1) / r->scale;
+        small.out = (unsigned char*)malloc((size_t)small.width * small.height);
+        if (!small.out) return 0;
+    }
+    int hist[MAXSIZE];
+    int n = r->scale > 1 ? filter_pass(&small, r, threads, hist) : filter_pass(r, NULL, threads, hist);
+    if (n) {
+        r->used_method = r->method;
+        if (r->method == TH_OTSU) {
+            r->used_treshold = otsu_counts_treshold(n, hist);
+        } else {
+            HistStats st;
+            hist_stats(n, hist, &st);
+            if (r->method == TH_AUTO) r->used_method = auto_treshold_method(&st);
+            r->used_treshold = hist_treshold(&st, r->used_method);
+        }
+        n = run_phase(r, threads, 2, NULL, NULL, r->scale > 1 ? &small : NULL, hist);
+    }
+    free(small.out);
+    return n > 0;
+}
+
+Strategy parse_strategy(char const * name) {
+    for (int i = 0; i < STRATEGY_COUNT; i++) {
+        if (strcmp(name, strategy_names[i]) == 0) return (Strategy)i;
+    }
+    return STRATEGY_COUNT;
+}
+
+char const * strategy_name(Strategy s) {
+    if (s < 0 || s >= STRATEGY_COUNT) return "unknown";
+    return strategy_names[s];
+}
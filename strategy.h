@@ -0,0 +1,62 @@
+/*
+Execution strategy of zad1's default pipeline (gray, tone LUT, 3x3 gaussian, threshold) picked from
+the image size and the host. Threads and tiles only pay off on big images: for a sample.ppm-sized
+one, waking threads and splitting the work cost about as much as the whole pipeline. So:
+- fused: one thread and three sweeps over the frame: gray with its histogram, the tone LUT applied
+  on the fly to a ring of 3 rows in front of the filter (the filtered histogram on the way), then
+  the threshold. Both histograms are global, so the sweeps cannot be merged any further; what
+  this strategy saves is the threads, and it is picked while the frame (RGB in, gray, output:
+  5 bytes per pixel) stays in L2 between the sweeps,
+- tiled: the same sweeps on every thread over bands of rows, the per-band histograms merged
+  between them (the input one for the LUT, the filtered one for the threshold),
+- stream: stream.h row by row while the file is read, when the frame would take a good part of the
+  memory (only the gray rows are held for the threshold).
+The limits come from the L2 size and the physical memory unless set (tune.h small_pixels and
+huge_pixels). Output is byte-identical to the whole-image path whatever runs, sampled histograms
+included; the reduced scale of the deadline planner (preset.h) is the one approximation.
+*/
+
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include "histogram.h"
+
+#define STRATEGYBYTES 5             // working set per pixel
+#define STRATEGYL2 (256 * 1024)     // when the L2 size is not known
+#define STRATEGYMEMORY 4            // stream from 1/4 of the physical memory
+
+typedef enum {
+    STRATEGY_AUTO,
+    STRATEGY_FUSED,
+    STRATEGY_TILED,
+    STRATEGY_STREAM,
+    STRATEGY_WHOLE,                 // zad1's general whole-image path
+    STRATEGY_COUNT
+} Strategy;
+
+typedef struct {
+    long long small_pixels;         // fused up to this many pixels, 0: from the L2 size
+    long long huge_pixels;          // streamed from this many, 0: from the memory
+} StrategyLimits;
+
+typedef struct {
+    int width, height;
+    unsigned char* rgb;             // width * height pixels in
+    unsigned char* out;             // width * height thresholded pixels out
+    PointParams* pp;                // filled as by point_lut
+    TresholdMethod method;
+    double fraction;                // of the rows and columns the histograms sample, as --sample
+    int scale;                      // 1, or filter at 1/scale and upscale bilinearly before the threshold
+    // filled by strategy_run
+    int used_treshold;
+    TresholdMethod used_method;
+} StrategyRun;
+
+long long strategy_small_pixels(StrategyLimits const * l);
+long long strategy_huge_pixels(StrategyLimits const * l);
+Strategy strategy_pick(int width, int height, int threads, StrategyLimits const * l);
+int strategy_run(StrategyRun* r, int threads);
+Strategy parse_strategy(char const * name);
+char const * strategy_name(Strategy s);
+
+#endif
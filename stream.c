@@ -0,0 +1,251 @@
+/*
+Push-style streaming pipeline, see stream.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+
+enum {
+    PHASE_COLLECT,          // input rows held until the input histogram is complete
+    PHASE_MEASURE,          // held rows replayed through the filter for the filtered histogram
+    PHASE_HOLD,             // filtered rows held until the filtered histogram is complete
+    PHASE_EMIT              // rows go all the way to the callback
+};
+
+static void window_init(RowWindow* w, int lo, int hi) {
+    w->lo = lo;
+    w->hi = hi;
+    w->rows = hi - lo + 1;
+    w->ring = NULL;
+    w->in = w->out = 0;
+}
+
+static void filter_row(Stream* s, unsigned char** rows, unsigned char* out) {
+    // convolve_3x3 for one row: same multiply-add order, columns clamped only at the two edges
+    double* k = s->sp.kernel;
+    int width = s->width;
+    for (int i = 0; i < width; i++) {
+        double acc = 0;
+        if (i > 0 && i < width - 1) {
+            for (int jj = 0; jj < 3; jj++) {
+                for (int ii = 0; ii < 3; ii++) acc += k[jj * 3 + ii] * rows[jj][i + ii - 1];
+            }
+        } else {
+            for (int jj = 0; jj < 3; jj++) {
+                for (int ii = 0; ii < 3; ii++) {
+                    int ni = i + ii - 1;
+                    ni = ni < 0 ? 0 : ni >= width ? width - 1 : ni;
+                    acc += k[jj * 3 + ii] * rows[jj][ni];
+                }
+            }
+        }
+        out[i] = acc > MAXGRAY ? MAXGRAY : acc < 0 ? 0 : (unsigned char)acc;
+    }
+}
+
+static void morph_row(Stream* s, unsigned char** rows, unsigned char* out) {
+    // minimum (erosion) or maximum (dilation) over the window rows, then along the row with the
+    // columns clamped, zad6's windows for even sizes included
+    int width = s->width, n = s->morph.rows, lo = s->morph.lo, hi = s->morph.hi;
+    int erode = s->sp.morph == 'e';
+    unsigned char* v = s->row;
+    memcpy(v, rows[0], width);
+    for (int k = 1; k < n; k++) {
+        for (int i = 0; i < width; i++) {
+            unsigned char x = rows[k][i];
+            if (erode ? x < v[i] : x > v[i]) v[i] = x;
+        }
+    }
+    for (int i = 0; i < width; i++) {
+        int a = i + lo < 0 ? 0 : i + lo, b = i + hi >= width ? width - 1 : i + hi;
+        unsigned char m = v[a];
+        for (int c = a + 1; c <= b; c++) {
+            if (erode ? v[c] < m : v[c] > m) m = v[c];
+        }
+        out[i] = m;
+    }
+}
+
+static void after_filter(Stream* s, int y, unsigned char* row);
+
+static void window_emit(Stream* s, RowWindow* w) {
+    int y = w->out++;
+    for (int k = 0; k < w->rows; k++) {
+        int r = y + w->lo + k;
+        r = r < 0 ? 0 : r >= s->height ? s->height - 1 : r;
+        s->window[k] = &w->ring[(size_t)(r % w->rows) * s->width];
+    }
+    if (w == &s->filter) {
+        // the filter output goes on in its own buffer, morph_row uses s->row
+        unsigned char* out = &w->ring[(size_t)w->rows * s->width];
+        filter_row(s, s->window, out);
+        after_filter(s, y, out);
+    } else {
+        morph_row(s, s->window, s->out);
+        s->emit(s->user, y, s->out, s->width);
+    }
+}
+
+static void window_push(Stream* s, RowWindow* w, unsigned char const * row) {
+    // output rows are produced as soon as their last input row (clamped to the image) is in
+    memcpy(&w->ring[(size_t)(w->in % w->rows) * s->width], row, s->width);
+    w->in++;
+    while (w->out < s->height && (w->out + w->hi < s->height ? w->out + w->hi : s->height - 1) < w->in) {
+        window_emit(s, w);
+    }
+}
+
+static void window_reset(RowWindow* w) {
+    w->in = w->out = 0;
+}
+
+static void after_filter(Stream* s, int y, unsigned char* row) {
+    if (s->phase == PHASE_MEASURE || s->phase == PHASE_HOLD) {
+        for (int i = 0; i < s->width; i++) s->fhist[row[i]]++;
+        if (s->phase == PHASE_HOLD) memcpy(&s->frame[(size_t)y * s->width], row, s->width);
+        return;
+    }
+    if (s->sp.treshold != STREAMNONE) {
+        unsigned char t = s->used_treshold;
+        for (int i = 0; i < s->width; i++) s->out[i] = row[i] > t ? MAXGRAY : 0;
+        row = s->out;
+    }
+    if (s->sp.morph) window_push(s, &s->morph, row);
+    else s->emit(s->user, y, row, s->width);
+}
+
+static void tone_row(Stream* s, unsigned char const * gray) {
+    // tone LUT, then the filter when there is one
+    unsigned char* row = s->out;
+    for (int i = 0; i < s->width; i++) row[i] = s->lut[gray[i]];
+    if (s->sp.kernel) window_push(s, &s->filter, row);
+    else after_filter(s, s->filter.in++, row);
+}
+
+int stream_alloc(Stream* s, int width, int height, StreamParams* sp, StreamEmit emit, void* user) {
+    memset(s, 0, sizeof(Stream));
+    s->width = width;
+    s->height = height;
+    s->sp = *sp;
+    s->emit = emit;
+    s->user = user;
+    if (sp->morph && sp->ksize < 1) return 0;
+    window_init(&s->filter, -1, 1);
+    int k = sp->morph ? sp->ksize : 1;
+    if (sp->morph == 'e') window_init(&s->morph, -(k / 2), k - 1 - k / 2);
+    else window_init(&s->morph, -(k - 1 - k / 2), k / 2);
+
+    int hold = !sp->hist || sp->treshold == STREAMAUTO;
+    s->row = (unsigned char*)malloc(width);
+    s->out = (unsigned char*)malloc(width);
+    s->window = (unsigned char**)malloc((k > 3 ? k : 3) * sizeof(unsigned char*));
+    // the filter ring has one more row for its output
+    s->filter.ring = sp->kernel ? (unsigned char*)malloc((size_t)(s->filter.rows + 1) * width) : NULL;
+    s->morph.ring = sp->morph ? (unsigned char*)malloc((size_t)s->morph.rows * width) : NULL;
+    s->frame = hold ? (unsigned char*)malloc((size_t)width * height) : NULL;
+    if (!s->row || !s->out || !s->window || (sp->kernel && !s->filter.ring) || (sp->morph && !s->morph.ring)
+        || (hold && !s->frame)) {
+        stream_free(s);
+        return 0;
+    }
+
+    s->used_treshold = sp->treshold;
+    s->used_method = sp->method;
+    if (sp->hist) {
+        int n = 0;
+        for (int i = 0; i < MAXSIZE; i++) n += sp->hist[i];
+        point_lut(n, sp->hist, &s->sp.pp, s->lut);
+        s->phase = sp->treshold == STREAMAUTO ? PHASE_HOLD : PHASE_EMIT;
+    } else {
+        s->phase = PHASE_COLLECT;
+    }
+    return 1;
+}
+
+void stream_free(Stream* s) {
+    free(s->row);
+    free(s->out);
+    free(s->window);
+    free(s->filter.ring);
+    free(s->morph.ring);
+    free(s->frame);
+    s->row = s->out = s->filter.ring = s->morph.ring = s->frame = NULL;
+    s->window = NULL;
+}
+
+int stream_latency(Stream* s) {
+    // rows pushed after row y before row y is emitted, -1 when rows wait for stream_finish
+    if (s->frame) return -1;
+    return (s->sp.kernel ? s->filter.hi : 0) + (s->sp.morph ? s->morph.hi : 0);
+}
+
+void stream_gray_row(StreamFormat format, unsigned char const * src, int n, unsigned char* gray) {
+    // n input pixels to gray, RGB with the weights (and truncation) of ppm_to_pgm_weighted
+    if (format == STREAM_GRAY) {
+        memcpy(gray, src, n);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        double v = 0.299 * src[3 * i] + 0.587 * src[3 * i + 1] + 0.114 * src[3 * i + 2];
+        gray[i] = v > MAXGRAY ? MAXGRAY : (unsigned char)v;
+    }
+}
+
+int stream_push(Stream* s, unsigned char const * data, int rows, int stride) {
+    // rows input rows stride bytes apart; 0 past the last row of the image
+    if (s->pushed + rows > s->height) return 0;
+    for (int r = 0; r < rows; r++, s->pushed++) {
+        unsigned char const * src = &data[(size_t)r * stride];
+        unsigned char* gray = s->phase == PHASE_COLLECT ? &s->frame[(size_t)s->pushed * s->width] : s->row;
+        stream_gray_row(s->sp.format, src, s->width, gray);
+        if (s->phase == PHASE_COLLECT) {
+            for (int i = 0; i < s->width; i++) s->hist[gray[i]]++;
+        } else {
+            tone_row(s, gray);
+        }
+    }
+    return 1;
+}
+
+static void flush(Stream* s, RowWindow* w) {
+    while (w->out < s->height) window_emit(s, w);
+}
+
+static void replay_tone(Stream* s) {
+    // held input rows through the tone LUT and the filter
+    window_reset(&s->filter);
+    for (int j = 0; j < s->height; j++) tone_row(s, &s->frame[(size_t)j * s->width]);
+    if (s->sp.kernel) flush(s, &s->filter);
+}
+
+static void pick_treshold(Stream* s) {
+    HistStats st;
+    hist_stats(s->width * s->height, s->fhist, &st);
+    if (s->used_method == TH_AUTO) s->used_method = auto_treshold_method(&st);
+    s->used_treshold = hist_treshold(&st, s->used_method);
+}
+
+int stream_finish(Stream* s) {
+    // emits every row that is still waiting; 0 when rows are missing
+    if (s->pushed != s->height) return 0;
+    if (s->phase == PHASE_COLLECT) {
+        point_lut(s->width * s->height, s->hist, &s->sp.pp, s->lut);
+        if (s->sp.treshold == STREAMAUTO) {
+            s->phase = PHASE_MEASURE;
+            replay_tone(s);
+            pick_treshold(s);
+        }
+        s->phase = PHASE_EMIT;
+        replay_tone(s);
+    } else if (s->phase == PHASE_HOLD) {
+        if (s->sp.kernel) flush(s, &s->filter);
+        pick_treshold(s);
+        s->phase = PHASE_EMIT;
+        for (int j = 0; j < s->height; j++) after_filter(s, j, &s->frame[(size_t)j * s->width]);
+    } else if (s->sp.kernel) {
+        flush(s, &s->filter);
+    }
+    if (s->sp.morph) flush(s, &s->morph);
+    return 1;
+}
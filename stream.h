@@ -0,0 +1,73 @@
+/*
+Push-style streaming pipeline for embedding zad1/zad6 processing without temp files.
+The caller pushes input rows (RGB or gray, any stride) as they are decoded and receives every output
+row through a callback as soon as it is final. Stages: the tone LUT (equalization, matching or levels,
+then gamma), an optional 3x3 filter (1 row of latency), the threshold and an optional erosion or
+dilation of the white pixels (ksize/2 rows). Row windows are rings of just the rows they need.
+The tone LUT needs the input histogram and an automatic threshold the filtered one: when either is
+not known in advance, the rows before it are held (gray, one byte per pixel) until stream_finish
+and replayed from there; recomputing the 3x3 filter is cheaper than storing its output.
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "histogram.h"
+
+#define STREAMAUTO -1       // threshold picked with the method from the filtered histogram
+#define STREAMNONE -2       // no threshold, gray output
+
+typedef enum {
+    STREAM_GRAY,
+    STREAM_RGB              // converted with the zad1/zad6 weights
+} StreamFormat;
+
+typedef struct {
+    StreamFormat format;
+    PointParams pp;         // tone curve from the input histogram
+    int* hist;              // input histogram known in advance (e.g. a previous page), NULL collects it
+    double* kernel;         // 3x3 weights, NULL for no filter
+    TresholdMethod method;
+    int treshold;           // 0..255 (pixels above are white), STREAMAUTO or STREAMNONE
+    char morph;             // 0, 'e' erosion or 'd' dilation with zad6's windows (the whole window, zad6's
+                            // raster-order dilation keeps only the part at or after each pixel)
+    int ksize;
+} StreamParams;
+
+typedef void (*StreamEmit)(void* user, int y, unsigned char const * row, int width);
+
+typedef struct {
+    int lo, hi;             // input rows y + lo .. y + hi make output row y
+    int rows;               // ring size, hi - lo + 1
+    unsigned char* ring;
+    int in, out;            // rows received and produced
+} RowWindow;
+
+typedef struct {
+    int width, height;
+    StreamParams sp;
+    StreamEmit emit;
+    void* user;
+    int phase;
+    int pushed;
+    unsigned char lut[MAXSIZE];
+    int hist[MAXSIZE];
+    int fhist[MAXSIZE];     // after the filter, for STREAMAUTO
+    unsigned char* frame;   // held rows, NULL when everything streams
+    unsigned char* row;     // scratch rows
+    unsigned char* out;
+    unsigned char** window; // row pointers of the current window
+    RowWindow filter, morph;
+    // filled by stream_finish
+    int used_treshold;
+    TresholdMethod used_method;
+} Stream;
+
+int stream_alloc(Stream* s, int width, int height, StreamParams* sp, StreamEmit emit, void* user);
+void stream_free(Stream* s);
+int stream_latency(Stream* s);
+int stream_push(Stream* s, unsigned char const * data, int rows, int stride);
+int stream_finish(Stream* s);
+void stream_gray_row(StreamFormat format, unsigned char const * src, int n, unsigned char* gray);
+
+#endif
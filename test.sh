@@ -4,4 +4,5 @@ make zad6
 ./zad6 d 1 sample.ppm test_d1.pbm
 ./zad6 d 2 sample.ppm test_d2.pbm
 ./zad6 e 1 sample.ppm test_e1.pbm
-./zad6 e 2 sample.ppm test_e2.pbm
\ No newline at end of file
+./zad6 e 2 sample.ppm test_e2.pbm
+./zad6 o 3 sample.ppm test_o3.pbm
\ No newline at end of file
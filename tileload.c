@@ -0,0 +1,298 @@
+/*
+This program is the load-test client of tileserver: every thread keeps one connection open and asks
+for tiles one after another, then the throughput and the latency percentiles are printed, followed by
+the server's /metrics.
+Can be compiled with the makefile provided (make tileload).
+Used from cmd, all args optional:
+    --port=N        TCP port of the server on 127.0.0.1 (default 8080).
+    --unix=PATH     connect to this Unix socket instead.
+    --threads=N     concurrent connections (default 4).
+    --requests=N    tiles asked for on every connection (default 200).
+    --level=Z       only tiles of level Z (default: every level, each as likely).
+    --pattern=P     random (default) tiles, or pan: every connection sweeps the level row by row from its own
+                    starting tile, so neighbours are asked for next (what the prefetching helps with).
+    --format=F      pgm (default) or png.
+    --seed=S        random tiles seed (default 1).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BUFSIZE 256
+#define PORT 8080
+#define MAXLEVELS 32
+#define MAXHEADER 4096
+
+typedef struct {
+    int port;
+    char const * unix_path;
+    int width, height, tile, levels;
+    int level_w[MAXLEVELS], level_h[MAXLEVELS];
+} Target;
+
+typedef struct {
+    Target* t;
+    int id;
+    int requests;
+    int level;                  // -1 for every level
+    char pattern;               // 'r' random, 'p' pan
+    char const * format;
+    unsigned int seed;
+    double* latency;            // ms, one per request
+    int done, errors;
+    long long bytes;
+} Client;
+
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static int connect_to(Target* t) {
+    int fd;
+    if (t->unix_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, t->unix_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(t->port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static long long get(int fd, char const * path, char* body, int size) {
+    // one keep-alive request; the body (up to size - 1 bytes of it, 0 ended) into body when it is not NULL;
+    // the body length, -1 when the connection failed or the status is not 200
+    char req[BUFSIZE * 2];
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    for (int sent = 0; sent < n;) {
+        ssize_t k = send(fd, req + sent, n - sent, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        sent += k;
+    }
+    char head[MAXHEADER + 1];
+    int used = 0;
+    char* end = NULL;
+    while (!end) {
+        if (used == MAXHEADER) return -1;
+        ssize_t k = recv(fd, head + used, MAXHEADER - used, 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        used += k;
+        head[used] = 0;
+        end = strstr(head, "\r\n\r\n");
+    }
+    int status;
+    char* length = strstr(head, "Content-Length:");
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1 || !length || length > end) return -1;
+    long long total = atoll(length + 15), got = used - (end + 4 - head);
+    if (got > total) return -1;     // the server does not send before it is asked
+    if (body && size > 0) {
+        int k = got < size - 1 ? got : size - 1;
+        memcpy(body, end + 4, k);
+        body[k] = 0;
+    }
+    char buf[BUFSIZE * 64];
+    while (got < total) {
+        ssize_t k = recv(fd, buf, total - got < (long long)sizeof(buf) ? total - got : (long long)sizeof(buf), 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        if (body && got < size - 1) {
+            int c = got + k < size - 1 ? k : size - 1 - got;
+            memcpy(body + got, buf, c);
+            body[got + c] = 0;
+        }
+        got += k;
+    }
+    return status == 200 ? total : -1;
+}
+
+static int tile_count(int n, int tile) {
+    return (n + tile - 1) / tile;
+}
+
+static void* client_thread(void* arg) {
+    Client* c = (Client*)arg;
+    Target* t = c->t;
+    int fd = connect_to(t);
+    int pos = -1;
+    for (int i = 0; i < c->requests; i++) {
+        int z = c->level >= 0 ? c->level : rand_r(&c->seed) % t->levels;
+        int cols = tile_count(t->level_w[z], t->tile), rows = tile_count(t->level_h[z], t->tile);
+        int x, y;
+        if (c->pattern == 'p') {
+            // row by row from a tile of its own
+            if (pos < 0) pos = rand_r(&c->seed) % (cols * rows);
+            else pos = (pos + 1) % (cols * rows);
+            x = pos % cols;
+            y = pos / cols;
+        } else {
+            x = rand_r(&c->seed) % cols;
+            y = rand_r(&c->seed) % rows;
+        }
+        char path[BUFSIZE];
+        snprintf(path, sizeof(path), "/tile/%d/%d/%d.%s", z, x, y, c->format);
+        double t0 = now_ms();
+        long long n = fd < 0 ? -1 : get(fd, path, NULL, 0);
+        if (n < 0) {
+            // a new connection for the next one
+            c->errors++;
+            if (fd >= 0) close(fd);
+            fd = connect_to(t);
+            continue;
+        }
+        c->latency[c->done++] = now_ms() - t0;
+        c->bytes += n;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static int compare_double(void const * a, void const * b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int read_info(Target* t) {
+    // the image and tile sizes from /info, the levels the way the server makes them
+    int fd = connect_to(t);
+    if (fd < 0) return 0;
+    char body[BUFSIZE];
+    int ok = get(fd, "/info", body, sizeof(body)) > 0
+        && sscanf(body, "width %d height %d tile %d levels %d", &t->width, &t->height, &t->tile, &t->levels) == 4
+        && t->levels >= 1 && t->levels <= MAXLEVELS && t->tile > 0;
+    close(fd);
+    if (!ok) return 0;
+    t->level_w[0] = t->width;
+    t->level_h[0] = t->height;
+    for (int z = 1; z < t->levels; z++) {
+        t->level_w[z] = (t->level_w[z - 1] + 1) / 2;
+        t->level_h[z] = (t->level_h[z - 1] + 1) / 2;
+    }
+    return 1;
+}
+
+int main(int argc, char const *argv[]) {
+    Target t = {PORT, NULL, 0, 0, 0, 0, {0}, {0}};
+    int threads = 4, requests = 200, level = -1;
+    unsigned int seed = 1;
+    char pattern = 'r';
+    char const * format = "pgm";
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--port=", 7) == 0) {
+            t.port = atoi(argv[a] + 7);
+        } else if (strncmp(argv[a], "--unix=", 7) == 0) {
+            t.unix_path = argv[a] + 7;
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            threads = atoi(argv[a] + 10);
+        } else if (strncmp(argv[a], "--requests=", 11) == 0) {
+            requests = atoi(argv[a] + 11);
+        } else if (strncmp(argv[a], "--level=", 8) == 0) {
+            level = atoi(argv[a] + 8);
+        } else if (strcmp(argv[a], "--pattern=random") == 0) {
+            pattern = 'r';
+        } else if (strcmp(argv[a], "--pattern=pan") == 0) {
+            pattern = 'p';
+        } else if (strcmp(argv[a], "--format=pgm") == 0 || strcmp(argv[a], "--format=png") == 0) {
+            format = argv[a] + 9;
+        } else if (strncmp(argv[a], "--seed=", 7) == 0) {
+            seed = strtoul(argv[a] + 7, NULL, 10);
+        } else {
+            printf("Unknown option %s.", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads < 1 || requests < 1) {
+        printf("Thread and request counts must be positive.");
+        exit(EXIT_FAILURE);
+    }
+    if (!read_info(&t)) {
+        printf("Could not get /info from the server.");
+        exit(EXIT_FAILURE);
+    }
+    if (level >= t.levels) {
+        printf("The server has levels 0..%d.", t.levels - 1);
+        exit(EXIT_FAILURE);
+    }
+
+    Client* clients = (Client*)calloc(threads, sizeof(Client));
+    pthread_t* ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    double* latency = (double*)malloc((size_t)threads * requests * sizeof(double));
+    int* started = (int*)calloc(threads, sizeof(int));
+    if (!clients || !ids || !latency || !started) {
+        printf("Out of memory.");
+        exit(EXIT_FAILURE);
+    }
+    double t0 = now_ms();
+    for (int i = 0; i < threads; i++) {
+        Client c = {&t, i, requests, level, pattern, format, seed + i * 7919u, &latency[(size_t)i * requests], 0, 0, 0};
+        clients[i] = c;
+    }
+    // thread 0 runs here, as does any thread that could not be started
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&ids[i], NULL, client_thread, &clients[i]) == 0;
+        if (!started[i]) client_thread(&clients[i]);
+    }
+    client_thread(&clients[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) pthread_join(ids[i], NULL);
+    }
+    double seconds = (now_ms() - t0) / 1e3;
+    free(started);
+
+    // the latencies of every connection together
+    int n = 0, errors = 0;
+    long long bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        memmove(&latency[n], clients[i].latency, clients[i].done * sizeof(double));
+        n += clients[i].done;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    qsort(latency, n, sizeof(double), compare_double);
+    printf("Image %dx%d, %d levels of %d px tiles.\n", t.width, t.height, t.levels, t.tile);
+    printf("%d connections x %d requests (%s, %s): %d ok, %d failed in %.2f s.\n", threads, requests,
+        pattern == 'p' ? "pan" : "random", format, n, errors, seconds);
+    printf("Throughput: %.1f tiles/s, %.2f MB/s.\n", n / seconds, bytes / seconds / (1024 * 1024));
+    if (n > 0) {
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms.\n", latency[n / 2],
+            latency[(int)(n * 0.9)], latency[(int)(n * 0.99)], latency[n - 1]);
+    }
+    int fd = connect_to(&t);
+    char metrics[BUFSIZE * 8];
+    if (fd >= 0 && get(fd, "/metrics", metrics, sizeof(metrics)) > 0) printf("Server metrics:\n%s", metrics);
+    if (fd >= 0) close(fd);
+    free(clients);
+    free(ids);
+    free(latency);
+    return errors > 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,254 @@
+/*
+Lazy tile evaluation, see tiles.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "tiles.h"
+
+typedef struct {
+    unsigned char* raw;     // one input row in the StreamParams format
+    unsigned char* rows;    // 3 gray rows, row r in slot r % 3
+    int cached[3];
+    int tone;               // rows are tone mapped
+} RowCache;
+
+static int bytes_per_px(TileEngine* e) {
+    return e->sp.format == STREAM_RGB ? 3 : 1;
+}
+
+static unsigned char filter_px(double* k, unsigned char** rows, int i, int lo, int hi) {
+    // convolve_3x3 at column i, neighbour columns clamped to [lo, hi]; same multiply-add order
+    double acc = 0;
+    for (int jj = 0; jj < 3; jj++) {
+        for (int ii = 0; ii < 3; ii++) {
+            int c = i + ii - 1;
+            c = c < lo ? lo : c > hi ? hi : c;
+            acc += k[jj * 3 + ii] * rows[jj][c];
+        }
+    }
+    return acc > MAXGRAY ? MAXGRAY : acc < 0 ? 0 : (unsigned char)acc;
+}
+
+static unsigned char* cached_row(TileEngine* e, RowCache* rc, int r) {
+    // gray (or tone mapped) row r clamped to the image, read at most once while it stays in the cache
+    r = r < 0 ? 0 : r >= e->height ? e->height - 1 : r;
+    unsigned char* row = &rc->rows[(size_t)(r % 3) * e->width];
+    if (rc->cached[r % 3] != r) {
+        if (!e->read(e->user, 0, r, e->width, 1, rc->raw)) return NULL;
+        stream_gray_row(e->sp.format, rc->raw, e->width, row);
+        if (rc->tone) {
+            for (int i = 0; i < e->width; i++) row[i] = e->lut[row[i]];
+        }
+        rc->cached[r % 3] = r;
+    }
+    return row;
+}
+
+typedef struct {
+    TileEngine* e;
+    RowCache* rc;
+    int filter;
+    unsigned char* out;     // one filtered row
+} StatsRows;
+
+static unsigned char* stats_row(void* ctx, int j) {
+    // gray (or tone mapped) row j, filtered when the histogram is the filtered one; NULL when a read fails
+    StatsRows* s = (StatsRows*)ctx;
+    TileEngine* e = s->e;
+    unsigned char* rows[3];
+    for (int k = 0; k < 3; k++) {
+        if (k != 1 && !s->filter) continue;
+        rows[k] = cached_row(e, s->rc, j + k - 1);
+        if (!rows[k]) return NULL;
+    }
+    if (!s->filter) return rows[1];
+    for (int i = 0; i < e->width; i++) s->out[i] = filter_px(e->sp.kernel, rows, i, 0, e->width - 1);
+    return s->out;
+}
+
+static int stats_pass(TileEngine* e, RowCache* rc, int tone, int* hist) {
+    // histogram of the input (tone = 0) or of the filtered image, on the strata of strided_histogram;
+    // returns the number of pixels counted, -1 when a read fails or out of memory
+    StatsRows s = {e, rc, tone && e->sp.kernel, NULL};
+    rc->tone = tone;
+    rc->cached[0] = rc->cached[1] = rc->cached[2] = -1;
+    if (s.filter) {
+        s.out = (unsigned char*)malloc(e->width);
+        if (!s.out) return -1;
+    }
+    int n = row_histogram(e->width, e->height, stats_row, &s, e->fraction, hist);
+    free(s.out);
+    return n;
+}
+
+void tile_engine_init(TileEngine* e, int width, int height, StreamParams* sp, double fraction, TileRead read, void* user) {
+    memset(e, 0, sizeof(TileEngine));
+    e->width = width;
+    e->height = height;
+    e->sp = *sp;
+    e->fraction = fraction;
+    e->read = read;
+    e->user = user;
+}
+
+int tile_stats(TileEngine* e) {
+    // the tone LUT and the threshold, computed on the first call only
+    if (e->stats_ready) return 1;
+    RowCache rc;
+    rc.raw = (unsigned char*)malloc((size_t)e->width * bytes_per_px(e));
+    rc.rows = (unsigned char*)malloc((size_t)e->width * 3);
+    int hist[MAXSIZE];
+    int n = rc.raw && rc.rows ? 0 : -1;
+    if (n == 0 && e->sp.hist) {
+        for (int i = 0; i < MAXSIZE; i++) n += hist[i] = e->sp.hist[i];
+    } else if (n == 0) {
+        n = stats_pass(e, &rc, 0, hist);
+    }
+    if (n >= 0) {
+        point_lut(n, hist, &e->sp.pp, e->lut);
+        e->used_treshold = e->sp.treshold;
+        e->used_method = e->sp.method;
+        if (e->sp.treshold == STREAMAUTO) n = stats_pass(e, &rc, 1, hist);
+    }
+    if (n >= 0 && e->sp.treshold == STREAMAUTO) {
+        HistStats st;
+        hist_stats(n, hist, &st);
+        if (e->used_method == TH_AUTO) e->used_method = auto_treshold_method(&st);
+        e->used_treshold = hist_treshold(&st, e->used_method);
+    }
+    free(rc.raw);
+    free(rc.rows);
+    e->stats_ready = n >= 0;
+    return e->stats_ready;
+}
+
+static void morph_window(TileEngine* e, int* lo, int* hi) {
+    // the windows of stream.c (and zad6), nothing without morphology
+    int k = e->sp.morph ? e->sp.ksize : 1;
+    *lo = e->sp.morph == 'e' ? -(k / 2) : -(k - 1 - k / 2);
+    *hi = e->sp.morph == 'e' ? k - 1 - k / 2 : k / 2;
+}
+
+int tile_render(TileEngine* e, int x, int y, int w, int h, unsigned char* out, int stride) {
+    // output pixels x..x+w-1, y..y+h-1 into out (rows stride bytes apart); 0 on failure
+    int W = e->width, H = e->height;
+    if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > W || y + h > H) return 0;
+    if (!tile_stats(e)) return 0;
+    int mlo, mhi, f = e->sp.kernel ? 1 : 0;
+    morph_window(e, &mlo, &mhi);
+    // the thresholded pixels the morphology reads, then the input pixels the filter reads for them
+    int x1 = x + mlo < 0 ? 0 : x + mlo, x2 = x + w - 1 + mhi >= W ? W - 1 : x + w - 1 + mhi;
+    int y1 = y + mlo < 0 ? 0 : y + mlo, y2 = y + h - 1 + mhi >= H ? H - 1 : y + h - 1 + mhi;
+    int x0 = x1 - f < 0 ? 0 : x1 - f, x3 = x2 + f >= W ? W - 1 : x2 + f;
+    int y0 = y1 - f < 0 ? 0 : y1 - f, y3 = y2 + f >= H ? H - 1 : y2 + f;
+    int w0 = x3 - x0 + 1, h0 = y3 - y0 + 1, w1 = x2 - x1 + 1, h1 = y2 - y1 + 1;
+    int bpp = bytes_per_px(e);
+    unsigned char* raw = (unsigned char*)malloc((size_t)w0 * h0 * bpp);
+    unsigned char* in = (unsigned char*)malloc((size_t)w0 * h0);
+    unsigned char* mid = (unsigned char*)malloc((size_t)w1 * h1);
+    unsigned char* v = (unsigned char*)malloc(w1);
+    int ok = raw && in && mid && v && e->read(e->user, x0, y0, w0, h0, raw);
+    if (!ok) {
+        free(raw);
+        free(in);
+        free(mid);
+        free(v);
+        return 0;
+    }
+    // tiles may be rendered from several threads once the statistics are known
+    __atomic_fetch_add(&e->pixels_read, (long long)w0 * h0, __ATOMIC_RELAXED);
+    for (int r = 0; r < h0; r++) {
+        unsigned char* g = &in[(size_t)r * w0];
+        stream_gray_row(e->sp.format, &raw[(size_t)r * w0 * bpp], w0, g);
+        for (int i = 0; i < w0; i++) g[i] = e->lut[g[i]];
+    }
+    free(raw);
+
+    // filter and threshold, the image edges replicate; in region coordinates column c is c - x0
+    unsigned char t = e->used_treshold;
+    for (int j = y1; j <= y2; j++) {
+        unsigned char* rows[3];
+        for (int k = 0; k < 3; k++) {
+            int r = f ? j + k - 1 : j;
+            r = r < 0 ? 0 : r >= H ? H - 1 : r;
+            rows[k] = &in[(size_t)(r - y0) * w0];
+        }
+        unsigned char* m = &mid[(size_t)(j - y1) * w1];
+        for (int i = x1; i <= x2; i++) {
+            unsigned char p = f ? filter_px(e->sp.kernel, rows, i - x0, -x0, W - 1 - x0) : rows[1][i - x0];
+            m[i - x1] = e->sp.treshold == STREAMNONE ? p : p > t ? MAXGRAY : 0;
+        }
+    }
+    free(in);
+
+    // erosion (minimum) or dilation (maximum) over the window rows, then along the row
+    int erode = e->sp.morph == 'e';
+    for (int j = y; j < y + h; j++) {
+        unsigned char* o = &out[(size_t)(j - y) * stride];
+        int r0 = j + mlo < 0 ? 0 : j + mlo, r1 = j + mhi >= H ? H - 1 : j + mhi;
+        memcpy(v, &mid[(size_t)(r0 - y1) * w1], w1);
+        for (int r = r0 + 1; r <= r1; r++) {
+            unsigned char* m = &mid[(size_t)(r - y1) * w1];
+            for (int i = 0; i < w1; i++) {
+                if (erode ? m[i] < v[i] : m[i] > v[i]) v[i] = m[i];
+            }
+        }
+        for (int i = x; i < x + w; i++) {
+            int a = i + mlo < 0 ? 0 : i + mlo, b = i + mhi >= W ? W - 1 : i + mhi;
+            unsigned char q = v[a - x1];
+            for (int c = a + 1; c <= b; c++) {
+                if (erode ? v[c - x1] < q : v[c - x1] > q) q = v[c - x1];
+            }
+            o[i - x] = q;
+        }
+    }
+    free(mid);
+    free(v);
+    return 1;
+}
+
+void tile_stats_key(FILE* src, char* key, size_t size) {
+    // appends the size and modification time of the open image, a replaced image of the same
+    // dimensions then misses the cache like the FILE.hist of --save-hist
+    struct stat st;
+    size_t n = strlen(key);
+    if (fstat(fileno(src), &st) != 0 || n + 1 >= size) return;
+    snprintf(key + n, size - n, "@%lld:%lld.%09ld ", (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+        (long)st.st_mtim.tv_nsec);
+}
+
+int tile_stats_save(char const * file_name, TileEngine* e, char const * key) {
+    // magic, a text line with the size, threshold and method, the key line, then the LUT
+    if (!e->stats_ready) return 0;
+    FILE* f = fopen(file_name, "wb");
+    if (!f) return 0;
+    fprintf(f, "%s %d %d %d %d\n%s\n", TILESMAGIC, e->width, e->height, e->used_treshold, (int)e->used_method, key);
+    int ok = fwrite(e->lut, 1, MAXSIZE, f) == MAXSIZE;
+    return fclose(f) == 0 && ok;
+}
+
+int tile_stats_load(char const * file_name, TileEngine* e, char const * key) {
+    // only statistics of the same image size and key are taken
+    FILE* f = fopen(file_name, "rb");
+    if (!f) return 0;
+    char magic[TILESMAGICSIZE + 1];
+    int width, height, treshold, method;
+    int ok = fscanf(f, "%4s %d %d %d %d", magic, &width, &height, &treshold, &method) == 5 && fgetc(f) == '\n'
+        && strcmp(magic, TILESMAGIC) == 0 && width == e->width && height == e->height;
+    size_t n = strlen(key);
+    char* line = (char*)malloc(n + 2);
+    ok = ok && line && fgets(line, n + 2, f) && strncmp(line, key, n) == 0 && line[n] == '\n';
+    free(line);
+    unsigned char lut[MAXSIZE];
+    ok = ok && fread(lut, 1, MAXSIZE, f) == MAXSIZE;
+    fclose(f);
+    if (!ok) return 0;
+    memcpy(e->lut, lut, MAXSIZE);
+    e->used_treshold = treshold;
+    e->used_method = (TresholdMethod)method;
+    e->stats_ready = 1;
+    return 1;
+}
@@ -0,0 +1,46 @@
+/*
+Pull-based lazy evaluation of the stream.h pipeline for viewers of huge images.
+A requested output tile is computed from just the input region it depends on: the tile grows by the
+morphology window for the thresholded pixels and by the filter halo again for the input, clamped to
+the image (the edges replicate, as in the whole-image path). The global statistics - the input
+histogram for the tone LUT and the filtered histogram for the threshold - take one pass over the
+input (or over a stratified sample of it, the strata of strided_histogram) on the first request and
+are kept in the engine; they can also be saved and loaded so later runs skip that pass, keyed on the
+options and on the size and modification time of the image file.
+Once they are known tile_render only reads the engine, so tiles can be rendered from several
+threads when the read callback allows it (e.g. pread).
+*/
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdio.h>
+#include "stream.h"
+
+#define TILESMAGIC "CVT1"
+#define TILESMAGICSIZE 4
+
+// reads rows y..y+h-1, columns x..x+w-1 in the StreamParams format, row after row; 0 on failure
+typedef int (*TileRead)(void* user, int x, int y, int w, int h, unsigned char* dst);
+
+typedef struct {
+    int width, height;
+    StreamParams sp;
+    double fraction;        // of the rows and columns the statistics sample
+    TileRead read;
+    void* user;
+    int stats_ready;
+    unsigned char lut[MAXSIZE];
+    int used_treshold;
+    TresholdMethod used_method;
+    long long pixels_read;  // input pixels read by tile_render so far
+} TileEngine;
+
+void tile_engine_init(TileEngine* e, int width, int height, StreamParams* sp, double fraction, TileRead read, void* user);
+int tile_stats(TileEngine* e);
+int tile_render(TileEngine* e, int x, int y, int w, int h, unsigned char* out, int stride);
+void tile_stats_key(FILE* src, char* key, size_t size);
+int tile_stats_save(char const * file_name, TileEngine* e, char const * key);
+int tile_stats_load(char const * file_name, TileEngine* e, char const * key);
+
+#endif
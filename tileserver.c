@@ -0,0 +1,934 @@
+/*
+This program serves the output of zad1's default pipeline for one huge P6 PPM as deep-zoom tiles,
+over HTTP on 127.0.0.1 or on a Unix socket, so a viewer can pan and zoom without the whole image ever
+being processed. Tiles come from the lazy evaluation of tiles.h (only the input they depend on is read,
+with pread). Level 0 is the full resolution, every next level halves the one below (2x2 average of its
+tiles) until the image fits in one tile.
+Can be compiled with the makefile provided (make tileserver); tileload is the load-test client.
+Used from cmd - first arg is the source file name (P6, opens as rb).
+Requests (GET, HTTP/1.1 keep-alive or HTTP/1.0):
+    /tile/Z/X/Y.pgm tile X, Y of level Z as P5 PGM (tile-size pixels, less at the right and bottom edges).
+    /tile/Z/X/Y.png the same as an 8-bit grayscale PNG (stored deflate blocks, no zlib needed).
+    /info           "width W", "height H", "tile T" and "levels L" lines.
+    /metrics        request, cache, coalescing and prefetch counters and latency percentiles as "name value" lines.
+Optional args after the file name:
+    --port=N        TCP port on 127.0.0.1 (default 8080).
+    --unix=PATH     listen on this Unix socket instead.
+    --threads=N     tiles rendered at once (default: all cores); every connection has its own thread.
+    --cache=MB      LRU cache of rendered tiles (default 256), requests for a tile being rendered wait for it.
+    --prefetch=N    threads rendering the neighbours of requested tiles ahead (default 1, 0 is off).
+    --tile-size=T   tile size (default 256, even).
+    --threshold=M, --sample=F, --match=FILE, --gamma=G|auto, --levels=auto and --tile-stats=FILE as for zad1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "histogram.h"
+#include "stream.h"
+#include "tiles.h"
+
+#define BUFSIZE 256
+#define MAXGRAY 255
+#define MAXSIZE (MAXGRAY+1)
+#define TILESIZE 256
+#define CACHEMB 256
+#define PORT 8080
+#define MAXLEVELS 32
+#define MAXREQUEST 4096         // request line and headers
+#define MAXCONNECTIONS 256
+#define PREFETCHQUEUE 256
+#define LATENCYBUCKETS 40       // bucket b holds latencies of 2^b .. 2^(b+1) - 1 us
+
+enum {
+    ENTRY_PENDING,              // being rendered, requests wait on the cache condition
+    ENTRY_READY,
+    ENTRY_FAILED                // out of the hash, freed by the last request holding it
+};
+
+enum {
+    GET_REQUEST,                // a client asked for the tile
+    GET_CHILD,                  // needed for a tile of the next level
+    GET_PREFETCH
+};
+
+typedef struct CacheEntry {
+    int z, x, y;
+    int w, h;
+    unsigned char* px;
+    int state;
+    int refs;                   // holders of px, only entries without any are evicted
+    int prefetched;             // rendered ahead and not requested yet
+    struct CacheEntry *prev, *next; // LRU list of the ready entries, most recent first
+    struct CacheEntry* chain;   // hash bucket
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    CacheEntry** buckets;
+    int mask;
+    CacheEntry *head, *tail;
+    size_t bytes, capacity;
+    int tiles;
+} TileCache;
+
+typedef struct {
+    int z, x, y;
+} TileKey;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    TileKey items[PREFETCHQUEUE];
+    int first, count;
+} PrefetchQueue;
+
+typedef struct {
+    // updated with atomics from every thread
+    long long requests, tile_requests, errors;
+    long long hits, misses, coalesced;
+    long long rendered, render_us;
+    long long prefetch_queued, prefetch_dropped, prefetch_used;
+    long long evictions, bytes_sent;
+    long long latency[LATENCYBUCKETS];
+    long long latency_max;
+} Metrics;
+
+typedef struct {
+    int fd;
+    off_t data;                 // offset of the first pixel
+    int width;
+} RegionFd;
+
+typedef struct {
+    TileEngine engine;
+    int tile;
+    int levels;
+    int level_w[MAXLEVELS], level_h[MAXLEVELS];
+    TileCache cache;
+    PrefetchQueue queue;
+    int prefetch;
+    // render slots, so that at most threads tiles are computed at once
+    pthread_mutex_t slot_lock;
+    pthread_cond_t slot_free;
+    int threads, busy;
+    int connections;            // open, under slot_lock
+    Metrics metrics;
+} Server;
+
+typedef struct {
+    Server* s;
+    int fd;
+} Connection;
+
+#define COUNT(s, field, n) __atomic_fetch_add(&(s)->metrics.field, (n), __ATOMIC_RELAXED)
+
+static unsigned int crc_table[MAXSIZE];
+
+void error_handler(FILE* src, FILE* tgt, char* msg) {
+    printf("%s\n", msg);
+    if (src) fclose(src);
+    if (tgt) fclose(tgt);
+    exit(EXIT_FAILURE);
+}
+
+static long long now_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+int read_region(void* user, int x, int y, int w, int h, unsigned char* dst) {
+    // tile reader: one pread per row of the region, safe from every thread at once
+    RegionFd* rf = (RegionFd*)user;
+    size_t n = (size_t)w * 3;
+    for (int j = 0; j < h; j++) {
+        off_t offset = rf->data + ((off_t)(y + j) * rf->width + x) * 3;
+        if (pread(rf->fd, &dst[j * n], n, offset) != (ssize_t)n) return 0;
+    }
+    return 1;
+}
+
+// --- tile cache ---
+
+static int cache_init(TileCache* c, size_t capacity, int tile) {
+    // about two buckets per tile that fits
+    size_t n = capacity / ((size_t)tile * tile) * 2;
+    int buckets = 1024;
+    while ((size_t)buckets < n && buckets < (1 << 24)) buckets <<= 1;
+    memset(c, 0, sizeof(TileCache));
+    c->buckets = (CacheEntry**)calloc(buckets, sizeof(CacheEntry*));
+    c->mask = buckets - 1;
+    c->capacity = capacity;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->ready, NULL);
+    return c->buckets != NULL;
+}
+
+static CacheEntry** cache_bucket(TileCache* c, int z, int x, int y) {
+    unsigned int h = (unsigned int)z * 2654435761u ^ (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+    return &c->buckets[(h ^ h >> 15) & c->mask];
+}
+
+static CacheEntry* cache_find(TileCache* c, int z, int x, int y) {
+    for (CacheEntry* e = *cache_bucket(c, z, x, y); e; e = e->chain) {
+        if (e->z == z && e->x == x && e->y == y) return e;
+    }
+    return NULL;
+}
+
+static void cache_unhash(TileCache* c, CacheEntry* e) {
+    CacheEntry** p = cache_bucket(c, e->z, e->x, e->y);
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+}
+
+static void lru_unlink(TileCache* c, CacheEntry* e) {
+    if (e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_front(TileCache* c, CacheEntry* e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e;
+    else c->tail = e;
+    c->head = e;
+}
+
+static void cache_evict(Server* s) {
+    // least recently used ready tiles nobody holds, until the cache fits (held ones may overshoot it)
+    TileCache* c = &s->cache;
+    CacheEntry* e = c->tail;
+    while (c->bytes > c->capacity && e) {
+        CacheEntry* prev = e->prev;
+        if (e->refs == 0) {
+            lru_unlink(c, e);
+            cache_unhash(c, e);
+            c->bytes -= (size_t)e->w * e->h;
+            c->tiles--;
+            free(e->px);
+            free(e);
+            COUNT(s, evictions, 1);
+        }
+        e = prev;
+    }
+}
+
+static void entry_release_locked(Server* s, CacheEntry* e) {
+    if (--e->refs > 0) return;
+    if (e->state == ENTRY_FAILED) {
+        free(e->px);
+        free(e);
+    } else {
+        cache_evict(s);
+    }
+}
+
+static void tile_release(Server* s, CacheEntry* e) {
+    pthread_mutex_lock(&s->cache.lock);
+    entry_release_locked(s, e);
+    pthread_mutex_unlock(&s->cache.lock);
+}
+
+// --- rendering ---
+
+static void slot_acquire(Server* s) {
+    pthread_mutex_lock(&s->slot_lock);
+    while (s->busy >= s->threads) pthread_cond_wait(&s->slot_free, &s->slot_lock);
+    s->busy++;
+    pthread_mutex_unlock(&s->slot_lock);
+}
+
+static void slot_release(Server* s) {
+    pthread_mutex_lock(&s->slot_lock);
+    s->busy--;
+    pthread_cond_signal(&s->slot_free);
+    pthread_mutex_unlock(&s->slot_lock);
+}
+
+static int tile_count(Server* s, int n) {
+    return (n + s->tile - 1) / s->tile;
+}
+
+static CacheEntry* tile_get(Server* s, int z, int x, int y, int kind);
+
+static int downsample(Server* s, CacheEntry* e, CacheEntry** child) {
+    // pixel i, j of level z is the rounded mean of pixels 2i..2i+1, 2j..2j+1 of level z - 1 (clamped to
+    // its size); the tile size is even, so they lie in the same child tile
+    int T = s->tile, W = s->level_w[e->z - 1], H = s->level_h[e->z - 1];
+    for (int j = 0; j < e->h; j++) {
+        int sy0 = 2 * (e->y * T + j), sy1 = sy0 + 1 < H ? sy0 + 1 : H - 1;
+        int cy = sy0 / T - 2 * e->y;
+        for (int i = 0; i < e->w; i++) {
+            int sx0 = 2 * (e->x * T + i), sx1 = sx0 + 1 < W ? sx0 + 1 : W - 1;
+            CacheEntry* c = child[cy * 2 + sx0 / T - 2 * e->x];
+            if (!c) return 0;
+            unsigned char* r0 = &c->px[(size_t)(sy0 % T) * c->w];
+            unsigned char* r1 = &c->px[(size_t)(sy1 % T) * c->w];
+            int sum = r0[sx0 % T] + r0[sx1 % T] + r1[sx0 % T] + r1[sx1 % T];
+            e->px[(size_t)j * e->w + i] = (sum + 2) >> 2;
+        }
+    }
+    return 1;
+}
+
+static int render_entry(Server* s, CacheEntry* e) {
+    // level 0 through the tile engine, the others from their (cached) children
+    int T = s->tile;
+    e->w = s->level_w[e->z] - e->x * T < T ? s->level_w[e->z] - e->x * T : T;
+    e->h = s->level_h[e->z] - e->y * T < T ? s->level_h[e->z] - e->y * T : T;
+    e->px = (unsigned char*)malloc((size_t)e->w * e->h);
+    if (!e->px) return 0;
+    CacheEntry* child[4] = {NULL, NULL, NULL, NULL};
+    if (e->z > 0) {
+        // children are taken without a render slot, waiting for them must not hold one
+        int cols = tile_count(s, s->level_w[e->z - 1]), rows = tile_count(s, s->level_h[e->z - 1]);
+        for (int k = 0; k < 4; k++) {
+            int cx = 2 * e->x + k % 2, cy = 2 * e->y + k / 2;
+            if (cx < cols && cy < rows) child[k] = tile_get(s, e->z - 1, cx, cy, GET_CHILD);
+        }
+    }
+    slot_acquire(s);
+    long long t0 = now_us();
+    int ok = e->z == 0 ? tile_render(&s->engine, e->x * T, e->y * T, e->w, e->h, e->px, e->w) : downsample(s, e, child);
+    COUNT(s, render_us, now_us() - t0);
+    slot_release(s);
+    COUNT(s, rendered, 1);
+    for (int k = 0; k < 4; k++) {
+        if (child[k]) tile_release(s, child[k]);
+    }
+    return ok;
+}
+
+static CacheEntry* tile_get(Server* s, int z, int x, int y, int kind) {
+    // the cached tile, or the tile another thread is rendering, or it is rendered here; the caller
+    // releases it with tile_release, NULL when it could not be rendered
+    TileCache* c = &s->cache;
+    pthread_mutex_lock(&c->lock);
+    CacheEntry* e = cache_find(c, z, x, y);
+    if (e) {
+        e->refs++;
+        if (e->state == ENTRY_PENDING) {
+            if (kind == GET_REQUEST) COUNT(s, coalesced, 1);
+            while (e->state == ENTRY_PENDING) pthread_cond_wait(&c->ready, &c->lock);
+        } else {
+            if (kind == GET_REQUEST) COUNT(s, hits, 1);
+            lru_unlink(c, e);
+            lru_front(c, e);
+        }
+        if (e->state == ENTRY_FAILED) {
+            entry_release_locked(s, e);
+            e = NULL;
+        } else if (kind == GET_REQUEST && e->prefetched) {
+            e->prefetched = 0;
+            COUNT(s, prefetch_used, 1);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    e = (CacheEntry*)calloc(1, sizeof(CacheEntry));
+    if (!e) {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    e->z = z;
+    e->x = x;
+    e->y = y;
+    e->state = ENTRY_PENDING;
+    e->refs = 1;
+    e->prefetched = kind == GET_PREFETCH;
+    CacheEntry** b = cache_bucket(c, z, x, y);
+    e->chain = *b;
+    *b = e;
+    if (kind == GET_REQUEST) COUNT(s, misses, 1);
+    pthread_mutex_unlock(&c->lock);
+
+    int ok = render_entry(s, e);
+
+    pthread_mutex_lock(&c->lock);
+    if (ok) {
+        e->state = ENTRY_READY;
+        lru_front(c, e);
+        c->bytes += (size_t)e->w * e->h;
+        c->tiles++;
+        cache_evict(s);
+    } else {
+        e->state = ENTRY_FAILED;
+        cache_unhash(c, e);
+    }
+    pthread_cond_broadcast(&c->ready);
+    if (!ok) {
+        entry_release_locked(s, e);
+        e = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+// --- prefetch ---
+
+static void prefetch_neighbours(Server* s, int z, int x, int y) {
+    // the 4 neighbours of a requested tile that are not cached yet, dropped when the queue is full
+    static int const dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+    int cols = tile_count(s, s->level_w[z]), rows = tile_count(s, s->level_h[z]);
+    for (int k = 0; k < 4; k++) {
+        int nx = x + dx[k], ny = y + dy[k];
+        if (nx < 0 || ny < 0 || nx >= cols || ny >= rows) continue;
+        pthread_mutex_lock(&s->cache.lock);
+        int cached = cache_find(&s->cache, z, nx, ny) != NULL;
+        pthread_mutex_unlock(&s->cache.lock);
+        if (cached) continue;
+        PrefetchQueue* q = &s->queue;
+        pthread_mutex_lock(&q->lock);
+        if (q->count < PREFETCHQUEUE) {
+            TileKey key = {z, nx, ny};
+            q->items[(q->first + q->count++) % PREFETCHQUEUE] = key;
+            pthread_cond_signal(&q->more);
+            COUNT(s, prefetch_queued, 1);
+        } else {
+            COUNT(s, prefetch_dropped, 1);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static void* prefetch_thread(void* arg) {
+    Server* s = (Server*)arg;
+    PrefetchQueue* q = &s->queue;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0) pthread_cond_wait(&q->more, &q->lock);
+        TileKey key = q->items[q->first];
+        q->first = (q->first + 1) % PREFETCHQUEUE;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+        CacheEntry* e = tile_get(s, key.z, key.x, key.y, GET_PREFETCH);
+        if (e) tile_release(s, e);
+    }
+    return NULL;
+}
+
+// --- encoding ---
+
+static void crc_init(void) {
+    for (unsigned int n = 0; n < MAXSIZE; n++) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static unsigned int crc32_update(unsigned int crc, unsigned char const * p, size_t n) {
+    for (size_t i = 0; i < n; i++) crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static unsigned char* put32(unsigned char* p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static unsigned char* png_chunk_end(unsigned char* type, unsigned char* end) {
+    // type points at the chunk type after its length, end past the data; appends the CRC
+    return put32(end, crc32_update(0xffffffffu, type, end - type) ^ 0xffffffffu);
+}
+
+static unsigned char* encode_png(unsigned char const * px, int w, int h, size_t* len) {
+    // 8-bit gray, filter 0 on every row, zlib stream of stored deflate blocks
+    size_t raw = (size_t)h * (w + 1);
+    size_t blocks = (raw + 65534) / 65535;
+    unsigned char* out = (unsigned char*)malloc(8 + 25 + 12 + 2 + blocks * 5 + raw + 4 + 12);
+    if (!out) return NULL;
+    static unsigned char const signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    memcpy(out, signature, 8);
+    unsigned char* p = put32(out + 8, 13);
+    unsigned char* type = p;
+    memcpy(p, "IHDR", 4);
+    p = put32(put32(p + 4, w), h);
+    *p++ = 8;                   // bit depth
+    *p++ = 0;                   // gray
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    p = png_chunk_end(type, p);
+
+    unsigned char* length = p;
+    type = p + 4;
+    memcpy(type, "IDAT", 4);
+    p = type + 4;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    unsigned int a = 1, b = 0;  // adler-32
+    size_t left = raw, block = 0;
+    for (int j = 0; j < h; j++) {
+        for (int i = -1; i < w; i++) {
+            if (block == 0) {
+                block = left < 65535 ? left : 65535;
+                left -= block;
+                *p++ = left == 0;
+                *p++ = block & 0xff;
+                *p++ = block >> 8;
+                *p++ = ~block & 0xff;
+                *p++ = (~block >> 8) & 0xff;
+            }
+            unsigned char v = i < 0 ? 0 : px[(size_t)j * w + i];
+            *p++ = v;
+            a = (a + v) % 65521;
+            b = (b + a) % 65521;
+            block--;
+        }
+    }
+    p = put32(p, b << 16 | a);
+    put32(length, p - type - 4);
+    p = png_chunk_end(type, p);
+
+    p = put32(p, 0);
+    type = p;
+    memcpy(p, "IEND", 4);
+    p = png_chunk_end(type, p + 4);
+    *len = p - out;
+    return out;
+}
+
+static unsigned char* encode_pgm(unsigned char const * px, int w, int h, size_t* len) {
+    unsigned char* out = (unsigned char*)malloc(BUFSIZE + (size_t)w * h);
+    if (!out) return NULL;
+    int n = snprintf((char*)out, BUFSIZE, "P5\n%d %d\n255\n", w, h);
+    memcpy(out + n, px, (size_t)w * h);
+    *len = n + (size_t)w * h;
+    return out;
+}
+
+// --- http ---
+
+static int send_all(int fd, void const * data, size_t n, int more) {
+    char const * p = (char const *)data;
+    while (n > 0) {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static int respond(Server* s, int fd, int status, char const * type, void const * body, size_t n, int keep) {
+    char const * reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found"
+        : status == 503 ? "Service Unavailable" : "Internal Server Error";
+    char head[BUFSIZE];
+    int k = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n", status, reason, type, n, keep ? "keep-alive" : "close");
+    if (status != 200) COUNT(s, errors, 1);
+    COUNT(s, bytes_sent, k + (long long)n);
+    // the head waits for the body, one segment for small tiles
+    return send_all(fd, head, k, n > 0) && send_all(fd, body, n, 0);
+}
+
+static double latency_percentile(Metrics* m, double p, long long n) {
+    // upper bound of the bucket holding the p-th latency, ms
+    long long seen = 0;
+    for (int b = 0; b < LATENCYBUCKETS; b++) {
+        seen += __atomic_load_n(&m->latency[b], __ATOMIC_RELAXED);
+        if (seen >= p * n && seen > 0) return (double)(1LL << (b + 1)) / 1e3;
+    }
+    return 0;
+}
+
+static int metrics_text(Server* s, char* out, int size) {
+    Metrics* m = &s->metrics;
+    long long n = 0;
+    for (int b = 0; b < LATENCYBUCKETS; b++) n += __atomic_load_n(&m->latency[b], __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->cache.lock);
+    int tiles = s->cache.tiles;
+    size_t bytes = s->cache.bytes;
+    pthread_mutex_unlock(&s->cache.lock);
+    return snprintf(out, size,
+        "requests %lld\ntile_requests %lld\nerrors %lld\ncache_hits %lld\ncache_misses %lld\ncoalesced %lld\n"
+        "tiles_rendered %lld\nrender_ms %.1f\nprefetch_queued %lld\nprefetch_dropped %lld\nprefetch_used %lld\n"
+        "evictions %lld\ncache_tiles %d\ncache_bytes %zu\nbytes_sent %lld\ninput_px_read %lld\n"
+        "latency_p50_ms %.3f\nlatency_p90_ms %.3f\nlatency_p99_ms %.3f\nlatency_max_ms %.3f\n",
+        m->requests, m->tile_requests, m->errors, m->hits, m->misses, m->coalesced,
+        m->rendered, m->render_us / 1e3, m->prefetch_queued, m->prefetch_dropped, m->prefetch_used,
+        m->evictions, tiles, bytes, m->bytes_sent, __atomic_load_n(&s->engine.pixels_read, __ATOMIC_RELAXED),
+        latency_percentile(m, 0.5, n), latency_percentile(m, 0.9, n), latency_percentile(m, 0.99, n),
+        m->latency_max / 1e3);
+}
+
+static int serve_tile(Server* s, int fd, int z, int x, int y, char const * ext, int keep) {
+    COUNT(s, tile_requests, 1);
+    int png = strcmp(ext, "png") == 0;
+    if ((!png && strcmp(ext, "pgm") != 0) || z < 0 || z >= s->levels || x < 0 || y < 0
+        || x >= tile_count(s, s->level_w[z]) || y >= tile_count(s, s->level_h[z])) {
+        return respond(s, fd, 404, "text/plain", "No such tile.\n", 14, keep);
+    }
+    CacheEntry* e = tile_get(s, z, x, y, GET_REQUEST);
+    if (!e) return respond(s, fd, 500, "text/plain", "Could not render the tile.\n", 27, keep);
+    size_t n;
+    unsigned char* body = png ? encode_png(e->px, e->w, e->h, &n) : encode_pgm(e->px, e->w, e->h, &n);
+    tile_release(s, e);
+    if (s->prefetch) prefetch_neighbours(s, z, x, y);
+    if (!body) return respond(s, fd, 500, "text/plain", "Out of memory.\n", 15, keep);
+    int ok = respond(s, fd, 200, png ? "image/png" : "image/x-portable-graymap", body, n, keep);
+    free(body);
+    return ok;
+}
+
+static int handle_request(Server* s, int fd, char* request, int* keep) {
+    // request line and headers, 0 when the connection has to be closed
+    char method[16], path[BUFSIZE], version[16];
+    if (sscanf(request, "%15s %255s %15s", method, path, version) != 3) {
+        *keep = 0;
+        respond(s, fd, 400, "text/plain", "Bad request.\n", 13, 0);
+        return 0;
+    }
+    // keep-alive unless asked otherwise (HTTP/1.1) or asked for (HTTP/1.0)
+    for (char* p = request; *p; p++) *p = *p >= 'A' && *p <= 'Z' ? *p + 'a' - 'A' : *p;
+    *keep = strcmp(version, "HTTP/1.1") == 0 ? strstr(request, "\nconnection: close") == NULL
+        : strstr(request, "\nconnection: keep-alive") != NULL;
+    int z, x, y;
+    char ext[8];
+    if (strcmp(method, "GET") != 0) {
+        return respond(s, fd, 400, "text/plain", "Only GET is served.\n", 20, *keep);
+    } else if (sscanf(path, "/tile/%d/%d/%d.%7s", &z, &x, &y, ext) == 4) {
+        return serve_tile(s, fd, z, x, y, ext, *keep);
+    } else if (strcmp(path, "/info") == 0) {
+        char body[BUFSIZE];
+        int n = snprintf(body, sizeof(body), "width %d\nheight %d\ntile %d\nlevels %d\n", s->engine.width,
+            s->engine.height, s->tile, s->levels);
+        return respond(s, fd, 200, "text/plain", body, n, *keep);
+    } else if (strcmp(path, "/metrics") == 0) {
+        char body[BUFSIZE * 8];
+        int n = metrics_text(s, body, sizeof(body));
+        return respond(s, fd, 200, "text/plain", body, n, *keep);
+    }
+    return respond(s, fd, 404, "text/plain", "Not found.\n", 11, *keep);
+}
+
+static void record_latency(Server* s, long long us) {
+    int b = 63 - __builtin_clzll((unsigned long long)us | 1);
+    COUNT(s, latency[b < LATENCYBUCKETS ? b : LATENCYBUCKETS - 1], 1);
+    long long m = __atomic_load_n(&s->metrics.latency_max, __ATOMIC_RELAXED);
+    while (us > m && !__atomic_compare_exchange_n(&s->metrics.latency_max, &m, us, 1, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED)) {
+    }
+}
+
+static void* connection_thread(void* arg) {
+    // requests of one connection in order (pipelined ones included) until it closes
+    Connection* c = (Connection*)arg;
+    Server* s = c->s;
+    char buf[MAXREQUEST + 1];
+    int used = 0, keep = 1;
+    while (keep) {
+        char* end;
+        buf[used] = 0;
+        while (!(end = strstr(buf, "\r\n\r\n"))) {
+            if (used == MAXREQUEST) break;
+            ssize_t k = recv(c->fd, buf + used, MAXREQUEST - used, 0);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) break;
+            used += k;
+            buf[used] = 0;
+        }
+        if (!end) break;
+        long long t0 = now_us();
+        end[2] = 0;
+        int n = end + 4 - buf;
+        COUNT(s, requests, 1);
+        int ok = handle_request(s, c->fd, buf, &keep);
+        record_latency(s, now_us() - t0);
+        if (!ok) break;
+        memmove(buf, buf + n, used - n);
+        used -= n;
+    }
+    close(c->fd);
+    pthread_mutex_lock(&s->slot_lock);
+    s->connections--;
+    pthread_mutex_unlock(&s->slot_lock);
+    free(c);
+    return NULL;
+}
+
+static int listen_socket(int port, char const * unix_path) {
+    int fd;
+    if (unix_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(unix_path) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, unix_path);
+        unlink(unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) return -1;
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) return -1;
+    }
+    return listen(fd, MAXCONNECTIONS) == 0 ? fd : -1;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc < 2) {
+        printf("This program takes at least 1 argument.");
+        exit(EXIT_FAILURE);
+    }
+
+    // optional args
+    TresholdMethod method = TH_OTSU;
+    double fraction = 1;
+    int ref_hist_buf[MAXSIZE] = {0};
+    PointParams pp = {.ref_hist = NULL, .auto_levels = 0, .gamma = 2.0};
+    char const * tile_stats_name = NULL;
+    char const * unix_path = NULL;
+    int port = PORT, tile = TILESIZE, prefetch = 1;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double cache_mb = CACHEMB;
+    for (int a = 2; a < argc; a++) {
+        if (strncmp(argv[a], "--threshold=", 12) == 0) {
+            method = parse_treshold_method(argv[a] + 12);
+            if (method == TH_COUNT) {
+                printf("Unknown threshold method %s.", argv[a] + 12);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--sample=", 9) == 0) {
+            fraction = strtod(argv[a] + 9, NULL);
+            if (fraction <= 0 || fraction > 1) {
+                printf("Sample fraction must be in (0, 1].");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--match=", 8) == 0) {
+            if (!reference_histogram(argv[a] + 8, ref_hist_buf)) {
+                printf("Could not read the reference histogram %s, or it is empty.", argv[a] + 8);
+                exit(EXIT_FAILURE);
+            }
+            pp.ref_hist = ref_hist_buf;
+        } else if (strncmp(argv[a], "--gamma=", 8) == 0) {
+            pp.gamma = strcmp(argv[a] + 8, "auto") == 0 ? 0 : strtod(argv[a] + 8, NULL);
+            if (pp.gamma < 0 || (pp.gamma == 0 && strcmp(argv[a] + 8, "auto") != 0)) {
+                printf("Gamma must be a positive number or auto.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[a], "--levels=auto") == 0) {
+            pp.auto_levels = 1;
+        } else if (strncmp(argv[a], "--tile-stats=", 13) == 0) {
+            tile_stats_name = argv[a] + 13;
+        } else if (strncmp(argv[a], "--port=", 7) == 0) {
+            port = atoi(argv[a] + 7);
+            if (port < 1 || port > 65535) {
+                printf("Port must be in 1..65535.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--unix=", 7) == 0) {
+            unix_path = argv[a] + 7;
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            threads = atoi(argv[a] + 10);
+            if (threads < 1) {
+                printf("Thread count must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--cache=", 8) == 0) {
+            cache_mb = strtod(argv[a] + 8, NULL);
+            if (cache_mb <= 0) {
+                printf("Cache size must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--prefetch=", 11) == 0) {
+            prefetch = atoi(argv[a] + 11);
+            if (prefetch < 0) {
+                printf("Prefetch thread count must not be negative.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--tile-size=", 12) == 0) {
+            tile = atoi(argv[a] + 12);
+            if (tile < 2 || tile % 2) {
+                printf("Tile size must be even and at least 2.");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            printf("Unknown option %s.", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads < 1) threads = 1;
+
+    FILE* src = fopen(argv[1], "rb");
+    if (src == NULL) {
+        error_handler(src, NULL, "Could not open the file.");
+    }
+
+    char format[3], buffer[BUFSIZE];
+    int width, height, max_val;
+
+    // skip comment lines
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, NULL, "Unexpected end of file (1).");
+        }
+    } while (buffer[0] == '#');
+
+    // read magic (format ID)
+    if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '6') {
+        error_handler(src, NULL, "Bad file format.");
+    }
+
+    // skip comment lines before reading dimensions
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, NULL, "Unexpected end of file (2).");
+        }
+    } while (buffer[0] == '#');
+
+    if (sscanf(buffer, "%d %d", &width, &height) != 2 || width < 1 || height < 1) {
+        error_handler(src, NULL, "Invalid image dimensions.");
+    }
+
+    // skip comment lines before reading max value
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, NULL, "Unexpected end of file (3).");
+        }
+    } while (buffer[0] == '#');
+
+    if (sscanf(buffer, "%d", &max_val) != 1) {
+        error_handler(src, NULL, "Invalid max color value.");
+    }
+
+    if (max_val > MAXGRAY) {
+        error_handler(src, NULL, "Unsupported max value > 255.");
+    }
+
+    // same pipeline as zad1 --tile
+    double kernel[9] = {
+        1.0 / 16, 2.0 / 16, 1.0 / 16,
+        2.0 / 16, 4.0 / 16, 2.0 / 16,
+        1.0 / 16, 2.0 / 16, 1.0 / 16
+    };
+    static Server s;
+    RegionFd rf = {fileno(src), ftello(src), width};
+    StreamParams sp = {STREAM_RGB, pp, NULL, kernel, method, STREAMAUTO, 0, 0};
+    tile_engine_init(&s.engine, width, height, &sp, fraction, read_region, &rf);
+    // the statistics depend on the image and the pipeline options only
+    char key[BUFSIZE * 4] = "";
+    for (int a = 1; a < argc; a++) {
+        if (a > 1 && strncmp(argv[a], "--threshold=", 12) != 0 && strncmp(argv[a], "--sample=", 9) != 0
+            && strncmp(argv[a], "--match=", 8) != 0 && strncmp(argv[a], "--gamma=", 8) != 0
+            && strncmp(argv[a], "--levels=", 9) != 0) {
+            continue;
+        }
+        strncat(key, argv[a], sizeof(key) - strlen(key) - 2);
+        strcat(key, " ");
+    }
+    tile_stats_key(src, key, sizeof(key));
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int cached = tile_stats_name && tile_stats_load(tile_stats_name, &s.engine, key);
+    if (!cached && !tile_stats(&s.engine)) {
+        error_handler(src, NULL, "Could not read the image for the statistics.");
+    }
+    if (!cached) report_point_params(&s.engine.sp.pp);
+    if (method == TH_AUTO) printf("Auto threshold method: %s.\n", treshold_method_name(s.engine.used_method));
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("Statistics (%s): threshold %d, %.2f ms.\n", cached ? "cached" : "computed", s.engine.used_treshold,
+        (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    if (!cached && tile_stats_name && !tile_stats_save(tile_stats_name, &s.engine, key)) {
+        printf("Could not save the statistics to %s.\n", tile_stats_name);
+    }
+
+    // levels until the image fits in one tile
+    s.tile = tile;
+    s.level_w[0] = width;
+    s.level_h[0] = height;
+    s.levels = 1;
+    while (s.levels < MAXLEVELS && (s.level_w[s.levels - 1] > tile || s.level_h[s.levels - 1] > tile)) {
+        s.level_w[s.levels] = (s.level_w[s.levels - 1] + 1) / 2;
+        s.level_h[s.levels] = (s.level_h[s.levels - 1] + 1) / 2;
+        s.levels++;
+    }
+    crc_init();
+    if (!cache_init(&s.cache, (size_t)(cache_mb * 1024 * 1024), tile)) {
+        error_handler(src, NULL, "Could not allocate the tile cache.");
+    }
+    s.threads = threads;
+    s.prefetch = prefetch;
+    pthread_mutex_init(&s.slot_lock, NULL);
+    pthread_cond_init(&s.slot_free, NULL);
+    pthread_mutex_init(&s.queue.lock, NULL);
+    pthread_cond_init(&s.queue.more, NULL);
+    for (int i = 0; i < prefetch; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, prefetch_thread, &s) != 0) {
+            s.prefetch = i;
+            break;
+        }
+        pthread_detach(t);
+    }
+
+    int lfd = listen_socket(port, unix_path);
+    if (lfd < 0) {
+        error_handler(src, NULL, "Could not listen on the socket.");
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (unix_path) printf("Serving %dx%d, %d levels of %d px tiles on %s.\n", width, height, s.levels, tile, unix_path);
+    else printf("Serving %dx%d, %d levels of %d px tiles on http://127.0.0.1:%d/.\n", width, height, s.levels, tile,
+        port);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+        // responses are written whole, nothing is gained by delaying the last segment
+        int one = 1;
+        if (!unix_path) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_mutex_lock(&s.slot_lock);
+        int full = s.connections >= MAXCONNECTIONS;
+        if (!full) s.connections++;
+        pthread_mutex_unlock(&s.slot_lock);
+        if (full) {
+            respond(&s, fd, 503, "text/plain", "Too many connections.\n", 22, 0);
+            close(fd);
+            continue;
+        }
+        Connection* c = (Connection*)malloc(sizeof(Connection));
+        if (!c) {
+            close(fd);
+            pthread_mutex_lock(&s.slot_lock);
+            s.connections--;
+            pthread_mutex_unlock(&s.slot_lock);
+            continue;
+        }
+        c->s = &s;
+        c->fd = fd;
+        pthread_t t;
+        if (pthread_create(&t, NULL, connection_thread, c) != 0) connection_thread(c);
+        else pthread_detach(t);
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+Per-thread ring buffers and the Chrome trace writer, see trace.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+
+typedef struct {
+    long long ts;           // ns since trace_start
+    char const * name;
+    int index;
+    char phase;             // 'B' or 'E'
+} TraceEvent;
+
+typedef struct TraceRing {
+    struct TraceRing* next;
+    int tid;                    // of the first thread, later owners record on the same track
+    int busy;                   // owned by a running thread
+    unsigned long long count;   // events recorded, the ring keeps the last TRACEEVENTS
+    TraceEvent events[TRACEEVENTS];
+} TraceRing;
+
+int trace_enabled = 0;
+static char trace_file[TRACEPATHSIZE];
+static struct timespec trace_t0;
+static TraceRing* rings = NULL;
+static int next_tid = 0;
+static __thread TraceRing* ring = NULL;
+static pthread_key_t ring_key;  // hands the ring back when its thread exits
+
+static void write_at_exit(void) {
+    if (trace_enabled) trace_write();
+}
+
+static void ring_release(void* r) {
+    __atomic_store_n(&((TraceRing*)r)->busy, 0, __ATOMIC_RELEASE);
+}
+
+static TraceRing* ring_register(void) {
+    // this thread's ring: one an exited thread handed back, else a new one pushed to the front of the
+    // list, so the band threads started for every phase share as many rings as ever ran at once
+    TraceRing* r;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&r->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!r) {
+        r = (TraceRing*)malloc(sizeof(TraceRing));
+        if (!r) return NULL;
+        r->count = 0;
+        r->busy = 1;
+        r->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(ring_key, r);
+    return ring = r;
+}
+
+int trace_start(char const * file_name, int length, double rate) {
+    // 1 when this process is traced: always for rate >= 1, else with probability rate; the first
+    // length characters of file_name are the output
+    clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+    unsigned int h = (unsigned int)trace_t0.tv_nsec * 2654435761u ^ (unsigned int)getpid() * 40503u;
+    h ^= h >> 15;
+    if (rate < 1 && (h % 1000000) >= rate * 1000000) return 0;
+    snprintf(trace_file, sizeof(trace_file), "%.*s", length, file_name);
+    // the calling thread is tid 0, "main"
+    if (pthread_key_create(&ring_key, ring_release) != 0 || !ring_register()) return 0;
+    trace_enabled = 1;
+    atexit(write_at_exit);
+    return 1;
+}
+
+void trace_event(char const * name, int index, char phase) {
+    TraceRing* r = ring ? ring : ring_register();
+    if (!r) return;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    TraceEvent* e = &r->events[r->count % TRACEEVENTS];
+    e->ts = (t.tv_sec - trace_t0.tv_sec) * 1000000000LL + (t.tv_nsec - trace_t0.tv_nsec);
+    e->name = name;
+    e->index = index;
+    e->phase = phase;
+    r->count++;
+}
+
+int trace_write(void) {
+    // every ring as one Chrome trace, after the threads recording into them are done
+    trace_enabled = 0;
+    FILE* f = fopen(trace_file, "w");
+    if (!f) {
+        printf("Could not write the trace %s.\n", trace_file);
+        return 0;
+    }
+    int pid = getpid(), threads = 0;
+    unsigned long long events = 0, dropped = 0;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (TraceRing* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": "
+            "\"%s %d\"}}", threads ? ",\n" : "", pid, r->tid, r->tid ? "worker" : "main", r->tid);
+        unsigned long long first = r->count > TRACEEVENTS ? r->count - TRACEEVENTS : 0;
+        for (unsigned long long k = first; k < r->count; k++) {
+            TraceEvent* e = &r->events[k % TRACEEVENTS];
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d", e->name,
+                e->phase, e->ts / 1000.0, pid, r->tid);
+            if (e->index >= 0) fprintf(f, ", \"args\": {\"index\": %d}", e->index);
+            fprintf(f, "}");
+        }
+        events += r->count - first;
+        dropped += first;
+        threads++;
+    }
+    fprintf(f, "\n]}\n");
+    int ok = fclose(f) == 0;
+    printf("Trace: %llu events from %d threads in %s (%llu dropped).\n", events, threads, trace_file, dropped);
+    return ok;
+}
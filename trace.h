@@ -0,0 +1,33 @@
+/*
+Timeline recorder for chrome://tracing and Perfetto (Chrome trace JSON): begin/end spans of stages,
+tiles and bands on every thread, so stalls between them show up where per-stage totals hide them.
+Each thread records into its own ring buffer, taken on its first event from the lock-free list of
+rings (a ring goes back to it when its thread exits, a new one is pushed only when all are in use);
+recording is a clock read and three stores, no locks, and a full ring overwrites its oldest events
+(they are counted as dropped). Off by default, when trace_begin and trace_end are one
+predictable branch. trace_start decides with probability rate whether this process is traced, so a
+sample of production jobs can run with it, and writes the JSON when the process exits.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACEEVENTS 32768   // per thread
+#define TRACEPATHSIZE 4096
+
+extern int trace_enabled;
+
+int trace_start(char const * file_name, int length, double rate);
+void trace_event(char const * name, int index, char phase);
+int trace_write(void);
+
+// name must outlive the process (a literal), index < 0 for none
+static inline void trace_begin(char const * name, int index) {
+    if (trace_enabled) trace_event(name, index, 'B');
+}
+
+static inline void trace_end(char const * name, int index) {
+    if (trace_enabled) trace_event(name, index, 'E');
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+Per-host tuning file, see tune.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tune.h"
+
+char const * tune_variant(void) {
+    // the SIMD code paths this build uses
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void tune_defaults(TuneConfig* c) {
+    c->fft = (FftTuning){DIRECTCOST, FFTCOST, FFTTILEFACTOR};
+    c->threads = 0;
+    c->strategy = (StrategyLimits){0, 0};
+    c->costs = (PipelineCosts){0, 0, 0};
+}
+
+int tune_default_path(char* path, int size) {
+    // $HOME/.zad1-tune-HOST, in the working directory without a home
+    char host[TUNEPATHSIZE / 4] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    char const * home = getenv("HOME");
+    return snprintf(path, size, "%s%s.zad1-tune-%s", home ? home : "", home ? "/" : "", host) < size;
+}
+
+static int tune_set(TuneConfig* c, char const * name, char const * value) {
+    // one "name value" pair, 0 for an unknown name or a value out of range
+    char* end;
+    double v = strtod(value, &end);
+    if (end == value) return 0;
+    if (strcmp(name, "direct_cost") == 0 && v > 0) c->fft.direct_cost = v;
+    else if (strcmp(name, "fft_cost") == 0 && v > 0) c->fft.fft_cost = v;
+    else if (strcmp(name, "tile_factor") == 0 && v >= 2 && v <= 64) c->fft.tile_factor = (int)v;
+    else if (strcmp(name, "threads") == 0 && v >= 0) c->threads = (int)v;
+    else if (strcmp(name, "small_pixels") == 0 && v >= 0) c->strategy.small_pixels = (long long)v;
+    else if (strcmp(name, "huge_pixels") == 0 && v >= 0) c->strategy.huge_pixels = (long long)v;
+    else if (strcmp(name, "pixel_ns") == 0 && v >= 0) c->costs.pixel_ns = v;
+    else if (strcmp(name, "tap_ns") == 0 && v >= 0) c->costs.tap_ns = v;
+    else if (strcmp(name, "rescale_ns") == 0 && v >= 0) c->costs.rescale_ns = v;
+    else return 0;
+    return 1;
+}
+
+int tune_load(char const * file_name, TuneConfig* c) {
+    // 1 when the file was read and measured with this build's variant, c is left alone otherwise
+    FILE* f = fopen(file_name, "r");
+    if (!f) return 0;
+    TuneConfig t = *c;
+    char line[TUNEPATHSIZE], name[64], value[64];
+    int ok = 1, variant = 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        ok = sscanf(line, "%63s %63s", name, value) == 2;
+        if (ok && strcmp(name, "variant") == 0) {
+            variant = strcmp(value, tune_variant()) == 0;
+            if (!variant) printf("Tuning %s was measured with %s, this build is %s: ignored.\n", file_name, value,
+                tune_variant());
+            ok = variant;
+        } else if (ok) {
+            ok = tune_set(&t, name, value);
+        }
+    }
+    fclose(f);
+    if (!ok || !variant) return 0;
+    *c = t;
+    return 1;
+}
+
+int tune_save(char const * file_name, TuneConfig* c) {
+    FILE* f = fopen(file_name, "w");
+    if (!f) return 0;
+    char host[TUNEPATHSIZE / 4] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    fprintf(f, "# zad1 --autotune on %s, %ld cores\nvariant %s\ndirect_cost %.4f\nfft_cost %.4f\ntile_factor %d\n"
+        "threads %d\nsmall_pixels %lld\nhuge_pixels %lld\npixel_ns %.3f\ntap_ns %.3f\nrescale_ns %.3f\n",
+        host, sysconf(_SC_NPROCESSORS_ONLN), tune_variant(), c->fft.direct_cost, c->fft.fft_cost, c->fft.tile_factor,
+        c->threads, c->strategy.small_pixels, c->strategy.huge_pixels, c->costs.pixel_ns, c->costs.tap_ns,
+        c->costs.rescale_ns);
+    return fclose(f) == 0;
+}
+
+int tune_force(char const * spec, TuneConfig* c) {
+    // "name=value[,name=value...]" over whatever was loaded
+    char buf[TUNEPATHSIZE];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char* item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if (!eq) return 0;
+        *eq = 0;
+        if (!tune_set(c, item, eq + 1)) return 0;
+    }
+    return 1;
+}
+
+void tune_report(TuneConfig* c) {
+    printf("Tuning (%s): direct cost %.3f, fft cost %.3f, tile factor %d, threads %d, fused up to %lld px, "
+        "streamed from %lld px, %.2f ns per pixel, %.2f ns per tap.\n", tune_variant(), c->fft.direct_cost,
+        c->fft.fft_cost, c->fft.tile_factor, c->threads, strategy_small_pixels(&c->strategy),
+        strategy_huge_pixels(&c->strategy), c->costs.pixel_ns > 0 ? c->costs.pixel_ns : PIXELNS,
+        c->costs.tap_ns > 0 ? c->costs.tap_ns : TAPNS);
+}
@@ -0,0 +1,35 @@
+/*
+Per-host tuning of the runtime choices: the direct/fft cost model and fft tile factor of fft.c, the
+default thread count, the size limits of the execution strategies (strategy.h) and the per-pixel
+costs the deadline planner estimates with (preset.h). zad1 --autotune times the candidates on
+synthetic data and saves the winners in a text file per host ("name value" lines, # comments),
+which zad1 loads at startup.
+SIMD variants are chosen at compile time, so a file records the variant it was measured with and
+is ignored by builds of another one. Single values can be forced over the file for reproducibility.
+*/
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include "fft.h"
+#include "strategy.h"
+#include "preset.h"
+
+#define TUNEPATHSIZE 512
+
+typedef struct {
+    FftTuning fft;
+    int threads;                // 0: all cores
+    StrategyLimits strategy;
+    PipelineCosts costs;
+} TuneConfig;
+
+char const * tune_variant(void);
+void tune_defaults(TuneConfig* c);
+int tune_default_path(char* path, int size);
+int tune_load(char const * file_name, TuneConfig* c);
+int tune_save(char const * file_name, TuneConfig* c);
+int tune_force(char const * spec, TuneConfig* c);
+void tune_report(TuneConfig* c);
+
+#endif
@@ -1,327 +1,1889 @@
-/*
-This program converts P6 PPM file to P5 PGM file. Works for 255 max values.
-Can be compiled normally with GCC without any flags or with makefile provided.
-Used from cmd - first arg is source file name (opens as rb), second arg is target file name (opens as wb).
-By Jakub Grabowski
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-
-#define BUFSIZE 256
-#define MAXGRAY 255
-#define MAXSIZE MAXGRAY+1
-#define KSIZE 3
-
-typedef struct {
-    unsigned char r, g, b;
-} Pixel;
-
-void error_handler(FILE* src, FILE* tgt, char* msg) {
-    printf("%s", msg);
-    if (src) fclose(src);
-    if (tgt) fclose(tgt);
-    exit(EXIT_FAILURE);
-}
-
-unsigned char round_clamp(double x) {
-    double xm = round(x);
-    if (x > 255) return 255;
-    if (x < 0) return 0;
-    return (unsigned char)x;
-}
-
-unsigned char ppm_to_pgm_avg(Pixel* pixel) {
-    return (pixel->r + pixel->g + pixel->b) / 3;
-}
-
-unsigned char ppm_to_pgm_weighted(Pixel* pixel) {
-    // magic numbers
-    double wr = 0.299, wg = 0.587, wb = 0.114; // weights sum up to 1, no division necessary 
-    double wsum = wr * pixel->r + wg * pixel->g + wb * pixel->b;
-    return round_clamp(wsum);
-}
-
-void histogram_transform(int size, unsigned char* grayscale) {
-    // create a histogram
-    // MAXGRAY+1 because there are bytes of MAXGRAY value (e.g. 256 values)
-    int hist[MAXSIZE] = {0};
-    for (int i = 0; i < size; i++) {
-        unsigned char val = grayscale[i];
-        hist[val]++;
-    }
-    
-    // compute gmin
-    int gmin = 0;
-    for (int i = 0; i < MAXSIZE; i++) {
-        if (hist[i] > 0) {
-            gmin = i;
-            break;
-        }
-    }
-
-    // compute c.img histogram
-    int histc[MAXSIZE] = {0};
-    histc[0] = 0;
-    for (int i = 1; i < MAXSIZE; i++) {
-        histc[i] = histc[i-1] + hist[i];
-    }
-    int hmin = histc[gmin];
-
-    // compute T values
-    unsigned char tvals[MAXSIZE] = {0};
-    for (int i = 1; i < MAXSIZE; i++) {
-        // happy casting
-        double val = MAXGRAY * ((double)(histc[i] - hmin) / (size - hmin));
-        tvals[i] = round_clamp(val);
-    }
-
-    // rewrite grayscale
-    for (int i = 0; i < size; i++) {
-        unsigned char val = grayscale[i];
-        grayscale[i] = tvals[val];
-    }
-}
-
-void gamma_transform(int size, unsigned char* grayscale, double gamma) {
-    // precompute gamma values
-    unsigned char lookup[MAXSIZE] = {0};
-    for (int i = 0; i < MAXSIZE; i++) {
-        double val = (double) i / MAXGRAY;
-        lookup[i] = round_clamp(MAXGRAY * pow(val, gamma));
-    }
-
-    for (int i = 0; i < size; i++) {
-        grayscale[i] = lookup[grayscale[i]];
-    }
-}
-
-unsigned char get_safe_gval(int width, int height, int i, int j, unsigned char* grayscale) {
-    // to avoid darkening on the edges, return nearest actual pixel from the img
-    int ii = i, jj = j;
-    if (i < 0) ii = 0;
-    if (j < 0) jj = 0;
-    if (i >= width) ii = width - 1;
-    if (j >= height) jj = height - 1;
-    return grayscale[jj * width + ii];
-}
-
-unsigned char* convolve_3x3(
-    int width, int height, unsigned char* grayscale, unsigned char* new_grayscale, double* kernel) {
-    for (int j = 0; j < height; j++) {
-        for (int i = 0; i < width; i++) {
-            double acc = 0;
-            for (int jj = 0; jj < KSIZE; jj++) {
-                for (int ii = 0; ii < KSIZE; ii++) {
-                    int ni = i + ii - 1;  // offset by kernel center
-                    int nj = j + jj - 1;
-
-                    double kval = kernel[jj * KSIZE + ii];
-                    unsigned char gval = get_safe_gval(width, height, ni, nj, grayscale);
-
-                    acc += kval * gval;
-                }
-            }
-            new_grayscale[j * width + i] = round_clamp(acc);
-        }
-    }
-}
-
-double arr_sum(int size, double* array) {
-    double S = 0;
-    for (int i = 0; i < size; i++) {
-        S += array[i];
-    }
-    return S;
-}
-
-double arr_mean(int size, double* array) {
-    return arr_sum(size, array) / size;
-}
-
-double arr_var(int size, double* probs, double* vals) {
-    double var = 0;
-    double mean = arr_mean(size, vals);
-    for (int i = 0; i < size; i++) {
-        var += probs[i] * pow(vals[i] - mean, 2);
-    }
-    return var;
-}
-
-void otsu_treshold(int size, unsigned char* grayscale) {
-    // create a histogram
-    // MAXGRAY+1 because there are bytes of MAXGRAY value (e.g. 256 values)
-    double histv[MAXSIZE] = {0};
-    double histp[MAXSIZE] = {0};
-    for (int i = 0; i < size; i++) {
-        unsigned char val = grayscale[i];
-        histv[val] += 1;
-    }
-    // normalize to calculate prob.
-    for (int i = 0; i < MAXSIZE; i++) {
-        histp[i] = histv[i] / size;
-    }
-
-    // calculate all possible tresholds
-    double vars[MAXSIZE-2] = {0};
-    for (int i = 0; i < MAXSIZE-2; i++) {
-        int size_b = i+1;
-        int size_f = MAXSIZE-i-1;
-        double* vslice_b = histv;
-        double* vslice_f = histv + size_b;
-        double* pslice_b = histp;
-        double* pslice_f = histp + size_b;
-
-        double var_b = arr_var(size_b, pslice_b, vslice_b);
-        double var_f = arr_var(size_f, pslice_f, vslice_f);
-        double om_b = arr_sum(size_b, pslice_b);
-        double om_f = arr_sum(size_f, pslice_f);
-
-        vars[i] = om_b * var_b + om_f * var_f;
-    }
-
-    // find min. var. threshold
-    double tvar = vars[0];
-    int th = 0;
-    for (int i = 1; i < MAXSIZE-2; i++) {
-        if (tvar > vars[i]) {
-            tvar = vars[i];
-            th = i;
-        }
-    }
-
-    // transform to black and white
-    for (int i = 0; i < size; i++) {
-        if (grayscale[i] > th) {
-            grayscale[i] = 255;
-        } else {
-            grayscale[i] = 0;
-        }
-    }
-}
-
-// args: $1: file to convert, $2: file to save the results to
-int main(int argc, char const *argv[]) {
-    if (argc != 3) {
-        printf("This program takes exactly 2 arguments.");
-        exit(EXIT_FAILURE);
-    }
-    char const * src_file_name = argv[1];
-    char const * res_file_name = argv[2];
-    FILE* src = fopen(src_file_name, "rb");
-    FILE* tgt = fopen(res_file_name, "wb");
-    
-    // file error handling
-    if (src == NULL || tgt == NULL) {
-        error_handler(src, tgt, "Could not open the files.");
-    }
-
-    char format[3], buffer[BUFSIZE];
-    int width, height, max_val, size;
-
-    // skip comment lines
-    do {
-        if (fgets(buffer, sizeof(buffer), src) == NULL) {
-            error_handler(src, tgt, "Unexpected end of file (1).");
-        }
-    } while (buffer[0] == '#');
-
-    // read magic (format ID)
-    if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '6') {
-        error_handler(src, tgt, "Bad file format.");
-    }
-
-    // skip comment lines before reading dimensions
-    do {
-        if (fgets(buffer, sizeof(buffer), src) == NULL) {
-            error_handler(src, tgt, "Unexpected end of file (2).");
-        }
-    } while (buffer[0] == '#');
-
-    if (sscanf(buffer, "%d %d", &width, &height) != 2) {
-        error_handler(src, tgt, "Invalid image dimensions.");
-    }
-
-    // skip comment lines before reading max value
-    do {
-        if (fgets(buffer, sizeof(buffer), src) == NULL) {
-            error_handler(src, tgt, "Unexpected end of file (3).");
-        }
-    } while (buffer[0] == '#');
-
-    if (sscanf(buffer, "%d", &max_val) != 1) {
-        error_handler(src, tgt, "Invalid max color value.");
-    }
-
-    if (max_val > MAXGRAY) {
-        error_handler(src, tgt, "Unsupported max value > 255.");
-    }
-
-    if (width < 1 || height < 1) {
-        error_handler(src, tgt, "Invalid image dimensions.");
-    }
-    size = width * height;
-
-    Pixel* pixels = (Pixel*)malloc(size * sizeof(Pixel));
-    if (pixels == NULL) {
-        free(pixels);
-        error_handler(src, tgt, "Could not allocate memory for the image.");
-    }
-
-    // read binary format
-    size_t bytes_read = fread(pixels, sizeof(Pixel), size, src);
-    if (bytes_read  != (size_t)(size)) {
-        free(pixels);
-        printf("Bytes read %ld. Supposed to be %d.", bytes_read, size);
-        error_handler(src, tgt, "Unexpected end of file (4).");
-    }
-    fclose(src);
-
-    // write header to target file
-    fprintf(tgt, "P5\n%d %d\n255\n", width, height);
-
-    unsigned char* grayscale = (unsigned char*)malloc(size);
-    if (!grayscale) {
-        free(pixels);
-        error_handler(src, tgt, "Memory allocation failed for grayscale data.");
-    }
-    
-    // write to grayscale
-    for (int i = 0; i < size; i++) {
-            // grayscale[i] = ppm_to_pgm_avg(&pixels[i]); // avg
-            grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
-    }
-    free(pixels);
-    
-    // transform grayscale with histogram
-    histogram_transform(size, grayscale);
-    // transform grayscale with gamma correction
-    gamma_transform(size, grayscale, 2.0);
-
-    // example approx. gaussian filter - can be changed to be any other 3x3 kernel
-    double kernel[KSIZE * KSIZE] = {
-        1.0 / 16, 2.0 / 16, 1.0 / 16,
-        2.0 / 16, 4.0 / 16, 2.0 / 16,
-        1.0 / 16, 2.0 / 16, 1.0 / 16
-    };
-
-    unsigned char* new_grayscale = (unsigned char*)malloc(size);
-    if (!new_grayscale) {
-        free(pixels);
-        free(new_grayscale);
-        error_handler(src, tgt, "Memory allocation failed for grayscale data manipulation.");
-    }
-    
-    convolve_3x3(width, height, grayscale, new_grayscale, kernel);
-
-    otsu_treshold(size, new_grayscale);
-
-    free(grayscale);
-    fwrite(new_grayscale, sizeof(unsigned char), size, tgt);
-    free(new_grayscale);
-
-    fclose(tgt);
-    printf("File converted successfully.\n");
-    return 0;
-}
+/*
+This program converts P6 PPM file to P5 PGM file. Works for 255 max values.
+Can be compiled normally with GCC without any flags or with makefile provided.
+Used from cmd - first arg is source file name (opens as rb), second arg is target file name (opens as wb).
+Optional args after these:
+    --threshold=M   otsu (default), kapur, yen, triangle, isodata, li or auto (picked from the histogram shape).
+    --sample=F      build histograms from a stratified sample of fraction F of the rows and columns,
+                    falls back to exact histograms when the sample is too sparse.
+    --match=FILE    match the histogram to a reference instead of equalizing it, FILE is a P5 PGM
+                    (its histogram is cached in FILE.hist) or a histogram saved with --save-hist.
+    --save-hist=FILE save the grayscale histogram of the input in the compact binary format.
+    --gamma=G|auto  gamma after equalization (default 2.0), auto brings the mean luminance to mid-gray.
+    --levels=auto   stretch between the 0.5% and 99.5% percentiles instead of equalizing.
+    --border=M      image edge for the filter: replicate (default), reflect or constant[:V].
+    --kernel=FILE   filter with this kernel instead of the 3x3 gaussian, FILE is "W H" followed by
+                    the weights, or a P5 PGM point spread function (normalized to sum 1).
+    --fft=auto|on|off filter in the frequency domain: auto (default) picks it for a --kernel when it is
+                    estimated to be faster, the built-in 3x3 stays direct unless it is on.
+    --deconvolve=NSR Wiener deconvolution of the --kernel blur with noise-to-signal ratio NSR.
+    --lowpass=S     gaussian low-pass with spatial sigma S instead of the kernel (frequency domain).
+    --highpass=S    the matching high-pass around mid-gray.
+    --threads=N     threads for the frequency-domain filter and tiled strategy (default: the tuned count, else
+                    all cores).
+    --unsharp=A[,R[,T]] sharpen instead of blurring: unsharp mask with amount A, radius R (default 1,
+                    the 3x3 gaussian) and threshold T gray levels (default 0), in one fixed-point sweep.
+    --guided=R[,E[,FILE]] edge-preserving guided filter instead of the blur, box radius R (1..127), regularization E
+                    (default 0.01 of the range squared), guided by the image itself or by the P5 PGM FILE
+                    of the same size; the cost does not depend on R, rows are split over --threads.
+    --flatfield=M[,S[,R]] normalize uneven illumination before equalization: divide by (M = divide) or
+                    subtract (M = subtract) a background estimated at 1/S resolution (S = 8..16, default 16)
+                    with radius R low resolution pixels (default 2).
+    --background=E  background estimate: close (default, grayscale closing then a blur, ignores text) or blur.
+    --corners=D     detect corners on the equalized grayscale before the filter: fast[:T] (FAST-9, T gray
+                    levels, default 20) or harris[:Q] (response above Q of the strongest, default 0.01).
+    --corner-grid=G keep the strongest corner of every G x G cell (default 16).
+    --keypoints=FILE write the corners as "x y score" lines (otherwise only their number is printed).
+    --find=FILE     locate the P5 PGM template FILE in the grayscale image by normalized cross-correlation,
+                    prints "x y score" of the best matches (top-left corner); --fft and --threads apply.
+    --find-count=K  report the K best non-overlapping matches (default 1).
+    --pyramid=L|auto search L levels of a 2x pyramid coarse to fine (auto: template stays >= 8 pixels).
+    --color         keep the colors and write P6: equalization, gamma and the filter work on luma only.
+    --color=channels same, but every RGB channel is processed on its own (for comparison).
+    --planar        with --color, store the image as aligned R, G, B planes split once while reading.
+    --stream[=FILE] run the default pipeline through the push API of stream.h, rows go in as they are read
+                    and out as they are final; FILE is a histogram (--save-hist) or P5 PGM of a similar
+                    image used for the tone curve, so only the threshold has to wait for the whole image.
+    --preset=exact|balanced|fast quality/speed trade-off (default: exact): balanced samples the histograms
+                    and crops a --kernel to 99% of its weight, fast filters the default pipeline at half the
+                    size; the approximations applied are printed, see preset.h.
+    --deadline=MS   processing budget: approximations are added, from the preset's up, until the time
+                    estimated from the tuning (--autotune) fits it.
+    --strategy=auto|fused|tiled|stream|whole how the default pipeline runs (default: auto, picked from the
+                    image size, see strategy.h): one thread, bands on --threads, streamed rows or
+                    the general whole-image path; the output is the same.
+    --verbose       print the strategy picked and its time.
+    --tile=X,Y,W,H  compute only this W x H region of the default pipeline's output (lazy evaluation),
+                    reading just the input it depends on; the global statistics take one pass (see --sample).
+    --tile-stats=FILE cache the statistics of --tile in FILE, later tiles of the same image and options reuse them.
+    --tune=FILE|off tuning file written by --autotune (default: the one of this host, see tune.h), off uses
+                    the built-in cost model.
+    --tune-set=N=V[,N=V] force tuned values (direct_cost, fft_cost, tile_factor, threads,
+                    small_pixels, huge_pixels, pixel_ns, tap_ns, rescale_ns) over the file.
+    --batch         many small images: the first arg is a text file listing P6 files (one per line), the second
+                    a directory for their P5 outputs (same base names, .pgm); the default pipeline runs on
+                    arenas of up to 4096 images with whole images per thread (see batch.h), --threshold, --gamma,
+                    --levels, --match and --threads apply; prints images/s.
+    --trace=FILE[,R] write a Chrome trace (chrome://tracing, Perfetto) of the stages, bands, fft tiles and
+                    batch images on every thread to FILE at exit; with R only that fraction of the runs is
+                    traced (see trace.h).
+Run as "zad1 --autotune[=FILE]" (no other args) to time the filter variants, fft tile sizes and thread
+counts of this host on synthetic data and save the winners to FILE (default: the host's tuning file).
+By Jakub Grabowski
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "histogram.h"
+#include "image.h"
+#include "fft.h"
+#include "background.h"
+#include "corners.h"
+#include "match.h"
+#include "stream.h"
+#include "tiles.h"
+#include "batch.h"
+#include "strategy.h"
+#include "preset.h"
+#include "trace.h"
+#include "filters.h"
+#include "tune.h"
+
+#define BUFSIZE 256
+#define MAXGRAY 255
+#define MAXSIZE (MAXGRAY+1)
+#define KSIZE 3
+#define TUNESIZE 1024           // synthetic image side for --autotune
+#define TUNERUNS 3              // best of
+#define MAXKERNEL 255
+#define PLANEALIGN 64
+
+typedef struct {
+    unsigned char r, g, b;
+} Pixel;
+
+typedef struct {
+    int width, height;
+    int stride;                 // bytes between rows, a multiple of PLANEALIGN
+    unsigned char* planes[3];   // R, G, B
+} PlanarImage;
+
+void error_handler(FILE* src, FILE* tgt, char* msg) {
+    printf("%s", msg);
+    if (src) fclose(src);
+    if (tgt) fclose(tgt);
+    exit(EXIT_FAILURE);
+}
+
+unsigned char round_clamp(double x) {
+    double xm = round(x);
+    if (x > 255) return 255;
+    if (x < 0) return 0;
+    return (unsigned char)x;
+}
+
+unsigned char ppm_to_pgm_avg(Pixel* pixel) {
+    return (pixel->r + pixel->g + pixel->b) / 3;
+}
+
+unsigned char ppm_to_pgm_weighted(Pixel* pixel) {
+    // magic numbers
+    double wr = 0.299, wg = 0.587, wb = 0.114; // weights sum up to 1, no division necessary 
+    double wsum = wr * pixel->r + wg * pixel->g + wb * pixel->b;
+    return round_clamp(wsum);
+}
+
+void histogram_transform(int width, int height, unsigned char* grayscale, double fraction) {
+    // create a histogram, from a stratified sample when fraction < 1
+    // MAXGRAY+1 because there are bytes of MAXGRAY value (e.g. 256 values)
+    int hist[MAXSIZE] = {0};
+    int n = gray_histogram(width, height, grayscale, fraction, hist);
+
+    unsigned char tvals[MAXSIZE] = {0};
+    histogram_lut(n, hist, tvals);
+
+    // rewrite grayscale
+    int size = width * height;
+    for (int i = 0; i < size; i++) {
+        unsigned char val = grayscale[i];
+        grayscale[i] = tvals[val];
+    }
+}
+
+void gamma_transform(int size, unsigned char* grayscale, double gamma) {
+    // precompute gamma values
+    unsigned char lookup[MAXSIZE] = {0};
+    gamma_lut(gamma, lookup);
+
+    for (int i = 0; i < size; i++) {
+        grayscale[i] = lookup[grayscale[i]];
+    }
+}
+
+void point_transform(int size, unsigned char* grayscale, int* hist, int n, PointParams* pp) {
+    // equalization (matching or levels) and gamma composed into one LUT, one pass over grayscale
+    // hist holds n px and comes from the grayscale pass, so there is no histogram pass here
+    unsigned char lut[MAXSIZE] = {0};
+    point_lut(n, hist, pp, lut);
+    report_point_params(pp);
+
+    for (int i = 0; i < size; i++) {
+        grayscale[i] = lut[grayscale[i]];
+    }
+}
+
+unsigned char get_safe_gval(int width, int height, int i, int j, unsigned char* grayscale) {
+    // to avoid darkening on the edges, return nearest actual pixel from the img
+    int ii = i, jj = j;
+    if (i < 0) ii = 0;
+    if (j < 0) jj = 0;
+    if (i >= width) ii = width - 1;
+    if (j >= height) jj = height - 1;
+    return grayscale[jj * width + ii];
+}
+
+unsigned char* convolve_3x3(
+    int width, int height, unsigned char* grayscale, unsigned char* new_grayscale, double* kernel) {
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            double acc = 0;
+            for (int jj = 0; jj < KSIZE; jj++) {
+                for (int ii = 0; ii < KSIZE; ii++) {
+                    int ni = i + ii - 1;  // offset by kernel center
+                    int nj = j + jj - 1;
+
+                    double kval = kernel[jj * KSIZE + ii];
+                    unsigned char gval = get_safe_gval(width, height, ni, nj, grayscale);
+
+                    acc += kval * gval;
+                }
+            }
+            new_grayscale[j * width + i] = round_clamp(acc);
+        }
+    }
+}
+
+int treshold_transform(
+    int width, int height, unsigned char* grayscale, TresholdMethod method, double fraction) {
+    // create a histogram, from a stratified sample when fraction < 1
+    int size = width * height;
+    int hist[MAXSIZE] = {0};
+    int n = gray_histogram(width, height, grayscale, fraction, hist);
+    HistStats st;
+    hist_stats(n, hist, &st);
+    if (method == TH_AUTO) {
+        method = auto_treshold_method(&st);
+        printf("Auto threshold method: %s.\n", treshold_method_name(method));
+    }
+    int th = hist_treshold(&st, method);
+
+    // transform to black and white
+    for (int i = 0; i < size; i++) {
+        if (grayscale[i] > th) {
+            grayscale[i] = 255;
+        } else {
+            grayscale[i] = 0;
+        }
+    }
+    return th;
+}
+
+void convolve_3x3_padded(PaddedImage* src, unsigned char* new_grayscale, double* kernel) {
+    // convolve_3x3 without get_safe_gval, the guard border supplies the edge pixels
+    // same multiply-add order per pixel as convolve_3x3, so the results are identical
+    int width = src->width, stride = src->stride;
+    for (int j = 0; j < src->height; j++) {
+        unsigned char* row = &src->px[j * stride];
+        unsigned char* out = &new_grayscale[j * width];
+        int i = 0;
+#if defined(__SSE2__)
+        // 8 px per step, in four pairs of double lanes
+        const __m128i zero = _mm_setzero_si128();
+        const __m128d lo = _mm_setzero_pd();
+        const __m128d hi = _mm_set1_pd(MAXGRAY);
+        for (; i <= width - 8; i += 8) {
+            __m128d acc[4] = {lo, lo, lo, lo};
+            for (int jj = 0; jj < KSIZE; jj++) {
+                for (int ii = 0; ii < KSIZE; ii++) {
+                    __m128d k = _mm_set1_pd(kernel[jj * KSIZE + ii]);
+                    __m128i v = _mm_loadl_epi64((__m128i*)&row[(jj - 1) * stride + i + ii - 1]);
+                    __m128i w = _mm_unpacklo_epi8(v, zero);
+                    __m128i a = _mm_unpacklo_epi16(w, zero);
+                    __m128i b = _mm_unpackhi_epi16(w, zero);
+                    acc[0] = _mm_add_pd(acc[0], _mm_mul_pd(k, _mm_cvtepi32_pd(a)));
+                    acc[1] = _mm_add_pd(acc[1], _mm_mul_pd(k, _mm_cvtepi32_pd(_mm_srli_si128(a, 8))));
+                    acc[2] = _mm_add_pd(acc[2], _mm_mul_pd(k, _mm_cvtepi32_pd(b)));
+                    acc[3] = _mm_add_pd(acc[3], _mm_mul_pd(k, _mm_cvtepi32_pd(_mm_srli_si128(b, 8))));
+                }
+            }
+            // clamp and truncate like round_clamp
+            __m128i q[4];
+            for (int k = 0; k < 4; k++) {
+                q[k] = _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(acc[k], lo), hi));
+            }
+            __m128i a = _mm_unpacklo_epi64(q[0], q[1]);
+            __m128i b = _mm_unpacklo_epi64(q[2], q[3]);
+            __m128i p = _mm_packs_epi32(a, b);
+            _mm_storel_epi64((__m128i*)&out[i], _mm_packus_epi16(p, p));
+        }
+#endif
+        // branch-free scalar loop for the rest
+        for (; i < width; i++) {
+            double acc = 0;
+            for (int jj = 0; jj < KSIZE; jj++) {
+                for (int ii = 0; ii < KSIZE; ii++) {
+                    acc += kernel[jj * KSIZE + ii] * row[(jj - 1) * stride + i + ii - 1];
+                }
+            }
+            out[i] = round_clamp(acc);
+        }
+    }
+}
+
+void convolve_padded(PaddedImage* src, unsigned char* new_grayscale, double* kernel, int kw, int kh) {
+    // any kw x kh kernel centered at (kw/2, kh/2), the border has to be at least max(kw, kh)/2
+    int width = src->width, stride = src->stride, cx = kw / 2, cy = kh / 2;
+    for (int j = 0; j < src->height; j++) {
+        unsigned char* row = &src->px[j * stride];
+        unsigned char* out = &new_grayscale[j * width];
+        for (int i = 0; i < width; i++) {
+            double acc = 0;
+            for (int jj = 0; jj < kh; jj++) {
+                unsigned char* in = &row[(jj - cy) * stride + i - cx];
+                for (int ii = 0; ii < kw; ii++) {
+                    acc += kernel[jj * kw + ii] * in[ii];
+                }
+            }
+            out[i] = round_clamp(acc);
+        }
+    }
+}
+
+double* read_kernel(char const * file_name, int* kw, int* kh) {
+    // text "W H" followed by W*H weights row by row, or a P5 PGM point spread function
+    // which is normalized to sum 1 (e.g. a drawn motion blur path)
+    FILE* f = fopen(file_name, "rb");
+    if (!f) return NULL;
+    char magic[3] = {0};
+    int max_val = 0, ok;
+    if (fscanf(f, "%2s", magic) == 1 && strcmp(magic, "P5") == 0) {
+        ok = fscanf(f, "%d %d %d", kw, kh, &max_val) == 3 && fgetc(f) != EOF && max_val <= MAXGRAY;
+    } else {
+        rewind(f);
+        ok = fscanf(f, "%d %d", kw, kh) == 2;
+    }
+    if (!ok || *kw < 1 || *kh < 1 || *kw > MAXKERNEL || *kh > MAXKERNEL) {
+        fclose(f);
+        return NULL;
+    }
+    int n = *kw * *kh;
+    double* kernel = (double*)malloc(n * sizeof(double));
+    if (!kernel) {
+        fclose(f);
+        return NULL;
+    }
+    if (max_val) {
+        double sum = 0;
+        for (int i = 0; i < n && ok; i++) {
+            int c = fgetc(f);
+            ok = c != EOF;
+            kernel[i] = c;
+            sum += c;
+        }
+        ok = ok && sum > 0;
+        for (int i = 0; i < n && ok; i++) kernel[i] /= sum;
+    } else {
+        for (int i = 0; i < n && ok; i++) ok = fscanf(f, "%lf", &kernel[i]) == 1;
+    }
+    fclose(f);
+    if (!ok) {
+        free(kernel);
+        return NULL;
+    }
+    return kernel;
+}
+
+double elapsed_ms(struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+typedef struct {
+    FILE* f;
+    off_t data;                 // offset of the first pixel
+    int width;
+} RegionFile;
+
+int read_region(void* user, int x, int y, int w, int h, unsigned char* dst) {
+    // tile reader: one seek per row of the region, the rest of the file is never touched
+    RegionFile* rf = (RegionFile*)user;
+    for (int j = 0; j < h; j++) {
+        if (fseeko(rf->f, rf->data + ((off_t)(y + j) * rf->width + x) * 3, SEEK_SET) != 0
+            || fread(&dst[(size_t)j * w * 3], 3, w, rf->f) != (size_t)w) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int read_ppm_header(FILE* f, int* width, int* height) {
+    // the header of a P6 with max value <= 255 as main reads it, 0 when it is not one
+    char buffer[BUFSIZE], format[3];
+    int max_val;
+    for (int field = 0; field < 3; field++) {
+        do {
+            if (fgets(buffer, sizeof(buffer), f) == NULL) return 0;
+        } while (buffer[0] == '#');
+        if (field == 0 && (sscanf(buffer, "%2s", format) != 1 || strcmp(format, "P6") != 0)) return 0;
+        if (field == 1 && (sscanf(buffer, "%d %d", width, height) != 2 || *width < 1 || *height < 1)) return 0;
+        if (field == 2 && (sscanf(buffer, "%d", &max_val) != 1 || max_val > MAXGRAY)) return 0;
+    }
+    return 1;
+}
+
+static int write_batch(Batch* b, char (*names)[BUFSIZE * 2]) {
+    // every output of the batch as a P5, returns the number that could not be written
+    int failed = 0;
+    for (int k = 0; k < b->count; k++) {
+        BatchImage* im = &b->images[k];
+        FILE* f = fopen(names[k], "wb");
+        int ok = f && fprintf(f, "P5\n%d %d\n255\n", im->width, im->height) > 0
+            && fwrite(&b->out[im->offset], 1, (size_t)im->width * im->height, f) == (size_t)im->width * im->height;
+        if (f && fclose(f) != 0) ok = 0;
+        if (!ok) {
+            printf("Could not write %s.\n", names[k]);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int run_batch(char const * list_name, char const * out_dir, PointParams* pp, TresholdMethod method, int threads) {
+    // files are read into the arena until it is full, then the arena is processed and written out
+    FILE* list = fopen(list_name, "r");
+    Batch b;
+    char (*names)[BUFSIZE * 2] = (char (*)[BUFSIZE * 2])malloc(BATCHIMAGES * sizeof(*names));
+    if (!list || !names || !batch_alloc(&b, BATCHIMAGES, BATCHPIXELS)) {
+        printf("Could not open %s or allocate the batch.", list_name);
+        exit(EXIT_FAILURE);
+    }
+    char line[BUFSIZE * 2];
+    int images = 0, failed = 0, done = 0;
+    double load_ms = 0, run_ms = 0, write_ms = 0;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (!done) {
+        done = fgets(line, sizeof(line), list) == NULL;
+        line[strcspn(line, "\r\n")] = 0;
+        int width = 0, height = 0;
+        FILE* f = NULL;
+        if (!done && line[0]) {
+            f = fopen(line, "rb");
+            if (!f || !read_ppm_header(f, &width, &height) || (size_t)width * height > BATCHPIXELS) {
+                printf("Could not read %s.\n", line);
+                if (f) fclose(f);
+                f = NULL;
+                failed++;
+            }
+        }
+        unsigned char* dst = f ? batch_add(&b, width, height) : NULL;
+        if ((f && !dst) || (done && b.count > 0)) {
+            // arena full (or the list is over): process it and start over
+            load_ms += elapsed_ms(&t0);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (!batch_run(&b, pp, method, threads)) {
+                printf("Could not allocate the batch scratch.");
+                exit(EXIT_FAILURE);
+            }
+            run_ms += elapsed_ms(&t0);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            failed += write_batch(&b, names);
+            images += b.count;
+            write_ms += elapsed_ms(&t0);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            batch_clear(&b);
+            if (f) dst = batch_add(&b, width, height);
+        }
+        if (!f) continue;
+        size_t n = (size_t)width * height * 3;
+        if (fread(dst, 1, n, f) != n) {
+            printf("Could not read %s.\n", line);
+            b.count--;
+            b.pixels -= n / 3;
+            failed++;
+        } else {
+            // the output name: the base name with .pgm, in out_dir
+            char const * base = strrchr(line, '/') ? strrchr(line, '/') + 1 : line;
+            char const * dot = strrchr(base, '.');
+            int len = dot && dot != base ? (int)(dot - base) : (int)strlen(base);
+            snprintf(names[b.count - 1], sizeof(*names), "%s/%.*s.pgm", out_dir, len, base);
+        }
+        fclose(f);
+    }
+    load_ms += elapsed_ms(&t0);
+    fclose(list);
+    batch_free(&b);
+    free(names);
+    double total = load_ms + run_ms + write_ms;
+    printf("Batch: %d images, %d failed; read %.2f ms, process %.2f ms (%.0f images/s), write %.2f ms.\n",
+        images, failed, load_ms, run_ms, images / (run_ms > 0 ? run_ms / 1e3 : 1e-9), write_ms);
+    printf("Overall %.0f images/s.\n", images / (total > 0 ? total / 1e3 : 1e-9));
+    return failed == 0;
+}
+
+static double tune_time(PaddedImage* img, unsigned char* out, double* kernel, int kw, FreqFilter* ff, int threads) {
+    // best of TUNERUNS runs of the direct filter (ff NULL) or of the fft one, ms
+    double best = 0;
+    for (int k = 0; k < TUNERUNS; k++) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (ff) freq_filter_apply(ff, img, out, threads);
+        else convolve_padded(img, out, kernel, kw, kw);
+        double ms = elapsed_ms(&t0);
+        if (k == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+int autotune(char const * file_name) {
+    // the fft cost model in units of the direct filter, then the tile factor, the thread count and
+    // the per-pixel costs of the deadline planner
+    TuneConfig c;
+    tune_defaults(&c);
+    fft_tuning(&c.fft);
+    int n = TUNESIZE, cores = sysconf(_SC_NPROCESSORS_ONLN);
+    PaddedImage img;
+    unsigned char* out = (unsigned char*)malloc((size_t)n * n);
+    double kernel[15 * 15];
+    if (!out || !padded_alloc(&img, n, n, 7)) {
+        free(out);
+        printf("Could not allocate the synthetic image.");
+        return 0;
+    }
+    // gradients with noise, the timings hardly depend on the content
+    unsigned int seed = 1;
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;
+            img.px[j * img.stride + i] = (i + 2 * j + (seed >> 26)) & MAXGRAY;
+        }
+    }
+    padded_fill_border(&img, BORDER_REPLICATE, 0);
+
+    // cost units: a direct tap per pixel costs DIRECTCOST of them
+    for (int i = 0; i < 81; i++) kernel[i] = 1.0 / 81;
+    double direct = tune_time(&img, out, kernel, 9, NULL, 1);
+    double unit = direct * 1e6 / ((double)n * n * 81) / DIRECTCOST;
+    c.costs.tap_ns = direct * 1e6 / ((double)n * n * 81);
+    printf("Direct 9x9: %.2f ms, %.3f ns per tap and pixel.\n", direct, c.costs.tap_ns);
+    FreqFilter ff = {0};
+    int ok = freq_filter_kernel(&ff, kernel, 9, 9, n);
+    double fft = ok ? tune_time(&img, out, NULL, 0, &ff, 1) : 0;
+    if (ok) {
+        // solve fft_preferred's estimate for the fft cost
+        int block = ff.n - 2 * ff.margin;
+        double outputs = (double)(block < n ? block : n) * (block < n ? block : n);
+        double per_output = fft * 1e6 / ((double)n * n) / unit;
+        double cost = (per_output * outputs * 2 / ((double)ff.n * ff.n) - 6) / (2 * log2((double)ff.n * ff.n));
+        c.fft.fft_cost = cost > 0.05 ? cost : 0.05;
+        printf("Fft 9x9 (%dx%d tiles): %.2f ms, fft cost %.3f.\n", ff.n, ff.n, fft, c.fft.fft_cost);
+    }
+    freq_filter_free(&ff);
+
+    // tile factor for a 15x15 kernel, factors that give the same tile are timed once
+    for (int i = 0; i < 225; i++) kernel[i] = 1.0 / 225;
+    double best = 0;
+    int last = 0, best_factor = FFTTILEFACTOR;
+    for (int factor = 4; ok && factor <= 32; factor *= 2) {
+        c.fft.tile_factor = factor;
+        fft_tuning(&c.fft);
+        if (fft_tile_size(7, n) == last) continue;
+        last = fft_tile_size(7, n);
+        ok = freq_filter_kernel(&ff, kernel, 15, 15, n);
+        double ms = ok ? tune_time(&img, out, NULL, 0, &ff, 1) : 0;
+        freq_filter_free(&ff);
+        if (!ok) break;
+        printf("Fft 15x15, tile factor %d (%dx%d tiles): %.2f ms.\n", factor, last, last, ms);
+        if (best == 0 || ms < best) {
+            best = ms;
+            best_factor = factor;
+        }
+    }
+    c.fft.tile_factor = best_factor;
+    fft_tuning(&c.fft);
+
+    // threads 1, 2, 4.. and all cores: the fewest within 5% of the fastest
+    int counts[64], tried = 0;
+    double times[64];
+    best = 0;
+    ok = ok && freq_filter_kernel(&ff, kernel, 15, 15, n);
+    for (int t = 1; ok && tried < 64; t *= 2) {
+        counts[tried] = t < cores ? t : cores;
+        times[tried] = tune_time(&img, out, NULL, 0, &ff, counts[tried]);
+        printf("Fft 15x15, %d threads: %.2f ms.\n", counts[tried], times[tried]);
+        if (best == 0 || times[tried] < best) best = times[tried];
+        if (counts[tried++] == cores) break;
+    }
+    for (int k = 0; k < tried; k++) {
+        if (times[k] <= best * 1.05) {
+            c.threads = counts[k];
+            break;
+        }
+    }
+    freq_filter_free(&ff);
+
+    // the default pipeline, fused, per pixel
+    unsigned char* rgb = ok ? (unsigned char*)malloc((size_t)n * n * 3) : NULL;
+    if (rgb) {
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                unsigned char v = img.px[j * img.stride + i];
+                unsigned char* p = &rgb[((size_t)j * n + i) * 3];
+                p[0] = v;
+                p[1] = v ^ (i & 31);
+                p[2] = v ^ (j & 31);
+            }
+        }
+        // and at half the size, what is not a quarter of the full-size cost is the rescaling
+        for (int scale = 1; scale <= 2; scale++) {
+            PointParams pp = {.ref_hist = NULL, .auto_levels = 0, .gamma = 2.0};
+            StrategyRun r = {n, n, rgb, NULL, &pp, TH_OTSU, 1, scale, 0, TH_OTSU};
+            double ms = 0;
+            for (int k = 0; k < TUNERUNS; k++) {
+                // with a fresh output as zad1 has, its page faults are part of the cost
+                struct timespec t0;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                r.out = (unsigned char*)malloc((size_t)n * n);
+                if (r.out) strategy_run(&r, 1);
+                free(r.out);
+                double t = elapsed_ms(&t0);
+                if (k == 0 || t < ms) ms = t;
+            }
+            double ns = ms * 1e6 / ((double)n * n);
+            if (scale == 1) c.costs.pixel_ns = ns;
+            else c.costs.rescale_ns = ns > c.costs.pixel_ns / 4 ? ns - c.costs.pixel_ns / 4 : 0;
+            printf("Default pipeline, fused at 1/%d: %.2f ms, %.3f ns per pixel.\n", scale, ms, ns);
+        }
+    }
+    free(rgb);
+    padded_free(&img);
+    free(out);
+    if (!ok) {
+        printf("Could not allocate the frequency-domain filter.");
+        return 0;
+    }
+    tune_report(&c);
+    char path[TUNEPATHSIZE];
+    if (!file_name && tune_default_path(path, sizeof(path))) file_name = path;
+    if (!file_name || !tune_save(file_name, &c)) {
+        printf("Could not save the tuning.");
+        return 0;
+    }
+    printf("Saved to %s.\n", file_name);
+    return 1;
+}
+
+void write_row(void* user, int y, unsigned char const * row, int width) {
+    // stream callback, rows come in order so y is not needed
+    (void)y;
+    fwrite(row, sizeof(unsigned char), width, (FILE*)user);
+}
+
+void rgb_to_luma(int size, Pixel* pixels, unsigned char* luma) {
+    // fixed-point luma, same 8-bit weights as zad5 (77 + 150 + 29 = 256)
+    int i = 0;
+#if defined(__ARM_NEON)
+    const uint8x16_t wr = vdupq_n_u8(77);
+    const uint8x16_t wg = vdupq_n_u8(150);
+    const uint8x16_t wb = vdupq_n_u8(29);
+    for (; i <= size - 16; i += 16) {
+        uint8x16x3_t rgb = vld3q_u8((uint8_t*)&pixels[i]); // load RGB into separate 16-lanes
+        uint16x8_t lo = vmull_u8(vget_low_u8(rgb.val[0]), vget_low_u8(wr));
+        lo = vmlal_u8(lo, vget_low_u8(rgb.val[1]), vget_low_u8(wg));
+        lo = vmlal_u8(lo, vget_low_u8(rgb.val[2]), vget_low_u8(wb));
+        uint16x8_t hi = vmull_u8(vget_high_u8(rgb.val[0]), vget_high_u8(wr));
+        hi = vmlal_u8(hi, vget_high_u8(rgb.val[1]), vget_high_u8(wg));
+        hi = vmlal_u8(hi, vget_high_u8(rgb.val[2]), vget_high_u8(wb));
+        vst1q_u8(&luma[i], vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8))); // div. 256
+    }
+#endif
+    // plain loop, vectorized by the compiler at -O3 on other targets
+    for (; i < size; i++) {
+        luma[i] = (77 * pixels[i].r + 150 * pixels[i].g + 29 * pixels[i].b) >> 8;
+    }
+}
+
+void convolve_3x3_row(
+    int width, unsigned char* above, unsigned char* row, unsigned char* below, double* kernel, unsigned char* out) {
+    // one output row of convolve_3x3, the caller passes the clamped neighbour rows
+    unsigned char* rows[KSIZE] = {above, row, below};
+    for (int i = 0; i < width; i++) {
+        double acc = 0;
+        for (int jj = 0; jj < KSIZE; jj++) {
+            for (int ii = 0; ii < KSIZE; ii++) {
+                int ni = i + ii - 1;  // offset by kernel center
+                if (ni < 0) ni = 0;
+                if (ni >= width) ni = width - 1;
+                acc += kernel[jj * KSIZE + ii] * rows[jj][ni];
+            }
+        }
+        out[i] = round_clamp(acc);
+    }
+}
+
+void add_luma_delta(int n, unsigned char* rgb, unsigned char* pos, unsigned char* neg, unsigned char* out) {
+    // out = clamp(rgb + pos - neg) per byte, the channels never need to be separated
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i <= n - 16; i += 16) {
+        __m128i p = _mm_loadu_si128((__m128i*)&rgb[i]);
+        p = _mm_adds_epu8(p, _mm_loadu_si128((__m128i*)&pos[i]));
+        p = _mm_subs_epu8(p, _mm_loadu_si128((__m128i*)&neg[i]));
+        _mm_storeu_si128((__m128i*)&out[i], p);
+    }
+#elif defined(__ARM_NEON)
+    for (; i <= n - 16; i += 16) {
+        uint8x16_t p = vqaddq_u8(vld1q_u8(&rgb[i]), vld1q_u8(&pos[i]));
+        vst1q_u8(&out[i], vqsubq_u8(p, vld1q_u8(&neg[i])));
+    }
+#endif
+    // scalar fallback for remaining bytes
+    for (; i < n; i++) {
+        int v = rgb[i] + pos[i] - neg[i];
+        out[i] = v > MAXGRAY ? MAXGRAY : v < 0 ? 0 : v;
+    }
+}
+
+int color_transform(
+    int width, int height, Pixel* pixels, double fraction, PointParams* pp, double* kernel, FILE* tgt) {
+    // Y is processed, chroma is carried as the differences R-Y, G-Y, B-Y (YCbCr up to constant scales),
+    // so going back to RGB is R' = R + Y' - Y and never quantizes chroma
+    // pass 1: luma + histogram, pass 2: LUT, convolution and back to RGB fused row by row
+    int size = width * height;
+    unsigned char* luma = (unsigned char*)malloc(size);
+    unsigned char* ring = (unsigned char*)malloc(KSIZE * width);
+    unsigned char* new_luma = (unsigned char*)malloc(width);
+    unsigned char* pos = (unsigned char*)malloc(3 * width);
+    unsigned char* neg = (unsigned char*)malloc(3 * width);
+    unsigned char* out = (unsigned char*)malloc(3 * width);
+    if (!luma || !ring || !new_luma || !pos || !neg || !out) {
+        free(luma);
+        free(ring);
+        free(new_luma);
+        free(pos);
+        free(neg);
+        free(out);
+        return 0;
+    }
+
+    rgb_to_luma(size, pixels, luma);
+    int hist[MAXSIZE] = {0};
+    int n = gray_histogram(width, height, luma, fraction, hist);
+    unsigned char lut[MAXSIZE] = {0};
+    point_lut(n, hist, pp, lut);
+    report_point_params(pp);
+
+    // ring of LUT-mapped rows, row j lives in slot j % KSIZE
+    int next = 0;
+    for (int j = 0; j < height; j++) {
+        for (; next <= j + 1 && next < height; next++) {
+            unsigned char* slot = &ring[(next % KSIZE) * width];
+            for (int i = 0; i < width; i++) {
+                slot[i] = lut[luma[next * width + i]];
+            }
+        }
+        unsigned char* above = &ring[((j > 0 ? j - 1 : 0) % KSIZE) * width];
+        unsigned char* row = &ring[(j % KSIZE) * width];
+        unsigned char* below = &ring[((j < height - 1 ? j + 1 : j) % KSIZE) * width];
+        convolve_3x3_row(width, above, row, below, kernel, new_luma);
+
+        for (int i = 0; i < width; i++) {
+            int d = new_luma[i] - luma[j * width + i];
+            unsigned char dp = d > 0 ? d : 0;
+            unsigned char dn = d < 0 ? -d : 0;
+            pos[3 * i] = pos[3 * i + 1] = pos[3 * i + 2] = dp;
+            neg[3 * i] = neg[3 * i + 1] = neg[3 * i + 2] = dn;
+        }
+        add_luma_delta(3 * width, (unsigned char*)&pixels[j * width], pos, neg, out);
+        fwrite(out, sizeof(unsigned char), 3 * width, tgt);
+    }
+
+    free(luma);
+    free(ring);
+    free(new_luma);
+    free(pos);
+    free(neg);
+    free(out);
+    return 1;
+}
+
+int channels_transform(
+    int width, int height, Pixel* pixels, double fraction, PointParams* pp, double* kernel, FILE* tgt) {
+    // reference for --color: R, G and B each equalized, gamma corrected and convolved on their own
+    int size = width * height;
+    unsigned char* plane = (unsigned char*)malloc(size);
+    unsigned char* new_plane = (unsigned char*)malloc(size);
+    if (!plane || !new_plane) {
+        free(plane);
+        free(new_plane);
+        return 0;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        unsigned char* channel = (unsigned char*)pixels + c;
+        for (int i = 0; i < size; i++) {
+            plane[i] = channel[3 * i];
+        }
+        int hist[MAXSIZE] = {0};
+        int n = gray_histogram(width, height, plane, fraction, hist);
+        point_transform(size, plane, hist, n, pp);
+        convolve_3x3(width, height, plane, new_plane, kernel);
+        for (int i = 0; i < size; i++) {
+            channel[3 * i] = new_plane[i];
+        }
+    }
+    fwrite(pixels, sizeof(Pixel), size, tgt);
+
+    free(plane);
+    free(new_plane);
+    return 1;
+}
+
+int planar_alloc(PlanarImage* img, int width, int height) {
+    // one block, every row of every plane starts on a PLANEALIGN boundary
+    img->width = width;
+    img->height = height;
+    img->stride = (width + PLANEALIGN - 1) / PLANEALIGN * PLANEALIGN;
+    size_t plane_size = (size_t)img->stride * height;
+    unsigned char* block = (unsigned char*)aligned_alloc(PLANEALIGN, 3 * plane_size);
+    if (!block) return 0;
+    for (int c = 0; c < 3; c++) {
+        img->planes[c] = block + c * plane_size;
+    }
+    return 1;
+}
+
+void planar_free(PlanarImage* img) {
+    free(img->planes[0]);
+}
+
+void deinterleave_row(int width, unsigned char* rgb, unsigned char* r, unsigned char* g, unsigned char* b) {
+    int i = 0;
+#if defined(__SSSE3__)
+    // 48 bytes -> 16 R, 16 G, 16 B, every output gathers from the three loads and ORs the parts
+    const __m128i ra = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i rb = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i rc = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i ga = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i gb = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i gc = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i ba = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i bb = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i bc = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    for (; i <= width - 16; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i*)&rgb[3 * i]);
+        __m128i m = _mm_loadu_si128((__m128i*)&rgb[3 * i + 16]);
+        __m128i z = _mm_loadu_si128((__m128i*)&rgb[3 * i + 32]);
+        _mm_storeu_si128((__m128i*)&r[i], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, ra), _mm_shuffle_epi8(m, rb)), _mm_shuffle_epi8(z, rc)));
+        _mm_storeu_si128((__m128i*)&g[i], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, ga), _mm_shuffle_epi8(m, gb)), _mm_shuffle_epi8(z, gc)));
+        _mm_storeu_si128((__m128i*)&b[i], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, ba), _mm_shuffle_epi8(m, bb)), _mm_shuffle_epi8(z, bc)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i <= width - 16; i += 16) {
+        uint8x16x3_t px = vld3q_u8(&rgb[3 * i]); // load RGB into separate 16-lanes
+        vst1q_u8(&r[i], px.val[0]);
+        vst1q_u8(&g[i], px.val[1]);
+        vst1q_u8(&b[i], px.val[2]);
+    }
+#endif
+    // scalar fallback for remaining pixels
+    for (; i < width; i++) {
+        r[i] = rgb[3 * i];
+        g[i] = rgb[3 * i + 1];
+        b[i] = rgb[3 * i + 2];
+    }
+}
+
+void interleave_row(int width, unsigned char* r, unsigned char* g, unsigned char* b, unsigned char* rgb) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    for (; i <= width - 16; i += 16) {
+        uint8x16x3_t px;
+        px.val[0] = vld1q_u8(&r[i]);
+        px.val[1] = vld1q_u8(&g[i]);
+        px.val[2] = vld1q_u8(&b[i]);
+        vst3q_u8(&rgb[3 * i], px);
+    }
+#endif
+    for (; i < width; i++) {
+        rgb[3 * i] = r[i];
+        rgb[3 * i + 1] = g[i];
+        rgb[3 * i + 2] = b[i];
+    }
+}
+
+int read_planar(FILE* src, PlanarImage* img) {
+    // the pixel data is read row by row and split into the planes right away
+    int width = img->width;
+    unsigned char* row = (unsigned char*)malloc(3 * width);
+    if (!row) return 0;
+    for (int j = 0; j < img->height; j++) {
+        if (fread(row, 3, width, src) != (size_t)width) {
+            free(row);
+            return 0;
+        }
+        int o = j * img->stride;
+        deinterleave_row(width, row, &img->planes[0][o], &img->planes[1][o], &img->planes[2][o]);
+    }
+    free(row);
+    return 1;
+}
+
+void planar_to_luma(PlanarImage* img, unsigned char* luma) {
+    // same fixed-point weights as rgb_to_luma, but with plain vector loads of each plane
+    for (int j = 0; j < img->height; j++) {
+        int o = j * img->stride;
+        unsigned char* r = &img->planes[0][o];
+        unsigned char* g = &img->planes[1][o];
+        unsigned char* b = &img->planes[2][o];
+        unsigned char* y = &luma[o];
+        int i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i wr = _mm_set1_epi16(77);
+        const __m128i wg = _mm_set1_epi16(150);
+        const __m128i wb = _mm_set1_epi16(29);
+        for (; i <= img->width - 16; i += 16) {
+            __m128i vr = _mm_load_si128((__m128i*)&r[i]);
+            __m128i vg = _mm_load_si128((__m128i*)&g[i]);
+            __m128i vb = _mm_load_si128((__m128i*)&b[i]);
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vr, zero), wr),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vg, zero), wg)),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vr, zero), wr),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vg, zero), wg)),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+            _mm_store_si128((__m128i*)&y[i], _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+#elif defined(__ARM_NEON)
+        for (; i <= img->width - 16; i += 16) {
+            uint8x16_t vr = vld1q_u8(&r[i]), vg = vld1q_u8(&g[i]), vb = vld1q_u8(&b[i]);
+            uint16x8_t lo = vmull_u8(vget_low_u8(vr), vdup_n_u8(77));
+            lo = vmlal_u8(lo, vget_low_u8(vg), vdup_n_u8(150));
+            lo = vmlal_u8(lo, vget_low_u8(vb), vdup_n_u8(29));
+            uint16x8_t hi = vmull_u8(vget_high_u8(vr), vdup_n_u8(77));
+            hi = vmlal_u8(hi, vget_high_u8(vg), vdup_n_u8(150));
+            hi = vmlal_u8(hi, vget_high_u8(vb), vdup_n_u8(29));
+            vst1q_u8(&y[i], vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+#endif
+        for (; i < img->width; i++) {
+            y[i] = (77 * r[i] + 150 * g[i] + 29 * b[i]) >> 8;
+        }
+    }
+}
+
+void filter_plane_rows(
+    int width, int height, int stride, unsigned char* plane, unsigned char* lut, double* kernel,
+    unsigned char* ring, unsigned char* out, int j, int* next) {
+    // brings LUT-mapped rows up to j + 1 into the ring (slot = row % KSIZE) and convolves row j into out
+    for (; *next <= j + 1 && *next < height; (*next)++) {
+        unsigned char* slot = &ring[(*next % KSIZE) * width];
+        unsigned char* src = &plane[*next * stride];
+        for (int i = 0; i < width; i++) {
+            slot[i] = lut[src[i]];
+        }
+    }
+    unsigned char* above = &ring[((j > 0 ? j - 1 : 0) % KSIZE) * width];
+    unsigned char* row = &ring[(j % KSIZE) * width];
+    unsigned char* below = &ring[((j < height - 1 ? j + 1 : j) % KSIZE) * width];
+    convolve_3x3_row(width, above, row, below, kernel, out);
+}
+
+int color_transform_planar(PlanarImage* img, double fraction, PointParams* pp, double* kernel, FILE* tgt) {
+    // color_transform on the planar layout: luma and the per-plane delta use plain vector loads,
+    // rows are interleaved again only for writing
+    int width = img->width, height = img->height, stride = img->stride;
+    unsigned char* luma = (unsigned char*)aligned_alloc(PLANEALIGN, (size_t)stride * height);
+    unsigned char* ring = (unsigned char*)malloc(KSIZE * width);
+    unsigned char* new_luma = (unsigned char*)malloc(width);
+    unsigned char* pos = (unsigned char*)malloc(width);
+    unsigned char* neg = (unsigned char*)malloc(width);
+    unsigned char* out = (unsigned char*)malloc(3 * stride);
+    unsigned char* rgb = (unsigned char*)malloc(3 * width);
+    if (!luma || !ring || !new_luma || !pos || !neg || !out || !rgb) {
+        free(luma);
+        free(ring);
+        free(new_luma);
+        free(pos);
+        free(neg);
+        free(out);
+        free(rgb);
+        return 0;
+    }
+
+    planar_to_luma(img, luma);
+    int hist[MAXSIZE] = {0};
+    int n = strided_histogram(width, height, stride, luma, fraction, hist);
+    unsigned char lut[MAXSIZE] = {0};
+    point_lut(n, hist, pp, lut);
+    report_point_params(pp);
+
+    int next = 0;
+    for (int j = 0; j < height; j++) {
+        filter_plane_rows(width, height, stride, luma, lut, kernel, ring, new_luma, j, &next);
+        unsigned char* y = &luma[j * stride];
+        for (int i = 0; i < width; i++) {
+            int d = new_luma[i] - y[i];
+            pos[i] = d > 0 ? d : 0;
+            neg[i] = d < 0 ? -d : 0;
+        }
+        for (int c = 0; c < 3; c++) {
+            add_luma_delta(width, &img->planes[c][j * stride], pos, neg, &out[c * stride]);
+        }
+        interleave_row(width, out, &out[stride], &out[2 * stride], rgb);
+        fwrite(rgb, sizeof(unsigned char), 3 * width, tgt);
+    }
+
+    free(luma);
+    free(ring);
+    free(new_luma);
+    free(pos);
+    free(neg);
+    free(out);
+    free(rgb);
+    return 1;
+}
+
+int channels_transform_planar(PlanarImage* img, double fraction, PointParams* pp, double* kernel, FILE* tgt) {
+    // channels_transform on the planar layout, each plane is filtered in place through the ring
+    int width = img->width, height = img->height, stride = img->stride;
+    unsigned char* ring = (unsigned char*)malloc(KSIZE * width);
+    unsigned char* rgb = (unsigned char*)malloc(3 * width);
+    if (!ring || !rgb) {
+        free(ring);
+        free(rgb);
+        return 0;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        unsigned char* plane = img->planes[c];
+        int hist[MAXSIZE] = {0};
+        int n = strided_histogram(width, height, stride, plane, fraction, hist);
+        unsigned char lut[MAXSIZE] = {0};
+        point_lut(n, hist, pp, lut);
+        report_point_params(pp);
+
+        // row j is already in the ring when it gets overwritten
+        int next = 0;
+        for (int j = 0; j < height; j++) {
+            filter_plane_rows(width, height, stride, plane, lut, kernel, ring, &plane[j * stride], j, &next);
+        }
+    }
+    for (int j = 0; j < height; j++) {
+        int o = j * stride;
+        interleave_row(width, &img->planes[0][o], &img->planes[1][o], &img->planes[2][o], rgb);
+        fwrite(rgb, sizeof(unsigned char), 3 * width, tgt);
+    }
+
+    free(ring);
+    free(rgb);
+    return 1;
+}
+
+// args: $1: file to convert, $2: file to save the results to
+int main(int argc, char const *argv[]) {
+    if (argc == 2 && strncmp(argv[1], "--autotune", 10) == 0 && (!argv[1][10] || argv[1][10] == '=')) {
+        return autotune(argv[1][10] ? argv[1] + 11 : NULL) ? 0 : EXIT_FAILURE;
+    }
+    if (argc < 3) {
+        printf("This program takes at least 2 arguments.");
+        exit(EXIT_FAILURE);
+    }
+
+    // optional args
+    TresholdMethod method = TH_OTSU;
+    int treshold_set = 0;
+    double fraction = 1;
+    int ref_hist_buf[MAXSIZE] = {0};
+    BorderMode border_mode = BORDER_REPLICATE;
+    unsigned char border_value = 0;
+    PointParams pp = {.ref_hist = NULL, .auto_levels = 0, .gamma = 2.0};
+    char const * save_hist_name = NULL;
+    char color = 0; // 'y' for luma, 'c' for channels
+    int planar = 0;
+    char const * kernel_name = NULL;
+    char fft_mode = 'a'; // 'a' auto, 'y' on, 'n' off
+    double nsr = 0, sigma = 0;
+    int highpass = 0;
+    int threads = 0; // 0 until --threads, then the tuning or all cores
+    char const * tune_name = NULL;
+    char const * tune_spec = NULL;
+    char const * trace_spec = NULL;
+    UnsharpParams up = {0, 1, 0};
+    GuidedParams gp = {0, 0.01};
+    FlatMode flat_mode = FLAT_COUNT; // FLAT_COUNT is off
+    int flat_scale = FLATSCALE, flat_radius = FLATRADIUS;
+    BackgroundEstimate bg_method = BG_CLOSE;
+    CornerMethod corner_method = CORNER_COUNT; // CORNER_COUNT is off
+    double corner_treshold = 0;
+    int corner_grid = CORNERGRID;
+    char const * keypoints_name = NULL;
+    char const * guide_name = NULL;
+    unsigned char* find_tmpl = NULL;
+    int find_w = 0, find_h = 0;
+    MatchParams mp = {1, -1, 'a', 1, 0.0, 0, 0};
+    int stream = 0, batch = 0, verbose = 0;
+    Strategy strategy = STRATEGY_AUTO;
+    Preset preset = PRESET_EXACT;
+    int planned = 0;
+    double deadline = 0;
+    int tile[4] = {0, 0, 0, 0}; // x, y, w, h, w = 0 is off
+    char const * tile_stats_name = NULL;
+    int stream_hist[MAXSIZE] = {0};
+    for (int a = 3; a < argc; a++) {
+        if (strncmp(argv[a], "--threshold=", 12) == 0) {
+            method = parse_treshold_method(argv[a] + 12);
+            if (method == TH_COUNT) {
+                printf("Unknown threshold method %s.", argv[a] + 12);
+                exit(EXIT_FAILURE);
+            }
+            treshold_set = 1;
+        } else if (strncmp(argv[a], "--sample=", 9) == 0) {
+            fraction = strtod(argv[a] + 9, NULL);
+            if (fraction <= 0 || fraction > 1) {
+                printf("Sample fraction must be in (0, 1].");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--match=", 8) == 0) {
+            if (!reference_histogram(argv[a] + 8, ref_hist_buf)) {
+                printf("Could not read the reference histogram %s, or it is empty.", argv[a] + 8);
+                exit(EXIT_FAILURE);
+            }
+            pp.ref_hist = ref_hist_buf;
+        } else if (strncmp(argv[a], "--gamma=", 8) == 0) {
+            pp.gamma = strcmp(argv[a] + 8, "auto") == 0 ? 0 : strtod(argv[a] + 8, NULL);
+            if (pp.gamma < 0 || (pp.gamma == 0 && strcmp(argv[a] + 8, "auto") != 0)) {
+                printf("Gamma must be a positive number or auto.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[a], "--levels=auto") == 0) {
+            pp.auto_levels = 1;
+        } else if (strcmp(argv[a], "--color") == 0 || strcmp(argv[a], "--color=luma") == 0) {
+            color = 'y';
+        } else if (strcmp(argv[a], "--color=channels") == 0) {
+            color = 'c';
+        } else if (strcmp(argv[a], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[a], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[a], "--batch") == 0) {
+            batch = 1;
+        } else if (strncmp(argv[a], "--stream=", 9) == 0) {
+            if (!reference_histogram(argv[a] + 9, stream_hist)) {
+                printf("Could not read the stream histogram %s.", argv[a] + 9);
+                exit(EXIT_FAILURE);
+            }
+            stream = 2;
+        } else if (strncmp(argv[a], "--tile=", 7) == 0) {
+            if (sscanf(argv[a] + 7, "%d,%d,%d,%d", &tile[0], &tile[1], &tile[2], &tile[3]) != 4
+                || tile[0] < 0 || tile[1] < 0 || tile[2] < 1 || tile[3] < 1) {
+                printf("Tile takes X,Y,W,H with a positive size.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--tile-stats=", 13) == 0) {
+            tile_stats_name = argv[a] + 13;
+        } else if (strcmp(argv[a], "--planar") == 0) {
+            planar = 1;
+        } else if (strncmp(argv[a], "--border=", 9) == 0) {
+            border_mode = parse_border_mode(argv[a] + 9, &border_value);
+            if (border_mode == BORDER_COUNT) {
+                printf("Unknown border mode %s.", argv[a] + 9);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--save-hist=", 12) == 0) {
+            save_hist_name = argv[a] + 12;
+        } else if (strncmp(argv[a], "--kernel=", 9) == 0) {
+            kernel_name = argv[a] + 9;
+        } else if (strncmp(argv[a], "--fft=", 6) == 0) {
+            fft_mode = strcmp(argv[a] + 6, "auto") == 0 ? 'a' : strcmp(argv[a] + 6, "on") == 0 ? 'y'
+                : strcmp(argv[a] + 6, "off") == 0 ? 'n' : 0;
+            if (!fft_mode) {
+                printf("Unknown fft mode %s.", argv[a] + 6);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--deconvolve=", 13) == 0) {
+            nsr = strtod(argv[a] + 13, NULL);
+            if (nsr <= 0) {
+                printf("Noise-to-signal ratio must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--lowpass=", 10) == 0 || strncmp(argv[a], "--highpass=", 11) == 0) {
+            highpass = argv[a][2] == 'h';
+            sigma = strtod(argv[a] + 10 + highpass, NULL);
+            if (sigma <= 0) {
+                printf("Filter sigma must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--unsharp=", 10) == 0) {
+            int fields = sscanf(argv[a] + 10, "%lf,%d,%d", &up.amount, &up.radius, &up.treshold);
+            if (fields < 1 || up.amount <= 0 || up.amount >= 8 || up.radius < 1 || up.radius > MAXUNSHARP
+                || up.treshold < 0 || up.treshold > MAXGRAY) {
+                printf("Unsharp mask takes amount in (0, 8), radius 1..%d and threshold 0..255.", MAXUNSHARP);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--guided=", 9) == 0) {
+            int fields = sscanf(argv[a] + 9, "%d,%lf", &gp.radius, &gp.eps);
+            char const * comma = strchr(argv[a] + 9, ',');
+            comma = comma ? strchr(comma + 1, ',') : NULL;
+            guide_name = comma ? comma + 1 : NULL;
+            if (fields < 1 || gp.radius < 1 || gp.radius > GUIDEDMAXRADIUS || gp.eps <= 0) {
+                printf("Guided filter takes radius 1..%d and a positive regularization.", GUIDEDMAXRADIUS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--flatfield=", 12) == 0) {
+            char mode_name[16] = {0};
+            sscanf(argv[a] + 12, "%15[^,],%d,%d", mode_name, &flat_scale, &flat_radius);
+            flat_mode = parse_flat_mode(mode_name);
+            if (flat_mode == FLAT_COUNT || flat_scale < 8 || flat_scale > 16 || flat_radius < 1) {
+                printf("Flat-field takes divide or subtract, a scale 8..16 and a positive radius.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--background=", 13) == 0) {
+            bg_method = parse_background_estimate(argv[a] + 13);
+            if (bg_method == BG_COUNT) {
+                printf("Unknown background estimate %s.", argv[a] + 13);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--corners=", 10) == 0) {
+            corner_method = parse_corner_method(argv[a] + 10, &corner_treshold);
+            if (corner_method == CORNER_COUNT) {
+                printf("Corners take fast[:T] with T in 1..254 or harris[:Q] with Q in (0, 1).");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--corner-grid=", 14) == 0) {
+            corner_grid = atoi(argv[a] + 14);
+            if (corner_grid < 1) {
+                printf("Corner grid must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--keypoints=", 12) == 0) {
+            keypoints_name = argv[a] + 12;
+        } else if (strncmp(argv[a], "--find=", 7) == 0) {
+            find_tmpl = read_pgm(argv[a] + 7, &find_w, &find_h);
+            if (!find_tmpl) {
+                printf("Could not read the template %s.", argv[a] + 7);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--find-count=", 13) == 0) {
+            mp.k = atoi(argv[a] + 13);
+            if (mp.k < 1) {
+                printf("Match count must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--pyramid=", 10) == 0) {
+            char* end;
+            mp.levels = strcmp(argv[a] + 10, "auto") == 0 ? -1 : (int)strtol(argv[a] + 10, &end, 10);
+            if (mp.levels != -1 && (*end || end == argv[a] + 10 || mp.levels < 0 || mp.levels > MATCHMAXLEVELS)) {
+                printf("Pyramid takes auto or 0..%d levels.", MATCHMAXLEVELS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            threads = atoi(argv[a] + 10);
+            if (threads < 1) {
+                printf("Thread count must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--tune=", 7) == 0 && argv[a][7]) {
+            tune_name = argv[a] + 7;
+        } else if (strncmp(argv[a], "--preset=", 9) == 0) {
+            preset = parse_preset(argv[a] + 9);
+            if (preset == PRESET_COUNT) {
+                printf("Preset takes exact, balanced or fast.");
+                exit(EXIT_FAILURE);
+            }
+            planned = 1;
+        } else if (strncmp(argv[a], "--deadline=", 11) == 0) {
+            deadline = strtod(argv[a] + 11, NULL);
+            if (deadline <= 0) {
+                printf("Deadline must be a positive number of ms.");
+                exit(EXIT_FAILURE);
+            }
+            planned = 1;
+        } else if (strncmp(argv[a], "--strategy=", 11) == 0) {
+            strategy = parse_strategy(argv[a] + 11);
+            if (strategy == STRATEGY_COUNT) {
+                printf("Strategy takes auto, fused, tiled, stream or whole.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--tune-set=", 11) == 0) {
+            tune_spec = argv[a] + 11;
+        } else if (strncmp(argv[a], "--trace=", 8) == 0) {
+            trace_spec = argv[a] + 8;
+        } else {
+            printf("Unknown optional arg %s.", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // FILE[,RATE], decided here for the whole run
+    if (trace_spec) {
+        char const * comma = strrchr(trace_spec, ',');
+        char* end = NULL;
+        int length = comma ? (int)(comma - trace_spec) : (int)strlen(trace_spec);
+        double rate = comma ? strtod(comma + 1, &end) : 1;
+        if (length == 0 || length >= TRACEPATHSIZE || (comma && (end == comma + 1 || *end)) || rate < 0 || rate > 1) {
+            printf("Trace takes FILE[,RATE] with RATE from 0 to 1.");
+            exit(EXIT_FAILURE);
+        }
+        trace_start(trace_spec, length, rate);
+    }
+
+    // the host's tuning unless off, forced values over it
+    TuneConfig tc;
+    tune_defaults(&tc);
+    char tune_path[TUNEPATHSIZE];
+    int tuned = 0;
+    if (tune_name && strcmp(tune_name, "off") != 0) {
+        tuned = tune_load(tune_name, &tc);
+        if (!tuned) printf("Could not use the tuning %s, built-in values apply.\n", tune_name);
+    } else if (!tune_name && tune_default_path(tune_path, sizeof(tune_path))) {
+        tuned = tune_load(tune_path, &tc);
+    }
+    if (tune_spec && !tune_force(tune_spec, &tc)) {
+        printf("--tune-set takes name=value pairs of direct_cost, fft_cost, tile_factor, threads, small_pixels,"
+            " huge_pixels, pixel_ns, tap_ns and rescale_ns.");
+        exit(EXIT_FAILURE);
+    }
+    if ((tune_name && tuned) || tune_spec) tune_report(&tc);
+    fft_tuning(&tc.fft);
+    if (threads == 0) threads = tc.threads > 0 ? tc.threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (nsr > 0 && !kernel_name) {
+        printf("--deconvolve needs the blur given with --kernel.");
+        exit(EXIT_FAILURE);
+    }
+    if ((up.amount > 0) + (gp.radius > 0) + (kernel_name || sigma > 0) > 1) {
+        printf("Unsharp mask, guided filter and --kernel/--lowpass/--highpass each replace the filter, pick one.");
+        exit(EXIT_FAILURE);
+    }
+    if (color && (kernel_name || nsr > 0 || sigma > 0 || fft_mode == 'y' || up.amount > 0 || gp.radius > 0
+        || flat_mode != FLAT_COUNT || corner_method != CORNER_COUNT || find_tmpl)) {
+        printf("Kernel and frequency-domain filters work on grayscale output only.");
+        exit(EXIT_FAILURE);
+    }
+    if (color && (treshold_set || save_hist_name)) {
+        printf("--color writes the colors without a threshold, --threshold and --save-hist do not apply.");
+        exit(EXIT_FAILURE);
+    }
+    if (planar && !color) {
+        printf("--planar only changes the layout of --color.");
+        exit(EXIT_FAILURE);
+    }
+    if ((stream || tile[2]) && (color || kernel_name || sigma > 0 || fft_mode == 'y' || up.amount > 0 || gp.radius > 0
+        || flat_mode != FLAT_COUNT || corner_method != CORNER_COUNT || find_tmpl || (stream && fraction < 1)
+        || border_mode != BORDER_REPLICATE || (stream && tile[2]))) {
+        printf("--stream and --tile run the default pipeline, only --threshold, --match, --gamma and --levels apply"
+            " (and --sample to --tile).");
+        exit(EXIT_FAILURE);
+    }
+    if (batch && (stream || tile[2] || color || kernel_name || sigma > 0 || fft_mode == 'y' || up.amount > 0
+        || gp.radius > 0 || flat_mode != FLAT_COUNT || corner_method != CORNER_COUNT || find_tmpl || fraction < 1
+        || border_mode != BORDER_REPLICATE || save_hist_name)) {
+        printf("--batch runs the default pipeline, only --threshold, --match, --gamma, --levels and --threads apply.");
+        exit(EXIT_FAILURE);
+    }
+    // the strategies run the default pipeline only, anything else takes the whole-image path
+    int plain = !(stream || tile[2] || batch || color || kernel_name || sigma > 0 || fft_mode == 'y' || up.amount > 0
+        || gp.radius > 0 || flat_mode != FLAT_COUNT || corner_method != CORNER_COUNT || find_tmpl
+        || border_mode != BORDER_REPLICATE || save_hist_name);
+    if (!plain && strategy != STRATEGY_AUTO && strategy != STRATEGY_WHOLE) {
+        printf("--strategy runs the default pipeline, only --threshold, --match, --gamma, --levels, --sample and"
+            " --threads apply.");
+        exit(EXIT_FAILURE);
+    }
+    if (strategy == STRATEGY_STREAM && (fraction < 1 || planned)) {
+        printf("--strategy=stream builds exact histograms, --sample, --preset and --deadline do not apply.");
+        exit(EXIT_FAILURE);
+    }
+    if (planned && (stream || tile[2] || batch)) {
+        printf("--preset and --deadline do not apply to --stream, --tile and --batch.");
+        exit(EXIT_FAILURE);
+    }
+    if (batch) {
+        return run_batch(argv[1], argv[2], &pp, method, threads) ? 0 : EXIT_FAILURE;
+    }
+    // the 3x3 gaussian unless a kernel file is given
+    int kw = KSIZE, kh = KSIZE;
+    double* user_kernel = NULL;
+    if (kernel_name) {
+        user_kernel = read_kernel(kernel_name, &kw, &kh);
+        if (!user_kernel) {
+            printf("Could not read the kernel %s.", kernel_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char const * src_file_name = argv[1];
+    char const * res_file_name = argv[2];
+    FILE* src = fopen(src_file_name, "rb");
+    FILE* tgt = fopen(res_file_name, "wb");
+    
+    // file error handling
+    if (src == NULL || tgt == NULL) {
+        error_handler(src, tgt, "Could not open the files.");
+    }
+
+    char format[3], buffer[BUFSIZE];
+    int width, height, max_val, size;
+
+    // skip comment lines
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, tgt, "Unexpected end of file (1).");
+        }
+    } while (buffer[0] == '#');
+
+    // read magic (format ID)
+    if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '6') {
+        error_handler(src, tgt, "Bad file format.");
+    }
+
+    // skip comment lines before reading dimensions
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, tgt, "Unexpected end of file (2).");
+        }
+    } while (buffer[0] == '#');
+
+    if (sscanf(buffer, "%d %d", &width, &height) != 2) {
+        error_handler(src, tgt, "Invalid image dimensions.");
+    }
+
+    // skip comment lines before reading max value
+    do {
+        if (fgets(buffer, sizeof(buffer), src) == NULL) {
+            error_handler(src, tgt, "Unexpected end of file (3).");
+        }
+    } while (buffer[0] == '#');
+
+    if (sscanf(buffer, "%d", &max_val) != 1) {
+        error_handler(src, tgt, "Invalid max color value.");
+    }
+
+    if (max_val > MAXGRAY) {
+        error_handler(src, tgt, "Unsupported max value > 255.");
+    }
+
+    if (width < 1 || height < 1) {
+        error_handler(src, tgt, "Invalid image dimensions.");
+    }
+    size = width * height;
+
+    // approximations for the preset and deadline, before anything depends on the sample or the kernel
+    int scale = 1;
+    if (planned) {
+        int direct = user_kernel && nsr == 0 && sigma == 0 && up.amount == 0 && gp.radius == 0 && fft_mode != 'y'
+            && !(fft_mode == 'a' && fft_preferred(kw, kh, width, height));
+        Plan plan;
+        plan_init(&plan, direct ? user_kernel : NULL, kw, kh, plain && strategy != STRATEGY_WHOLE);
+        plan_deadline(&plan, preset, deadline, width, height, &tc.costs);
+        plan_report(&plan, preset, deadline);
+        if (plan.fraction < fraction) fraction = plan.fraction;
+        if (direct && (plan.cw != kw || plan.ch != kh)) {
+            kernel_crop(user_kernel, kw, kh, plan.cw, plan.ch);
+            kw = plan.cw;
+            kh = plan.ch;
+        }
+        scale = plan.scale;
+    }
+
+    // example approx. gaussian filter - can be changed to be any other 3x3 kernel
+    double kernel[KSIZE * KSIZE] = {
+        1.0 / 16, 2.0 / 16, 1.0 / 16,
+        2.0 / 16, 4.0 / 16, 2.0 / 16,
+        1.0 / 16, 2.0 / 16, 1.0 / 16
+    };
+
+    if (tile[2]) {
+        if (tile[0] + tile[2] > width || tile[1] + tile[3] > height) {
+            error_handler(src, tgt, "Tile outside the image.");
+        }
+        fprintf(tgt, "P5\n%d %d\n255\n", tile[2], tile[3]);
+        // the statistics depend on the image and every option but the tile itself
+        char key[BUFSIZE * 4] = "";
+        for (int a = 1; a < argc; a++) {
+            if (a == 2 || strncmp(argv[a], "--tile", 6) == 0) continue;
+            strncat(key, argv[a], sizeof(key) - strlen(key) - 2);
+            strcat(key, " ");
+        }
+        tile_stats_key(src, key, sizeof(key));
+        RegionFile rf = {src, ftello(src), width};
+        StreamParams sp = {STREAM_RGB, pp, NULL, kernel, method, STREAMAUTO, 0, 0};
+        TileEngine te;
+        tile_engine_init(&te, width, height, &sp, fraction, read_region, &rf);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        trace_begin("tile statistics", -1);
+        int cached = tile_stats_name && tile_stats_load(tile_stats_name, &te, key);
+        if (!cached && !tile_stats(&te)) {
+            error_handler(src, tgt, "Could not read the image for the statistics.");
+        }
+        trace_end("tile statistics", -1);
+        if (!cached) report_point_params(&te.sp.pp);
+        if (method == TH_AUTO) printf("Auto threshold method: %s.\n", treshold_method_name(te.used_method));
+        printf("Statistics (%s): threshold %d, %.2f ms.\n", cached ? "cached" : "computed", te.used_treshold,
+            elapsed_ms(&t0));
+        if (!cached && tile_stats_name && !tile_stats_save(tile_stats_name, &te, key)) {
+            printf("Could not save the statistics to %s.\n", tile_stats_name);
+        }
+        unsigned char* out = (unsigned char*)malloc((size_t)tile[2] * tile[3]);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        trace_begin("tile", -1);
+        if (!out || !tile_render(&te, tile[0], tile[1], tile[2], tile[3], out, tile[2])) {
+            free(out);
+            error_handler(src, tgt, "Could not read or allocate the tile.");
+        }
+        trace_end("tile", -1);
+        printf("Tile %dx%d at (%d, %d): %lld input px read, %.2f ms.\n", tile[2], tile[3], tile[0], tile[1],
+            te.pixels_read, elapsed_ms(&t0));
+        fclose(src);
+        fwrite(out, sizeof(unsigned char), (size_t)tile[2] * tile[3], tgt);
+        free(out);
+        fclose(tgt);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    if (plain) {
+        if (strategy == STRATEGY_AUTO) strategy = strategy_pick(width, height, threads, &tc.strategy);
+        // the stream builds exact histograms at full size
+        if (strategy == STRATEGY_STREAM && (fraction < 1 || scale > 1)) {
+            strategy = threads > 1 ? STRATEGY_TILED : STRATEGY_FUSED;
+        }
+        if (verbose) {
+            printf("Strategy: %s for %dx%d (fused up to %lld px, streamed from %lld px).\n",
+                strategy_name(strategy), width, height, strategy_small_pixels(&tc.strategy),
+                strategy_huge_pixels(&tc.strategy));
+        }
+        if (strategy == STRATEGY_STREAM) stream = 1;
+    }
+
+    if (plain && (strategy == STRATEGY_FUSED || strategy == STRATEGY_TILED)) {
+        fprintf(tgt, "P5\n%d %d\n255\n", width, height);
+        StrategyRun r = {width, height, (unsigned char*)malloc((size_t)size * 3), (unsigned char*)malloc(size), &pp,
+                         method, fraction, scale, 0, method};
+        if (!r.rgb || !r.out) {
+            free(r.rgb);
+            free(r.out);
+            error_handler(src, tgt, "Could not allocate memory for the image.");
+        }
+        trace_begin("read", -1);
+        if (fread(r.rgb, 3, size, src) != (size_t)size) {
+            free(r.rgb);
+            free(r.out);
+            error_handler(src, tgt, "Unexpected end of file (4).");
+        }
+        fclose(src);
+        trace_end("read", -1);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int n = strategy == STRATEGY_FUSED ? 1 : threads;
+        trace_begin(strategy_name(strategy), -1);
+        int ok = strategy_run(&r, n);
+        trace_end(strategy_name(strategy), -1);
+        double ms = elapsed_ms(&t0);
+        if (ok) {
+            report_point_params(&pp);
+            if (method == TH_AUTO) printf("Auto threshold method: %s.\n", treshold_method_name(r.used_method));
+            if (verbose) {
+                printf("Strategy %s, %d threads: threshold %d, %.2f ms.\n", strategy_name(strategy), n,
+                    r.used_treshold, ms);
+            }
+            trace_begin("write", -1);
+            fwrite(r.out, sizeof(unsigned char), size, tgt);
+            trace_end("write", -1);
+        }
+        free(r.rgb);
+        free(r.out);
+        if (!ok) {
+            error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+        }
+        fclose(tgt);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    if (stream) {
+        fprintf(tgt, "P5\n%d %d\n255\n", width, height);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        StreamParams sp = {STREAM_RGB, pp, stream == 2 ? stream_hist : NULL, kernel, method, STREAMAUTO, 0, 0};
+        Stream st;
+        unsigned char* rgb = (unsigned char*)malloc(3 * width);
+        if (!rgb || !stream_alloc(&st, width, height, &sp, write_row, tgt)) {
+            free(rgb);
+            error_handler(src, tgt, "Memory allocation failed for the stream.");
+        }
+        if (stream_latency(&st) < 0) printf("Stream latency: whole image.\n");
+        else printf("Stream latency: %d rows.\n", stream_latency(&st));
+        trace_begin("stream", -1);
+        for (int j = 0; j < height; j++) {
+            if (fread(rgb, 3, width, src) != (size_t)width) {
+                free(rgb);
+                stream_free(&st);
+                error_handler(src, tgt, "Unexpected end of file (4).");
+            }
+            stream_push(&st, rgb, 1, 3 * width);
+        }
+        fclose(src);
+        free(rgb);
+        stream_finish(&st);
+        trace_end("stream", -1);
+        report_point_params(&st.sp.pp);
+        if (method == TH_AUTO) printf("Auto threshold method: %s.\n", treshold_method_name(st.used_method));
+        printf("Stream: threshold %d, %.2f ms.\n", st.used_treshold, elapsed_ms(&t0));
+        stream_free(&st);
+        fclose(tgt);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    if (color && planar) {
+        PlanarImage img;
+        if (!planar_alloc(&img, width, height)) {
+            error_handler(src, tgt, "Could not allocate memory for the image.");
+        }
+        if (!read_planar(src, &img)) {
+            planar_free(&img);
+            error_handler(src, tgt, "Unexpected end of file (4).");
+        }
+        fclose(src);
+
+        fprintf(tgt, "P6\n%d %d\n255\n", width, height);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ok = color == 'y'
+            ? color_transform_planar(&img, fraction, &pp, kernel, tgt)
+            : channels_transform_planar(&img, fraction, &pp, kernel, tgt);
+        printf("Color processing (%s, planar): %.2f ms.\n", color == 'y' ? "luma" : "channels", elapsed_ms(&t0));
+        planar_free(&img);
+        if (!ok) {
+            error_handler(NULL, tgt, "Memory allocation failed for color data.");
+        }
+        fclose(tgt);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    Pixel* pixels = (Pixel*)malloc(size * sizeof(Pixel));
+    if (pixels == NULL) {
+        free(pixels);
+        error_handler(src, tgt, "Could not allocate memory for the image.");
+    }
+
+    // read binary format
+    trace_begin("read", -1);
+    size_t bytes_read = fread(pixels, sizeof(Pixel), size, src);
+    if (bytes_read  != (size_t)(size)) {
+        free(pixels);
+        printf("Bytes read %ld. Supposed to be %d.", bytes_read, size);
+        error_handler(src, tgt, "Unexpected end of file (4).");
+    }
+    fclose(src);
+    trace_end("read", -1);
+
+    if (color) {
+        fprintf(tgt, "P6\n%d %d\n255\n", width, height);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ok = color == 'y'
+            ? color_transform(width, height, pixels, fraction, &pp, kernel, tgt)
+            : channels_transform(width, height, pixels, fraction, &pp, kernel, tgt);
+        printf("Color processing (%s): %.2f ms.\n", color == 'y' ? "luma" : "channels", elapsed_ms(&t0));
+        free(pixels);
+        if (!ok) {
+            error_handler(NULL, tgt, "Memory allocation failed for color data.");
+        }
+        fclose(tgt);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    // write header to target file
+    fprintf(tgt, "P5\n%d %d\n255\n", width, height);
+
+    unsigned char* grayscale = (unsigned char*)malloc(size);
+    if (!grayscale) {
+        free(pixels);
+        error_handler(src, tgt, "Memory allocation failed for grayscale data.");
+    }
+    
+    // write to grayscale, the histogram is collected on the way unless it is sampled
+    trace_begin("gray", -1);
+    int hist[MAXSIZE] = {0};
+    int hist_n = size;
+    Background bg;
+    if (flat_mode != FLAT_COUNT) {
+        // the background is accumulated from every row while it is still in cache, the histogram
+        // has to be the one of the normalized image and is built once the background is known
+        if (!background_alloc(&bg, width, height, flat_scale, flat_radius, flat_mode)) {
+            free(pixels);
+            free(grayscale);
+            error_handler(NULL, tgt, "Memory allocation failed for the background.");
+        }
+        for (int j = 0; j < height; j++) {
+            for (int i = j * width; i < (j + 1) * width; i++) {
+                grayscale[i] = ppm_to_pgm_weighted(&pixels[i]);
+            }
+            background_accumulate(&bg, j, &grayscale[j * width]);
+        }
+        background_estimate(&bg, bg_method);
+        hist_n = background_histogram(&bg, grayscale, fraction, hist);
+        if (hist_n < 0) {
+            free(pixels);
+            free(grayscale);
+            background_free(&bg);
+            error_handler(NULL, tgt, "Memory allocation failed for the background.");
+        }
+        printf("Background level %.1f.\n", bg.level);
+    } else if (sample_step(fraction) > 1) {
+        for (int i = 0; i < size; i++) {
+                grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
+        }
+        hist_n = gray_histogram(width, height, grayscale, fraction, hist);
+    } else {
+        for (int i = 0; i < size; i++) {
+                // grayscale[i] = ppm_to_pgm_avg(&pixels[i]); // avg
+                grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
+                hist[grayscale[i]]++;
+        }
+    }
+    free(pixels);
+    trace_end("gray", -1);
+    
+    if (save_hist_name && !save_histogram(save_hist_name, hist)) {
+        printf("Could not save the histogram to %s.\n", save_hist_name);
+    }
+
+    if (find_tmpl) {
+        // on the plain grayscale, equalization would change with the image content around the template
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        mp.fft_mode = fft_mode;
+        mp.threads = threads;
+        Match* matches = (Match*)malloc(mp.k * sizeof(Match));
+        trace_begin("find", -1);
+        int n = matches ? match_template(grayscale, width, height, find_tmpl, find_w, find_h, &mp, matches) : -1;
+        trace_end("find", -1);
+        free(find_tmpl);
+        if (n < 0) {
+            free(matches);
+            free(grayscale);
+            error_handler(NULL, tgt, "Memory allocation failed for template matching.");
+        }
+        printf("Find (%s, %d pyramid levels): %d matches, %.2f ms.\n", mp.used_fft ? "fft" : "direct",
+               mp.used_levels, n, elapsed_ms(&t0));
+        for (int i = 0; i < n; i++) {
+            printf("Match %d: %d %d %.4f.\n", i + 1, matches[i].x, matches[i].y, matches[i].score);
+        }
+        free(matches);
+    }
+
+    // frequency-domain filters are set up first, their margin decides the border
+    double* filter_kernel = user_kernel ? user_kernel : kernel;
+    FreqFilter ff = {0};
+    // (the unsharp mask and the guided filter have their own sweeps and never go there)
+    int use_fft = up.amount == 0 && gp.radius == 0 && (sigma > 0 || nsr > 0 || fft_mode == 'y'
+        || (fft_mode == 'a' && user_kernel && fft_preferred(kw, kh, width, height)));
+    if (use_fft) {
+        int extent = width > height ? width : height;
+        int ok = sigma > 0 ? freq_filter_gauss(&ff, sigma, highpass, extent)
+            : nsr > 0 ? freq_filter_wiener(&ff, filter_kernel, kw, kh, nsr, extent)
+            : freq_filter_kernel(&ff, filter_kernel, kw, kh, extent);
+        if (!ok) {
+            free(grayscale);
+            free(user_kernel);
+            freq_filter_free(&ff);
+            error_handler(NULL, tgt, "Filter too large for the frequency domain.");
+        }
+    }
+    int border = use_fft ? ff.margin : up.amount > 0 ? up.radius : (kw > kh ? kw : kh) / 2;
+
+    // transform grayscale with histogram (or match it to the reference) and gamma correction in one pass,
+    // written into a padded image whose border is filled once for the filter
+    trace_begin("tone", -1);
+    unsigned char lut[MAXSIZE] = {0};
+    point_lut(hist_n, hist, &pp, lut);
+    report_point_params(&pp);
+    if (corner_method != CORNER_COUNT && border < CORNERBORDER) border = CORNERBORDER;
+    PaddedImage padded;
+    if (!padded_alloc(&padded, width, height, border)) {
+        free(grayscale);
+        error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+    }
+    if (flat_mode != FLAT_COUNT) {
+        padded_load_flat(&padded, grayscale, lut, &bg);
+        background_free(&bg);
+    } else {
+        padded_load_lut(&padded, grayscale, lut);
+    }
+    padded_fill_border(&padded, border_mode, border_value);
+    trace_end("tone", -1);
+
+    if (corner_method != CORNER_COUNT) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        Keypoint* keypoints = NULL;
+        trace_begin("corners", -1);
+        int n = detect_corners(&padded, corner_method, corner_treshold, corner_grid, threads, &keypoints);
+        trace_end("corners", -1);
+        if (n < 0) {
+            free(grayscale);
+            padded_free(&padded);
+            error_handler(NULL, tgt, "Memory allocation failed for corner detection.");
+        }
+        printf("Corners: %d keypoints, %.2f ms.\n", n, elapsed_ms(&t0));
+        if (keypoints_name && !save_keypoints(keypoints_name, keypoints, n, corner_method)) {
+            printf("Could not save the keypoints to %s.\n", keypoints_name);
+        }
+        free(keypoints);
+    }
+
+    unsigned char* new_grayscale = (unsigned char*)malloc(size);
+    if (!new_grayscale) {
+        free(grayscale);
+        padded_free(&padded);
+        error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+    }
+    
+    trace_begin("filter", -1);
+    if (use_fft) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ok = freq_filter_apply(&ff, &padded, new_grayscale, threads);
+        printf("Filter: fft %dx%d tiles, margin %d, %d threads: %.2f ms.\n",
+            ff.n, ff.n, ff.margin, threads, elapsed_ms(&t0));
+        freq_filter_free(&ff);
+        if (!ok) {
+            free(grayscale);
+            free(new_grayscale);
+            free(user_kernel);
+            padded_free(&padded);
+            error_handler(NULL, tgt, "Memory allocation failed for the frequency-domain filter.");
+        }
+    } else if (up.amount > 0) {
+        if (!unsharp_padded(&padded, new_grayscale, &up)) {
+            free(grayscale);
+            free(new_grayscale);
+            padded_free(&padded);
+            error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+        }
+    } else if (gp.radius > 0) {
+        unsigned char* guide = NULL;
+        if (guide_name) {
+            int gw, gh;
+            guide = read_pgm(guide_name, &gw, &gh);
+            if (guide && (gw != width || gh != height)) {
+                free(guide);
+                guide = NULL;
+            }
+        }
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ok = (!guide_name || guide) && guided_filter(&padded, guide, &gp, new_grayscale, threads);
+        if (ok) printf("Filter: guided r=%d, %d threads: %.2f ms.\n", gp.radius, threads, elapsed_ms(&t0));
+        free(guide);
+        if (!ok) {
+            free(grayscale);
+            free(new_grayscale);
+            padded_free(&padded);
+            error_handler(NULL, tgt, guide_name ? "Could not read a guide of the image size or allocate the filter."
+                : "Memory allocation failed for the guided filter.");
+        }
+    } else if (user_kernel) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        convolve_padded(&padded, new_grayscale, user_kernel, kw, kh);
+        printf("Filter: direct %dx%d: %.2f ms.\n", kw, kh, elapsed_ms(&t0));
+    } else {
+        convolve_3x3_padded(&padded, new_grayscale, kernel);
+    }
+    trace_end("filter", -1);
+    padded_free(&padded);
+    free(user_kernel);
+
+    trace_begin("threshold", -1);
+    treshold_transform(width, height, new_grayscale, method, fraction);
+    trace_end("threshold", -1);
+
+    free(grayscale);
+    trace_begin("write", -1);
+    fwrite(new_grayscale, sizeof(unsigned char), size, tgt);
+    trace_end("write", -1);
+    free(new_grayscale);
+
+    fclose(tgt);
+    printf("File converted successfully.\n");
+    return 0;
+}
@@ -13,7 +13,7 @@ By Jakub Grabowski
 
 #define BUFSIZE 256
 #define MAXGRAY 255
-#define MAXSIZE MAXGRAY+1
+#define MAXSIZE (MAXGRAY+1)
 #define KSIZE 3
 #define VECSIZE 8
 
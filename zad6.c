@@ -2,10 +2,27 @@
 This program converts P6 PPM file to PBM file. Works for 255 max values.
 Can be compiled normally with GCC with makefile provided.
 Used from cmd: 
-    1st arg is either "d", "e" or "n" for dilation, erosion or none, respectively,
-    2nd arg is dil./er. strength (int), 
+    1st arg is either "d", "e", "n" or "o" for dilation, erosion, none or ordered dithering, respectively,
+    2nd arg is dil./er. strength (int), for "o" it is the Bayer matrix level (1-3, i.e. 2x2 up to 8x8),
     3rd arg is source file name (opens as rb), 
     4th arg is target file name (opens as wb).
+Optional args after these:
+    --tile=FILE     P5 PGM threshold tile (e.g. blue noise) used by "o" instead of the Bayer matrix.
+    --threshold=M   otsu (default), kapur, yen, triangle, isodata, li or auto (picked from the histogram shape).
+    --sample=F      build histograms from a stratified sample of fraction F of the rows and columns,
+                    falls back to exact histograms when the sample is too sparse.
+    --match=FILE    match the histogram to a reference instead of equalizing it, FILE is a P5 PGM
+                    (its histogram is cached in FILE.hist) or a histogram saved with --save-hist.
+    --save-hist=FILE save the grayscale histogram of the input in the compact binary format.
+    --gamma=G|auto  gamma after equalization (default 1.1), auto brings the mean luminance to mid-gray.
+    --levels=auto   stretch between the 0.5% and 99.5% percentiles instead of equalizing.
+    --border=M      image edge for erosion: replicate (default), reflect or constant[:V].
+    --hough=M[:V]   find lines in the binary output, black pixels vote: lines (rho and angle of the strongest
+                    accumulator peaks) or segments (progressive probabilistic, with endpoints); V votes a
+                    line needs (default 64).
+    --hough-count=K report at most K lines (default 32).
+    --lines=FILE    write them as "rho theta votes" or "x0 y0 x1 y1 votes" lines.
+    --threads=N     threads voting for --hough=lines (default: all cores).
 By Jakub Grabowski
 */
 
@@ -13,11 +30,29 @@ By Jakub Grabowski
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "histogram.h"
+#include "image.h"
+#include "hough.h"
 
 #define BUFSIZE 256
 #define MAXGRAY 255
-#define MAXSIZE MAXGRAY+1
+#define MAXSIZE (MAXGRAY+1)
 #define KSIZE 3
+#define MAXBAYER 3
+
+// bit-reversed bytes, movemask gives LSB first but P4 wants MSB first
+unsigned char bitrev[MAXSIZE];
 
 typedef struct {
     unsigned char r, g, b;
@@ -48,41 +83,17 @@ unsigned char ppm_to_pgm_weighted(Pixel* pixel) {
     return round_clamp(wsum);
 }
 
-void histogram_transform(int size, unsigned char* grayscale) {
-    // create a histogram
+void histogram_transform(int width, int height, unsigned char* grayscale, double fraction) {
+    // create a histogram, from a stratified sample when fraction < 1
     // MAXGRAY+1 because there are bytes of MAXGRAY value (e.g. 256 values)
     int hist[MAXSIZE] = {0};
-    for (int i = 0; i < size; i++) {
-        unsigned char val = grayscale[i];
-        hist[val]++;
-    }
-    
-    // compute gmin
-    int gmin = 0;
-    for (int i = 0; i < MAXSIZE; i++) {
-        if (hist[i] > 0) {
-            gmin = i;
-            break;
-        }
-    }
+    int n = gray_histogram(width, height, grayscale, fraction, hist);
 
-    // compute c.img histogram
-    int histc[MAXSIZE] = {0};
-    histc[0] = 0;
-    for (int i = 1; i < MAXSIZE; i++) {
-        histc[i] = histc[i-1] + hist[i];
-    }
-    int hmin = histc[gmin];
-
-    // compute T values
     unsigned char tvals[MAXSIZE] = {0};
-    for (int i = 1; i < MAXSIZE; i++) {
-        // happy casting
-        double val = MAXGRAY * ((double)(histc[i] - hmin) / (size - hmin));
-        tvals[i] = round_clamp(val);
-    }
+    histogram_lut(n, hist, tvals);
 
     // rewrite grayscale
+    int size = width * height;
     for (int i = 0; i < size; i++) {
         unsigned char val = grayscale[i];
         grayscale[i] = tvals[val];
@@ -92,16 +103,25 @@ void histogram_transform(int size, unsigned char* grayscale) {
 void gamma_transform(int size, unsigned char* grayscale, double gamma) {
     // precompute gamma values
     unsigned char lookup[MAXSIZE] = {0};
-    for (int i = 0; i < MAXSIZE; i++) {
-        double val = (double) i / MAXGRAY;
-        lookup[i] = round_clamp(MAXGRAY * pow(val, gamma));
-    }
+    gamma_lut(gamma, lookup);
 
     for (int i = 0; i < size; i++) {
         grayscale[i] = lookup[grayscale[i]];
     }
 }
 
+void point_transform(int size, unsigned char* grayscale, int* hist, int n, PointParams* pp) {
+    // equalization (matching or levels) and gamma composed into one LUT, one pass over grayscale
+    // hist holds n px and comes from the grayscale pass, so there is no histogram pass here
+    unsigned char lut[MAXSIZE] = {0};
+    point_lut(n, hist, pp, lut);
+    report_point_params(pp);
+
+    for (int i = 0; i < size; i++) {
+        grayscale[i] = lut[grayscale[i]];
+    }
+}
+
 unsigned char get_safe_gval(int width, int height, int i, int j, unsigned char* grayscale) {
     // to avoid darkening on the edges, return nearest actual pixel from the img
     int ii = i, jj = j;
@@ -133,68 +153,23 @@ void convolve_3x3(
     }
 }
 
-double arr_sum(int size, double* array) {
-    double S = 0;
-    for (int i = 0; i < size; i++) {
-        S += array[i];
-    }
-    return S;
-}
-
-double arr_mean(int size, double* array) {
-    return arr_sum(size, array) / size;
-}
-
-double arr_var(int size, double* probs, double* vals) {
-    double var = 0;
-    double mean = arr_mean(size, vals);
-    for (int i = 0; i < size; i++) {
-        var += probs[i] * pow(vals[i] - mean, 2);
-    }
-    return var;
+int treshold_value(int width, int height, unsigned char* grayscale, TresholdMethod method, double fraction) {
+    // create a histogram, from a stratified sample when fraction < 1
+    int hist[MAXSIZE] = {0};
+    int n = gray_histogram(width, height, grayscale, fraction, hist);
+    HistStats st;
+    hist_stats(n, hist, &st);
+    if (method == TH_AUTO) {
+        method = auto_treshold_method(&st);
+        printf("Auto threshold method: %s.\n", treshold_method_name(method));
+    }
+    return hist_treshold(&st, method);
 }
 
-void otsu_treshold(int size, unsigned char* grayscale) {
-    // create a histogram
-    // MAXGRAY+1 because there are bytes of MAXGRAY value (e.g. 256 values)
-    double histv[MAXSIZE] = {0};
-    double histp[MAXSIZE] = {0};
-    for (int i = 0; i < size; i++) {
-        unsigned char val = grayscale[i];
-        histv[val] += 1;
-    }
-    // normalize to calculate prob.
-    for (int i = 0; i < MAXSIZE; i++) {
-        histp[i] = histv[i] / size;
-    }
-
-    // calculate all possible tresholds
-    double vars[MAXSIZE-2] = {0};
-    for (int i = 0; i < MAXSIZE-2; i++) {
-        int size_b = i+1;
-        int size_f = MAXSIZE-i-1;
-        double* vslice_b = histv;
-        double* vslice_f = histv + size_b;
-        double* pslice_b = histp;
-        double* pslice_f = histp + size_b;
-
-        double var_b = arr_var(size_b, pslice_b, vslice_b);
-        double var_f = arr_var(size_f, pslice_f, vslice_f);
-        double om_b = arr_sum(size_b, pslice_b);
-        double om_f = arr_sum(size_f, pslice_f);
-
-        vars[i] = om_b * var_b + om_f * var_f;
-    }
-
-    // find min. var. threshold
-    double tvar = vars[0];
-    int th = 0;
-    for (int i = 1; i < MAXSIZE-2; i++) {
-        if (tvar > vars[i]) {
-            tvar = vars[i];
-            th = i;
-        }
-    }
+int treshold_transform(
+    int width, int height, unsigned char* grayscale, TresholdMethod method, double fraction) {
+    int size = width * height;
+    int th = treshold_value(width, height, grayscale, method, fraction);
 
     // transform to black and white
     for (int i = 0; i < size; i++) {
@@ -204,6 +179,7 @@ void otsu_treshold(int size, unsigned char* grayscale) {
             grayscale[i] = 0;
         }
     }
+    return th;
 }
 
 void dilation(
@@ -260,17 +236,345 @@ void erosion(
     }
 }
 
+void min_bytes(int n, unsigned char* acc, unsigned char* src) {
+    // acc = min(acc, src) per byte
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i <= n - 16; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i*)&acc[i]);
+        _mm_storeu_si128((__m128i*)&acc[i], _mm_min_epu8(a, _mm_loadu_si128((__m128i*)&src[i])));
+    }
+#elif defined(__ARM_NEON)
+    for (; i <= n - 16; i += 16) {
+        vst1q_u8(&acc[i], vminq_u8(vld1q_u8(&acc[i]), vld1q_u8(&src[i])));
+    }
+#endif
+    for (; i < n; i++) {
+        if (src[i] < acc[i]) acc[i] = src[i];
+    }
+}
+
+int erosion_padded(PaddedImage* src, unsigned char* new_grayscale, int ksize) {
+    // erosion without get_safe_gval: white only if the whole window is white, i.e. its minimum is > 127,
+    // the minimum is taken over the window rows first and then along the row (O(ksize) per px)
+    int width = src->width, stride = src->stride;
+    int offset = ksize / 2;
+    int n = width + ksize - 1;
+    unsigned char* vmin = (unsigned char*)malloc(n);
+    if (!vmin) return 0;
+
+    for (int j = 0; j < src->height; j++) {
+        unsigned char* top = &src->px[(j - offset) * stride - offset];
+        memcpy(vmin, top, n);
+        for (int jj = 1; jj < ksize; jj++) {
+            min_bytes(n, vmin, top + jj * stride);
+        }
+        unsigned char* out = &new_grayscale[j * width];
+        memcpy(out, vmin, width);
+        for (int ii = 1; ii < ksize; ii++) {
+            min_bytes(width, out, vmin + ii);
+        }
+        for (int i = 0; i < width; i++) {
+            out[i] = out[i] > 127 ? MAXGRAY : 0;
+        }
+    }
+
+    free(vmin);
+    return 1;
+}
+
+void build_bitrev_lut() {
+    for (int i = 0; i < MAXSIZE; i++) {
+        unsigned char r = 0;
+        for (int b = 0; b < 8; b++) {
+            if (i & (1 << b)) r |= 1 << (7 - b);
+        }
+        bitrev[i] = r;
+    }
+}
+
+typedef struct {
+    int width;
+    Pixel* pixels;
+    unsigned char* gray;        // one row
+} GrayRows;
+
+static unsigned char* gray_row(void* ctx, int j) {
+    GrayRows* g = (GrayRows*)ctx;
+    for (int i = 0; i < g->width; i++) {
+        g->gray[i] = ppm_to_pgm_weighted(&g->pixels[j * g->width + i]);
+    }
+    return g->gray;
+}
+
+int rgb_to_gray_histogram(int width, int height, Pixel* pixels, double fraction, int* hist) {
+    // same conversion as the grayscale pass, but only the histogram is kept, one row at a time
+    // sampled like gray_histogram when fraction < 1, returns the number of pixels counted or -1 when out of memory
+    GrayRows g = {width, pixels, (unsigned char*)malloc(width)};
+    if (!g.gray) return -1;
+    int n = row_histogram(width, height, gray_row, &g, fraction, hist);
+    free(g.gray);
+    return n;
+}
+
+void rgb_row_to_gray_lut(int width, Pixel* pixels, unsigned char* lut, unsigned char* gray_row) {
+    for (int i = 0; i < width; i++) {
+        gray_row[i] = lut[ppm_to_pgm_weighted(&pixels[i])];
+    }
+}
+
+void pack_row(int width, unsigned char* gray_row, unsigned char* thresh_row, unsigned char* bits) {
+    // set bit (black) where gray <= thresh, MSB first, 16 or 32 px per step
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i <= width - 32; i += 32) {
+        __m256i g = _mm256_loadu_si256((__m256i*)&gray_row[i]);
+        __m256i t = _mm256_loadu_si256((__m256i*)&thresh_row[i]);
+        __m256i le = _mm256_cmpeq_epi8(_mm256_max_epu8(g, t), t); // g <= t iff max(g, t) == t
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(le);
+        bits[i / 8] = bitrev[mask & 0xff];
+        bits[i / 8 + 1] = bitrev[(mask >> 8) & 0xff];
+        bits[i / 8 + 2] = bitrev[(mask >> 16) & 0xff];
+        bits[i / 8 + 3] = bitrev[mask >> 24];
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i <= width - 16; i += 16) {
+        __m128i g = _mm_loadu_si128((__m128i*)&gray_row[i]);
+        __m128i t = _mm_loadu_si128((__m128i*)&thresh_row[i]);
+        __m128i le = _mm_cmpeq_epi8(_mm_max_epu8(g, t), t);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(le);
+        bits[i / 8] = bitrev[mask & 0xff];
+        bits[i / 8 + 1] = bitrev[mask >> 8];
+    }
+#elif defined(__ARM_NEON)
+    // no movemask on NEON - weight the lanes by their bit and add them up
+    const uint8_t weights[16] = {128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1};
+    const uint8x16_t w = vld1q_u8(weights);
+    for (; i <= width - 16; i += 16) {
+        uint8x16_t g = vld1q_u8(&gray_row[i]);
+        uint8x16_t t = vld1q_u8(&thresh_row[i]);
+        uint8x16_t le = vandq_u8(vcleq_u8(g, t), w);
+        bits[i / 8] = vaddv_u8(vget_low_u8(le));
+        bits[i / 8 + 1] = vaddv_u8(vget_high_u8(le));
+    }
+#endif
+
+    // scalar fallback for remaining pixels (i is a multiple of 8 here)
+    for (int k = i / 8; k < (width + 7) / 8; k++) {
+        bits[k] = 0;
+    }
+    for (; i < width; i++) {
+        if (gray_row[i] <= thresh_row[i]) {
+            bits[i / 8] |= (1 << (7 - (i % 8)));
+        }
+    }
+}
+
+void bayer_tile(int level, unsigned char* tile) {
+    // index matrix from interleaved bits of (x ^ y) and y, scaled to mid-bin thresholds
+    int n = 1 << level;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            int v = 0;
+            for (int k = 0; k < level; k++) {
+                v = (v << 2) | ((((x >> k) ^ (y >> k)) & 1) << 1) | ((y >> k) & 1);
+            }
+            tile[y * n + x] = (2 * v + 1) * 128 / (n * n);
+        }
+    }
+}
+
+unsigned char* read_tile_pgm(char const * file_name, int* tw, int* th) {
+    // threshold tiles are small, so they are read as a plain P5 without the error_handler exit path
+    FILE* f = fopen(file_name, "rb");
+    if (f == NULL) return NULL;
+
+    char format[3], buffer[BUFSIZE];
+    int max_val;
+    int fields[5];
+    int nfields = 0;
+    int magic = 0;
+    while (nfields < 3 && fgets(buffer, sizeof(buffer), f) != NULL) {
+        if (buffer[0] == '#') continue;
+        if (!magic) {
+            if (sscanf(buffer, "%2s", format) != 1 || format[0] != 'P' || format[1] != '5') break;
+            magic = 1;
+            continue;
+        }
+        int n = sscanf(buffer, "%d %d %d", &fields[nfields], &fields[nfields + 1], &fields[nfields + 2]);
+        if (n < 1) break;
+        nfields += n;
+    }
+    if (nfields < 3) {
+        fclose(f);
+        return NULL;
+    }
+    *tw = fields[0];
+    *th = fields[1];
+    max_val = fields[2];
+    if (*tw < 1 || *th < 1 || max_val > MAXGRAY) {
+        fclose(f);
+        return NULL;
+    }
+
+    unsigned char* tile = (unsigned char*)malloc(*tw * *th);
+    if (tile == NULL || fread(tile, 1, *tw * *th, f) != (size_t)(*tw * *th)) {
+        free(tile);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    return tile;
+}
+
+int pack_rgb_rows(
+    int width, int height, Pixel* pixels, unsigned char* lut, unsigned char* thresh, int th, FILE* tgt,
+    unsigned char* keep) {
+    // gray is produced one row at a time and packed right away, the gray frame is never stored
+    // thresh holds th rows of width thresholds, row j uses thresh row j % th
+    // keep (if not NULL) gets a copy of the packed rows
+    int row_bytes = (width + 7) / 8;
+    unsigned char* gray_row = (unsigned char*)malloc(width);
+    unsigned char* bits = (unsigned char*)malloc(row_bytes);
+    if (!gray_row || !bits) {
+        free(gray_row);
+        free(bits);
+        return 0;
+    }
+
+    for (int j = 0; j < height; j++) {
+        rgb_row_to_gray_lut(width, &pixels[j * width], lut, gray_row);
+        pack_row(width, gray_row, &thresh[(j % th) * width], bits);
+        fwrite(bits, sizeof(unsigned char), row_bytes, tgt);
+        if (keep) memcpy(&keep[j * row_bytes], bits, row_bytes);
+    }
+
+    free(gray_row);
+    free(bits);
+    return 1;
+}
+
+int pack_gray_rows(int width, int height, unsigned char* grayscale, unsigned char t, FILE* tgt, unsigned char* keep) {
+    // pixels <= t become black, rows are padded to full bytes as P4 requires
+    int row_bytes = (width + 7) / 8;
+    unsigned char* thresh = (unsigned char*)malloc(width);
+    unsigned char* bits = (unsigned char*)malloc(row_bytes);
+    if (!thresh || !bits) {
+        free(thresh);
+        free(bits);
+        return 0;
+    }
+    memset(thresh, t, width);
+
+    for (int j = 0; j < height; j++) {
+        pack_row(width, &grayscale[j * width], thresh, bits);
+        fwrite(bits, sizeof(unsigned char), row_bytes, tgt);
+        if (keep) memcpy(&keep[j * row_bytes], bits, row_bytes);
+    }
+
+    free(thresh);
+    free(bits);
+    return 1;
+}
+
+int ordered_dither(
+    int width, int height, Pixel* pixels, unsigned char* lut, unsigned char* tile, int tw, int th, FILE* tgt,
+    unsigned char* keep) {
+    unsigned char* thresh = (unsigned char*)malloc(th * width);
+    if (!thresh) return 0;
+
+    // repeat the tile horizontally once, so that the kernel can use plain vector loads
+    for (int j = 0; j < th; j++) {
+        for (int i = 0; i < width; i++) {
+            thresh[j * width + i] = tile[j * tw + i % tw];
+        }
+    }
+
+    int ok = pack_rgb_rows(width, height, pixels, lut, thresh, th, tgt, keep);
+    free(thresh);
+    return ok;
+}
+
+int treshold_pack(
+    int width, int height, Pixel* pixels, unsigned char* lut, int* hist, int n, TresholdMethod method, FILE* tgt,
+    unsigned char* keep) {
+    // histogram after the LUT follows from the input one (n px), so the threshold needs no pass over the image
+    int lhist[MAXSIZE] = {0};
+    for (int i = 0; i < MAXSIZE; i++) {
+        lhist[lut[i]] += hist[i];
+    }
+    HistStats st;
+    hist_stats(n, lhist, &st);
+    if (method == TH_AUTO) {
+        method = auto_treshold_method(&st);
+        printf("Auto threshold method: %s.\n", treshold_method_name(method));
+    }
+    int t = hist_treshold(&st, method);
+
+    unsigned char* thresh = (unsigned char*)malloc(width);
+    if (!thresh) return 0;
+    memset(thresh, t, width);
+
+    int ok = pack_rgb_rows(width, height, pixels, lut, thresh, 1, tgt, keep);
+    free(thresh);
+    return ok;
+}
+
+int find_lines(
+    unsigned char* bits, int width, int height, HoughMode mode, int min_votes, int count, int threads,
+    char const * lines_name) {
+    // Hough transform of the packed output, prints the lines and saves them if asked to
+    HoughLine* lines = (HoughLine*)malloc(count * sizeof(HoughLine));
+    if (!lines) return 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int n = hough_lines(bits, width, height, mode, min_votes, count, threads, lines);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (n < 0) {
+        free(lines);
+        return 0;
+    }
+    printf("Hough (%s): %d %s, %.2f ms.\n", mode == HOUGH_LINES ? "lines" : "segments", n,
+           mode == HOUGH_LINES ? "lines" : "segments",
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    for (int i = 0; i < n; i++) {
+        if (mode == HOUGH_LINES) {
+            printf("Line %d: %d %d %d.\n", i + 1, lines[i].rho, lines[i].theta, lines[i].votes);
+        } else {
+            printf("Segment %d: %d %d %d %d %d.\n", i + 1, lines[i].x0, lines[i].y0, lines[i].x1, lines[i].y1,
+                   lines[i].votes);
+        }
+    }
+    if (lines_name && !save_hough_lines(lines_name, lines, n, mode)) {
+        printf("Could not save the lines to %s.\n", lines_name);
+    }
+    free(lines);
+    return 1;
+}
+
+void finish_lines(
+    unsigned char* bits, int width, int height, HoughMode mode, int min_votes, int count, int threads,
+    char const * lines_name) {
+    // find_lines when --hough is on (bits not NULL), then bits are freed
+    if (bits && !find_lines(bits, width, height, mode, min_votes, count, threads, lines_name)) {
+        free(bits);
+        error_handler(NULL, NULL, "Hough transform failed (image too large or out of memory).");
+    }
+    free(bits);
+}
+
 // args: $1: file to convert, $2: file to save the results to
 int main(int argc, char const *argv[]) {
-    if (argc != 5) {
-        printf("This program takes exactly 4 arguments.");
+    if (argc < 5) {
+        printf("This program takes at least 4 arguments.");
         exit(EXIT_FAILURE);
     }
 
     // option
     char opt = argv[1][0];
     opt = opt | 0x60; // convert to lowercase
-    if (opt != 'd' && opt != 'e' && opt != 'n') {
+    if (opt != 'd' && opt != 'e' && opt != 'n' && opt != 'o') {
         printf("Unknown option for the 1st arg.");
         exit(EXIT_FAILURE);
     }
@@ -283,6 +587,86 @@ int main(int argc, char const *argv[]) {
         printf("Strength must be greater than 0.");
         exit(EXIT_FAILURE);
     }
+    if (opt == 'o' && bs > MAXBAYER) {
+        printf("Bayer matrix level must be between 1 and %d.", MAXBAYER);
+        exit(EXIT_FAILURE);
+    }
+
+    // optional args
+    char const * tile_file_name = NULL;
+    TresholdMethod method = TH_OTSU;
+    double fraction = 1;
+    int ref_hist_buf[MAXSIZE] = {0};
+    BorderMode border_mode = BORDER_REPLICATE;
+    unsigned char border_value = 0;
+    PointParams pp = {.ref_hist = NULL, .auto_levels = 0, .gamma = 1.1};
+    char const * save_hist_name = NULL;
+    HoughMode hough_mode = HOUGH_COUNT; // HOUGH_COUNT is off
+    int hough_votes = HOUGHVOTES, hough_count = HOUGHCOUNT;
+    char const * lines_name = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int a = 5; a < argc; a++) {
+        if (strncmp(argv[a], "--tile=", 7) == 0) {
+            tile_file_name = argv[a] + 7;
+        } else if (strncmp(argv[a], "--threshold=", 12) == 0) {
+            method = parse_treshold_method(argv[a] + 12);
+            if (method == TH_COUNT) {
+                printf("Unknown threshold method %s.", argv[a] + 12);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--sample=", 9) == 0) {
+            fraction = strtod(argv[a] + 9, NULL);
+            if (fraction <= 0 || fraction > 1) {
+                printf("Sample fraction must be in (0, 1].");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--match=", 8) == 0) {
+            if (!reference_histogram(argv[a] + 8, ref_hist_buf)) {
+                printf("Could not read the reference histogram %s, or it is empty.", argv[a] + 8);
+                exit(EXIT_FAILURE);
+            }
+            pp.ref_hist = ref_hist_buf;
+        } else if (strncmp(argv[a], "--gamma=", 8) == 0) {
+            pp.gamma = strcmp(argv[a] + 8, "auto") == 0 ? 0 : strtod(argv[a] + 8, NULL);
+            if (pp.gamma < 0 || (pp.gamma == 0 && strcmp(argv[a] + 8, "auto") != 0)) {
+                printf("Gamma must be a positive number or auto.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[a], "--levels=auto") == 0) {
+            pp.auto_levels = 1;
+        } else if (strncmp(argv[a], "--border=", 9) == 0) {
+            border_mode = parse_border_mode(argv[a] + 9, &border_value);
+            if (border_mode == BORDER_COUNT) {
+                printf("Unknown border mode %s.", argv[a] + 9);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--save-hist=", 12) == 0) {
+            save_hist_name = argv[a] + 12;
+        } else if (strncmp(argv[a], "--hough=", 8) == 0) {
+            hough_mode = parse_hough_mode(argv[a] + 8, &hough_votes);
+            if (hough_mode == HOUGH_COUNT) {
+                printf("Hough takes lines[:V] or segments[:V] with V a positive vote count.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--hough-count=", 14) == 0) {
+            hough_count = atoi(argv[a] + 14);
+            if (hough_count < 1) {
+                printf("Line count must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[a], "--lines=", 8) == 0) {
+            lines_name = argv[a] + 8;
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            threads = atoi(argv[a] + 10);
+            if (threads < 1) {
+                printf("Thread count must be positive.");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            printf("Unknown optional arg %s.", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // files
     char const * src_file_name = argv[3];
@@ -358,6 +742,80 @@ int main(int argc, char const *argv[]) {
 
     // write header to target file
     fprintf(tgt, "P4\n%d %d\n", width, height);
+    build_bitrev_lut();
+
+    // the packed rows are kept for the Hough transform as they are written
+    unsigned char* bits = NULL;
+    if (hough_mode != HOUGH_COUNT) {
+        bits = (unsigned char*)malloc((size_t)(width + 7) / 8 * height);
+        if (!bits) {
+            free(pixels);
+            error_handler(NULL, tgt, "Memory allocation failed for the Hough transform.");
+        }
+    }
+
+    // histogram from the RGB input, equalization (or matching) and gamma composed into one LUT
+    int hist[MAXSIZE] = {0};
+    int hist_n = size;
+    unsigned char lut[MAXSIZE] = {0};
+    if (opt == 'o' || opt == 'n') {
+        hist_n = rgb_to_gray_histogram(width, height, pixels, fraction, hist);
+        if (hist_n < 0) {
+            free(pixels);
+            error_handler(NULL, tgt, "Memory allocation failed for the histogram row.");
+        }
+        if (save_hist_name && !save_histogram(save_hist_name, hist)) {
+            printf("Could not save the histogram to %s.\n", save_hist_name);
+        }
+        point_lut(hist_n, hist, &pp, lut);
+        report_point_params(&pp);
+    }
+
+    if (opt == 'n') {
+        // threshold, copy and bit packing fused into one compare-and-pack pass
+        int ok = treshold_pack(width, height, pixels, lut, hist, hist_n, method, tgt, bits);
+        free(pixels);
+        if (!ok) {
+            free(bits);
+            error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+        }
+        fclose(tgt);
+        finish_lines(bits, width, height, hough_mode, hough_votes, hough_count, threads, lines_name);
+        printf("File converted successfully.\n");
+        return 0;
+    }
+
+    if (opt == 'o') {
+        int tw, th;
+        unsigned char* tile;
+        if (tile_file_name) {
+            tile = read_tile_pgm(tile_file_name, &tw, &th);
+            if (!tile) {
+                free(pixels);
+                error_handler(NULL, tgt, "Could not read the threshold tile.");
+            }
+        } else {
+            tw = th = 1 << bs;
+            tile = (unsigned char*)malloc(tw * th);
+            if (!tile) {
+                free(pixels);
+                error_handler(NULL, tgt, "Memory allocation failed for the threshold tile.");
+            }
+            bayer_tile(bs, tile);
+        }
+
+        int ok = ordered_dither(width, height, pixels, lut, tile, tw, th, tgt, bits);
+        free(tile);
+        free(pixels);
+        if (!ok) {
+            free(bits);
+            error_handler(NULL, tgt, "Memory allocation failed for dithering.");
+        }
+        fclose(tgt);
+        finish_lines(bits, width, height, hough_mode, hough_votes, hough_count, threads, lines_name);
+        printf("File converted successfully.\n");
+        return 0;
+    }
 
     unsigned char* grayscale = (unsigned char*)malloc(size * sizeof(unsigned char));
     if (!grayscale) {
@@ -365,62 +823,74 @@ int main(int argc, char const *argv[]) {
         error_handler(src, tgt, "Memory allocation failed for grayscale data.");
     }
     
-    // write to grayscale
-    for (int i = 0; i < size; i++) {
-            // grayscale[i] = ppm_to_pgm_avg(&pixels[i]); // avg
-            grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
+    // write to grayscale, the histogram is collected on the way unless it is sampled
+    if (sample_step(fraction) > 1) {
+        for (int i = 0; i < size; i++) {
+                grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
+        }
+        hist_n = gray_histogram(width, height, grayscale, fraction, hist);
+    } else {
+        for (int i = 0; i < size; i++) {
+                // grayscale[i] = ppm_to_pgm_avg(&pixels[i]); // avg
+                grayscale[i] = ppm_to_pgm_weighted(&pixels[i]); // weighted avg
+                hist[grayscale[i]]++;
+        }
     }
     free(pixels);
     
-    // transform grayscale with histogram
-    histogram_transform(size, grayscale);
-    // transform grayscale with gamma correction
-    gamma_transform(size, grayscale, 1.1);
-    
-    // otsu for black and white img
-    otsu_treshold(size, grayscale);
+    if (save_hist_name && !save_histogram(save_hist_name, hist)) {
+        printf("Could not save the histogram to %s.\n", save_hist_name);
+    }
 
+    // transform grayscale with histogram (or match it to the reference) and gamma correction in one pass
+    point_transform(size, grayscale, hist, hist_n, &pp);
+    
     unsigned char* new_grayscale = (unsigned char*)malloc(size * sizeof(unsigned char));
     if (!new_grayscale) {
         free(grayscale);
-        error_handler(src, tgt, "Memory allocation failed for grayscale data manipulation.");
+        error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
     }
 
-    // dilate or erode
+    // otsu (or the chosen method) for black and white img, then dilate or erode
     if (opt == 'd') {
+        treshold_transform(width, height, grayscale, method, fraction);
         dilation(width, height, grayscale, new_grayscale, bs);
-    } else if (opt == 'e') {
-        erosion(width, height, grayscale, new_grayscale, bs);
     } else {
-        memcpy(new_grayscale, grayscale, size * sizeof(unsigned char));
+        // the threshold pass writes into a padded image, its border is filled once for the erosion
+        int th = treshold_value(width, height, grayscale, method, fraction);
+        unsigned char tlut[MAXSIZE];
+        for (int i = 0; i < MAXSIZE; i++) {
+            tlut[i] = i > th ? MAXGRAY : 0;
+        }
+        PaddedImage padded;
+        if (!padded_alloc(&padded, width, height, bs / 2)) {
+            free(grayscale);
+            free(new_grayscale);
+            error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+        }
+        padded_load_lut(&padded, grayscale, tlut);
+        padded_fill_border(&padded, border_mode, border_value);
+        int ok = erosion_padded(&padded, new_grayscale, bs);
+        padded_free(&padded);
+        if (!ok) {
+            free(grayscale);
+            free(new_grayscale);
+            error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
+        }
     }
     free(grayscale);
 
-    // number of bytes is ceil(size/8)
-    int byte_size = sizeof(unsigned char);
-    int pbm_byte_size = (size + byte_size - 1) / byte_size;
-    
-    // set all bits to zero
-    unsigned char* bwscale = (unsigned char*)calloc(pbm_byte_size, sizeof(unsigned char));
-    if (!bwscale) {
-        free(new_grayscale);
-        free(bwscale);
-        error_handler(src, tgt, "Memory allocation failed for grayscale data manipulation.");
-    }
-
     // convert to BPM
     // change bits ~ bytes < 128 to 1s, the rest stays as 0s
-    for (int i = 0; i < size; i++) {
-        if (new_grayscale[i] < 128) {
-            bwscale[i / 8] |= (1 << (7 - (i % 8))); // set bit from left (MSB first)
-        }
+    if (!pack_gray_rows(width, height, new_grayscale, 127, tgt, bits)) {
+        free(new_grayscale);
+        free(bits);
+        error_handler(NULL, tgt, "Memory allocation failed for grayscale data manipulation.");
     }
     free(new_grayscale);
-    
-    fwrite(bwscale, sizeof(unsigned char), pbm_byte_size, tgt);
-    free(bwscale);
 
     fclose(tgt);
+    finish_lines(bits, width, height, hough_mode, hough_votes, hough_count, threads, lines_name);
     printf("File converted successfully.\n");
     return 0;
 }